@@ -0,0 +1,610 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS 1
+#endif
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Count the packets and bytes sent by the library, from any thread
+static volatile long sent_packets;
+static volatile long sent_bytes;
+#define sendto(sock, buffer, size, flags, addr, addrlen)                                          \
+	(mdns_atomic_add(&sent_packets, 1), mdns_atomic_add(&sent_bytes, (long)(size)),             \
+	 sendto(sock, buffer, size, flags, addr, addrlen))
+
+#include "mdns.h"
+
+#undef sendto
+
+// Benchmark of the responder answering a PTR query enumerating all instances of a service type,
+// with a PTR, SRV and TXT record per instance and all instances on the same host. The query is
+// sent as a legacy unicast query over loopback, and the latency is measured from receiving the
+// query until the last answer packet is sent. The same query is also answered as a multicast
+// query, queuing the answer in a scheduler and sending it to the multicast group, where the
+// latency excludes the random answer delay.
+
+static const char service_type[] = "_bench._tcp.local.";
+static const char hostname[] = "benchhost.local.";
+
+// Buffer size for the answers, fitting an Ethernet MTU without fragmenting
+static uint32_t sendbuffer[1472 / 4];
+static uint32_t recvbuffer[2048 / 4];
+static uint32_t querybuffer[512 / 4];
+
+static uint64_t
+time_now_us(void) {
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)((counter.QuadPart * 1000000LL) / frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+#endif
+}
+
+// Open a non-blocking UDP socket bound to an ephemeral port on the loopback interface
+static int
+open_loopback_socket(struct sockaddr_in* addr) {
+	int sock = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	if (bind(sock, (struct sockaddr*)addr, addrlen) ||
+	    getsockname(sock, (struct sockaddr*)addr, &addrlen)) {
+		mdns_socket_close(sock);
+		return -1;
+	}
+
+#ifdef _WIN32
+	unsigned long param = 1;
+	ioctlsocket(sock, FIONBIO, &param);
+#else
+	const int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+	return sock;
+}
+
+// Discard all answers received on the client socket
+static void
+drain_socket(int sock) {
+	while (recv(sock, (char*)recvbuffer, sizeof(recvbuffer), 0) > 0) {
+	}
+}
+
+// Number of packets dropped by the kernel on a UDP socket since it was opened, read from the drops
+// column of /proc/net/udp on Linux. Returns -1 if not available
+static long
+socket_drops(int sock) {
+#ifdef __linux__
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(sock, (struct sockaddr*)&addr, &addrlen))
+		return -1;
+	FILE* file = fopen("/proc/net/udp", "r");
+	if (!file)
+		return -1;
+	char line[512];
+	long drops = -1;
+	unsigned int port = ntohs(addr.sin_port);
+	while ((drops < 0) && fgets(line, sizeof(line), file)) {
+		unsigned int local_port = 0;
+		long line_drops = 0;
+		// sl local_address rem_address st queues tr retrnsmt uid timeout inode ref pointer drops
+		if (sscanf(line, " %*u: %*x:%x %*x:%*x %*x %*x:%*x %*x:%*x %*x %*u %*d %*u %*d %*x %ld",
+		           &local_port, &line_drops) == 2) {
+			if (local_port == port)
+				drops = line_drops;
+		}
+	}
+	fclose(file);
+	return drops;
+#else
+	(void)sizeof(sock);
+	return -1;
+#endif
+}
+
+// Print the packets dropped by the socket between two counts from socket_drops
+static void
+print_drops(long before, long after) {
+	if ((before < 0) || (after < 0))
+		printf("dropped    n/a by socket");
+	else
+		printf("dropped %6u by socket", (unsigned int)(after - before));
+}
+
+// Send a legacy unicast query to the responder socket and answer it, returns the latency in
+// microseconds from receiving the query until the last answer packet is sent
+static uint64_t
+run_query(int client, int server, const struct sockaddr_in* server_addr,
+          mdns_responder_context_t* context, mdns_record_type_t type, const char* name) {
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, client, server_addr, sizeof(struct sockaddr_in), querybuffer,
+	                 sizeof(querybuffer), 1, 0);
+	if (mdns_packet_add_question(&packet, type, name, strlen(name), MDNS_CLASS_IN) ||
+	    mdns_packet_flush(&packet, 0))
+		return 0;
+
+	// Wait for the query to arrive before starting the clock
+	fd_set readfs;
+	FD_ZERO(&readfs);
+	FD_SET(server, &readfs);
+	select(server + 1, &readfs, 0, 0, 0);
+
+	sent_packets = 0;
+	sent_bytes = 0;
+	uint64_t start = time_now_us();
+	mdns_socket_listen(server, recvbuffer, sizeof(recvbuffer), mdns_responder_callback, context);
+	uint64_t latency = time_now_us() - start;
+
+	drain_socket(client);
+	return latency;
+}
+
+// Answer the questions as if sent from the mDNS port, so that the queries are multicast queries
+// answered through the context scheduler
+static int
+multicast_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                   uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+                   const void* data, size_t size, size_t name_offset, size_t name_length,
+                   size_t record_offset, size_t record_length, void* user_data) {
+	struct sockaddr_in addr;
+	memcpy(&addr, from, sizeof(addr));
+	addr.sin_port = htons(MDNS_PORT);
+	return mdns_responder_callback(sock, (const struct sockaddr*)&addr, addrlen, entry, query_id,
+	                               rtype, rclass, ttl, data, size, name_offset, name_length,
+	                               record_offset, record_length, user_data);
+}
+
+// Send a query to the responder socket and answer it as a multicast query, returns the latency in
+// microseconds from receiving the query until the last scheduled answer packet is sent, without
+// waiting for the answer deadlines
+static uint64_t
+run_multicast_query(int client, int server, const struct sockaddr_in* server_addr,
+                    mdns_responder_context_t* context, mdns_record_type_t type,
+                    const char* name) {
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, client, server_addr, sizeof(struct sockaddr_in), querybuffer,
+	                 sizeof(querybuffer), 0, 0);
+	if (mdns_packet_add_question(&packet, type, name, strlen(name), MDNS_CLASS_IN) ||
+	    mdns_packet_flush(&packet, 0))
+		return 0;
+
+	fd_set readfs;
+	FD_ZERO(&readfs);
+	FD_SET(server, &readfs);
+	select(server + 1, &readfs, 0, 0, 0);
+
+	mdns_scheduler_t* scheduler = context->scheduler;
+	context->now = 0;
+	sent_packets = 0;
+	sent_bytes = 0;
+	uint64_t start = time_now_us();
+	mdns_socket_listen(server, recvbuffer, sizeof(recvbuffer), multicast_callback, context);
+	while (scheduler->count) {
+		if (mdns_scheduler_send(scheduler, server, sendbuffer, sizeof(sendbuffer),
+		                        mdns_scheduler_next_deadline(scheduler)) < 0)
+			break;
+	}
+	uint64_t latency = time_now_us() - start;
+
+	drain_socket(client);
+	return latency;
+}
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+#define THREAD_FUNCTION(name) static DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+
+static void
+thread_start(thread_t* thread, LPTHREAD_START_ROUTINE function, void* arg) {
+	*thread = CreateThread(0, 0, function, arg, 0, 0);
+}
+
+static void
+thread_join(thread_t thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static void
+thread_yield(void) {
+	SwitchToThread();
+}
+#else
+typedef pthread_t thread_t;
+#define THREAD_FUNCTION(name) static void* name(void* arg)
+#define THREAD_RETURN return 0
+
+static void
+thread_start(thread_t* thread, void* (*function)(void*), void* arg) {
+	pthread_create(thread, 0, function, arg);
+}
+
+static void
+thread_join(thread_t thread) {
+	pthread_join(thread, 0);
+}
+
+static void
+thread_yield(void) {
+	sched_yield();
+}
+#endif
+
+// Burst benchmark, where a client thread sends a burst of queries while they are answered either
+// inline by the thread receiving them, or by a pipeline of a receive thread feeding a ring of
+// packets to a pool of worker threads. Queries not received in time are dropped by the socket.
+
+#define MAX_WORKERS 4
+
+typedef struct {
+	int client;
+	const struct sockaddr_in* server_addr;
+	size_t count;
+} burst_t;
+
+typedef struct {
+	mdns_ring_t* ring;
+	mdns_responder_context_t context;
+	uint32_t buffer[1472 / 4];
+	size_t additional[16];
+} burst_worker_t;
+
+static volatile long burst_answered;
+static volatile long burst_stop;
+
+// Answer the questions with the responder and count the answered queries
+static int
+burst_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+               size_t record_length, void* user_data) {
+	if (entry == MDNS_ENTRYTYPE_QUESTION)
+		mdns_atomic_add(&burst_answered, 1);
+	return mdns_responder_callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+	                               size, name_offset, name_length, record_offset, record_length,
+	                               user_data);
+}
+
+THREAD_FUNCTION(burst_send) {
+	const burst_t* burst = (const burst_t*)arg;
+	uint32_t buffer[512 / 4];
+	for (size_t iquery = 0; iquery < burst->count; ++iquery) {
+		mdns_packet_t packet;
+		mdns_packet_init(&packet, burst->client, burst->server_addr, sizeof(struct sockaddr_in),
+		                 buffer, sizeof(buffer), (uint16_t)(iquery + 1), 0);
+		mdns_packet_add_question(&packet, MDNS_RECORDTYPE_PTR, service_type,
+		                         sizeof(service_type) - 1, MDNS_CLASS_IN);
+		mdns_packet_flush(&packet, 0);
+	}
+	THREAD_RETURN;
+}
+
+THREAD_FUNCTION(burst_receive) {
+	mdns_ring_t* ring = (mdns_ring_t*)arg;
+	// The ring has a single receive thread, which drains the socket as fast as possible
+	int sock = ring->sock;
+	while (!mdns_atomic_load(&burst_stop)) {
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		FD_SET(sock, &readfs);
+		struct timeval timeout = {0, 10000};
+		if (select(sock + 1, &readfs, 0, 0, &timeout) <= 0)
+			continue;
+		while (mdns_ring_receive(ring))
+			;
+	}
+	THREAD_RETURN;
+}
+
+THREAD_FUNCTION(burst_work) {
+	burst_worker_t* worker = (burst_worker_t*)arg;
+	while (!mdns_atomic_load(&burst_stop) || mdns_ring_pending(worker->ring)) {
+		if (!mdns_ring_process(worker->ring, 16, burst_callback, &worker->context))
+			thread_yield();
+	}
+	THREAD_RETURN;
+}
+
+// Wait until no query has been answered for the given time, returns the time of the last answer
+static uint64_t
+burst_wait(uint64_t start, uint64_t quiet_us) {
+	long answered = mdns_atomic_load(&burst_answered);
+	uint64_t last = time_now_us();
+	while ((time_now_us() - last) < quiet_us) {
+		thread_yield();
+		long now_answered = mdns_atomic_load(&burst_answered);
+		if (now_answered != answered) {
+			answered = now_answered;
+			last = time_now_us();
+		}
+	}
+	return last - start;
+}
+
+static void
+run_burst(const mdns_responder_t* responder, size_t burst_size, int worker_count, int client,
+          int server, const struct sockaddr_in* server_addr) {
+	static burst_worker_t workers[MAX_WORKERS];
+	for (int iworker = 0; iworker < MAX_WORKERS; ++iworker) {
+		burst_worker_t* worker = workers + iworker;
+		memset(&worker->context, 0, sizeof(worker->context));
+		worker->context.responder = responder;
+		worker->context.buffer = worker->buffer;
+		worker->context.capacity = sizeof(worker->buffer);
+		worker->context.additional = worker->additional;
+		worker->context.additional_capacity = sizeof(worker->additional) / sizeof(size_t);
+	}
+	burst_t burst = {client, server_addr, burst_size};
+	thread_t sender;
+
+	// Inline, receiving and answering in the same thread
+	drain_socket(server);
+	burst_answered = 0;
+	long drops = socket_drops(server);
+	uint64_t start = time_now_us();
+	thread_start(&sender, burst_send, &burst);
+	uint64_t last = start;
+	while ((time_now_us() - last) < 100000) {
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		FD_SET(server, &readfs);
+		struct timeval timeout = {0, 10000};
+		if (select(server + 1, &readfs, 0, 0, &timeout) <= 0)
+			continue;
+		mdns_socket_listen(server, recvbuffer, sizeof(recvbuffer), burst_callback,
+		                   &workers[0].context);
+		last = time_now_us();
+	}
+	thread_join(sender);
+	drain_socket(client);
+	printf("%6u queries burst, inline:    answered %6u, ", (unsigned int)burst_size,
+	       (unsigned int)burst_answered);
+	print_drops(drops, socket_drops(server));
+	printf(", %8.3f ms\n", (double)(last - start) / 1000.0);
+
+	// Pipeline, one receive thread feeding a ring of packets to the worker threads
+	static mdns_datagram_t slots[256];
+	static uint32_t ring_buffer[(256 * 1500) / 4];
+	mdns_ring_t ring;
+	mdns_ring_init(&ring, server, slots, 256, ring_buffer, 1500);
+
+	drain_socket(server);
+	burst_answered = 0;
+	burst_stop = 0;
+	drops = socket_drops(server);
+	thread_t receiver;
+	thread_t worker_threads[MAX_WORKERS];
+	thread_start(&receiver, burst_receive, &ring);
+	for (int iworker = 0; iworker < worker_count; ++iworker) {
+		workers[iworker].ring = &ring;
+		thread_start(&worker_threads[iworker], burst_work, &workers[iworker]);
+	}
+	start = time_now_us();
+	thread_start(&sender, burst_send, &burst);
+	thread_join(sender);
+	uint64_t elapsed = burst_wait(start, 100000);
+	mdns_atomic_store(&burst_stop, 1);
+	thread_join(receiver);
+	for (int iworker = 0; iworker < worker_count; ++iworker)
+		thread_join(worker_threads[iworker]);
+	drain_socket(client);
+	printf("%6u queries burst, %d worker%s: answered %6u, ", (unsigned int)burst_size,
+	       worker_count, (worker_count > 1) ? "s" : " ", (unsigned int)burst_answered);
+	print_drops(drops, socket_drops(server));
+	printf(", %6u by ring, %8.3f ms\n", (unsigned int)ring.dropped, (double)elapsed / 1000.0);
+}
+
+static int
+run_benchmark(size_t instance_count, size_t burst_size, int client, int server,
+              const struct sockaddr_in* server_addr) {
+	int ret = -1;
+	size_t capacity = (instance_count * 3) + 1;
+	mdns_responder_entry_t* entries = malloc(sizeof(mdns_responder_entry_t) * capacity);
+	size_t* buckets = malloc(sizeof(size_t) * capacity);
+	char* names = malloc(instance_count * 32);
+	// The scheduler holds the full multicast answer, a PTR answer with SRV, TXT and address
+	// additional records for all instances
+	size_t scheduler_capacity = (instance_count * 3) + 16;
+	size_t additional_capacity = (instance_count * 2) + 2;
+	mdns_scheduled_record_t* scheduled =
+	    malloc(sizeof(mdns_scheduled_record_t) * scheduler_capacity);
+	size_t* scheduler_index = malloc(sizeof(size_t) * scheduler_capacity * 2);
+	size_t* multicast_additional = malloc(sizeof(size_t) * additional_capacity);
+	if (!entries || !buckets || !names || !scheduled || !scheduler_index || !multicast_additional)
+		goto cleanup;
+
+	char txt_data[64];
+	mdns_record_txt_t txt_pairs[2] = {{{MDNS_STRING_CONST("path")}, {MDNS_STRING_CONST("/")}},
+	                                  {{MDNS_STRING_CONST("version")}, {MDNS_STRING_CONST("1")}}};
+	size_t txt_size = mdns_txt_make(txt_data, sizeof(txt_data), txt_pairs, 2);
+
+	mdns_responder_t responder;
+	mdns_responder_init(&responder, entries, capacity, buckets, capacity);
+
+	uint64_t start = time_now_us();
+	size_t names_size = 0;
+	mdns_record_t record;
+	for (size_t iinst = 0; iinst < instance_count; ++iinst) {
+		char* instance = names + (iinst * 32);
+		int length = snprintf(instance, 32, "inst-%u.%s", (unsigned int)iinst, service_type);
+		mdns_string_t instance_name = {instance, (size_t)length};
+		names_size += (size_t)length + 1;
+
+		memset(&record, 0, sizeof(record));
+		record.name = (mdns_string_t){service_type, sizeof(service_type) - 1};
+		record.type = MDNS_RECORDTYPE_PTR;
+		record.data.ptr.name = instance_name;
+		if (mdns_responder_add(&responder, record))
+			goto cleanup;
+
+		memset(&record, 0, sizeof(record));
+		record.name = instance_name;
+		record.type = MDNS_RECORDTYPE_SRV;
+		record.data.srv.name = (mdns_string_t){hostname, sizeof(hostname) - 1};
+		record.data.srv.port = (uint16_t)(8000 + (iinst % 1000));
+		if (mdns_responder_add(&responder, record))
+			goto cleanup;
+
+		memset(&record, 0, sizeof(record));
+		record.name = instance_name;
+		record.type = MDNS_RECORDTYPE_TXT;
+		record.data.txt.value = (mdns_string_t){txt_data, txt_size};
+		if (mdns_responder_add(&responder, record))
+			goto cleanup;
+	}
+	memset(&record, 0, sizeof(record));
+	record.name = (mdns_string_t){hostname, sizeof(hostname) - 1};
+	record.type = MDNS_RECORDTYPE_A;
+	record.data.a.addr.sin_family = AF_INET;
+	record.data.a.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (mdns_responder_add(&responder, record))
+		goto cleanup;
+	uint64_t register_time = time_now_us() - start;
+
+	size_t additional[16];
+	mdns_responder_context_t context;
+	memset(&context, 0, sizeof(context));
+	context.responder = &responder;
+	context.buffer = sendbuffer;
+	context.capacity = sizeof(sendbuffer);
+	context.additional = additional;
+	context.additional_capacity = sizeof(additional) / sizeof(size_t);
+
+	const int iterations = 10;
+	uint64_t best = (uint64_t)-1;
+	uint64_t total = 0;
+	for (int iter = 0; iter < iterations; ++iter) {
+		uint64_t latency =
+		    run_query(client, server, server_addr, &context, MDNS_RECORDTYPE_PTR, service_type);
+		if (latency < best)
+			best = latency;
+		total += latency;
+	}
+	size_t packets = (size_t)sent_packets;
+	size_t bytes = (size_t)sent_bytes;
+
+	uint64_t srv_latency = (uint64_t)-1;
+	for (int iter = 0; iter < iterations; ++iter) {
+		uint64_t latency =
+		    run_query(client, server, server_addr, &context, MDNS_RECORDTYPE_SRV, names);
+		if (latency < srv_latency)
+			srv_latency = latency;
+	}
+
+	mdns_scheduler_t scheduler;
+	mdns_scheduler_init(&scheduler, scheduled, scheduler_capacity, 1);
+	mdns_scheduler_set_index(&scheduler, scheduler_index, scheduler_capacity * 2);
+	mdns_responder_context_t multicast_context = context;
+	multicast_context.scheduler = &scheduler;
+	multicast_context.additional = multicast_additional;
+	multicast_context.additional_capacity = additional_capacity;
+
+	uint64_t multicast_best = (uint64_t)-1;
+	uint64_t multicast_total = 0;
+	for (int iter = 0; iter < iterations; ++iter) {
+		uint64_t latency = run_multicast_query(client, server, server_addr, &multicast_context,
+		                                       MDNS_RECORDTYPE_PTR, service_type);
+		if (latency < multicast_best)
+			multicast_best = latency;
+		multicast_total += latency;
+	}
+	size_t multicast_packets = (size_t)sent_packets;
+	size_t multicast_bytes = (size_t)sent_bytes;
+
+	size_t memory = (sizeof(mdns_responder_entry_t) * responder.used) + (sizeof(size_t) * capacity);
+	printf("%6u instances: register %6.2f ms, %4u bytes/instance (+%u name), PTR query %5u packets "
+	       "%8u bytes, latency best %8.3f ms avg %8.3f ms, SRV query %6.3f ms\n",
+	       (unsigned int)instance_count, (double)register_time / 1000.0,
+	       (unsigned int)(memory / instance_count), (unsigned int)(names_size / instance_count),
+	       (unsigned int)packets, (unsigned int)bytes, (double)best / 1000.0,
+	       (double)total / (1000.0 * iterations), (double)srv_latency / 1000.0);
+	printf("%6u instances: multicast PTR query %5u packets %8u bytes, latency best %8.3f ms "
+	       "avg %8.3f ms, %u records dropped by scheduler\n",
+	       (unsigned int)instance_count, (unsigned int)multicast_packets,
+	       (unsigned int)multicast_bytes, (double)multicast_best / 1000.0,
+	       (double)multicast_total / (1000.0 * iterations), (unsigned int)scheduler.dropped);
+
+	if (burst_size) {
+		run_burst(&responder, burst_size, 1, client, server, server_addr);
+		run_burst(&responder, burst_size, MAX_WORKERS, client, server, server_addr);
+	}
+	ret = 0;
+
+cleanup:
+	free(multicast_additional);
+	free(scheduler_index);
+	free(scheduled);
+	free(names);
+	free(buckets);
+	free(entries);
+	return ret;
+}
+
+int
+main(int argc, const char* const* argv) {
+	(void)sizeof(argc);
+	(void)sizeof(argv);
+
+#ifdef _WIN32
+	WORD versionWanted = MAKEWORD(1, 1);
+	WSADATA wsaData;
+	if (WSAStartup(versionWanted, &wsaData)) {
+		printf("Failed to initialize WinSock\n");
+		return -1;
+	}
+#endif
+
+	int ret = -1;
+	struct sockaddr_in client_addr;
+	struct sockaddr_in server_addr;
+	int client = open_loopback_socket(&client_addr);
+	int server = open_loopback_socket(&server_addr);
+	if ((client < 0) || (server < 0)) {
+		printf("Failed to open loopback sockets\n");
+		goto cleanup;
+	}
+
+	size_t instance_counts[] = {1000, 10000, 50000};
+	ret = 0;
+	for (size_t icount = 0; !ret && (icount < sizeof(instance_counts) / sizeof(size_t)); ++icount)
+		ret = run_benchmark(instance_counts[icount], icount ? 0 : 1000, client, server,
+		                    &server_addr);
+	if (ret)
+		printf("Benchmark failed\n");
+
+cleanup:
+	if (client >= 0)
+		mdns_socket_close(client);
+	if (server >= 0)
+		mdns_socket_close(server);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return ret;
+}
@@ -10,13 +10,18 @@
 
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <iphlpapi.h>
 #define sleep(x) Sleep(x * 1000)
 #else
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
 #endif
 
 // Alias some things to simulate recieving data to fuzz library
@@ -43,23 +48,132 @@ static struct sockaddr_in6 service_address_ipv6;
 static int has_ipv4;
 static int has_ipv6;
 
+// Local network interface with its addresses and the prefix length of the network of each address
+typedef struct {
+	unsigned int index;
+	struct sockaddr_storage addresses[8];
+	unsigned int prefix_length[8];
+	size_t address_count;
+} local_interface_t;
+
+// Local network interfaces collected when enumerating the interfaces to open sockets
+static local_interface_t local_interfaces[8];
+static int num_local_interfaces;
+
 volatile sig_atomic_t running = 1;
 
-// Data for our service including the mDNS records
+typedef struct service_t service_t;
+
+// Response scheduler for multicast answers on one service socket, the context for answering
+// questions on the socket with the record responder, the prober claiming our names on the
+// interface of the socket and the announcer repeating announcements of our records
 typedef struct {
+	int sock;
+	mdns_scheduler_t scheduler;
+	mdns_scheduled_record_t records[64];
+	size_t index[128];
+	mdns_responder_context_t context;
+	mdns_prober_t prober;
+	mdns_probe_t probes[2];
+	mdns_announcer_t announcer;
+	mdns_announcement_t announcements[32];
+	service_t* service;
+} service_socket_t;
+
+// Data for our service including the mDNS records
+struct service_t {
 	mdns_string_t service;
 	mdns_string_t hostname;
 	mdns_string_t service_instance;
 	mdns_string_t hostname_qualified;
-	struct sockaddr_in address_ipv4;
-	struct sockaddr_in6 address_ipv6;
 	int port;
 	mdns_record_t record_ptr;
 	mdns_record_t record_srv;
-	mdns_record_t record_a;
-	mdns_record_t record_aaaa;
-	mdns_record_t txt_record[2];
-} service_t;
+	mdns_record_t record_txt;
+	char txt_data[256];
+	mdns_record_t record_dns_sd;
+	mdns_record_t record_subtype;
+	mdns_record_t records_instance[2];
+	// A/AAAA records for the addresses of all interfaces, each tagged with its interface index
+	mdns_record_t records_address[16];
+	unsigned int address_interface[16];
+	size_t address_count;
+	// The addresses are registered per interface, so a query is answered with only the addresses
+	// valid on the interface it was received on. The addresses are indexed to answer reverse
+	// mapping queries for them with the hostname
+	mdns_responder_t responder;
+	mdns_responder_entry_t responder_entries[32];
+	size_t responder_buckets[32];
+	size_t responder_addresses[32];
+	size_t additional[16];
+};
+
+// Monotonic time in milliseconds, used for scheduling multicast answers
+static uint64_t
+time_now_ms(void) {
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+#endif
+}
+
+// Wall clock time in milliseconds, used for relating cache times across restarts
+static uint64_t
+time_wall_ms(void) {
+#ifdef _WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return ((((uint64_t)ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 10000ULL;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+#endif
+}
+
+// Map a file of the given size in memory, creating the file if it does not exist
+static void*
+map_cache_file(const char* path, size_t size) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_ALWAYS,
+	                          FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+	                                    (DWORD)size, 0);
+	CloseHandle(file);
+	if (!mapping)
+		return 0;
+	void* image = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	CloseHandle(mapping);
+	return image;
+#else
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return 0;
+	void* image = 0;
+	if (ftruncate(fd, (off_t)size) == 0) {
+		image = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (image == MAP_FAILED)
+			image = 0;
+	}
+	close(fd);
+	return image;
+#endif
+}
+
+static void
+unmap_cache_file(void* image, size_t size) {
+#ifdef _WIN32
+	(void)sizeof(size);
+	UnmapViewOfFile(image);
+#else
+	munmap(image, size);
+#endif
+}
 
 static mdns_string_t
 ipv4_address_to_string(char* buffer, size_t capacity, const struct sockaddr_in* addr,
@@ -121,7 +235,11 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
 	(void)sizeof(sock);
 	(void)sizeof(query_id);
 	(void)sizeof(name_length);
-	(void)sizeof(user_data);
+	// Keep the answers in the cache given as user data, if any
+	if (user_data)
+		mdns_cache_record_callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+		                           size, name_offset, name_length, record_offset, record_length,
+		                           user_data);
 	mdns_string_t fromaddrstr = ip_address_to_string(addrbuffer, sizeof(addrbuffer), from, addrlen);
 	const char* entrytype = (entry == MDNS_ENTRYTYPE_ANSWER) ?
                                 "answer" :
@@ -168,6 +286,20 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
 				       MDNS_STRING_FORMAT(entrystr), MDNS_STRING_FORMAT(txtbuffer[itxt].key));
 			}
 		}
+	} else if (rtype == MDNS_RECORDTYPE_NSEC) {
+		mdns_record_nsec_t nsec = mdns_record_parse_nsec(data, size, record_offset, record_length,
+		                                                 namebuffer, sizeof(namebuffer));
+		char types[128];
+		size_t types_length = 0;
+		for (uint16_t type = 1; (type < 128) && (types_length + 8 < sizeof(types)); ++type) {
+			if (mdns_record_nsec_has_type(&nsec, type))
+				types_length += (size_t)snprintf(types + types_length,
+				                                 sizeof(types) - types_length, " %u", type);
+		}
+		types[types_length] = 0;
+		printf("%.*s : %s %.*s NSEC %.*s types%s rclass 0x%x ttl %u\n",
+		       MDNS_STRING_FORMAT(fromaddrstr), entrytype, MDNS_STRING_FORMAT(entrystr),
+		       MDNS_STRING_FORMAT(nsec.name), types, rclass, ttl);
 	} else {
 		printf("%.*s : %s %.*s type %u rclass 0x%x ttl %u length %d\n",
 		       MDNS_STRING_FORMAT(fromaddrstr), entrytype, MDNS_STRING_FORMAT(entrystr), rtype,
@@ -176,20 +308,42 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
 	return 0;
 }
 
-// Callback handling questions incoming on service sockets
+// Find the index of the interface a query was received on, by matching the source address with
+// the networks of the interface addresses. Returns zero for queries from other networks, which are
+// answered with the addresses of all interfaces
+static unsigned int
+service_select_interface(const struct sockaddr* from) {
+	for (int iif = 0; iif < num_local_interfaces; ++iif) {
+		const local_interface_t* iface = local_interfaces + iif;
+		for (size_t iaddr = 0; iaddr < iface->address_count; ++iaddr) {
+			if (mdns_address_in_network(from, (const struct sockaddr*)(iface->addresses + iaddr),
+			                            iface->prefix_length[iaddr]))
+				return iface->index;
+		}
+	}
+	return 0;
+}
+
+// Callback handling questions incoming on service sockets, answered by the record responder
 static int
 service_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
                  uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
                  size_t size, size_t name_offset, size_t name_length, size_t record_offset,
                  size_t record_length, void* user_data) {
-	(void)sizeof(ttl);
-	if (entry != MDNS_ENTRYTYPE_QUESTION)
-		return 0;
-
-	const char dns_sd[] = "_services._dns-sd._udp.local.";
-	const service_t* service = (const service_t*)user_data;
-
-	mdns_string_t fromaddrstr = ip_address_to_string(addrbuffer, sizeof(addrbuffer), from, addrlen);
+	service_socket_t* service_socket = (service_socket_t*)user_data;
+	mdns_responder_context_t* context = &service_socket->context;
+	context->now = time_now_ms();
+	if (entry != MDNS_ENTRYTYPE_QUESTION) {
+		// Records for our names from other hosts are conflicts or simultaneous probes while we
+		// are probing for the names
+		mdns_prober_receive(&service_socket->prober, context->now, entry, data, size, name_offset,
+		                    rtype, record_offset, record_length);
+		// Another host multicasting the same records we are about to send makes our answer
+		// redundant, the responder cancels it in the scheduler
+		return mdns_responder_callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl,
+		                               data, size, name_offset, name_length, record_offset,
+		                               record_length, context);
+	}
 
 	size_t offset = name_offset;
 	mdns_string_t name = mdns_string_extract(data, size, &offset, namebuffer, sizeof(namebuffer));
@@ -211,199 +365,16 @@ service_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_ent
 		return 0;
 	printf("Query %s %.*s\n", record_name, MDNS_STRING_FORMAT(name));
 
-	if ((name.length == (sizeof(dns_sd) - 1)) &&
-	    (strncmp(name.str, dns_sd, sizeof(dns_sd) - 1) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The PTR query was for the DNS-SD domain, send answer with a PTR record for the
-			// service name we advertise, typically on the "<_service-name>._tcp.local." format
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = {
-			    .name = name, .type = MDNS_RECORDTYPE_PTR, .data.ptr.name = service->service};
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s (%s)\n", MDNS_STRING_FORMAT(answer.data.ptr.name),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0, 0,
-				                          0);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0, 0,
-				                            0);
-			}
-		}
-	} else if ((name.length == service->service.length) &&
-	           (strncmp(name.str, service->service.str, name.length) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The PTR query was for our service (usually "<_service-name._tcp.local"), answer a PTR
-			// record reverse mapping the queried service name to our service instance name
-			// (typically on the "<hostname>.<_service-name>._tcp.local." format), and add
-			// additional records containing the SRV record mapping the service instance name to our
-			// qualified hostname (typically "<hostname>.local.") and port, as well as any IPv4/IPv6
-			// address for the hostname as A/AAAA records, and two test TXT records
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = service->record_ptr;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// SRV record mapping "<hostname>.<_service-name>._tcp.local." to
-			// "<hostname>.local." with port. Set weight & priority to 0.
-			additional[additional_count++] = service->record_srv;
-
-			// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_ptr.data.ptr.name),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
-	} else if ((name.length == service->service_instance.length) &&
-	           (strncmp(name.str, service->service_instance.str, name.length) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_SRV) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The SRV query was for our service instance (usually
-			// "<hostname>.<_service-name._tcp.local"), answer a SRV record mapping the service
-			// instance name to our qualified hostname (typically "<hostname>.local.") and port, as
-			// well as any IPv4/IPv6 address for the hostname as A/AAAA records, and two test TXT
-			// records
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = service->record_srv;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s port %d (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_srv.data.srv.name), service->port,
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
-	} else if ((name.length == service->hostname_qualified.length) &&
-	           (strncmp(name.str, service->hostname_qualified.str, name.length) == 0)) {
-		if (((rtype == MDNS_RECORDTYPE_A) || (rtype == MDNS_RECORDTYPE_ANY)) &&
-		    (service->address_ipv4.sin_family == AF_INET)) {
-			// The A query was for our qualified hostname (typically "<hostname>.local.") and we
-			// have an IPv4 address, answer with an A record mappiing the hostname to an IPv4
-			// address, as well as any IPv6 address for the hostname, and two test TXT records
-
-			// Answer A records mapping "<hostname>.local." to IPv4 address
-			mdns_record_t answer = service->record_a;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// AAAA record mapping "<hostname>.local." to IPv6 addresses
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			mdns_string_t addrstr = ip_address_to_string(
-			    addrbuffer, sizeof(addrbuffer), (struct sockaddr*)&service->record_a.data.a.addr,
-			    sizeof(service->record_a.data.a.addr));
-			printf("  --> answer %.*s IPv4 %.*s (%s)\n", MDNS_STRING_FORMAT(service->record_a.name),
-			       MDNS_STRING_FORMAT(addrstr), (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		} else if (((rtype == MDNS_RECORDTYPE_AAAA) || (rtype == MDNS_RECORDTYPE_ANY)) &&
-		           (service->address_ipv6.sin6_family == AF_INET6)) {
-			// The AAAA query was for our qualified hostname (typically "<hostname>.local.") and we
-			// have an IPv6 address, answer with an AAAA record mappiing the hostname to an IPv6
-			// address, as well as any IPv4 address for the hostname, and two test TXT records
-
-			// Answer AAAA records mapping "<hostname>.local." to IPv6 address
-			mdns_record_t answer = service->record_aaaa;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// A record mapping "<hostname>.local." to IPv4 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			mdns_string_t addrstr =
-			    ip_address_to_string(addrbuffer, sizeof(addrbuffer),
-			                         (struct sockaddr*)&service->record_aaaa.data.aaaa.addr,
-			                         sizeof(service->record_aaaa.data.aaaa.addr));
-			printf("  --> answer %.*s IPv6 %.*s (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_aaaa.name), MDNS_STRING_FORMAT(addrstr),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
+	// The responder looks up the records registered for the name and type, and sends them with
+	// the additional records for service instances and hostnames, unicast or multicast depending
+	// on the query. Only the addresses of the interface the query was received on are given
+	context->if_index = service_select_interface(from);
+	int answers = mdns_responder_answer(context, sock, from, addrlen, query_id, rtype, rclass,
+	                                    data, size, name_offset);
+	if (answers > 0) {
+		uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
+		printf("  --> answer %d record%s (%s)\n", answers, (answers > 1) ? "s" : "",
+		       (unicast ? "unicast" : "multicast"));
 	}
 	return 0;
 }
@@ -446,9 +417,64 @@ dump_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_
 	printf("%.*s: %s %s %.*s rclass 0x%x ttl %u\n", MDNS_STRING_FORMAT(fromaddrstr), entry_type,
 	       record_name, MDNS_STRING_FORMAT(name), (unsigned int)rclass, ttl);
 
+	// Passively cache all records seen in responses on the link
+	if (user_data)
+		mdns_cache_record_callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+		                           size, name_offset, name_length, record_offset, record_length,
+		                           user_data);
 	return 0;
 }
 
+// Add an address to the list of local interfaces and their addresses
+static void
+add_interface_address(unsigned int index, const struct sockaddr* saddr, size_t saddrlen,
+                      unsigned int prefix_length) {
+	local_interface_t* iface = 0;
+	for (int iif = 0; !iface && (iif < num_local_interfaces); ++iif) {
+		if (local_interfaces[iif].index == index)
+			iface = local_interfaces + iif;
+	}
+	if (!iface) {
+		if (num_local_interfaces >= (int)(sizeof(local_interfaces) / sizeof(local_interfaces[0])))
+			return;
+		iface = local_interfaces + num_local_interfaces++;
+		memset(iface, 0, sizeof(local_interface_t));
+		iface->index = index;
+	}
+	for (size_t iaddr = 0; iaddr < iface->address_count; ++iaddr) {
+		if (!memcmp(iface->addresses + iaddr, saddr, saddrlen))
+			return;
+	}
+	if (iface->address_count >= (sizeof(iface->addresses) / sizeof(iface->addresses[0])))
+		return;
+	memset(iface->addresses + iface->address_count, 0, sizeof(struct sockaddr_storage));
+	memcpy(iface->addresses + iface->address_count, saddr, saddrlen);
+	iface->prefix_length[iface->address_count++] = prefix_length;
+}
+
+#ifndef _WIN32
+// Get the network prefix length from an interface netmask
+static unsigned int
+netmask_prefix_length(const struct sockaddr* netmask, unsigned int max_length) {
+	if (!netmask)
+		return max_length;
+	const unsigned char* mask;
+	if (netmask->sa_family == AF_INET6)
+		mask = (const unsigned char*)&((const struct sockaddr_in6*)netmask)->sin6_addr;
+	else
+		mask = (const unsigned char*)&((const struct sockaddr_in*)netmask)->sin_addr;
+	unsigned int length = 0;
+	for (unsigned int ibyte = 0; ibyte < (max_length / 8); ++ibyte) {
+		for (unsigned char bit = 0x80; bit; bit >>= 1) {
+			if (!(mask[ibyte] & bit))
+				return length;
+			++length;
+		}
+	}
+	return length;
+}
+#endif
+
 // Open sockets for sending one-shot multicast queries from an ephemeral port
 static int
 open_client_sockets(int* sockets, int max_sockets, int port) {
@@ -504,6 +530,8 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 						log_addr = 1;
 					}
 					has_ipv4 = 1;
+					add_interface_address((unsigned int)adapter->IfIndex, (struct sockaddr*)saddr,
+					                      sizeof(struct sockaddr_in), unicast->OnLinkPrefixLength);
 					if (num_sockets < max_sockets) {
 						saddr->sin_port = htons((unsigned short)port);
 						int sock = mdns_socket_open_ipv4(saddr);
@@ -540,6 +568,8 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 						log_addr = 1;
 					}
 					has_ipv6 = 1;
+					add_interface_address((unsigned int)adapter->IfIndex, (struct sockaddr*)saddr,
+					                      sizeof(struct sockaddr_in6), unicast->OnLinkPrefixLength);
 					if (num_sockets < max_sockets) {
 						saddr->sin6_port = htons((unsigned short)port);
 						int sock = mdns_socket_open_ipv6(saddr);
@@ -591,6 +621,9 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 					log_addr = 1;
 				}
 				has_ipv4 = 1;
+				add_interface_address(if_nametoindex(ifa->ifa_name), ifa->ifa_addr,
+				                      sizeof(struct sockaddr_in),
+				                      netmask_prefix_length(ifa->ifa_netmask, 32));
 				if (num_sockets < max_sockets) {
 					saddr->sin_port = htons(port);
 					int sock = mdns_socket_open_ipv4(saddr);
@@ -626,6 +659,9 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 					log_addr = 1;
 				}
 				has_ipv6 = 1;
+				add_interface_address(if_nametoindex(ifa->ifa_name), ifa->ifa_addr,
+				                      sizeof(struct sockaddr_in6),
+				                      netmask_prefix_length(ifa->ifa_netmask, 128));
 				if (num_sockets < max_sockets) {
 					saddr->sin6_port = htons(port);
 					int sock = mdns_socket_open_ipv6(saddr);
@@ -763,7 +799,6 @@ send_dns_sd(void) {
 static int
 send_mdns_query(mdns_query_t* query, size_t count) {
 	int sockets[32];
-	int query_id[32];
 	int num_sockets = open_client_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]), 0);
 	if (num_sockets <= 0) {
 		printf("Failed to open any client sockets\n");
@@ -773,7 +808,14 @@ send_mdns_query(mdns_query_t* query, size_t count) {
 
 	size_t capacity = 2048;
 	void* buffer = malloc(capacity);
-	void* user_data = 0;
+
+	// Cache the answers, duplicates from several interfaces or responders are stored once
+	static mdns_cache_entry_t cache_entries[64];
+	size_t cache_buckets[32];
+	mdns_cache_t cache;
+	mdns_cache_init(&cache, cache_entries, sizeof(cache_entries) / sizeof(mdns_cache_entry_t),
+	                cache_buckets, sizeof(cache_buckets) / sizeof(size_t), time_now_ms());
+	void* user_data = &cache;
 
 	printf("Sending mDNS query");
 	for (size_t iq = 0; iq < count; ++iq) {
@@ -784,17 +826,29 @@ send_mdns_query(mdns_query_t* query, size_t count) {
 			record_name = "A";
 		else if (query[iq].type == MDNS_RECORDTYPE_AAAA)
 			record_name = "AAAA";
+		else if (query[iq].type == MDNS_RECORDTYPE_TXT)
+			record_name = "TXT";
 		else
 			query[iq].type = MDNS_RECORDTYPE_PTR;
 		printf(" : %s %s", query[iq].name, record_name);
 	}
 	printf("\n");
-	for (int isock = 0; isock < num_sockets; ++isock) {
-		query_id[isock] =
-		    mdns_multiquery_send(sockets[isock], query, count, buffer, capacity, 0);
-		if (query_id[isock] < 0)
-			printf("Failed to send mDNS query: %s\n", strerror(errno));
-	}
+
+	// Each query is added as a separate question, as if from separate callers, and the scheduler
+	// packs them into shared packets asking once for repeated questions
+	mdns_question_t questions[16];
+	mdns_querier_t querier;
+	mdns_querier_init(&querier, questions, sizeof(questions) / sizeof(mdns_question_t));
+	uint64_t now = time_now_ms();
+	for (size_t iq = 0; iq < count; ++iq)
+		mdns_querier_add(&querier, now, query[iq].type, query[iq].name, query[iq].length, 10000,
+		                 query_callback, user_data);
+	// All questions are added at once, so send them without waiting for the window to close
+	now = mdns_querier_next_deadline(&querier);
+	if (mdns_querier_send(&querier, sockets, (size_t)num_sockets, buffer, capacity, now) < 0)
+		printf("Failed to send mDNS query: %s\n", strerror(errno));
+	printf("Sent %d packets for %d questions (%d deduplicated)\n", (int)querier.packets,
+	       (int)count, (int)querier.deduplicated);
 
 	// This is a simple implementation that loops for 5 seconds or as long as we get replies
 	int res;
@@ -818,8 +872,8 @@ send_mdns_query(mdns_query_t* query, size_t count) {
 		if (res > 0) {
 			for (int isock = 0; isock < num_sockets; ++isock) {
 				if (FD_ISSET(sockets[isock], &readfs)) {
-					size_t rec = mdns_query_recv(sockets[isock], buffer, capacity, query_callback,
-					                             user_data, query_id[isock]);
+					mdns_cache_expire(&cache, time_now_ms());
+					size_t rec = mdns_querier_recv(&querier, sockets[isock], buffer, capacity);
 					if (rec > 0)
 						records += rec;
 				}
@@ -830,6 +884,17 @@ send_mdns_query(mdns_query_t* query, size_t count) {
 
 	printf("Read %d records\n", records);
 
+	mdns_cache_expire(&cache, time_now_ms());
+	printf("Cached %d records\n", (int)cache.count);
+	for (size_t ientry = 0; ientry < cache.used; ++ientry) {
+		if (!cache.entries[ientry].name_size)
+			continue;
+		mdns_string_t name =
+		    mdns_cache_entry_name(&cache, ientry, entrybuffer, sizeof(entrybuffer));
+		printf("  %.*s type %u ttl %u\n", MDNS_STRING_FORMAT(name),
+		       (unsigned int)cache.entries[ientry].rtype, mdns_cache_entry_ttl(&cache, ientry));
+	}
+
 	free(buffer);
 
 	for (int isock = 0; isock < num_sockets; ++isock)
@@ -839,9 +904,55 @@ send_mdns_query(mdns_query_t* query, size_t count) {
 	return 0;
 }
 
+// Register our records with the responder and announce them, once probing has claimed our names
+static void
+service_announce(service_t* service, service_socket_t* service_sockets, int num_sockets,
+                 uint64_t now) {
+	// Register all records with the responder, the address records with the interface they are
+	// valid on so that queries are answered with the addresses of the receiving interface
+	mdns_responder_t* responder = &service->responder;
+	mdns_responder_init(responder, service->responder_entries,
+	                    sizeof(service->responder_entries) / sizeof(mdns_responder_entry_t),
+	                    service->responder_buckets,
+	                    sizeof(service->responder_buckets) / sizeof(size_t));
+	mdns_responder_set_address_index(responder, service->responder_addresses,
+	                                 sizeof(service->responder_addresses) / sizeof(size_t));
+	mdns_responder_add(responder, service->record_dns_sd);
+	mdns_responder_add(responder, service->record_ptr);
+	if (service->record_subtype.name.length)
+		mdns_responder_add(responder, service->record_subtype);
+	mdns_responder_add(responder, service->record_srv);
+	for (size_t iaddr = 0; iaddr < service->address_count; ++iaddr)
+		mdns_responder_add_address(responder, service->records_address[iaddr],
+		                           service->address_interface[iaddr]);
+	mdns_responder_add(responder, service->record_txt);
+
+	// Queue the announcements on startup of service, the announcers repeat them at increasing
+	// intervals and pack all records due at the same time into as few packets as possible. When
+	// a record changes later, use mdns_announcer_update to send a goodbye for the old record and
+	// announce the new record. The service sockets multicast on the default interface, which is
+	// not known here, so announce the addresses of all interfaces
+	printf("Sending announce\n");
+	mdns_record_t records[20] = {0};
+	size_t record_count = 0;
+	records[record_count++] = service->record_ptr;
+	if (service->record_subtype.name.length)
+		records[record_count++] = service->record_subtype;
+	records[record_count++] = service->record_srv;
+	for (size_t iaddr = 0; iaddr < service->address_count; ++iaddr)
+		records[record_count++] = service->records_address[iaddr];
+	records[record_count++] = service->record_txt;
+
+	for (int isock = 0; isock < num_sockets; ++isock) {
+		for (size_t irec = 0; irec < record_count; ++irec)
+			mdns_announcer_add(&service_sockets[isock].announcer, now, records[irec]);
+	}
+}
+
 // Provide a mDNS service, answering incoming DNS-SD and mDNS queries
 static int
-service_mdns(const char* hostname, const char* service_name, int service_port) {
+service_mdns(const char* hostname, const char* service_name, int service_port,
+             const char* subtype) {
 	int sockets[32];
 	int num_sockets = open_service_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]));
 	if (num_sockets <= 0) {
@@ -891,10 +1002,40 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 	service.hostname = hostname_string;
 	service.service_instance = service_instance_string;
 	service.hostname_qualified = hostname_qualified_string;
-	service.address_ipv4 = service_address_ipv4;
-	service.address_ipv6 = service_address_ipv6;
 	service.port = service_port;
 
+	// Rate limit table shared by all sockets, making sure no record is multicast more than once
+	// per second on each socket even if a client floods us with queries
+	static mdns_ratelimit_entry_t ratelimit_entries[256];
+	mdns_ratelimit_t ratelimit;
+	mdns_ratelimit_init(&ratelimit, ratelimit_entries,
+	                    sizeof(ratelimit_entries) / sizeof(ratelimit_entries[0]));
+
+	// Setup a response scheduler for each socket to aggregate and delay multicast answers
+	service_socket_t* service_sockets = malloc(sizeof(service_socket_t) * (size_t)num_sockets);
+	uint32_t seed = (uint32_t)time_now_ms() ^ (uint32_t)service_address_ipv4.sin_addr.s_addr;
+	for (int isock = 0; isock < num_sockets; ++isock) {
+		service_socket_t* service_socket = service_sockets + isock;
+		service_socket->sock = sockets[isock];
+		mdns_scheduler_init(&service_socket->scheduler, service_socket->records,
+		                    sizeof(service_socket->records) / sizeof(mdns_scheduled_record_t),
+		                    seed + (uint32_t)isock);
+		mdns_scheduler_set_index(&service_socket->scheduler, service_socket->index,
+		                         sizeof(service_socket->index) / sizeof(size_t));
+		mdns_scheduler_set_ratelimit(&service_socket->scheduler, &ratelimit);
+
+		service_socket->service = &service;
+
+		mdns_responder_context_t* context = &service_socket->context;
+		memset(context, 0, sizeof(mdns_responder_context_t));
+		context->responder = &service.responder;
+		context->buffer = sendbuffer;
+		context->capacity = sizeof(sendbuffer);
+		context->scheduler = &service_socket->scheduler;
+		context->additional = service.additional;
+		context->additional_capacity = sizeof(service.additional) / sizeof(size_t);
+	}
+
 	// Setup our mDNS records
 
 	// PTR record reverse mapping "<_service-name>._tcp.local." to
@@ -916,52 +1057,86 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 	                                     .rclass = 0,
 	                                     .ttl = 0};
 
-	// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
-	service.record_a = (mdns_record_t){.name = service.hostname_qualified,
-	                                   .type = MDNS_RECORDTYPE_A,
-	                                   .data.a.addr = service.address_ipv4,
-	                                   .rclass = 0,
-	                                   .ttl = 0};
-
-	service.record_aaaa = (mdns_record_t){.name = service.hostname_qualified,
-	                                      .type = MDNS_RECORDTYPE_AAAA,
-	                                      .data.aaaa.addr = service.address_ipv6,
-	                                      .rclass = 0,
-	                                      .ttl = 0};
-
-	// Add two test TXT records for our service instance name, will be coalesced into
-	// one record with both key-value pair strings by the library
-	service.txt_record[0] = (mdns_record_t){.name = service.service_instance,
-	                                        .type = MDNS_RECORDTYPE_TXT,
-	                                        .data.txt.key = {MDNS_STRING_CONST("test")},
-	                                        .data.txt.value = {MDNS_STRING_CONST("1")},
-	                                        .rclass = 0,
-	                                        .ttl = 0};
-	service.txt_record[1] = (mdns_record_t){.name = service.service_instance,
-	                                        .type = MDNS_RECORDTYPE_TXT,
-	                                        .data.txt.key = {MDNS_STRING_CONST("other")},
-	                                        .data.txt.value = {MDNS_STRING_CONST("value")},
-	                                        .rclass = 0,
-	                                        .ttl = 0};
-
-	// Send an announcement on startup of service
-	{
-		printf("Sending announce\n");
-		mdns_record_t additional[5] = {0};
-		size_t additional_count = 0;
-		additional[additional_count++] = service.record_srv;
-		if (service.address_ipv4.sin_family == AF_INET)
-			additional[additional_count++] = service.record_a;
-		if (service.address_ipv6.sin6_family == AF_INET6)
-			additional[additional_count++] = service.record_aaaa;
-		additional[additional_count++] = service.txt_record[0];
-		additional[additional_count++] = service.txt_record[1];
-
-		for (int isock = 0; isock < num_sockets; ++isock)
-			mdns_announce_multicast(sockets[isock], buffer, capacity, service.record_ptr, 0, 0,
-			                        additional, additional_count);
+	// A/AAAA records mapping "<hostname>.local." to the IPv4/IPv6 addresses of each interface
+	size_t address_capacity = sizeof(service.records_address) / sizeof(mdns_record_t);
+	for (int iif = 0; iif < num_local_interfaces; ++iif) {
+		const local_interface_t* iface = local_interfaces + iif;
+		for (size_t iaddr = 0;
+		     (iaddr < iface->address_count) && (service.address_count < address_capacity);
+		     ++iaddr) {
+			const struct sockaddr* saddr = (const struct sockaddr*)(iface->addresses + iaddr);
+			mdns_record_t record = {.name = service.hostname_qualified, .rclass = 0, .ttl = 0};
+			if (saddr->sa_family == AF_INET) {
+				record.type = MDNS_RECORDTYPE_A;
+				record.data.a.addr = *(const struct sockaddr_in*)saddr;
+			} else {
+				record.type = MDNS_RECORDTYPE_AAAA;
+				record.data.aaaa.addr = *(const struct sockaddr_in6*)saddr;
+			}
+			service.address_interface[service.address_count] = iface->index;
+			service.records_address[service.address_count++] = record;
+		}
+	}
+
+	// TXT record with two test key-value pairs for our service instance name. The pairs are
+	// serialized once here, and the record with an empty key sends the data as is
+	mdns_record_txt_t txt_pairs[2] = {{.key = {MDNS_STRING_CONST("test")},
+	                                   .value = {MDNS_STRING_CONST("1")}},
+	                                  {.key = {MDNS_STRING_CONST("other")},
+	                                   .value = {MDNS_STRING_CONST("value")}}};
+	size_t txt_size = mdns_txt_make(service.txt_data, sizeof(service.txt_data), txt_pairs,
+	                                sizeof(txt_pairs) / sizeof(mdns_record_txt_t));
+	service.record_txt = (mdns_record_t){.name = service.service_instance,
+	                                     .type = MDNS_RECORDTYPE_TXT,
+	                                     .data.txt.key = {0, 0},
+	                                     .data.txt.value = {service.txt_data, txt_size},
+	                                     .rclass = 0,
+	                                     .ttl = 0};
+
+	// PTR record for DNS-SD service type enumeration, mapping "_services._dns-sd._udp.local." to
+	// "<_service-name>._tcp.local."
+	service.record_dns_sd =
+	    (mdns_record_t){.name = {MDNS_STRING_CONST("_services._dns-sd._udp.local.")},
+	                    .type = MDNS_RECORDTYPE_PTR,
+	                    .data.ptr.name = service.service,
+	                    .rclass = 0,
+	                    .ttl = 0};
+
+	// Optional PTR record mapping the subtype name "<subtype>._sub.<_service-name>._tcp.local."
+	// to "<hostname>.<_service-name>._tcp.local.", letting clients browse for the subtype only
+	char subtype_buffer[256];
+	if (subtype) {
+		mdns_string_t subtype_name =
+		    mdns_subtype_make(subtype_buffer, sizeof(subtype_buffer), subtype, strlen(subtype),
+		                      MDNS_STRING_ARGS(service.service));
+		if (subtype_name.length) {
+			service.record_subtype = mdns_record_subtype(&service.record_ptr, subtype_name);
+			printf("Subtype: %.*s\n", MDNS_STRING_FORMAT(subtype_name));
+		}
 	}
 
+	// Probe for the service instance name and the hostname on each interface before answering
+	// for them, as the names must be unique on the network (RFC 6762 section 8)
+	service.records_instance[0] = service.record_srv;
+	service.records_instance[1] = service.record_txt;
+	uint64_t start = time_now_ms();
+	for (int isock = 0; isock < num_sockets; ++isock) {
+		service_socket_t* service_socket = service_sockets + isock;
+		mdns_prober_init(&service_socket->prober, service_socket->probes,
+		                 sizeof(service_socket->probes) / sizeof(mdns_probe_t),
+		                 seed + (uint32_t)isock);
+		mdns_announcer_init(&service_socket->announcer, service_socket->announcements,
+		                    sizeof(service_socket->announcements) / sizeof(mdns_announcement_t));
+		mdns_prober_add(&service_socket->prober, start, MDNS_STRING_ARGS(service.service_instance),
+		                service.records_instance, 2);
+		if (service.address_count)
+			mdns_prober_add(&service_socket->prober, start,
+			                MDNS_STRING_ARGS(service.hostname_qualified), service.records_address,
+			                service.address_count);
+	}
+	printf("Probing for names\n");
+	int announced = 0;
+
 	// This is a crude implementation that checks for incoming queries
 	while (running) {
 		int nfds = 0;
@@ -973,42 +1148,102 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 			FD_SET(sockets[isock], &readfs);
 		}
 
+		// Wake up in time for the next scheduled multicast answer, probe or announcement
+		uint64_t now = time_now_ms();
+		uint64_t wait = 100;
+		for (int isock = 0; isock < num_sockets; ++isock) {
+			uint64_t deadline = mdns_scheduler_next_deadline(&service_sockets[isock].scheduler);
+			uint64_t probe_deadline = mdns_prober_next_deadline(&service_sockets[isock].prober);
+			uint64_t announce_deadline =
+			    mdns_announcer_next_deadline(&service_sockets[isock].announcer);
+			if (probe_deadline < deadline)
+				deadline = probe_deadline;
+			if (announce_deadline < deadline)
+				deadline = announce_deadline;
+			if (deadline <= now)
+				wait = 0;
+			else if ((deadline - now) < wait)
+				wait = deadline - now;
+		}
+
 		struct timeval timeout;
 		timeout.tv_sec = 0;
-		timeout.tv_usec = 100000;
+		timeout.tv_usec = (int)(wait * 1000);
 
 		if (select(nfds, &readfs, 0, 0, &timeout) >= 0) {
 			for (int isock = 0; isock < num_sockets; ++isock) {
 				if (FD_ISSET(sockets[isock], &readfs)) {
 					mdns_socket_listen(sockets[isock], buffer, capacity, service_callback,
-					                   &service);
+					                   service_sockets + isock);
 				}
 				FD_SET(sockets[isock], &readfs);
 			}
+			now = time_now_ms();
+			for (int isock = 0; isock < num_sockets; ++isock) {
+				mdns_scheduler_send(&service_sockets[isock].scheduler, sockets[isock], sendbuffer,
+				                    sizeof(sendbuffer), now);
+				mdns_prober_send(&service_sockets[isock].prober, sockets[isock], sendbuffer,
+				                 sizeof(sendbuffer), now);
+				mdns_announcer_send(&service_sockets[isock].announcer, sockets[isock],
+				                    sendbuffer, sizeof(sendbuffer), now);
+			}
 		} else {
 			break;
 		}
+
+		// Announce once our names are claimed on all interfaces. A real service would pick a new
+		// name on conflict, for example by appending a number, and probe again
+		if (!announced) {
+			int claimed = 1;
+			int conflict = 0;
+			for (int isock = 0; isock < num_sockets; ++isock) {
+				mdns_prober_t* prober = &service_sockets[isock].prober;
+				for (size_t iprobe = 0; iprobe < prober->count; ++iprobe) {
+					if (prober->probes[iprobe].state == MDNS_PROBESTATE_CONFLICT)
+						conflict = 1;
+					else if (prober->probes[iprobe].state != MDNS_PROBESTATE_SUCCESS)
+						claimed = 0;
+				}
+			}
+			if (conflict) {
+				printf("Name conflict, another host uses the hostname or service instance name\n");
+				break;
+			}
+			if (claimed) {
+				service_announce(&service, service_sockets, num_sockets, now);
+				announced = 1;
+			}
+		}
 	}
 
 	// Send a goodbye on end of service
-	{
+	if (announced) {
 		printf("Sending goodbye\n");
-		mdns_record_t additional[5] = {0};
-		size_t additional_count = 0;
-		additional[additional_count++] = service.record_srv;
-		if (service.address_ipv4.sin_family == AF_INET)
-			additional[additional_count++] = service.record_a;
-		if (service.address_ipv6.sin6_family == AF_INET6)
-			additional[additional_count++] = service.record_aaaa;
-		additional[additional_count++] = service.txt_record[0];
-		additional[additional_count++] = service.txt_record[1];
-
-		for (int isock = 0; isock < num_sockets; ++isock)
-			mdns_goodbye_multicast(sockets[isock], buffer, capacity, service.record_ptr, 0, 0,
-			                       additional, additional_count);
+		mdns_record_t records[20] = {0};
+		size_t record_count = 0;
+		records[record_count++] = service.record_ptr;
+		if (service.record_subtype.name.length)
+			records[record_count++] = service.record_subtype;
+		records[record_count++] = service.record_srv;
+		for (size_t iaddr = 0; iaddr < service.address_count; ++iaddr)
+			records[record_count++] = service.records_address[iaddr];
+		records[record_count++] = service.record_txt;
+
+		// Goodbye records must be identical to the announced records
+		for (int isock = 0; isock < num_sockets; ++isock) {
+			size_t cursor = 0;
+			mdns_goodbye_multicast_bulk(sockets[isock], buffer, capacity, records, record_count,
+			                            &cursor, 0);
+		}
 	}
 
+	size_t duplicates = 0;
+	for (int isock = 0; isock < num_sockets; ++isock)
+		duplicates += service_sockets[isock].scheduler.suppressed;
+	printf("Suppressed %u duplicate and %u rate limited records\n", (unsigned int)duplicates,
+	       (unsigned int)ratelimit.suppressed);
 	free(buffer);
+	free(service_sockets);
 	free(service_name_buffer);
 
 	for (int isock = 0; isock < num_sockets; ++isock)
@@ -1018,9 +1253,10 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 	return 0;
 }
 
-// Dump all incoming mDNS queries and answers
+// Dump all incoming mDNS queries and answers, caching the records in responses with names in the
+// given domain, if any
 static int
-dump_mdns(void) {
+dump_mdns(const char* domain) {
 	int sockets[32];
 	int num_sockets = open_service_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]));
 	if (num_sockets <= 0) {
@@ -1032,8 +1268,17 @@ dump_mdns(void) {
 	size_t capacity = 2048;
 	void* buffer = malloc(capacity);
 
+	static mdns_cache_entry_t cache_entries[256];
+	size_t cache_buckets[64];
+	mdns_cache_t cache;
+	mdns_cache_init(&cache, cache_entries, sizeof(cache_entries) / sizeof(mdns_cache_entry_t),
+	                cache_buckets, sizeof(cache_buckets) / sizeof(size_t), time_now_ms());
+	if (domain)
+		mdns_cache_set_filter(&cache, mdns_cache_filter_domain, (void*)domain);
+
 	// This is a crude implementation that checks for incoming queries and answers
 	while (running) {
+		mdns_cache_expire(&cache, time_now_ms());
 		int nfds = 0;
 		fd_set readfs;
 		FD_ZERO(&readfs);
@@ -1050,7 +1295,7 @@ dump_mdns(void) {
 		if (select(nfds, &readfs, 0, 0, &timeout) >= 0) {
 			for (int isock = 0; isock < num_sockets; ++isock) {
 				if (FD_ISSET(sockets[isock], &readfs)) {
-					mdns_socket_listen(sockets[isock], buffer, capacity, dump_callback, 0);
+					mdns_socket_listen(sockets[isock], buffer, capacity, dump_callback, &cache);
 				}
 				FD_SET(sockets[isock], &readfs);
 			}
@@ -1059,6 +1304,218 @@ dump_mdns(void) {
 		}
 	}
 
+	printf("Cached %d records (%d filtered, %d evicted)\n", (int)cache.count, (int)cache.filtered,
+	       (int)cache.evicted);
+
+	free(buffer);
+
+	for (int isock = 0; isock < num_sockets; ++isock)
+		mdns_socket_close(sockets[isock]);
+	printf("Closed socket%s\n", num_sockets > 1 ? "s" : "");
+
+	return 0;
+}
+
+// Browse event callback printing the instances found and lost, keeping found instances fresh
+static void
+browse_callback(mdns_browser_t* browser, const mdns_browse_t* browse, mdns_browse_event_t event,
+                mdns_string_t instance, size_t entry, void* user_data) {
+	(void)sizeof(user_data);
+	if (event == MDNS_BROWSEEVENT_ADDED)
+		mdns_cache_set_interest(browser->cache, entry, 1);
+	const char* eventstr = (event == MDNS_BROWSEEVENT_ADDED) ?
+                               "added" :
+                               ((event == MDNS_BROWSEEVENT_UPDATED) ? "updated" : "removed");
+	printf("%.*s : %s %.*s\n", (int)browse->length, browse->name, eventstr,
+	       MDNS_STRING_FORMAT(instance));
+}
+
+// Continuously browse for instances of a service type until interrupted, with queries at
+// increasing intervals and answers kept in a cache, optionally kept in a file across restarts
+static int
+browse_mdns(const char* service_name, const char* cache_file) {
+	int sockets[32];
+	int num_sockets = open_service_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]));
+	if (num_sockets <= 0) {
+		printf("Failed to open any client sockets\n");
+		return -1;
+	}
+	printf("Opened %d socket%s for mDNS browse\n", num_sockets, num_sockets > 1 ? "s" : "");
+
+	size_t capacity = 2048;
+	void* buffer = malloc(capacity);
+
+	static mdns_cache_entry_t cache_entries[256];
+	size_t cache_buckets[64];
+	mdns_cache_t cache;
+	size_t cache_image_size = mdns_cache_image_size(256);
+	void* cache_image = cache_file ? map_cache_file(cache_file, cache_image_size) : 0;
+	if (cache_image) {
+		int restored = mdns_cache_attach(&cache, cache_image, cache_image_size, cache_buckets,
+		                                 sizeof(cache_buckets) / sizeof(size_t), time_now_ms(),
+		                                 time_wall_ms());
+		printf("Restored %d cached records from %s\n", restored, cache_file);
+	} else {
+		if (cache_file)
+			printf("Failed to map cache file %s\n", cache_file);
+		mdns_cache_init(&cache, cache_entries, sizeof(cache_entries) / sizeof(mdns_cache_entry_t),
+		                cache_buckets, sizeof(cache_buckets) / sizeof(size_t), time_now_ms());
+	}
+
+	mdns_browse_t browses[1];
+	mdns_browser_t browser;
+	mdns_browser_init(&browser, browses, sizeof(browses) / sizeof(mdns_browse_t), &cache,
+	                  (uint32_t)time_now_ms());
+	mdns_browser_add(&browser, time_now_ms(), service_name, strlen(service_name), browse_callback,
+	                 0);
+	printf("Browsing for %s\n", service_name);
+
+	while (running) {
+		uint64_t now = time_now_ms();
+		mdns_cache_expire(&cache, now);
+		if (mdns_browser_send(&browser, sockets, (size_t)num_sockets, buffer, capacity, now) < 0)
+			printf("Failed to send mDNS browse query: %s\n", strerror(errno));
+		if (mdns_cache_refresh_send(&cache, sockets, (size_t)num_sockets, buffer, capacity) < 0)
+			printf("Failed to send mDNS refresh query: %s\n", strerror(errno));
+
+		int nfds = 0;
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		for (int isock = 0; isock < num_sockets; ++isock) {
+			if (sockets[isock] >= nfds)
+				nfds = sockets[isock] + 1;
+			FD_SET(sockets[isock], &readfs);
+		}
+
+		// Wake up for the next query, or to expire cached records
+		uint64_t wait = 1000;
+		uint64_t next = mdns_browser_next_deadline(&browser);
+		if (next <= now)
+			wait = 0;
+		else if ((next - now) < wait)
+			wait = next - now;
+		struct timeval timeout;
+		timeout.tv_sec = (long)(wait / 1000);
+		timeout.tv_usec = (int)((wait % 1000) * 1000);
+
+		if (select(nfds, &readfs, 0, 0, &timeout) >= 0) {
+			mdns_cache_expire(&cache, time_now_ms());
+			for (int isock = 0; isock < num_sockets; ++isock) {
+				if (FD_ISSET(sockets[isock], &readfs))
+					mdns_socket_listen(sockets[isock], buffer, capacity,
+					                   mdns_cache_record_callback, &cache);
+				FD_SET(sockets[isock], &readfs);
+			}
+		} else {
+			break;
+		}
+	}
+
+	free(buffer);
+	if (cache_image)
+		unmap_cache_file(cache_image, cache_image_size);
+
+	for (int isock = 0; isock < num_sockets; ++isock)
+		mdns_socket_close(sockets[isock]);
+	printf("Closed socket%s\n", num_sockets > 1 ? "s" : "");
+
+	return 0;
+}
+
+// Resolve callback printing the address found
+static void
+resolve_callback(mdns_resolver_t* resolver, const char* name, size_t length, size_t entry,
+                 void* user_data) {
+	int* pending = (int*)user_data;
+	--*pending;
+	if (entry == MDNS_INVALID_POS) {
+		printf("%.*s : no answer\n", (int)length, name);
+		return;
+	}
+	struct sockaddr_storage addr;
+	if (mdns_cache_entry_address(resolver->cache, entry, &addr) < 0)
+		return;
+	mdns_string_t addrstr = ip_address_to_string(addrbuffer, sizeof(addrbuffer),
+	                                             (const struct sockaddr*)&addr, sizeof(addr));
+	printf("%.*s : %.*s ttl %u\n", (int)length, name, MDNS_STRING_FORMAT(addrstr),
+	       mdns_cache_entry_ttl(resolver->cache, entry));
+}
+
+// Resolve hostnames to addresses, completing each as soon as the first answer arrives. Repeated
+// names share the same query, and names already answered are resolved from the cache
+static int
+resolve_mdns(const mdns_query_t* names, size_t count) {
+	int sockets[32];
+	int num_sockets = open_client_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]), 0);
+	if (num_sockets <= 0) {
+		printf("Failed to open any client sockets\n");
+		return -1;
+	}
+	printf("Opened %d socket%s for mDNS resolve\n", num_sockets, num_sockets > 1 ? "s" : "");
+
+	size_t capacity = 2048;
+	void* buffer = malloc(capacity);
+
+	static mdns_cache_entry_t cache_entries[64];
+	size_t cache_buckets[32];
+	mdns_cache_t cache;
+	mdns_cache_init(&cache, cache_entries, sizeof(cache_entries) / sizeof(mdns_cache_entry_t),
+	                cache_buckets, sizeof(cache_buckets) / sizeof(size_t), time_now_ms());
+
+	mdns_resolve_t requests[16];
+	mdns_resolver_t resolver;
+	mdns_resolver_init(&resolver, requests, sizeof(requests) / sizeof(mdns_resolve_t), &cache);
+
+	int pending = 0;
+	for (size_t iname = 0; iname < count; ++iname) {
+		++pending;
+		if (mdns_resolve(&resolver, time_now_ms(), names[iname].name, names[iname].length,
+		                 MDNS_RECORDTYPE_ANY, 5000, resolve_callback, &pending) < 0) {
+			printf("Failed to resolve %s\n", names[iname].name);
+			--pending;
+		}
+	}
+
+	while (running && (pending > 0)) {
+		uint64_t now = time_now_ms();
+		mdns_cache_expire(&cache, now);
+		if (mdns_resolver_send(&resolver, sockets, (size_t)num_sockets, buffer, capacity, now) <
+		    0)
+			printf("Failed to send mDNS resolve query: %s\n", strerror(errno));
+		if (pending <= 0)
+			break;
+
+		int nfds = 0;
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		for (int isock = 0; isock < num_sockets; ++isock) {
+			if (sockets[isock] >= nfds)
+				nfds = sockets[isock] + 1;
+			FD_SET(sockets[isock], &readfs);
+		}
+
+		uint64_t wait = 0;
+		uint64_t next = mdns_resolver_next_deadline(&resolver);
+		if ((next > now) && (next != MDNS_TIME_NEVER))
+			wait = next - now;
+		struct timeval timeout;
+		timeout.tv_sec = (long)(wait / 1000);
+		timeout.tv_usec = (int)((wait % 1000) * 1000);
+
+		if (select(nfds, &readfs, 0, 0, &timeout) >= 0) {
+			mdns_cache_expire(&cache, time_now_ms());
+			for (int isock = 0; isock < num_sockets; ++isock) {
+				if (FD_ISSET(sockets[isock], &readfs))
+					mdns_query_recv(sockets[isock], buffer, capacity, mdns_cache_record_callback,
+					                &cache, 0);
+				FD_SET(sockets[isock], &readfs);
+			}
+		} else {
+			break;
+		}
+	}
+	printf("Coalesced %d requests\n", (int)resolver.coalesced);
+
 	free(buffer);
 
 	for (int isock = 0; isock < num_sockets; ++isock)
@@ -1166,6 +1623,10 @@ main(int argc, const char* const* argv) {
 	mdns_query_t query[16];
 	size_t query_count = 0;
 	int service_port = 42424;
+	const char* subtype = 0;
+	const char* filter = 0;
+	const char* cache_file = 0;
+	char query_names[16][256];
 
 #ifdef _WIN32
 
@@ -1200,6 +1661,7 @@ main(int argc, const char* const* argv) {
 			//  mdns --query _foo._tcp.local.
 			//  mdns --query SRV myhost._foo._tcp.local.
 			//  mdns --query A myhost._tcp.local. _service._tcp.local.
+			//  mdns --query PTR 192.168.1.10
 			mode = 1;
 			++iarg;
 			while ((iarg < argc) && (query_count < 16)) {
@@ -1215,6 +1677,8 @@ main(int argc, const char* const* argv) {
 						record_type = MDNS_RECORDTYPE_A;
 					else if (strcmp(query[query_count].name, "AAAA") == 0)
 						record_type = MDNS_RECORDTYPE_AAAA;
+					else if (strcmp(query[query_count].name, "TXT") == 0)
+						record_type = MDNS_RECORDTYPE_TXT;
 					if (record_type != 0) {
 						query[query_count].type = record_type;
 						query[query_count].name = argv[iarg++];
@@ -1230,10 +1694,47 @@ main(int argc, const char* const* argv) {
 				service = argv[iarg];
 		} else if (strcmp(argv[iarg], "--dump") == 0) {
 			mode = 3;
+		} else if (strcmp(argv[iarg], "--filter") == 0) {
+			// Domain of the records cached in dump mode, for example:
+			//  mdns --dump --filter _http._tcp.local.
+			++iarg;
+			if (iarg < argc)
+				filter = argv[iarg];
+		} else if (strcmp(argv[iarg], "--resolve") == 0) {
+			// Resolve each hostname to an address, for example:
+			//  mdns --resolve myhost.local. otherhost.local.
+			mode = 5;
+			++iarg;
+			while ((iarg < argc) && (query_count < 16)) {
+				query[query_count].type = MDNS_RECORDTYPE_ANY;
+				query[query_count].name = argv[iarg++];
+				query[query_count].length = strlen(query[query_count].name);
+				++query_count;
+			}
+		} else if (strcmp(argv[iarg], "--browse") == 0) {
+			// Continuously browse for instances of the service type, for example:
+			//  mdns --browse _http._tcp.local.
+			mode = 4;
+			++iarg;
+			if (iarg < argc)
+				service = argv[iarg];
+		} else if (strcmp(argv[iarg], "--cache-file") == 0) {
+			// File keeping the browse cache across restarts, for example:
+			//  mdns --cache-file browse.cache --browse _http._tcp.local.
+			++iarg;
+			if (iarg < argc)
+				cache_file = argv[iarg];
 		} else if (strcmp(argv[iarg], "--hostname") == 0) {
 			++iarg;
 			if (iarg < argc)
 				hostname = argv[iarg];
+		} else if (strcmp(argv[iarg], "--subtype") == 0) {
+			// Subtype registered in service mode, or browsed for in PTR queries. Must be given
+			// before the query names, for example:
+			//  mdns --subtype _printer --query _http._tcp.local.
+			++iarg;
+			if (iarg < argc)
+				subtype = argv[iarg];
 		} else if (strcmp(argv[iarg], "--port") == 0) {
 			++iarg;
 			if (iarg < argc)
@@ -1244,15 +1745,46 @@ main(int argc, const char* const* argv) {
 #ifdef MDNS_FUZZING
 	fuzz_mdns();
 #else
+	// Look up the name of an address given to a PTR query with the reverse mapping name, or
+	// browse for the instances registered under the subtype instead of all instances
+	for (size_t iq = 0; iq < query_count; ++iq) {
+		if (query[iq].type != MDNS_RECORDTYPE_PTR)
+			continue;
+		mdns_string_t name = {0, 0};
+		struct sockaddr_in addr_ipv4;
+		struct sockaddr_in6 addr_ipv6;
+		memset(&addr_ipv4, 0, sizeof(addr_ipv4));
+		memset(&addr_ipv6, 0, sizeof(addr_ipv6));
+		addr_ipv4.sin_family = AF_INET;
+		addr_ipv6.sin6_family = AF_INET6;
+		if (inet_pton(AF_INET, query[iq].name, &addr_ipv4.sin_addr) == 1)
+			name = mdns_reverse_name_make(query_names[iq], sizeof(query_names[iq]),
+			                              (const struct sockaddr*)&addr_ipv4);
+		else if (inet_pton(AF_INET6, query[iq].name, &addr_ipv6.sin6_addr) == 1)
+			name = mdns_reverse_name_make(query_names[iq], sizeof(query_names[iq]),
+			                              (const struct sockaddr*)&addr_ipv6);
+		else if (subtype)
+			name = mdns_subtype_make(query_names[iq], sizeof(query_names[iq]), subtype,
+			                         strlen(subtype), query[iq].name, query[iq].length);
+		if (name.length) {
+			query[iq].name = name.str;
+			query[iq].length = name.length;
+		}
+	}
+
 	int ret;
 	if (mode == 0)
 		ret = send_dns_sd();
 	else if (mode == 1)
 		ret = send_mdns_query(query, query_count);
 	else if (mode == 2)
-		ret = service_mdns(hostname, service, service_port);
+		ret = service_mdns(hostname, service, service_port, subtype);
 	else if (mode == 3)
-		ret = dump_mdns();
+		ret = dump_mdns(filter);
+	else if (mode == 4)
+		ret = browse_mdns(service, cache_file);
+	else if (mode == 5)
+		ret = resolve_mdns(query, query_count);
 #endif
 
 #ifdef _WIN32
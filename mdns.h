@@ -49,6 +49,127 @@ extern "C" {
 #define MDNS_CACHE_FLUSH 0x8000U
 #define MDNS_MAX_SUBSTRINGS 64
 
+#define MDNS_TIME_NEVER ((uint64_t)-1)
+
+// Random delay range in milliseconds for multicast answers for shared records (RFC 6762 section 6)
+#ifndef MDNS_SHARED_DELAY_MIN
+#define MDNS_SHARED_DELAY_MIN 20
+#endif
+#ifndef MDNS_SHARED_DELAY_MAX
+#define MDNS_SHARED_DELAY_MAX 120
+#endif
+
+// Scheduled answers due within this many milliseconds are aggregated into the same packet
+#ifndef MDNS_AGGREGATION_WINDOW
+#define MDNS_AGGREGATION_WINDOW 100
+#endif
+
+// Minimum interval in milliseconds between multicasts of the same record on the same interface,
+// and the shorter interval allowed when defending a record against a probe (RFC 6762 section 6)
+#define MDNS_MULTICAST_INTERVAL 1000
+#define MDNS_PROBE_DEFENSE_INTERVAL 250
+
+// Probing for unique names (RFC 6762 section 8). Three probes are sent 250ms apart after a random
+// delay of up to 250ms. A host losing a simultaneous probe tie-break waits one second before
+// probing again, and after fifteen conflicts within ten seconds a host waits five seconds before
+// probing for a new name
+#define MDNS_PROBE_COUNT 3
+#define MDNS_PROBE_INTERVAL 250
+#define MDNS_PROBE_WAIT 250
+#define MDNS_PROBE_DEFER 1000
+#define MDNS_PROBE_CONFLICT_LIMIT 15
+#define MDNS_PROBE_CONFLICT_WINDOW 10000
+#define MDNS_PROBE_CONFLICT_DELAY 5000
+
+// Maximum number of records and total data size per name compared in a probe tie-break
+#ifndef MDNS_PROBE_TIEBREAK_RECORDS
+#define MDNS_PROBE_TIEBREAK_RECORDS 16
+#endif
+#ifndef MDNS_PROBE_TIEBREAK_SIZE
+#define MDNS_PROBE_TIEBREAK_SIZE 1024
+#endif
+
+// Number of announcements sent for a new or changed record, and the interval in milliseconds
+// between the first two announcements, doubling for each following announcement (RFC 6762
+// section 8.3 requires at least two announcements one second apart, and allows up to eight)
+#ifndef MDNS_ANNOUNCE_COUNT
+#define MDNS_ANNOUNCE_COUNT 2
+#endif
+#ifndef MDNS_ANNOUNCE_INTERVAL
+#define MDNS_ANNOUNCE_INTERVAL 1000
+#endif
+
+// Number of slots searched in the rate limit table for each record
+#ifndef MDNS_RATELIMIT_PROBE
+#define MDNS_RATELIMIT_PROBE 8
+#endif
+
+// Timing wheel for expiring cached records. The first level has one slot per tick of the given
+// length in milliseconds, and each following level one slot per turn of the level below, so four
+// levels of 64 slots with 250ms ticks cover TTLs of up to 48 days at a constant cost per record
+#ifndef MDNS_CACHE_WHEEL_TICK
+#define MDNS_CACHE_WHEEL_TICK 250
+#endif
+#define MDNS_CACHE_WHEEL_BITS 6
+#define MDNS_CACHE_WHEEL_SLOTS (1 << MDNS_CACHE_WHEEL_BITS)
+#define MDNS_CACHE_WHEEL_LEVELS 4
+
+// Storage size in bytes for the uncompressed name and data of a cached record, larger records
+// are not cached
+#ifndef MDNS_CACHE_RECORD_SIZE
+#define MDNS_CACHE_RECORD_SIZE 256
+#endif
+
+// Cached records are removed this many milliseconds after a goodbye or a cache flush, and records
+// received within this time are not flushed by a record of the same set (RFC 6762 section 10)
+#define MDNS_CACHE_FLUSH_DELAY 1000
+
+// Cached records of interest are refreshed by queries at 80%, 85%, 90% and 95% of the TTL, each
+// delayed by a random 0-2% of the TTL (RFC 6762 section 5.2)
+#define MDNS_CACHE_REFRESH_COUNT 4
+#define MDNS_CACHE_REFRESH_START 80
+#define MDNS_CACHE_REFRESH_STEP 5
+#define MDNS_CACHE_REFRESH_JITTER 2
+
+// Identification of a cache image, the version is changed with any change to the layout of the
+// image header or cache entries
+#define MDNS_CACHE_IMAGE_MAGIC 0x434e444dU
+#define MDNS_CACHE_IMAGE_VERSION 1
+
+// Continuous browsing queries (RFC 6762 section 5.2). The first query is sent after a random delay
+// of 20-120ms, the second one second later, and the interval doubles for each following query up
+// to one hour. Each interval is extended by a random jitter of up to 2%
+#define MDNS_BROWSE_DELAY_MIN 20
+#define MDNS_BROWSE_DELAY_MAX 120
+#define MDNS_BROWSE_INTERVAL 1000
+#define MDNS_BROWSE_INTERVAL_MAX 3600000
+#define MDNS_BROWSE_JITTER 50
+
+// Interval in milliseconds between the first two queries of a hostname resolve, doubling for each
+// following query up to the maximum interval until the resolve times out
+#ifndef MDNS_RESOLVE_INTERVAL
+#define MDNS_RESOLVE_INTERVAL 1000
+#endif
+#ifndef MDNS_RESOLVE_INTERVAL_MAX
+#define MDNS_RESOLVE_INTERVAL_MAX 60000
+#endif
+
+// Questions added to a query scheduler within this many milliseconds of the first pending question
+// are sent in the same packets
+#ifndef MDNS_QUERY_WINDOW
+#define MDNS_QUERY_WINDOW 20
+#endif
+
+// Arena allocator size classes, doubling from 16 to 2048 bytes. Each size class carves its blocks
+// from slabs of this many bytes taken from the arena memory
+#define MDNS_ARENA_CLASS_MIN 16
+#define MDNS_ARENA_CLASS_COUNT 8
+#ifndef MDNS_ARENA_SLAB_SIZE
+#define MDNS_ARENA_SLAB_SIZE 4096
+#endif
+
+#define MDNS_HASH_SEED 0xcbf29ce484222325ULL
+
 enum mdns_record_type {
 	MDNS_RECORDTYPE_IGNORE = 0,
 	// Address
@@ -61,6 +182,8 @@ enum mdns_record_type {
 	MDNS_RECORDTYPE_AAAA = 28,
 	// Server Selection [RFC2782]
 	MDNS_RECORDTYPE_SRV = 33,
+	// Next Secure, asserting which record types exist for a name [RFC4034, RFC6762]
+	MDNS_RECORDTYPE_NSEC = 47,
 	// Any available records
 	MDNS_RECORDTYPE_ANY = 255
 };
@@ -74,9 +197,39 @@ enum mdns_entry_type {
 
 enum mdns_class { MDNS_CLASS_IN = 1, MDNS_CLASS_ANY = 255 };
 
+enum mdns_probe_state {
+	// Probing for the name
+	MDNS_PROBESTATE_PROBING = 0,
+	// Probing completed without conflict, the name may be announced
+	MDNS_PROBESTATE_SUCCESS = 1,
+	// Another host uses the name, a new name must be chosen
+	MDNS_PROBESTATE_CONFLICT = 2
+};
+
+enum mdns_cache_event {
+	// A record was added to the cache
+	MDNS_CACHEEVENT_ADDED = 0,
+	// A cached record was received again, or set to expire by a goodbye or cache flush
+	MDNS_CACHEEVENT_UPDATED = 1,
+	// A record expired or was removed from the cache
+	MDNS_CACHEEVENT_REMOVED = 2
+};
+
+enum mdns_browse_event {
+	// A service instance was found
+	MDNS_BROWSEEVENT_ADDED = 0,
+	// The SRV or TXT record of a service instance was added or changed
+	MDNS_BROWSEEVENT_UPDATED = 1,
+	// A service instance expired or said goodbye
+	MDNS_BROWSEEVENT_REMOVED = 2
+};
+
 typedef enum mdns_record_type mdns_record_type_t;
 typedef enum mdns_entry_type mdns_entry_type_t;
 typedef enum mdns_class mdns_class_t;
+typedef enum mdns_probe_state mdns_probe_state_t;
+typedef enum mdns_cache_event mdns_cache_event_t;
+typedef enum mdns_browse_event mdns_browse_event_t;
 
 typedef int (*mdns_record_callback_fn)(int sock, const struct sockaddr* from, size_t addrlen,
                                        mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
@@ -94,7 +247,49 @@ typedef struct mdns_record_ptr_t mdns_record_ptr_t;
 typedef struct mdns_record_a_t mdns_record_a_t;
 typedef struct mdns_record_aaaa_t mdns_record_aaaa_t;
 typedef struct mdns_record_txt_t mdns_record_txt_t;
+typedef struct mdns_record_nsec_t mdns_record_nsec_t;
 typedef struct mdns_query_t mdns_query_t;
+typedef struct mdns_packet_t mdns_packet_t;
+typedef struct mdns_ratelimit_entry_t mdns_ratelimit_entry_t;
+typedef struct mdns_ratelimit_t mdns_ratelimit_t;
+typedef struct mdns_scheduled_record_t mdns_scheduled_record_t;
+typedef struct mdns_scheduler_t mdns_scheduler_t;
+typedef struct mdns_responder_entry_t mdns_responder_entry_t;
+typedef struct mdns_responder_t mdns_responder_t;
+typedef struct mdns_responder_context_t mdns_responder_context_t;
+typedef struct mdns_snapshot_t mdns_snapshot_t;
+typedef struct mdns_publisher_t mdns_publisher_t;
+typedef struct mdns_datagram_t mdns_datagram_t;
+typedef struct mdns_ring_t mdns_ring_t;
+typedef struct mdns_probe_t mdns_probe_t;
+typedef struct mdns_prober_t mdns_prober_t;
+typedef struct mdns_probe_rdata_t mdns_probe_rdata_t;
+typedef struct mdns_announcement_t mdns_announcement_t;
+typedef struct mdns_announcer_t mdns_announcer_t;
+typedef struct mdns_cache_entry_t mdns_cache_entry_t;
+typedef struct mdns_cache_t mdns_cache_t;
+typedef struct mdns_cache_image_t mdns_cache_image_t;
+
+typedef struct mdns_browse_t mdns_browse_t;
+typedef struct mdns_browser_t mdns_browser_t;
+typedef struct mdns_resolve_t mdns_resolve_t;
+typedef struct mdns_resolver_t mdns_resolver_t;
+typedef struct mdns_question_t mdns_question_t;
+typedef struct mdns_querier_t mdns_querier_t;
+typedef struct mdns_arena_t mdns_arena_t;
+
+typedef void (*mdns_cache_callback_fn)(mdns_cache_t* cache, size_t entry, mdns_cache_event_t event,
+                                       void* user_data);
+
+typedef int (*mdns_cache_filter_fn)(const void* buffer, size_t size, size_t name_offset,
+                                    uint16_t rtype, void* user_data);
+
+typedef void (*mdns_browse_callback_fn)(mdns_browser_t* browser, const mdns_browse_t* browse,
+                                        mdns_browse_event_t event, mdns_string_t instance,
+                                        size_t entry, void* user_data);
+
+typedef void (*mdns_resolve_callback_fn)(mdns_resolver_t* resolver, const char* name,
+                                         size_t length, size_t entry, void* user_data);
 
 #ifdef _WIN32
 typedef int mdns_size_t;
@@ -145,6 +340,11 @@ struct mdns_record_txt_t {
 	mdns_string_t value;
 };
 
+struct mdns_record_nsec_t {
+	mdns_string_t name;
+	uint8_t bitmap[16];
+};
+
 struct mdns_record_t {
 	mdns_string_t name;
 	mdns_record_type_t type;
@@ -154,6 +354,7 @@ struct mdns_record_t {
 		mdns_record_a_t a;
 		mdns_record_aaaa_t aaaa;
 		mdns_record_txt_t txt;
+		mdns_record_nsec_t nsec;
 	} data;
 	uint16_t rclass;
 	uint32_t ttl;
@@ -174,6 +375,303 @@ struct mdns_query_t {
 	size_t length;
 };
 
+struct mdns_packet_t {
+	int sock;
+	const void* address;
+	size_t address_size;
+	void* buffer;
+	size_t capacity;
+	void* data;
+	uint16_t query_id;
+	uint16_t flags;
+	uint16_t count[4];
+	mdns_string_table_t string_table;
+	const char* question_name;
+	size_t question_length;
+	uint16_t question_type;
+	uint16_t question_class;
+	size_t sent;
+};
+
+struct mdns_ratelimit_entry_t {
+	uint64_t key;
+	uint64_t last;
+};
+
+struct mdns_ratelimit_t {
+	mdns_ratelimit_entry_t* entries;
+	size_t capacity;
+	size_t suppressed;
+	size_t evicted;
+};
+
+struct mdns_scheduled_record_t {
+	mdns_record_t record;
+	uint64_t hash;
+	uint64_t deadline;
+	mdns_entry_type_t section;
+	int probe_defense;
+	int flags;
+};
+
+struct mdns_scheduler_t {
+	mdns_scheduled_record_t* records;
+	size_t capacity;
+	size_t count;
+	uint64_t next;
+	uint32_t random_state;
+	size_t suppressed;
+	size_t dropped;
+	mdns_ratelimit_t* ratelimit;
+	size_t* index;
+	size_t index_capacity;
+};
+
+struct mdns_responder_entry_t {
+	mdns_record_t record;
+	uint64_t hash;
+	size_t next;
+	size_t same;
+	size_t prev;
+	// Index of the network interface the record is valid on, zero if valid on all interfaces
+	unsigned int if_index;
+};
+
+struct mdns_responder_t {
+	mdns_responder_entry_t* entries;
+	size_t capacity;
+	size_t used;
+	size_t count;
+	size_t free;
+	size_t* buckets;
+	size_t bucket_count;
+	size_t* addresses;
+	size_t address_capacity;
+	size_t address_count;
+};
+
+struct mdns_responder_context_t {
+	const mdns_responder_t* responder;
+	void* buffer;
+	size_t capacity;
+	mdns_scheduler_t* scheduler;
+	uint64_t now;
+	size_t* additional;
+	size_t additional_capacity;
+	mdns_publisher_t* publisher;
+	unsigned int if_index;
+};
+
+struct mdns_snapshot_t {
+	const mdns_responder_t* responder;
+	volatile long readers;
+};
+
+struct mdns_publisher_t {
+	mdns_snapshot_t* volatile current;
+};
+
+struct mdns_datagram_t {
+	volatile long sequence;
+	size_t size;
+	struct sockaddr_in6 from;
+	size_t addrlen;
+};
+
+struct mdns_ring_t {
+	int sock;
+	mdns_datagram_t* slots;
+	void* buffer;
+	size_t slot_size;
+	long mask;
+	volatile long head;
+	volatile long tail;
+	volatile long received;
+	volatile long dropped;
+	volatile long processed;
+};
+
+struct mdns_probe_t {
+	mdns_string_t name;
+	const mdns_record_t* records;
+	size_t record_count;
+	uint64_t deadline;
+	mdns_probe_state_t state;
+	int sent;
+};
+
+struct mdns_prober_t {
+	mdns_probe_t* probes;
+	size_t capacity;
+	size_t count;
+	uint64_t next;
+	uint32_t random_state;
+	uint64_t conflict_start;
+	size_t conflict_count;
+};
+
+struct mdns_probe_rdata_t {
+	uint16_t rclass;
+	uint16_t rtype;
+	size_t offset;
+	size_t length;
+};
+
+struct mdns_announcement_t {
+	mdns_record_t record;
+	uint64_t deadline;
+	uint32_t interval;
+	int remaining;
+	int sent;
+	int flags;
+};
+
+struct mdns_announcer_t {
+	mdns_announcement_t* announcements;
+	size_t capacity;
+	size_t count;
+	uint64_t next;
+};
+
+struct mdns_cache_entry_t {
+	uint64_t hash;
+	uint64_t received;
+	uint64_t expire;
+	uint64_t refresh;
+	uint32_t ttl;
+	uint16_t rtype;
+	uint16_t rclass;
+	uint16_t name_size;
+	uint16_t data_size;
+	uint8_t interest;
+	uint8_t refreshes;
+	uint8_t refresh_pending;
+	uint32_t timer_slot;
+	size_t next;
+	size_t timer_next;
+	size_t timer_prev;
+	size_t refresh_next;
+	uint8_t storage[MDNS_CACHE_RECORD_SIZE];
+};
+
+struct mdns_cache_t {
+	mdns_cache_entry_t* entries;
+	size_t capacity;
+	size_t used;
+	size_t count;
+	size_t free;
+	size_t* buckets;
+	size_t bucket_count;
+	uint64_t now;
+	uint64_t tick;
+	size_t wheel[MDNS_CACHE_WHEEL_LEVELS * MDNS_CACHE_WHEEL_SLOTS];
+	mdns_cache_callback_fn callback;
+	void* user_data;
+	mdns_cache_filter_fn filter;
+	void* filter_user_data;
+	size_t max_records;
+	size_t max_bytes;
+	size_t bytes;
+	size_t refresh_pending;
+	uint32_t random_state;
+	size_t evicted;
+	size_t dropped;
+	size_t filtered;
+	size_t refreshed;
+};
+
+// Header of a cache image, followed by the cache entries. Entries link to each other by index,
+// so the image does not depend on the address it is mapped at. The clock offset is the wall clock
+// time minus the cache time, in milliseconds
+struct mdns_cache_image_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint64_t capacity;
+	int64_t clock_offset;
+};
+
+struct mdns_browse_t {
+	const char* name;
+	size_t length;
+	uint64_t hash;
+	uint64_t deadline;
+	uint32_t interval;
+	mdns_browse_callback_fn callback;
+	void* user_data;
+};
+
+struct mdns_browser_t {
+	mdns_browse_t* browses;
+	size_t capacity;
+	size_t count;
+	mdns_cache_t* cache;
+	mdns_cache_callback_fn cache_callback;
+	void* cache_user_data;
+	uint32_t random_state;
+};
+
+struct mdns_resolve_t {
+	const char* name;
+	size_t length;
+	uint64_t hash;
+	uint16_t rtype;
+	uint64_t deadline;
+	uint64_t timeout;
+	uint32_t interval;
+	mdns_resolve_callback_fn callback;
+	void* user_data;
+};
+
+struct mdns_resolver_t {
+	mdns_resolve_t* requests;
+	size_t capacity;
+	size_t count;
+	mdns_cache_t* cache;
+	mdns_cache_callback_fn cache_callback;
+	void* cache_user_data;
+	mdns_arena_t* arena;
+	size_t coalesced;
+};
+
+struct mdns_question_t {
+	const char* name;
+	size_t length;
+	uint64_t hash;
+	uint16_t rtype;
+	uint8_t sent;
+	uint8_t matched;
+	uint64_t deadline;
+	uint64_t expire;
+	mdns_record_callback_fn callback;
+	void* user_data;
+};
+
+struct mdns_querier_t {
+	mdns_question_t* questions;
+	size_t capacity;
+	size_t count;
+	size_t sequence;
+	size_t matched_sequence;
+	mdns_entry_type_t last_entry;
+	uint64_t filter;
+	size_t packets;
+	size_t deduplicated;
+	size_t suppressed;
+};
+
+struct mdns_arena_t {
+	uint8_t* memory;
+	size_t capacity;
+	size_t used;
+	size_t free[MDNS_ARENA_CLASS_COUNT];
+	size_t cursor[MDNS_ARENA_CLASS_COUNT];
+	size_t end[MDNS_ARENA_CLASS_COUNT];
+	size_t allocated;
+	size_t failed;
+};
+
 // mDNS/DNS-SD public API
 
 //! Open and setup a IPv4 socket for mDNS/DNS-SD. To bind the socket to a specific interface, pass
@@ -220,6 +718,14 @@ static inline size_t
 mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                    void* user_data);
 
+//! Parse a packet received on the given socket from the given address, as done by
+//! mdns_socket_listen after receiving the packet. Lets the packet be received in one thread and
+//! parsed in another, see mdns_ring_receive. Buffer must be 32 bit aligned. Parsing is stopped
+//! when callback function returns non-zero. Returns the number of queries parsed.
+static inline size_t
+mdns_socket_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                  size_t size, mdns_record_callback_fn callback, void* user_data);
+
 //! Send a multicast DNS-SD reqeuest on the given socket to discover available services. Returns 0
 //! on success, or <0 if error.
 static inline int
@@ -249,11 +755,22 @@ mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t leng
 //! (mdns_record_type_t), a name string pointer (const char*) and a name length (size_t). The list
 //! of variable arguments should be terminated with a record type of 0. The query will request a
 //! unicast response if the socket is bound to an ephemeral port, or a multicast response if the
-//! socket is bound to mDNS port 5353. Returns the used query ID, or <0 if error.
+//! socket is bound to mDNS port 5353. If the questions do not fit in the buffer they are split
+//! over multiple packets, each a complete query without the truncated (TC) bit. Returns the used
+//! query ID, or <0 if error.
 static inline int
 mdns_multiquery_send(int sock, const mdns_query_t* query, size_t count, void* buffer,
                      size_t capacity, uint16_t query_id);
 
+//! Send a multicast mDNS query on the given socket for the instances of the given service type
+//! registered under the given subtype (RFC 6763 section 7.1), for example subtype "_printer" and
+//! service type "_http._tcp.local.". Only the matching instances are answered, instead of all
+//! instances of the service type. Buffer and query ID are used as in mdns_query_send. Returns
+//! the used query ID, or <0 if error.
+static inline int
+mdns_query_subtype_send(int sock, const char* subtype, size_t subtype_length, const char* service,
+                        size_t service_length, void* buffer, size_t capacity, uint16_t query_id);
+
 //! Receive unicast responses to a mDNS query sent with mdns_[multi]query_send, optionally filtering
 //! out any responses not matching the given query ID. Set the query ID to 0 to parse all responses,
 //! even if it is not matching the query ID set in a specific query. Any data will be piped to the
@@ -267,7 +784,8 @@ mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn
 //! given address. Use the top bit of the query class field (MDNS_UNICAST_RESPONSE) in the query
 //! recieved to determine if the answer should be sent unicast (bit set) or multicast (bit not set).
 //! Buffer must be 32 bit aligned. The record type and name should match the data from the query
-//! recieved. Returns 0 if success, or <0 if error.
+//! recieved. Records that do not fit in the buffer are sent in additional packets, split at record
+//! boundaries and each repeating the question. Returns 0 if success, or <0 if error.
 static inline int
 mdns_query_answer_unicast(int sock, const void* address, size_t address_size, void* buffer,
                           size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
@@ -278,7 +796,8 @@ mdns_query_answer_unicast(int sock, const void* address, size_t address_size, vo
 //! Send a variable multicast mDNS query answer to any question with variable number of records. Use
 //! the top bit of the query class field (MDNS_UNICAST_RESPONSE) in the query recieved to determine
 //! if the answer should be sent unicast (bit set) or multicast (bit not set). Buffer must be 32 bit
-//! aligned. Returns 0 if success, or <0 if error.
+//! aligned. Records that do not fit in the buffer are sent in additional packets, split at record
+//! boundaries. Returns 0 if success, or <0 if error.
 static inline int
 mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
                             const mdns_record_t* authority, size_t authority_count,
@@ -299,160 +818,893 @@ mdns_goodbye_multicast(int sock, void* buffer, size_t capacity, mdns_record_t an
                        const mdns_record_t* authority, size_t authority_count,
                        const mdns_record_t* additional, size_t additional_count);
 
-// Parse records functions
+//! Send a variable number of records as unsolicited multicast answers, packed into as few packets
+//! as the buffer capacity allows. Use this instead of a mdns_announce_multicast call per service
+//! to announce many services at once. Use a buffer capacity that fits the MTU of the interface
+//! without fragmenting, for example 1472 bytes for IPv4 over Ethernet (1500 bytes MTU less IP and
+//! UDP headers) or 1452 bytes for IPv6. Names are compressed across all records in a packet, so
+//! keep records with the same or similar names close in the array. TXT key-value pairs are
+//! coalesced into one record if consecutive in the array. Sending starts at the record index given
+//! by the cursor and stops when all records are sent or after the given number of packets (0 for
+//! no limit), and the cursor is updated to the first record not sent. To avoid traffic bursts,
+//! call repeatedly with a small packet limit spaced out in time until the cursor reaches the
+//! record count. Buffer must be 32 bit aligned. Returns the number of packets sent, or <0 if
+//! error.
+static inline int
+mdns_announce_multicast_bulk(int sock, void* buffer, size_t capacity, const mdns_record_t* records,
+                             size_t record_count, size_t* cursor, size_t max_packets);
 
-//! Parse a PTR record, returns the name in the record
-static inline mdns_string_t
-mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
-                      char* strbuffer, size_t capacity);
+//! Send a variable number of records as multicast goodbyes, packed and paced in the same way as
+//! mdns_announce_multicast_bulk. Use this on service end for removing many resources at once. The
+//! records must be identical to the according announcement.
+static inline int
+mdns_goodbye_multicast_bulk(int sock, void* buffer, size_t capacity, const mdns_record_t* records,
+                            size_t record_count, size_t* cursor, size_t max_packets);
 
-//! Parse a SRV record, returns the priority, weight, port and name in the record
-static inline mdns_record_srv_t
-mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
-                      char* strbuffer, size_t capacity);
+// TXT record functions
 
-//! Parse an A record, returns the IPv4 address in the record
-static inline struct sockaddr_in*
-mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
-                    struct sockaddr_in* addr);
+//! Serialize key-value pairs into TXT record data as a sequence of length-prefixed strings. The
+//! data is sent as is by a TXT record with an empty key and the data as value, which avoids
+//! coalescing and copying the pairs on every send, so build it once and reuse the record. Values
+//! may contain binary data, and a pair with a null value string is stored as a boolean attribute
+//! without '='. Returns the size of the data, or 0 if the buffer is too small or any pair is
+//! longer than 255 bytes.
+static inline size_t
+mdns_txt_make(void* buffer, size_t capacity, const mdns_record_txt_t* pairs, size_t count);
 
-//! Parse an AAAA record, returns the IPv6 address in the record
-static inline struct sockaddr_in6*
-mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
-                       struct sockaddr_in6* addr);
+// NSEC record functions
 
-//! Parse a TXT record, returns the number of key=value records parsed and stores the key-value
-//! pairs in the supplied buffer
-static inline size_t
-mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t length,
-                      mdns_record_txt_t* records, size_t capacity);
+//! Mark a record type as existing in a NSEC record. Multicast DNS only uses the first window block
+//! of the type bitmap (RFC 6762 section 6.1), and the bitmap holds types below 128. Returns 0 if
+//! success, or <0 if the type is out of range.
+static inline int
+mdns_record_nsec_set_type(mdns_record_nsec_t* nsec, uint16_t rtype);
 
-// Internal functions
+//! Check if a NSEC record asserts that records of the given type exist for its name. Returns 1 if
+//! the type exists, 0 if not.
+static inline int
+mdns_record_nsec_has_type(const mdns_record_nsec_t* nsec, uint16_t rtype);
 
+// Service subtype functions
+
+//! Make the subtype name "<subtype>._sub.<service>" in the given buffer (RFC 6763 section 7.1),
+//! for example "_printer._sub._http._tcp.local." for the subtype "_printer" of the service type
+//! "_http._tcp.local.". Returns the name, with zero length if the subtype is not a single label
+//! or the name does not fit in the buffer.
 static inline mdns_string_t
-mdns_string_extract(const void* buffer, size_t size, size_t* offset, char* str, size_t capacity);
+mdns_subtype_make(char* buffer, size_t capacity, const char* subtype, size_t subtype_length,
+                  const char* service, size_t service_length);
 
+//! Split a subtype name "<subtype>._sub.<service>" into the subtype and the service type. Returns
+//! 0 if the name is a subtype name, or <0 if not.
 static inline int
-mdns_string_skip(const void* buffer, size_t size, size_t* offset);
+mdns_subtype_parse(const char* name, size_t length, mdns_string_t* subtype,
+                   mdns_string_t* service);
+
+//! Make the PTR record mapping the given subtype name to the service instance of the given PTR
+//! record for the service type, with the same class and TTL. Register and announce it along with
+//! the service type PTR record to make the instance browsable by subtype.
+static inline mdns_record_t
+mdns_record_subtype(const mdns_record_t* record, mdns_string_t subtype_name);
 
+// Response scheduling functions
+
+//! Initialize a multicast response scheduler using the given caller owned storage for pending
+//! records. The seed initializes the random generator used for answer delays and should differ
+//! between hosts, for example by deriving it from a local address.
+static inline void
+mdns_scheduler_init(mdns_scheduler_t* scheduler, mdns_scheduled_record_t* records, size_t capacity,
+                    uint32_t seed);
+
+//! Schedule a multicast answer with variable number of additional records. Answers for shared
+//! records (PTR) are delayed by a random 20-120ms as required by RFC 6762 section 6, other answers
+//! are due immediately. Records already pending are merged, keeping the earliest deadline, and
+//! additional records already pending as answers are not duplicated. The time is given in
+//! milliseconds from any monotonic clock, which must be used consistently for the scheduler.
+//! Records are copied, but the strings referenced by the records must remain valid until the
+//! records are sent or cancelled, so names parsed into a temporary buffer cannot be scheduled.
+//! Returns 0 if success, or <0 if the scheduler storage is full.
+static inline int
+mdns_scheduler_add(mdns_scheduler_t* scheduler, uint64_t now, mdns_record_t answer,
+                   const mdns_record_t* additional, size_t additional_count);
+
+//! Cancel pending records that another host has multicast, as given by a record parsed in a
+//! response received on a socket bound to the mDNS port. The arguments are the corresponding
+//! arguments of the record callback. According to RFC 6762 section 7.4 the record is treated as
+//! sent if the received TTL is not less than our TTL. With an index the pending records are looked
+//! up by the hash of the received record. Returns the number of cancelled records.
 static inline size_t
-mdns_string_find(const char* str, size_t length, char c, size_t offset);
+mdns_scheduler_suppress(mdns_scheduler_t* scheduler, const void* buffer, size_t size,
+                        size_t name_offset, uint16_t rtype, uint32_t ttl, size_t record_offset,
+                        size_t record_length);
 
-//! Compare if two strings are equal. If the strings are equal it returns >0 and the offset variables are
-//! updated to the end of the corresponding strings. If the strings are not equal it returns 0 and 
-//! the offset variables are NOT updated.
+//! Get the time of the earliest pending record, or MDNS_TIME_NEVER if no records are pending.
+static inline uint64_t
+mdns_scheduler_next_deadline(const mdns_scheduler_t* scheduler);
+
+//! Send all pending records that are due, aggregating any records due within the aggregation
+//! window into the same packet. Buffer must be 32 bit aligned. Returns the number of packets sent,
+//! or <0 if error.
 static inline int
-mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
-                  size_t size_rhs, size_t* ofs_rhs);
+mdns_scheduler_send(mdns_scheduler_t* scheduler, int sock, void* buffer, size_t capacity,
+                    uint64_t now);
+
+//! Index the pending records by record hash in the given caller owned storage, so that merging a
+//! record with an equal pending record and coalescing the TXT key-value pairs of a name when
+//! sending take constant time instead of a scan of all pending records. Without an index each
+//! insert compares the record with every pending record, which only suits schedulers holding a
+//! few records. The index is an open addressing table, use a capacity of about twice the
+//! scheduler capacity. Returns 0 if success, or <0 if the capacity is not larger than the
+//! scheduler capacity.
+static inline int
+mdns_scheduler_set_index(mdns_scheduler_t* scheduler, size_t* index, size_t capacity);
 
-static inline void*
-mdns_string_make(void* buffer, size_t capacity, void* data, const char* name, size_t length,
-                 mdns_string_table_t* string_table);
+//! Use the given rate limit table to avoid multicasting the same record more than once per second
+//! on the socket. The table can be shared between schedulers for different sockets. Records that
+//! are rate limited when due are dropped and counted in the rate limit table.
+static inline void
+mdns_scheduler_set_ratelimit(mdns_scheduler_t* scheduler, mdns_ratelimit_t* ratelimit);
 
-static inline size_t
-mdns_string_table_find(mdns_string_table_t* string_table, const void* buffer, size_t capacity,
-                       const char* str, size_t first_length, size_t total_length);
+// Responder functions
 
-// Implementations
+//! Initialize a responder record registry using the given caller owned storage for records and
+//! for the hash table buckets indexing the records. Use a bucket count of about the number of
+//! records to register.
+static inline void
+mdns_responder_init(mdns_responder_t* responder, mdns_responder_entry_t* entries, size_t capacity,
+                    size_t* buckets, size_t bucket_count);
+
+//! Register a record to answer questions with. The record is copied, but the strings referenced
+//! by the record must remain valid while the record is registered. Multiple records with the same
+//! name and type form a set which is answered together, for example a PTR record for each service
+//! instance of a service type. Registering a record equal to an already registered record has no
+//! effect. Returns 0 if success, or <0 if the registry storage is full.
+static inline int
+mdns_responder_add(mdns_responder_t* responder, mdns_record_t record);
+
+//! Register an A or AAAA record valid only on the network interface with the given index, for a
+//! host with different addresses on its interfaces. Questions are answered with the address
+//! records valid on the interface in the context if_index field, as a response must only hold the
+//! addresses valid on the link it is sent on (RFC 6762 section 6.2). Registering an address
+//! record equal to a record registered for another interface makes the record valid on all
+//! interfaces. Remove the record with mdns_responder_remove. Returns 0 if success, or <0 if the
+//! record is not an address record or the registry storage is full.
+static inline int
+mdns_responder_add_address(mdns_responder_t* responder, mdns_record_t record,
+                           unsigned int if_index);
 
-static inline uint16_t
-mdns_ntohs(const void* data) {
-	uint16_t aligned;
-	memcpy(&aligned, data, sizeof(uint16_t));
-	return ntohs(aligned);
-}
+//! Unregister a record equal to the given record. Returns 0 if success, or <0 if not found.
+static inline int
+mdns_responder_remove(mdns_responder_t* responder, const mdns_record_t* record);
+
+//! Index the registered A and AAAA records by address in the given caller owned storage, so
+//! that reverse mapping PTR questions for "<reversed IPv4 address>.in-addr.arpa." and
+//! "<reversed IPv6 address nibbles>.ip6.arpa." names are answered with the names of the address
+//! records, without registering any PTR records. The index is an open addressing table, use a
+//! capacity of about twice the number of address records. Registering an address record fails
+//! if the index is full. Already registered address records are indexed. Returns 0 if success,
+//! or <0 if the storage is too small.
+static inline int
+mdns_responder_set_address_index(mdns_responder_t* responder, size_t* addresses,
+                                 size_t capacity);
 
-static inline uint32_t
-mdns_ntohl(const void* data) {
-	uint32_t aligned;
-	memcpy(&aligned, data, sizeof(uint32_t));
-	return ntohl(aligned);
-}
+//! Find a registered A or AAAA record with the given address in the address index. Returns the
+//! index of the record in the responder entries, or MDNS_INVALID_POS if not found.
+static inline size_t
+mdns_responder_find_address(const mdns_responder_t* responder, const struct sockaddr* addr);
 
-static inline void*
-mdns_htons(void* data, uint16_t val) {
-	val = htons(val);
-	memcpy(data, &val, sizeof(uint16_t));
-	return MDNS_POINTER_OFFSET(data, sizeof(uint16_t));
-}
+//! Register the service instance of the given PTR record for the service type under the subtype
+//! name made with mdns_subtype_make. Subtype names are indexed like any other name, so PTR
+//! questions for a subtype are answered with only the instances registered under it, with the
+//! same additional records as for the service type. The subtype name string must remain valid
+//! while the record is registered. Returns 0 if success, or <0 if the registry storage is full.
+static inline int
+mdns_responder_add_subtype(mdns_responder_t* responder, mdns_string_t subtype_name,
+                           const mdns_record_t* record);
 
-static inline void*
-mdns_htonl(void* data, uint32_t val) {
-	val = htonl(val);
-	memcpy(data, &val, sizeof(uint32_t));
-	return MDNS_POINTER_OFFSET(data, sizeof(uint32_t));
-}
+//! Unregister a service instance registered with mdns_responder_add_subtype. Returns 0 if
+//! success, or <0 if not found.
+static inline int
+mdns_responder_remove_subtype(mdns_responder_t* responder, mdns_string_t subtype_name,
+                              const mdns_record_t* record);
 
+//! Copy all records registered in the source responder to the given responder, replacing its
+//! records. The responder must be initialized with storage for at least as many records as the
+//! source. With the same bucket count the storage is copied as is, otherwise the records are
+//! registered again. Returns 0 if success, or <0 if the responder storage is full.
 static inline int
-mdns_socket_open_ipv4(const struct sockaddr_in* saddr) {
-	int sock = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sock < 0)
-		return -1;
-	if (mdns_socket_setup_ipv4(sock, saddr)) {
-		mdns_socket_close(sock);
-		return -1;
-	}
-	return sock;
-}
+mdns_responder_copy(mdns_responder_t* responder, const mdns_responder_t* source);
 
+//! Find the registered records with the given name and type. Returns the index of the first
+//! record in the responder entries, with the following records with the same name and type linked
+//! by the entry "same" index, or MDNS_INVALID_POS if no record matches.
+static inline size_t
+mdns_responder_find(const mdns_responder_t* responder, const char* name, size_t length,
+                    mdns_record_type_t type);
+
+//! Answer a question for the name in the given buffer with the registered records, adding
+//! additional records according to RFC 6763 section 12. Questions for PTR, SRV, TXT, A, AAAA and
+//! ANY records are answered. A question for a type that does not exist for a name with unique
+//! records (any records other than PTR records) is answered with a NSEC record listing the types
+//! that do exist (RFC 6762 section 6.1), so that the client can cache the negative answer instead
+//! of asking again. A and AAAA answers get a NSEC record as additional record if the host has no
+//! address of the other type. Reverse mapping PTR questions are answered from the address index if
+//! set (see mdns_responder_set_address_index), sent directly rather than scheduled. Questions
+//! asking for a unicast response (MDNS_UNICAST_RESPONSE bit set in the class), or sent from a port
+//! other than the mDNS port, are answered by unicast to the given address. Other questions are
+//! answered by multicast, through the context scheduler if set. Records that do not fit in the
+//! scheduler storage are dropped and counted in the scheduler dropped field. Address records
+//! registered with mdns_responder_add_address are only used if valid on the interface in the
+//! context if_index field, or all of them if zero. Returns the number of answer records, or <0 if
+//! error.
 static inline int
-mdns_socket_setup_ipv4(int sock, const struct sockaddr_in* saddr) {
-	unsigned char ttl = 1;
-	unsigned char loopback = 1;
-	unsigned int reuseaddr = 1;
-	struct ip_mreq req;
+mdns_responder_answer(mdns_responder_context_t* context, int sock, const struct sockaddr* from,
+                      size_t addrlen, uint16_t query_id, uint16_t rtype, uint16_t rclass,
+                      const void* buffer, size_t size, size_t name_offset);
+
+//! Record callback for mdns_socket_listen answering questions with mdns_responder_answer. The
+//! user data must be a mdns_responder_context_t with the responder, the send buffer and optional
+//! scheduler and storage for additional record sets. With a scheduler, answers received from
+//! other hosts cancel pending equal answers (see mdns_scheduler_suppress). If the context has a
+//! publisher, questions are answered from the currently published record set instead of the
+//! context responder, without taking any lock.
+static inline int
+mdns_responder_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                        mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                        uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                        size_t name_offset, size_t name_length, size_t record_offset,
+                        size_t record_length, void* user_data);
 
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuseaddr, sizeof(reuseaddr));
-#ifdef SO_REUSEPORT
-	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuseaddr, sizeof(reuseaddr));
-#endif
-	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
-	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
+// Record set publishing functions
 
-	memset(&req, 0, sizeof(req));
-	req.imr_multiaddr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
-	if (saddr)
-		req.imr_interface = saddr->sin_addr;
-	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&req, sizeof(req)))
-		return -1;
+//! Initialize a snapshot wrapping the given responder, which must not be modified while the
+//! snapshot is published or in use by readers
+static inline void
+mdns_snapshot_init(mdns_snapshot_t* snapshot, const mdns_responder_t* responder);
 
-	struct sockaddr_in sock_addr;
-	if (!saddr) {
-		memset(&sock_addr, 0, sizeof(struct sockaddr_in));
-		sock_addr.sin_family = AF_INET;
-		sock_addr.sin_addr.s_addr = INADDR_ANY;
-#ifdef __APPLE__
-		sock_addr.sin_len = sizeof(struct sockaddr_in);
-#endif
-	} else {
-		memcpy(&sock_addr, saddr, sizeof(struct sockaddr_in));
-		setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&sock_addr.sin_addr,
-		           sizeof(sock_addr.sin_addr));
-#ifndef _WIN32
-		sock_addr.sin_addr.s_addr = INADDR_ANY;
-#endif
-	}
+//! Check if any reader still uses a snapshot. A snapshot replaced by mdns_publisher_publish can
+//! be modified and published again once this returns 0. Returns >0 if in use, 0 if not.
+static inline int
+mdns_snapshot_in_use(const mdns_snapshot_t* snapshot);
+
+//! Initialize a publisher with the given snapshot as the published record set. A publisher lets
+//! writer threads replace the records answered by receive threads without stopping them: build a
+//! new responder in separate storage (for example with mdns_responder_copy followed by
+//! mdns_responder_add and mdns_responder_remove), wrap it in a snapshot and publish it with a
+//! single atomic pointer swap. Readers never block, and each reader sees either the old or the
+//! new record set in full.
+static inline void
+mdns_publisher_init(mdns_publisher_t* publisher, mdns_snapshot_t* snapshot);
 
-	if (bind(sock, (struct sockaddr*)&sock_addr, sizeof(struct sockaddr_in)))
-		return -1;
+//! Publish a new snapshot, replacing the currently published snapshot. Returns the replaced
+//! snapshot, which readers may still use until mdns_snapshot_in_use returns 0. Records answered
+//! through a scheduler are copied, so the strings of removed records must also remain valid until
+//! the scheduled answers have been sent. Only one thread may publish at a time.
+static inline mdns_snapshot_t*
+mdns_publisher_publish(mdns_publisher_t* publisher, mdns_snapshot_t* snapshot);
 
-#ifdef _WIN32
-	unsigned long param = 1;
-	ioctlsocket(sock, FIONBIO, &param);
-#else
-	const int flags = fcntl(sock, F_GETFL, 0);
-	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-#endif
+//! Acquire the currently published snapshot for reading, without taking any lock. The snapshot
+//! must be released with mdns_publisher_release when done.
+static inline mdns_snapshot_t*
+mdns_publisher_acquire(mdns_publisher_t* publisher);
 
-	return 0;
+//! Release a snapshot acquired with mdns_publisher_acquire
+static inline void
+mdns_publisher_release(mdns_snapshot_t* snapshot);
+
+// Receive pipeline functions
+
+//! Initialize a ring of packets received on the given socket, using the given caller owned
+//! storage for the slots, and a buffer of capacity times slot size bytes for the packet data. The
+//! capacity must be a power of two, and the slot size a multiple of 4 bytes large enough for the
+//! largest packet to receive (for example 1500 bytes). A ring lets a receive thread drain a socket
+//! while worker threads parse the packets and send the answers, so slow answers do not make the
+//! socket drop packets. Each ring takes packets from one socket and one receive thread, and any
+//! number of worker threads. The socket is kept in the sock field of the ring, for the receive
+//! thread to wait on. Returns 0 if success, or <0 if the capacity is not a power of two.
+static inline int
+mdns_ring_init(mdns_ring_t* ring, int sock, mdns_datagram_t* slots, size_t capacity,
+               void* buffer, size_t slot_size);
+
+//! Receive one packet from the socket of the ring into the next free slot, from the receive
+//! thread of the ring. If the ring is full the packet is still read from the socket, to keep the
+//! socket buffer from filling up, and counted as dropped in the ring. Returns the size of the
+//! packet, 0 if no packet was available, or <0 if the packet was dropped.
+static inline int
+mdns_ring_receive(mdns_ring_t* ring);
+
+//! Parse up to the given number of packets from the ring with mdns_socket_parse, from any number
+//! of worker threads. The callback answers on the socket the packet was received on, so each
+//! worker should use its own user data, for example a mdns_responder_context_t with a send
+//! buffer, additional record storage and scheduler of its own, sharing the records through a
+//! publisher. Schedulers are not shared, so duplicate suppression and rate limiting only apply
+//! to the answers of the same worker. Returns the number of packets parsed.
+static inline size_t
+mdns_ring_process(mdns_ring_t* ring, size_t max_count, mdns_record_callback_fn callback,
+                  void* user_data);
+
+//! Get the number of packets received into the ring and not yet parsed, for applying backpressure
+//! when the workers fall behind. The ring also counts the received, dropped and processed packets
+//! in the fields of the same name.
+static inline size_t
+mdns_ring_pending(mdns_ring_t* ring);
+
+// Record cache functions
+
+//! Initialize a cache of received records using the given caller owned storage for the records
+//! and the hash buckets for the names, at the given time in milliseconds. Records are kept until
+//! their TTL runs out, expired by a timing wheel at a constant cost per record. Goodbye records
+//! and records of a set flushed by a record with the cache flush bit are removed one second later
+//! (RFC 6762 section 10). If the cache is full the record expiring first is evicted.
+static inline void
+mdns_cache_init(mdns_cache_t* cache, mdns_cache_entry_t* entries, size_t capacity, size_t* buckets,
+                size_t bucket_count, uint64_t now);
+
+//! Set a callback called when records are added to, updated in or removed from the cache. The
+//! callback must not add or remove records.
+static inline void
+mdns_cache_set_callback(mdns_cache_t* cache, mdns_cache_callback_fn callback, void* user_data);
+
+//! Set a filter deciding which records are cached, given the name and type of each record added.
+//! The filter returns non-zero to cache the record. Filtered records are counted in the filtered
+//! field. Use mdns_cache_filter_domain with a domain string as user data to only cache records
+//! with names in the domain.
+static inline void
+mdns_cache_set_filter(mdns_cache_t* cache, mdns_cache_filter_fn filter, void* user_data);
+
+//! Limit the number of cached records, and the total size in bytes of their uncompressed names
+//! and data, below the capacity of the cache storage. A limit of zero means no limit. When a
+//! record would exceed a limit the records expiring first are evicted to make room.
+static inline void
+mdns_cache_set_budget(mdns_cache_t* cache, size_t max_records, size_t max_bytes);
+
+//! Cache filter matching records with names equal to or ending in the domain name given as a
+//! zero terminated string in the user data, for example "_http._tcp.local.".
+static inline int
+mdns_cache_filter_domain(const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                         void* user_data);
+
+//! Add a record in a packet buffer received at the given time in milliseconds, or update the TTL
+//! of the record if already cached. Records with TTL zero are goodbyes and set a cached record to
+//! expire in one second. Returns the index of the record in the cache entries, or
+//! MDNS_INVALID_POS if not cached.
+static inline size_t
+mdns_cache_add(mdns_cache_t* cache, uint64_t now, const void* buffer, size_t size,
+               size_t name_offset, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+               size_t record_offset, size_t record_length);
+
+//! Record callback adding the records of received responses to the cache given as user data, for
+//! use with mdns_query_recv, mdns_discovery_recv or mdns_socket_listen. Questions and records
+//! in queries are ignored, as are multicast responses not sent from the mDNS port (RFC 6762
+//! section 11). Records are added at the time of the last call to mdns_cache_expire. On a socket
+//! bound to the mDNS port this passively caches the answer, authority and additional records of
+//! all responses on the link, so most lookups can be answered without sending a query.
+static inline int
+mdns_cache_record_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                           mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                           uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                           size_t name_offset, size_t name_length, size_t record_offset,
+                           size_t record_length, void* user_data);
+
+//! Remove the records expired at the given time in milliseconds, and set the time used by
+//! mdns_cache_record_callback and mdns_cache_find. Call periodically, at least every few seconds
+//! while records are cached. Returns the number of expired records.
+static inline size_t
+mdns_cache_expire(mdns_cache_t* cache, uint64_t now);
+
+//! Find the next cached record with the given name and type, or any type for
+//! MDNS_RECORDTYPE_ANY, after the given record index, or the first for MDNS_INVALID_POS. Expired
+//! records are skipped. The uncompressed name and data are stored in the storage field of the
+//! entry, the data at offset name_size with a size of data_size bytes, so the
+//! mdns_record_parse_* functions parse the data using the storage as buffer. Returns the index
+//! of the record in the cache entries, or MDNS_INVALID_POS if not found.
+static inline size_t
+mdns_cache_find(const mdns_cache_t* cache, const char* name, size_t length, uint16_t rtype,
+                size_t previous);
+
+//! Remove a record from the cache
+static inline void
+mdns_cache_remove(mdns_cache_t* cache, size_t entry);
+
+//! Get the name of a cached record, copied to the given buffer as a dotted string
+static inline mdns_string_t
+mdns_cache_entry_name(const mdns_cache_t* cache, size_t entry, char* buffer, size_t capacity);
+
+//! Get the remaining TTL in seconds of a cached record
+static inline uint32_t
+mdns_cache_entry_ttl(const mdns_cache_t* cache, size_t entry);
+
+//! Mark a cached record as interesting, or not, for keeping it fresh. Records of interest are
+//! queried for again at 80%, 85%, 90% and 95% of their TTL plus a random 0-2% (RFC 6762
+//! section 5.2), until an answer renews the record. The refresh schedule starts over each time
+//! the record is received, and the mark stays until the record is removed.
+static inline void
+mdns_cache_set_interest(mdns_cache_t* cache, size_t entry, int interest);
+
+//! Send the refresh queries that have become due in calls to mdns_cache_expire on each of the
+//! given sockets, one question per name and type, packed into as few packets as possible. Call
+//! after mdns_cache_expire. Since refreshes are collected per tick of the expiry timing wheel,
+//! the refreshes of many records due close together share packets. Buffer must be 32 bit
+//! aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_cache_refresh_send(mdns_cache_t* cache, const int* sockets, size_t socket_count,
+                        void* buffer, size_t capacity);
+
+//! Get the address of a cached A or AAAA record. Returns 0 if success, or <0 if the record is not
+//! an address record.
+static inline int
+mdns_cache_entry_address(const mdns_cache_t* cache, size_t entry, struct sockaddr_storage* addr);
+
+//! Get the size in bytes of a cache image holding the given number of records.
+static inline size_t
+mdns_cache_image_size(size_t capacity);
+
+//! Initialize a cache keeping its records in the given image, for example a memory mapped file,
+//! so the cache survives a restart of the process. The image must be 8 byte aligned and from a
+//! trusted source. The cache time now in milliseconds and the wall clock time in milliseconds
+//! relate the cache times stored in the image to the cache times of this process. If the image
+//! holds records of a cache with the same version and capacity, the records with TTL remaining
+//! are usable right away without parsing, and the records of interest due for a refresh are
+//! queued for mdns_cache_refresh_send. Otherwise the image is cleared. The capacity of the cache
+//! is the number of records fitting in the image. Returns the number of records restored, or <0
+//! if the image is too small.
+static inline int
+mdns_cache_attach(mdns_cache_t* cache, void* image, size_t size, size_t* buckets,
+                  size_t bucket_count, uint64_t now, uint64_t wall);
+
+// Browsing functions
+
+//! Initialize a browser continuously querying for service instances, using the given caller
+//! owned storage for the browsed service types. Answers are read from the given cache, and the
+//! browser reports instances added to and removed from the cache instead of raw records. The
+//! browser sets itself as the cache callback, forwarding to the callback set before. The seed
+//! initializes the random generator used for query timing and should differ between hosts.
+static inline void
+mdns_browser_init(mdns_browser_t* browser, mdns_browse_t* browses, size_t capacity,
+                  mdns_cache_t* cache, uint32_t seed);
+
+//! Start browsing for instances of a service type, for example "_http._tcp.local.". The name must
+//! remain valid while browsing. Instances already in the cache are reported as added right away.
+//! The callback is called with the instance name and the index of the cache entry of the record
+//! causing the event, when an instance is added, when the SRV or TXT record of an instance is
+//! added or changed, and when an instance is removed. Returns the index of the browse in the
+//! browser storage, or <0 if the storage is full.
+static inline int
+mdns_browser_add(mdns_browser_t* browser, uint64_t now, const char* name, size_t length,
+                 mdns_browse_callback_fn callback, void* user_data);
+
+//! Stop browsing for a service type. Returns 0 if success, or <0 if not browsing for the type.
+static inline int
+mdns_browser_remove(mdns_browser_t* browser, const char* name, size_t length);
+
+//! Get the time of the next browse query, or MDNS_TIME_NEVER if not browsing.
+static inline uint64_t
+mdns_browser_next_deadline(const mdns_browser_t* browser);
+
+//! Send the browse queries that are due on each of the given sockets, packing the questions due
+//! within the aggregation window into the same packets. The instances in the cache with more
+//! than half their TTL remaining are included as known answers, so responders only answer with
+//! new or expiring instances (RFC 6762 section 7.1). The interval to the next query of each type
+//! doubles up to one hour, so a long running browse costs close to no traffic. Buffer must be 32
+//! bit aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_browser_send(mdns_browser_t* browser, const int* sockets, size_t socket_count, void* buffer,
+                  size_t capacity, uint64_t now);
+
+// Hostname resolving functions
+
+//! Initialize a resolver of hostnames to addresses, using the given caller owned storage for
+//! pending requests. Answers are read from the given cache. The resolver sets itself as the
+//! cache callback, forwarding to the callback set before.
+static inline void
+mdns_resolver_init(mdns_resolver_t* resolver, mdns_resolve_t* requests, size_t capacity,
+                   mdns_cache_t* cache);
+
+//! Copy the names of pending requests into blocks allocated from the given arena, so that the
+//! name given to mdns_resolve only needs to remain valid during the call. Set the arena before
+//! resolving any names, and give a null pointer to stop copying when no requests are pending.
+static inline void
+mdns_resolver_set_arena(mdns_resolver_t* resolver, mdns_arena_t* arena);
+
+//! Resolve a hostname like "myhost.local." to an address, of type MDNS_RECORDTYPE_A,
+//! MDNS_RECORDTYPE_AAAA or MDNS_RECORDTYPE_ANY for either. If a fresh address record is cached the
+//! callback is called right away. Otherwise the request waits for the first address record
+//! received, and the callback is called with the index of its cache entry, or with MDNS_INVALID_POS
+//! if none arrived within the given timeout in milliseconds. Requests for a name already being
+//! resolved for the same type, or for MDNS_RECORDTYPE_ANY, share its outstanding query instead of
+//! sending another. The name must remain valid until the callback is called, unless the resolver
+//! has an arena (see mdns_resolver_set_arena). Returns 1 if answered from the cache, 0 if the
+//! request is pending, or <0 if the request storage or the arena is full.
+static inline int
+mdns_resolve(mdns_resolver_t* resolver, uint64_t now, const char* name, size_t length,
+             mdns_record_type_t rtype, uint32_t timeout, mdns_resolve_callback_fn callback,
+             void* user_data);
+
+//! Get the time of the next resolve query or timeout, or MDNS_TIME_NEVER if no requests are
+//! pending.
+static inline uint64_t
+mdns_resolver_next_deadline(const mdns_resolver_t* resolver);
+
+//! Send the resolve queries that are due on each of the given sockets, one question per name and
+//! type packed into the same packets, and complete the requests that timed out. Unanswered queries
+//! are repeated after one second and then at doubling intervals, up to MDNS_RESOLVE_INTERVAL_MAX.
+//! Buffer must be 32 bit aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_resolver_send(mdns_resolver_t* resolver, const int* sockets, size_t socket_count,
+                   void* buffer, size_t capacity, uint64_t now);
+
+// Query scheduling functions
+
+//! Initialize a query scheduler collecting the questions of many callers into shared packets,
+//! using the given caller owned storage for pending questions.
+static inline void
+mdns_querier_init(mdns_querier_t* querier, mdns_question_t* questions, size_t capacity);
+
+//! Add a question for the given record type and name, to be sent by mdns_querier_send within
+//! MDNS_QUERY_WINDOW milliseconds together with the other questions added meanwhile. Until the
+//! timeout in milliseconds has passed, records answering the question received through
+//! mdns_querier_record_callback are passed to the callback, followed by the authority and
+//! additional records of the same response. The name must remain valid until the question times
+//! out or is canceled. Returns 0 if success, or <0 if the question storage is full.
+static inline int
+mdns_querier_add(mdns_querier_t* querier, uint64_t now, mdns_record_type_t rtype, const char* name,
+                 size_t length, uint32_t timeout, mdns_record_callback_fn callback,
+                 void* user_data);
+
+//! Cancel all questions added with the given user data.
+static inline void
+mdns_querier_cancel(mdns_querier_t* querier, void* user_data);
+
+//! Get the time the pending questions are due to be sent or the next question times out, or
+//! MDNS_TIME_NEVER if no questions are pending.
+static inline uint64_t
+mdns_querier_next_deadline(const mdns_querier_t* querier);
+
+//! If the first pending question is due, send all pending questions on each of the given sockets,
+//! asking once for questions added by many callers, packed into as few packets as the buffer
+//! capacity allows. Use a capacity matching the interface MTU. Questions that timed out are
+//! removed. Buffer must be 32 bit aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_querier_send(mdns_querier_t* querier, const int* sockets, size_t socket_count, void* buffer,
+                  size_t capacity, uint64_t now);
+
+//! Receive and parse a packet on the given socket with mdns_querier_record_callback, starting a
+//! new packet sequence so that the authority and additional records of the packet are only passed
+//! to the questions answered by the same packet. Buffer must be 32 bit aligned. Returns the number
+//! of records parsed.
+static inline size_t
+mdns_querier_recv(mdns_querier_t* querier, int sock, void* buffer, size_t capacity);
+
+//! Record callback with the query scheduler as user data, passing the records of responses to the
+//! callbacks of the questions they answer. The question callbacks must not add or cancel
+//! questions. On sockets bound to port 5353 the callback also watches the questions of other
+//! hosts. A pending question asked by another host for a multicast response without known
+//! answers is not sent, since the answers will arrive anyway (RFC 6762 section 7.3). Receive with
+//! mdns_querier_recv, or increment the querier sequence field before parsing each packet when
+//! passing the callback to other receive functions.
+static inline int
+mdns_querier_record_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                             mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                             uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                             size_t name_offset, size_t name_length, size_t record_offset,
+                             size_t record_length, void* user_data);
+
+// Arena functions
+
+//! Initialize an arena allocator carving blocks from the given caller owned memory. Blocks are
+//! taken from slabs of one size class each, from 16 to 2048 bytes, so allocating and freeing are
+//! constant time and a freed block is reused by the next allocation of its size class without
+//! fragmenting the memory. Slabs stay with their size class once taken. Blocks are aligned to 16
+//! bytes.
+static inline void
+mdns_arena_init(mdns_arena_t* arena, void* memory, size_t capacity);
+
+//! Allocate a block of at least the given size. Returns a null pointer if the arena is out of
+//! memory or the size is larger than the largest size class.
+static inline void*
+mdns_arena_alloc(mdns_arena_t* arena, size_t size);
+
+//! Free a block allocated from the arena, with the size it was allocated with. Blocks larger than
+//! the largest size class or outside the arena memory are ignored.
+static inline void
+mdns_arena_free(mdns_arena_t* arena, void* block, size_t size);
+
+// Probing functions
+
+//! Initialize a prober claiming unique names as required by RFC 6762 section 8 before the records
+//! for the names are announced, using the given caller owned storage for the names. The seed
+//! initializes the random generator used for the initial probe delay and should differ between
+//! hosts. Use one prober per socket, as names are claimed per interface.
+static inline void
+mdns_prober_init(mdns_prober_t* prober, mdns_probe_t* probes, size_t capacity, uint32_t seed);
+
+//! Start probing for a unique name, proposing the given records which must all have the given
+//! name, for example the SRV and TXT records of a service instance or the A and AAAA records of a
+//! hostname. The name and records must remain valid while probing. A name added while other names
+//! are probing joins their next probe packet, so any number of names are claimed in the same
+//! probe sequence. Returns the index of the probe in the prober storage, or <0 if the storage is
+//! full.
+static inline int
+mdns_prober_add(mdns_prober_t* prober, uint64_t now, const char* name, size_t length,
+                const mdns_record_t* records, size_t record_count);
+
+//! Get the time of the next probe packet or probe completion, or MDNS_TIME_NEVER if no names are
+//! probing.
+static inline uint64_t
+mdns_prober_next_deadline(const mdns_prober_t* prober);
+
+//! Send the probes that are due, a question for each name with the proposed records in the
+//! authority section, packing as many names as fit into each packet. Names probed three times
+//! without conflict during the following 250ms enter the MDNS_PROBESTATE_SUCCESS state and may be
+//! announced. Buffer must be 32 bit aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_prober_send(mdns_prober_t* prober, int sock, void* buffer, size_t capacity, uint64_t now);
+
+//! Check a record received on a socket bound to the mDNS port against the names being probed. The
+//! arguments are the corresponding arguments of the record callback. A record for a probing name
+//! in a response that is not one of the proposed records means another host uses the name, and
+//! the probe enters the MDNS_PROBESTATE_CONFLICT state. The caller should choose a new name and
+//! probe again. An authority record for a probing name is a simultaneous probe from another host,
+//! resolved by comparing the proposed records (RFC 6762 section 8.2), and the host with the
+//! lexicographically earlier records waits one second and probes again. Returns the number of
+//! probes in conflict or deferred.
+static inline size_t
+mdns_prober_receive(mdns_prober_t* prober, uint64_t now, mdns_entry_type_t entry,
+                    const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                    size_t record_offset, size_t record_length);
+
+// Announcement functions
+
+//! Initialize an announcer sending unsolicited announcements and goodbyes for records, using the
+//! given caller owned storage for pending announcements. Use one announcer per socket.
+static inline void
+mdns_announcer_init(mdns_announcer_t* announcer, mdns_announcement_t* announcements,
+                    size_t capacity);
+
+//! Announce a new or changed record, repeated MDNS_ANNOUNCE_COUNT times at doubling intervals
+//! starting at one second (RFC 6762 section 8.3). The first announcement is due now. Announcing
+//! a record that is already pending restarts its announcements, and cancels a pending goodbye
+//! for it. The strings referenced by the record must remain valid while it is pending. Returns 0
+//! if success, or <0 if the announcer storage is full.
+static inline int
+mdns_announcer_add(mdns_announcer_t* announcer, uint64_t now, mdns_record_t record);
+
+//! Send a goodbye for a record that is no longer valid, cancelling any pending announcements of
+//! it. No goodbye is sent for a record that was never announced. Returns 0 if success, or <0 if
+//! the announcer storage is full.
+static inline int
+mdns_announcer_goodbye(mdns_announcer_t* announcer, uint64_t now, mdns_record_t record);
+
+//! Replace a record with an updated record, sending a goodbye for the old record followed by
+//! announcements of the new record (RFC 6762 section 8.4). Returns 0 if success, or <0 if the
+//! announcer storage is full.
+static inline int
+mdns_announcer_update(mdns_announcer_t* announcer, uint64_t now, mdns_record_t old_record,
+                      mdns_record_t record);
+
+//! Get the time of the earliest pending announcement, or MDNS_TIME_NEVER if none are pending.
+static inline uint64_t
+mdns_announcer_next_deadline(const mdns_announcer_t* announcer);
+
+//! Send all pending announcements and goodbyes that are due, aggregating any due within the
+//! aggregation window into the same packets with goodbyes before announcements. Buffer must be 32
+//! bit aligned. Returns the number of packets sent, or <0 if error.
+static inline int
+mdns_announcer_send(mdns_announcer_t* announcer, int sock, void* buffer, size_t capacity,
+                    uint64_t now);
+
+// Rate limiting functions
+
+//! Initialize a multicast rate limit table using the given caller owned storage. Entries older
+//! than one second are reused, so the capacity only needs to hold the records multicast within
+//! one second. A few times that number gives a good margin. If the table is too small the oldest
+//! entry is evicted, which is counted and can only cause a record to be multicast too early.
+static inline void
+mdns_ratelimit_init(mdns_ratelimit_t* ratelimit, mdns_ratelimit_entry_t* entries, size_t capacity);
+
+//! Check if a record with the given identity hash (from mdns_record_hash) may be multicast on
+//! the given link at the given time, and if so record the time. The link id is any value that
+//! identifies the interface the record is sent on, the scheduler uses the socket descriptor. A
+//! record may be multicast once per second, or every 250ms if defending it against a probe.
+//! Returns 1 if the record may be sent, 0 if it should be suppressed. Suppressed records are
+//! counted in the table.
+static inline int
+mdns_ratelimit_allow(mdns_ratelimit_t* ratelimit, uint64_t now, uint64_t record_hash,
+                     uint32_t link_id, int probe_defense);
+
+// Address functions
+
+//! Check if an address is within the network of a local interface address with the given network
+//! prefix length, for example to find the interface a query was received on from its source
+//! address so that only addresses valid on that interface are given in answers (RFC 6762 section
+//! 15). IPv4 addresses mapped to IPv6 match IPv4 networks, and IPv6 link-local addresses must
+//! also have the same scope. Returns 1 if the address is within the network, 0 if not.
+static inline int
+mdns_address_in_network(const struct sockaddr* addr, const struct sockaddr* network,
+                        unsigned int prefix_length);
+
+//! Make the reverse mapping name of an IPv4 or IPv6 address in the given buffer, for example
+//! "4.3.2.1.in-addr.arpa." for 1.2.3.4 or the 32 reversed nibbles of an IPv6 address followed by
+//! "ip6.arpa." (RFC 1035 section 3.5 and RFC 3596 section 2.5). Use with mdns_query_send to
+//! look up the name of an address. A buffer of 74 bytes fits any address. Returns the name,
+//! with zero length if the address family is not supported or the name does not fit.
+static inline mdns_string_t
+mdns_reverse_name_make(char* buffer, size_t capacity, const struct sockaddr* addr);
+
+//! Parse a reverse mapping name in a packet buffer at the given offset into the address it maps,
+//! reading the labels in place without copying the name. Returns 0 if the name is a complete
+//! "in-addr.arpa." or "ip6.arpa." name, or <0 if not.
+static inline int
+mdns_reverse_name_parse(const void* buffer, size_t size, size_t offset,
+                        struct sockaddr_storage* addr);
+
+// Parse records functions
+
+//! Parse a PTR record, returns the name in the record
+static inline mdns_string_t
+mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
+                      char* strbuffer, size_t capacity);
+
+//! Parse a SRV record, returns the priority, weight, port and name in the record
+static inline mdns_record_srv_t
+mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
+                      char* strbuffer, size_t capacity);
+
+//! Parse an A record, returns the IPv4 address in the record
+static inline struct sockaddr_in*
+mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
+                    struct sockaddr_in* addr);
+
+//! Parse an AAAA record, returns the IPv6 address in the record
+static inline struct sockaddr_in6*
+mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
+                       struct sockaddr_in6* addr);
+
+//! Parse a TXT record, returns the number of key=value records parsed and stores the key-value
+//! pairs in the supplied buffer
+static inline size_t
+mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t length,
+                      mdns_record_txt_t* records, size_t capacity);
+
+//! Parse a NSEC record, returns the next domain name and the types in the first window block of the
+//! type bitmap, which is the only block used by mDNS. Types from 128 and up are ignored, check
+//! the types with mdns_record_nsec_has_type.
+static inline mdns_record_nsec_t
+mdns_record_parse_nsec(const void* buffer, size_t size, size_t offset, size_t length,
+                       char* strbuffer, size_t capacity);
+
+// Internal functions
+
+static inline mdns_string_t
+mdns_string_extract(const void* buffer, size_t size, size_t* offset, char* str, size_t capacity);
+
+static inline int
+mdns_string_skip(const void* buffer, size_t size, size_t* offset);
+
+static inline size_t
+mdns_string_find(const char* str, size_t length, char c, size_t offset);
+
+//! Compare if two strings are equal. If the strings are equal it returns >0 and the offset variables are
+//! updated to the end of the corresponding strings. If the strings are not equal it returns 0 and 
+//! the offset variables are NOT updated.
+static inline int
+mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
+                  size_t size_rhs, size_t* ofs_rhs);
+
+static inline void*
+mdns_string_make(void* buffer, size_t capacity, void* data, const char* name, size_t length,
+                 mdns_string_table_t* string_table);
+
+static inline size_t
+mdns_string_table_find(mdns_string_table_t* string_table, const void* buffer, size_t capacity,
+                       const char* str, size_t first_length, size_t total_length);
+
+//! Compare if a name in a buffer is equal to the given dotted name string, ignoring case and any
+//! trailing dot. Returns >0 if the names are equal, 0 if not.
+static inline int
+mdns_string_equal_name(const void* buffer, size_t size, size_t offset, const char* name,
+                       size_t length);
+
+//! Calculate a hash of the name (ignoring case and trailing dot) in the given string
+static inline uint64_t
+mdns_string_hash(uint64_t hash, const char* str, size_t length);
+
+//! Calculate a hash of the name (ignoring case) in the given buffer. The hash is equal to the hash
+//! calculated by mdns_string_hash for the corresponding dotted name string.
+static inline uint64_t
+mdns_string_hash_name(uint64_t hash, const void* buffer, size_t size, size_t offset);
+
+//! Calculate a hash of the record identity, the name, type and data. TXT key-value pairs are
+//! coalesced into one record per name, so they are identified by name only, while pre-serialized
+//! TXT records are also identified by their data.
+static inline uint64_t
+mdns_record_hash(const mdns_record_t* record);
+
+//! Calculate a hash of the identity of a record in a buffer. The hash is equal to the hash
+//! calculated by mdns_record_hash for the corresponding record, where a TXT record in a buffer
+//! corresponds to a pre-serialized TXT record with the same data. Pass a zero record length for
+//! the hash of the TXT key-value pairs of the name.
+static inline uint64_t
+mdns_record_hash_wire(const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                      size_t record_offset, size_t record_length);
+
+//! Compare if two records are equal in name, type and data
+static inline int
+mdns_record_equal(const mdns_record_t* lhs, const mdns_record_t* rhs);
+
+//! Compare if a record is equal in name, type and data to a record in a buffer
+static inline int
+mdns_record_equal_wire(const mdns_record_t* record, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype, size_t record_offset,
+                       size_t record_length);
+
+//! Copy the data of a record in a buffer to the given data buffer, expanding any compressed names
+//! in the data. The uncompressed data is the canonical form used to compare records. Returns the
+//! size of the data, or 0 if the data is invalid or does not fit.
+static inline size_t
+mdns_record_data_expand(const void* buffer, size_t size, size_t offset, size_t length,
+                        uint16_t rtype, void* data, size_t capacity);
+
+//! Atomically add to a value with full memory ordering. Returns the new value.
+static inline long
+mdns_atomic_add(volatile long* value, long add);
+
+//! Atomically load a pointer with full memory ordering
+static inline void*
+mdns_atomic_load_ptr(void* volatile* ptr);
+
+//! Atomically store a pointer with full memory ordering. Returns the previous pointer.
+static inline void*
+mdns_atomic_exchange_ptr(void* volatile* ptr, void* value);
+
+//! Atomically load a value with full memory ordering
+static inline long
+mdns_atomic_load(volatile long* value);
+
+//! Atomically store a value with full memory ordering
+static inline void
+mdns_atomic_store(volatile long* value, long store);
+
+//! Atomically replace a value if it equals the expected value. Returns >0 if replaced, 0 if not.
+static inline int
+mdns_atomic_cas(volatile long* value, long expected, long desired);
+
+// Implementations
+
+static inline uint16_t
+mdns_ntohs(const void* data) {
+	uint16_t aligned;
+	memcpy(&aligned, data, sizeof(uint16_t));
+	return ntohs(aligned);
+}
+
+static inline uint32_t
+mdns_ntohl(const void* data) {
+	uint32_t aligned;
+	memcpy(&aligned, data, sizeof(uint32_t));
+	return ntohl(aligned);
+}
+
+static inline void*
+mdns_htons(void* data, uint16_t val) {
+	val = htons(val);
+	memcpy(data, &val, sizeof(uint16_t));
+	return MDNS_POINTER_OFFSET(data, sizeof(uint16_t));
+}
+
+static inline void*
+mdns_htonl(void* data, uint32_t val) {
+	val = htonl(val);
+	memcpy(data, &val, sizeof(uint32_t));
+	return MDNS_POINTER_OFFSET(data, sizeof(uint32_t));
 }
 
 static inline int
-mdns_socket_open_ipv6(const struct sockaddr_in6* saddr) {
-	int sock = (int)socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+mdns_socket_open_ipv4(const struct sockaddr_in* saddr) {
+	int sock = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (sock < 0)
 		return -1;
-	if (mdns_socket_setup_ipv6(sock, saddr)) {
+	if (mdns_socket_setup_ipv4(sock, saddr)) {
 		mdns_socket_close(sock);
 		return -1;
 	}
@@ -460,44 +1712,44 @@ mdns_socket_open_ipv6(const struct sockaddr_in6* saddr) {
 }
 
 static inline int
-mdns_socket_setup_ipv6(int sock, const struct sockaddr_in6* saddr) {
-	int hops = 1;
-	unsigned int loopback = 1;
+mdns_socket_setup_ipv4(int sock, const struct sockaddr_in* saddr) {
+	unsigned char ttl = 1;
+	unsigned char loopback = 1;
 	unsigned int reuseaddr = 1;
-	struct ipv6_mreq req;
+	struct ip_mreq req;
 
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuseaddr, sizeof(reuseaddr));
 #ifdef SO_REUSEPORT
 	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuseaddr, sizeof(reuseaddr));
 #endif
-	setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char*)&hops, sizeof(hops));
-	setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
 
 	memset(&req, 0, sizeof(req));
-	req.ipv6mr_multiaddr.s6_addr[0] = 0xFF;
-	req.ipv6mr_multiaddr.s6_addr[1] = 0x02;
-	req.ipv6mr_multiaddr.s6_addr[15] = 0xFB;
-	if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&req, sizeof(req)))
+	req.imr_multiaddr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
+	if (saddr)
+		req.imr_interface = saddr->sin_addr;
+	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&req, sizeof(req)))
 		return -1;
 
-	struct sockaddr_in6 sock_addr;
+	struct sockaddr_in sock_addr;
 	if (!saddr) {
-		memset(&sock_addr, 0, sizeof(struct sockaddr_in6));
-		sock_addr.sin6_family = AF_INET6;
-		sock_addr.sin6_addr = in6addr_any;
+		memset(&sock_addr, 0, sizeof(struct sockaddr_in));
+		sock_addr.sin_family = AF_INET;
+		sock_addr.sin_addr.s_addr = INADDR_ANY;
 #ifdef __APPLE__
-		sock_addr.sin6_len = sizeof(struct sockaddr_in6);
+		sock_addr.sin_len = sizeof(struct sockaddr_in);
 #endif
 	} else {
-		memcpy(&sock_addr, saddr, sizeof(struct sockaddr_in6));
-		unsigned int ifindex = 0;
-		setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (const char*)&ifindex, sizeof(ifindex));
+		memcpy(&sock_addr, saddr, sizeof(struct sockaddr_in));
+		setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&sock_addr.sin_addr,
+		           sizeof(sock_addr.sin_addr));
 #ifndef _WIN32
-		sock_addr.sin6_addr = in6addr_any;
+		sock_addr.sin_addr.s_addr = INADDR_ANY;
 #endif
 	}
 
-	if (bind(sock, (struct sockaddr*)&sock_addr, sizeof(struct sockaddr_in6)))
+	if (bind(sock, (struct sockaddr*)&sock_addr, sizeof(struct sockaddr_in)))
 		return -1;
 
 #ifdef _WIN32
@@ -511,19 +1763,83 @@ mdns_socket_setup_ipv6(int sock, const struct sockaddr_in6* saddr) {
 	return 0;
 }
 
-static inline void
-mdns_socket_close(int sock) {
-#ifdef _WIN32
-	closesocket(sock);
-#else
-	close(sock);
-#endif
-}
-
 static inline int
-mdns_is_string_ref(uint8_t val) {
-	return (0xC0 == (val & 0xC0));
-}
+mdns_socket_open_ipv6(const struct sockaddr_in6* saddr) {
+	int sock = (int)socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+	if (mdns_socket_setup_ipv6(sock, saddr)) {
+		mdns_socket_close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static inline int
+mdns_socket_setup_ipv6(int sock, const struct sockaddr_in6* saddr) {
+	int hops = 1;
+	unsigned int loopback = 1;
+	unsigned int reuseaddr = 1;
+	struct ipv6_mreq req;
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuseaddr, sizeof(reuseaddr));
+#ifdef SO_REUSEPORT
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuseaddr, sizeof(reuseaddr));
+#endif
+	setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char*)&hops, sizeof(hops));
+	setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
+
+	memset(&req, 0, sizeof(req));
+	req.ipv6mr_multiaddr.s6_addr[0] = 0xFF;
+	req.ipv6mr_multiaddr.s6_addr[1] = 0x02;
+	req.ipv6mr_multiaddr.s6_addr[15] = 0xFB;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&req, sizeof(req)))
+		return -1;
+
+	struct sockaddr_in6 sock_addr;
+	if (!saddr) {
+		memset(&sock_addr, 0, sizeof(struct sockaddr_in6));
+		sock_addr.sin6_family = AF_INET6;
+		sock_addr.sin6_addr = in6addr_any;
+#ifdef __APPLE__
+		sock_addr.sin6_len = sizeof(struct sockaddr_in6);
+#endif
+	} else {
+		memcpy(&sock_addr, saddr, sizeof(struct sockaddr_in6));
+		unsigned int ifindex = 0;
+		setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (const char*)&ifindex, sizeof(ifindex));
+#ifndef _WIN32
+		sock_addr.sin6_addr = in6addr_any;
+#endif
+	}
+
+	if (bind(sock, (struct sockaddr*)&sock_addr, sizeof(struct sockaddr_in6)))
+		return -1;
+
+#ifdef _WIN32
+	unsigned long param = 1;
+	ioctlsocket(sock, FIONBIO, &param);
+#else
+	const int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+	return 0;
+}
+
+static inline void
+mdns_socket_close(int sock) {
+#ifdef _WIN32
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+static inline int
+mdns_is_string_ref(uint8_t val) {
+	return (0xC0 == (val & 0xC0));
+}
 
 static inline mdns_string_pair_t
 mdns_get_next_substring(const void* rawdata, size_t size, size_t offset) {
@@ -694,9 +2010,22 @@ mdns_string_table_find(mdns_string_table_t* string_table, const void* buffer, si
 			offset = dot_pos + 1;
 		}
 
-		// Return reference offset if entire string matches
-		if (offset >= total_length)
-			return string_table->offset[istr];
+		if (offset < total_length)
+			continue;
+
+		// Entire string matches, move the entry to the newest position in the table to keep
+		// frequently referenced names (like the common suffixes) from being replaced when packing
+		// many records in a packet. Then return the reference offset
+		size_t found_offset = string_table->offset[istr];
+		size_t table_capacity = sizeof(string_table->offset) / sizeof(string_table->offset[0]);
+		size_t newest = (string_table->next ? string_table->next : table_capacity) - 1;
+		while (istr != newest) {
+			size_t inext = (istr + 1 < table_capacity) ? istr + 1 : 0;
+			string_table->offset[istr] = string_table->offset[inext];
+			istr = inext;
+		}
+		string_table->offset[newest] = found_offset;
+		return found_offset;
 	}
 
 	return MDNS_INVALID_POS;
@@ -727,6 +2056,96 @@ mdns_string_find(const char* str, size_t length, char c, size_t offset) {
 	return MDNS_INVALID_POS;
 }
 
+static inline int
+mdns_string_equal_name(const void* buffer, size_t size, size_t offset, const char* name,
+                       size_t length) {
+	if (length && (name[length - 1] == '.'))
+		--length;
+	size_t pos = 0;
+	mdns_string_pair_t substr;
+	unsigned int counter = 0;
+	while (1) {
+		substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS))
+			return 0;
+		if (!substr.length)
+			break;
+		if (pos >= length)
+			return 0;
+		size_t dot_pos = mdns_string_find(name, length, '.', pos);
+		size_t end = (dot_pos != MDNS_INVALID_POS) ? dot_pos : length;
+		if ((end - pos) != substr.length)
+			return 0;
+		if (strncasecmp(name + pos, (const char*)MDNS_POINTER_OFFSET_CONST(buffer, substr.offset),
+		                substr.length))
+			return 0;
+		pos = end + 1;
+		offset = substr.offset + substr.length;
+	}
+	return (pos >= length);
+}
+
+static inline int
+mdns_string_equal_dotted(const char* lhs, size_t lhs_length, const char* rhs, size_t rhs_length) {
+	if (lhs_length && (lhs[lhs_length - 1] == '.'))
+		--lhs_length;
+	if (rhs_length && (rhs[rhs_length - 1] == '.'))
+		--rhs_length;
+	if (lhs_length != rhs_length)
+		return 0;
+	return !lhs_length || !strncasecmp(lhs, rhs, lhs_length);
+}
+
+static inline uint64_t
+mdns_hash_data(uint64_t hash, const void* data, size_t size) {
+	// FNV-1a
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t ibyte = 0; ibyte < size; ++ibyte) {
+		hash ^= bytes[ibyte];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static inline uint64_t
+mdns_hash_lowercase(uint64_t hash, const char* str, size_t length) {
+	for (size_t ichar = 0; ichar < length; ++ichar) {
+		uint8_t c = (uint8_t)str[ichar];
+		if ((c >= 'A') && (c <= 'Z'))
+			c += 'a' - 'A';
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static inline uint64_t
+mdns_string_hash(uint64_t hash, const char* str, size_t length) {
+	if (length && (str[length - 1] == '.'))
+		--length;
+	return mdns_hash_lowercase(hash, str, length);
+}
+
+static inline uint64_t
+mdns_string_hash_name(uint64_t hash, const void* buffer, size_t size, size_t offset) {
+	mdns_string_pair_t substr;
+	unsigned int counter = 0;
+	int first = 1;
+	while (1) {
+		substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || !substr.length ||
+		    (counter++ > MDNS_MAX_SUBSTRINGS))
+			break;
+		if (!first)
+			hash = mdns_hash_lowercase(hash, ".", 1);
+		hash = mdns_hash_lowercase(
+		    hash, (const char*)MDNS_POINTER_OFFSET_CONST(buffer, substr.offset), substr.length);
+		offset = substr.offset + substr.length;
+		first = 0;
+	}
+	return hash;
+}
+
 static inline void*
 mdns_string_make_ref(void* data, size_t capacity, size_t ref_offset) {
 	if (capacity < 2)
@@ -853,6 +2272,123 @@ mdns_multicast_send(int sock, const void* buffer, size_t size) {
 	return 0;
 }
 
+static inline int
+mdns_packet_reset(mdns_packet_t* packet) {
+	packet->data = MDNS_POINTER_OFFSET(packet->buffer, sizeof(struct mdns_header_t));
+	memset(packet->count, 0, sizeof(packet->count));
+	memset(&packet->string_table, 0, sizeof(mdns_string_table_t));
+	if (!packet->question_name)
+		return 0;
+
+	// Repeat the question in each packet
+	void* data = mdns_string_make(packet->buffer, packet->capacity, packet->data,
+	                              packet->question_name, packet->question_length,
+	                              &packet->string_table);
+	if (!data || ((packet->capacity - MDNS_POINTER_DIFF(data, packet->buffer)) < 4))
+		return -1;
+	data = mdns_htons(data, packet->question_type);
+	data = mdns_htons(data, packet->question_class);
+	packet->data = data;
+	packet->count[MDNS_ENTRYTYPE_QUESTION] = 1;
+	return 0;
+}
+
+static inline void
+mdns_packet_init(mdns_packet_t* packet, int sock, const void* address, size_t address_size,
+                 void* buffer, size_t capacity, uint16_t query_id, uint16_t flags) {
+	memset(packet, 0, sizeof(mdns_packet_t));
+	packet->sock = sock;
+	packet->address = address;
+	packet->address_size = address_size;
+	packet->buffer = buffer;
+	packet->capacity = capacity;
+	packet->query_id = query_id;
+	packet->flags = flags;
+	mdns_packet_reset(packet);
+}
+
+static inline int
+mdns_packet_set_question(mdns_packet_t* packet, mdns_record_type_t type, const char* name,
+                         size_t length, uint16_t rclass) {
+	packet->question_name = name;
+	packet->question_length = length;
+	packet->question_type = (uint16_t)type;
+	packet->question_class = rclass;
+	return mdns_packet_reset(packet);
+}
+
+static inline size_t
+mdns_packet_content_count(const mdns_packet_t* packet) {
+	size_t count = (size_t)packet->count[MDNS_ENTRYTYPE_QUESTION] +
+	               packet->count[MDNS_ENTRYTYPE_ANSWER] + packet->count[MDNS_ENTRYTYPE_AUTHORITY] +
+	               packet->count[MDNS_ENTRYTYPE_ADDITIONAL];
+	// A repeated question is not content by itself
+	if (packet->question_name && count)
+		--count;
+	return count;
+}
+
+static inline int
+mdns_packet_flush(mdns_packet_t* packet, uint16_t flags) {
+	if (!mdns_packet_content_count(packet))
+		return 0;
+
+	struct mdns_header_t* header = (struct mdns_header_t*)packet->buffer;
+	header->query_id = htons(packet->query_id);
+	header->flags = htons(packet->flags | flags);
+	header->questions = htons(packet->count[MDNS_ENTRYTYPE_QUESTION]);
+	header->answer_rrs = htons(packet->count[MDNS_ENTRYTYPE_ANSWER]);
+	header->authority_rrs = htons(packet->count[MDNS_ENTRYTYPE_AUTHORITY]);
+	header->additional_rrs = htons(packet->count[MDNS_ENTRYTYPE_ADDITIONAL]);
+
+	size_t tosend = MDNS_POINTER_DIFF(packet->data, packet->buffer);
+	int ret;
+	if (packet->address)
+		ret = mdns_unicast_send(packet->sock, packet->address, packet->address_size,
+		                        packet->buffer, tosend);
+	else
+		ret = mdns_multicast_send(packet->sock, packet->buffer, tosend);
+	if (!ret)
+		++packet->sent;
+	if (mdns_packet_reset(packet))
+		return -1;
+	return ret;
+}
+
+// Called when an entry did not fit in the current packet. Restores the string table to the state
+// before the failed write and sends the current packet to make room for the entry. Returns 0 if
+// the entry should be retried in the new packet, <0 if it will never fit or on error
+static inline int
+mdns_packet_overflow(mdns_packet_t* packet, const mdns_string_table_t* string_table,
+                     uint16_t flags) {
+	packet->string_table = *string_table;
+	if (!mdns_packet_content_count(packet))
+		return -1;
+	return mdns_packet_flush(packet, flags);
+}
+
+static inline int
+mdns_packet_add_question(mdns_packet_t* packet, mdns_record_type_t type, const char* name,
+                         size_t length, uint16_t rclass) {
+	while (1) {
+		mdns_string_table_t string_table = packet->string_table;
+		void* data = mdns_string_make(packet->buffer, packet->capacity, packet->data, name, length,
+		                              &packet->string_table);
+		if (data && ((packet->capacity - MDNS_POINTER_DIFF(data, packet->buffer)) >= 4)) {
+			data = mdns_htons(data, type);
+			data = mdns_htons(data, rclass);
+			packet->data = data;
+			++packet->count[MDNS_ENTRYTYPE_QUESTION];
+			return 0;
+		}
+		// Questions continue in the next packet. The truncated (TC) bit of a multicast query
+		// means that more known answers follow and makes responders wait 400-500ms (RFC 6762
+		// section 7.2), so it is only set by the packet flags when known answers spill over
+		if (mdns_packet_overflow(packet, &string_table, 0))
+			return -1;
+	}
+}
+
 static const uint8_t mdns_services_query[] = {
     // Query ID
     0x00, 0x00,
@@ -993,7 +2529,14 @@ mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback
 	if (ret <= 0)
 		return 0;
 
-	size_t data_size = (size_t)ret;
+	return mdns_socket_parse(sock, saddr, addrlen, buffer, (size_t)ret, callback, user_data);
+}
+
+static inline size_t
+mdns_socket_parse(int sock, const struct sockaddr* saddr, size_t addrlen, const void* buffer,
+                  size_t data_size, mdns_record_callback_fn callback, void* user_data) {
+	if (data_size < sizeof(struct mdns_header_t))
+		return 0;
 	const uint16_t* data = (const uint16_t*)buffer;
 
 	uint16_t query_id = mdns_ntohs(data++);
@@ -1019,485 +2562,4591 @@ mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback
 		size_t length = offset - question_offset;
 		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
 
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);
-		uint16_t class_without_flushbit = rclass & ~MDNS_CACHE_FLUSH;
+		uint16_t rtype = mdns_ntohs(data++);
+		uint16_t rclass = mdns_ntohs(data++);
+		uint16_t class_without_flushbit = rclass & ~MDNS_CACHE_FLUSH;
+
+		// Make sure we get a question of class IN or ANY
+		if (!((class_without_flushbit == MDNS_CLASS_IN) ||
+		      (class_without_flushbit == MDNS_CLASS_ANY))) {
+			break;
+		}
+
+		if (dns_sd && flags)
+			continue;
+
+		++total_records;
+		if (callback && callback(sock, saddr, addrlen, MDNS_ENTRYTYPE_QUESTION, query_id, rtype,
+		                         rclass, 0, buffer, data_size, question_offset, length,
+		                         question_offset, length, user_data))
+			return total_records;
+	}
+
+	size_t offset = MDNS_POINTER_DIFF(data, buffer);
+	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                             MDNS_ENTRYTYPE_ANSWER, query_id, answer_rrs, callback, user_data);
+	total_records += records;
+	if (records != answer_rrs)
+		return total_records;
+
+	records =
+	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
+	total_records += records;
+	if (records != authority_rrs)
+		return total_records;
+
+	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
+	                             user_data);
+
+	return total_records;
+}
+
+static inline int
+mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
+                size_t capacity, uint16_t query_id) {
+	mdns_query_t query;
+	query.type = type;
+	query.name = name;
+	query.length = length;
+	return mdns_multiquery_send(sock, &query, 1, buffer, capacity, query_id);
+}
+
+static inline int
+mdns_query_subtype_send(int sock, const char* subtype, size_t subtype_length, const char* service,
+                        size_t service_length, void* buffer, size_t capacity, uint16_t query_id) {
+	char name_buffer[256];
+	mdns_string_t name = mdns_subtype_make(name_buffer, sizeof(name_buffer), subtype,
+	                                       subtype_length, service, service_length);
+	if (!name.length)
+		return -1;
+	return mdns_query_send(sock, MDNS_RECORDTYPE_PTR, name.str, name.length, buffer, capacity,
+	                       query_id);
+}
+
+// Get the question class for queries sent on the socket, asking for a unicast response unless the
+// socket is bound to the mDNS port
+static inline uint16_t
+mdns_query_class(int sock) {
+	// Ask for a unicast response since it's a one-shot query
+	uint16_t rclass = MDNS_CLASS_IN | MDNS_UNICAST_RESPONSE;
+
+	struct sockaddr_storage addr_storage;
+	struct sockaddr* saddr = (struct sockaddr*)&addr_storage;
+	socklen_t saddrlen = sizeof(addr_storage);
+	if (getsockname(sock, saddr, &saddrlen) == 0) {
+		if ((saddr->sa_family == AF_INET) &&
+		    (ntohs(((struct sockaddr_in*)saddr)->sin_port) == MDNS_PORT))
+			rclass &= ~MDNS_UNICAST_RESPONSE;
+		else if ((saddr->sa_family == AF_INET6) &&
+		         (ntohs(((struct sockaddr_in6*)saddr)->sin6_port) == MDNS_PORT))
+			rclass &= ~MDNS_UNICAST_RESPONSE;
+	}
+	return rclass;
+}
+
+static inline int
+mdns_multiquery_send(int sock, const mdns_query_t* query, size_t count, void* buffer, size_t capacity,
+                     uint16_t query_id) {
+	if (!count || (capacity < (sizeof(struct mdns_header_t) + 6)))
+		return -1;
+
+	uint16_t rclass = mdns_query_class(sock);
+
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, query_id, 0);
+	for (size_t iq = 0; iq < count; ++iq) {
+		// Name string, record type and optional unicast response based on local port, class IN
+		if (mdns_packet_add_question(&packet, query[iq].type, query[iq].name, query[iq].length,
+		                             rclass))
+			return -1;
+	}
+	if (mdns_packet_flush(&packet, 0))
+		return -1;
+	return query_id;
+}
+
+static inline size_t
+mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
+                void* user_data, int only_query_id) {
+	struct sockaddr_in6 addr;
+	struct sockaddr* saddr = (struct sockaddr*)&addr;
+	socklen_t addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+#ifdef __APPLE__
+	saddr->sa_len = sizeof(addr);
+#endif
+	mdns_ssize_t ret = recvfrom(sock, (char*)buffer, (mdns_size_t)capacity, 0, saddr, &addrlen);
+	if (ret <= 0)
+		return 0;
+
+	size_t data_size = (size_t)ret;
+	const uint16_t* data = (const uint16_t*)buffer;
+
+	uint16_t query_id = mdns_ntohs(data++);
+	uint16_t flags = mdns_ntohs(data++);
+	uint16_t questions = mdns_ntohs(data++);
+	uint16_t answer_rrs = mdns_ntohs(data++);
+	uint16_t authority_rrs = mdns_ntohs(data++);
+	uint16_t additional_rrs = mdns_ntohs(data++);
+	(void)sizeof(flags);
+
+	if ((only_query_id > 0) && (query_id != only_query_id))
+		return 0;  // Not a reply to the wanted one-shot query
+
+	// Skip questions part
+	int i;
+	for (i = 0; i < questions; ++i) {
+		size_t offset = MDNS_POINTER_DIFF(data, buffer);
+		if (!mdns_string_skip(buffer, data_size, &offset))
+			return 0;
+		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+		// Record type and class not used, skip
+		// uint16_t rtype = mdns_ntohs(data++);
+		// uint16_t rclass = mdns_ntohs(data++);
+		data += 2;
+	}
+
+	size_t records = 0;
+	size_t total_records = 0;
+	size_t offset = MDNS_POINTER_DIFF(data, buffer);
+	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                             MDNS_ENTRYTYPE_ANSWER, query_id, answer_rrs, callback, user_data);
+	total_records += records;
+	if (records != answer_rrs)
+		return total_records;
+
+	records =
+	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
+	total_records += records;
+	if (records != authority_rrs)
+		return total_records;
+
+	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
+	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
+	                             user_data);
+	total_records += records;
+	if (records != additional_rrs)
+		return total_records;
+
+	return total_records;
+}
+
+static inline void*
+mdns_answer_add_record_header(void* buffer, size_t capacity, void* data, mdns_record_t record,
+                              mdns_string_table_t* string_table) {
+	data = mdns_string_make(buffer, capacity, data, record.name.str, record.name.length, string_table);
+	if (!data)
+		return 0;
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	if (remain < 10)
+		return 0;
+
+	data = mdns_htons(data, record.type);
+	data = mdns_htons(data, record.rclass);
+	data = mdns_htonl(data, record.ttl);
+	data = mdns_htons(data, 0);  // Length, to be filled later
+	return data;
+}
+
+static inline int
+mdns_record_is_txt_pair(const mdns_record_t* record) {
+	// A TXT record with an empty key holds pre-serialized data in the value
+	return (record->type == MDNS_RECORDTYPE_TXT) && record->data.txt.key.length;
+}
+
+static inline void*
+mdns_answer_add_record(void* buffer, size_t capacity, void* data, mdns_record_t record,
+                       mdns_string_table_t* string_table) {
+	// TXT key-value pairs will be coalesced into one record per name later
+	if (!data || mdns_record_is_txt_pair(&record))
+		return data;
+
+	data = mdns_answer_add_record_header(buffer, capacity, data, record, string_table);
+	if (!data)
+		return 0;
+
+	// Pointer to length of record to be filled at end
+	void* record_length = MDNS_POINTER_OFFSET(data, -2);
+	void* record_data = data;
+
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	switch (record.type) {
+		case MDNS_RECORDTYPE_PTR:
+			data = mdns_string_make(buffer, capacity, data, record.data.ptr.name.str,
+			                        record.data.ptr.name.length, string_table);
+			break;
+
+		case MDNS_RECORDTYPE_SRV:
+			if (remain <= 6)
+				return 0;
+			data = mdns_htons(data, record.data.srv.priority);
+			data = mdns_htons(data, record.data.srv.weight);
+			data = mdns_htons(data, record.data.srv.port);
+			data = mdns_string_make(buffer, capacity, data, record.data.srv.name.str,
+			                        record.data.srv.name.length, string_table);
+			break;
+
+		case MDNS_RECORDTYPE_A:
+			if (remain < 4)
+				return 0;
+			memcpy(data, &record.data.a.addr.sin_addr.s_addr, 4);
+			data = MDNS_POINTER_OFFSET(data, 4);
+			break;
+
+		case MDNS_RECORDTYPE_AAAA:
+			if (remain < 16)
+				return 0;
+			memcpy(data, &record.data.aaaa.addr.sin6_addr, 16);  // ipv6 address
+			data = MDNS_POINTER_OFFSET(data, 16);
+			break;
+
+		case MDNS_RECORDTYPE_TXT:
+			// Pre-serialized data, an empty record must still hold one zero length string
+			if (!record.data.txt.value.length) {
+				if (remain < 1)
+					return 0;
+				*(unsigned char*)data = 0;
+				data = MDNS_POINTER_OFFSET(data, 1);
+				break;
+			}
+			if ((remain < record.data.txt.value.length) || (record.data.txt.value.length > 0xFFFF))
+				return 0;
+			memcpy(data, record.data.txt.value.str, record.data.txt.value.length);
+			data = MDNS_POINTER_OFFSET(data, record.data.txt.value.length);
+			break;
+
+		case MDNS_RECORDTYPE_NSEC: {
+			// Next domain name, which may be compressed in mDNS, followed by the first window
+			// block of the type bitmap without trailing zero bytes
+			data = mdns_string_make(buffer, capacity, data, record.data.nsec.name.str,
+			                        record.data.nsec.name.length, string_table);
+			size_t bitmap_length = sizeof(record.data.nsec.bitmap);
+			while (bitmap_length && !record.data.nsec.bitmap[bitmap_length - 1])
+				--bitmap_length;
+			if (!data || !bitmap_length)
+				break;
+			remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+			if (remain < (bitmap_length + 2))
+				return 0;
+			uint8_t* block = (uint8_t*)data;
+			block[0] = 0;
+			block[1] = (uint8_t)bitmap_length;
+			memcpy(block + 2, record.data.nsec.bitmap, bitmap_length);
+			data = MDNS_POINTER_OFFSET(data, bitmap_length + 2);
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	if (!data)
+		return 0;
+
+	// Fill record length
+	mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+	return data;
+}
+
+static inline void
+mdns_record_update_rclass_ttl(mdns_record_t* record, uint16_t rclass, uint32_t ttl) {
+	if (!record->rclass)
+		record->rclass = rclass;
+	if (!record->ttl || !ttl)
+		record->ttl = ttl;
+	record->rclass &= (uint16_t)(MDNS_CLASS_IN | MDNS_CACHE_FLUSH);
+	// Never flush PTR record
+	if (record->type == MDNS_RECORDTYPE_PTR)
+		record->rclass &= ~(uint16_t)MDNS_CACHE_FLUSH;
+}
+
+static inline void*
+mdns_answer_add_txt_value(void* buffer, size_t capacity, void* data, const mdns_record_t* record) {
+	// TXT strings are unlikely to be shared, just make then raw. Also need one byte for
+	// termination, thus the <= check
+	size_t string_length = record->data.txt.key.length + record->data.txt.value.length + 1;
+	if (!data)
+		return 0;
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	if ((remain <= string_length) || (string_length > 0xFF))
+		return 0;
+
+	unsigned char* strdata = (unsigned char*)data;
+	*strdata++ = (unsigned char)string_length;
+	memcpy(strdata, record->data.txt.key.str, record->data.txt.key.length);
+	strdata += record->data.txt.key.length;
+	*strdata++ = '=';
+	memcpy(strdata, record->data.txt.value.str, record->data.txt.value.length);
+	strdata += record->data.txt.value.length;
+
+	return strdata;
+}
+
+static inline size_t
+mdns_txt_make(void* buffer, size_t capacity, const mdns_record_txt_t* pairs, size_t count) {
+	unsigned char* data = (unsigned char*)buffer;
+	// An empty TXT record must contain a single zero length string
+	if (!count) {
+		if (!capacity)
+			return 0;
+		data[0] = 0;
+		return 1;
+	}
+
+	size_t offset = 0;
+	for (size_t ipair = 0; ipair < count; ++ipair) {
+		const mdns_record_txt_t* pair = pairs + ipair;
+		size_t string_length = pair->key.length;
+		if (pair->value.str)
+			string_length += pair->value.length + 1;
+		if ((string_length > 0xFF) || ((capacity - offset) <= string_length))
+			return 0;
+
+		data[offset++] = (unsigned char)string_length;
+		memcpy(data + offset, pair->key.str, pair->key.length);
+		offset += pair->key.length;
+		if (pair->value.str) {
+			data[offset++] = '=';
+			memcpy(data + offset, pair->value.str, pair->value.length);
+			offset += pair->value.length;
+		}
+	}
+	return offset;
+}
+
+static inline int
+mdns_record_nsec_set_type(mdns_record_nsec_t* nsec, uint16_t rtype) {
+	if (rtype >= (sizeof(nsec->bitmap) * 8))
+		return -1;
+	nsec->bitmap[rtype / 8] |= (uint8_t)(0x80 >> (rtype % 8));
+	return 0;
+}
+
+static inline int
+mdns_record_nsec_has_type(const mdns_record_nsec_t* nsec, uint16_t rtype) {
+	if (rtype >= (sizeof(nsec->bitmap) * 8))
+		return 0;
+	return (nsec->bitmap[rtype / 8] & (0x80 >> (rtype % 8))) ? 1 : 0;
+}
+
+static inline mdns_string_t
+mdns_subtype_make(char* buffer, size_t capacity, const char* subtype, size_t subtype_length,
+                  const char* service, size_t service_length) {
+	mdns_string_t name = {buffer, 0};
+	static const char sub_label[] = "._sub.";
+	size_t sub_length = sizeof(sub_label) - 1;
+	if (!subtype_length || (subtype_length > 63) || memchr(subtype, '.', subtype_length) ||
+	    (capacity <= (subtype_length + sub_length + service_length)))
+		return name;
+	memcpy(buffer, subtype, subtype_length);
+	memcpy(buffer + subtype_length, sub_label, sub_length);
+	memcpy(buffer + subtype_length + sub_length, service, service_length);
+	name.length = subtype_length + sub_length + service_length;
+	buffer[name.length] = 0;
+	return name;
+}
+
+static inline int
+mdns_subtype_parse(const char* name, size_t length, mdns_string_t* subtype,
+                   mdns_string_t* service) {
+	const char* dot = (const char*)memchr(name, '.', length);
+	if (!dot || (dot == name))
+		return -1;
+	size_t subtype_length = (size_t)(dot - name);
+	size_t rest = length - subtype_length;
+	if ((rest <= 6) || (strncasecmp(dot, "._sub.", 6) != 0))
+		return -1;
+	subtype->str = name;
+	subtype->length = subtype_length;
+	service->str = dot + 6;
+	service->length = rest - 6;
+	return 0;
+}
+
+static inline mdns_record_t
+mdns_record_subtype(const mdns_record_t* record, mdns_string_t subtype_name) {
+	mdns_record_t subtype_record = *record;
+	subtype_record.name = subtype_name;
+	return subtype_record;
+}
+
+static inline int
+mdns_answer_is_first_txt_pair(const mdns_record_t* records, size_t index) {
+	// Check if this is the first key-value pair with this name, which starts the coalesced record
+	for (size_t irec = 0; irec < index; ++irec) {
+		if (mdns_record_is_txt_pair(records + irec) &&
+		    mdns_string_equal_dotted(MDNS_STRING_ARGS(records[irec].name),
+		                             MDNS_STRING_ARGS(records[index].name)))
+			return 0;
+	}
+	return 1;
+}
+
+static inline void*
+mdns_answer_add_txt_record(void* buffer, size_t capacity, void* data, const mdns_record_t* records,
+                           size_t record_count, size_t first, uint16_t rclass, uint32_t ttl,
+                           mdns_string_table_t* string_table) {
+	// Coalesce all key-value pairs with the same name as the first pair into one record
+	mdns_record_t record = records[first];
+	mdns_record_update_rclass_ttl(&record, rclass, ttl);
+	data = mdns_answer_add_record_header(buffer, capacity, data, record, string_table);
+	if (!data)
+		return data;
+
+	// Pointer to length of record to be filled at end
+	void* record_length = MDNS_POINTER_OFFSET(data, -2);
+	void* record_data = data;
+
+	for (size_t irec = first; data && (irec < record_count); ++irec) {
+		if (!mdns_record_is_txt_pair(records + irec) ||
+		    !mdns_string_equal_dotted(MDNS_STRING_ARGS(records[irec].name),
+		                              MDNS_STRING_ARGS(record.name)))
+			continue;
+		data = mdns_answer_add_txt_value(buffer, capacity, data, records + irec);
+	}
+
+	// Fill record length
+	if (data)
+		mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+
+	return data;
+}
+
+static inline uint16_t
+mdns_answer_get_record_count(const mdns_record_t* records, size_t record_count) {
+	// TXT key-value pairs will be coalesced into one record per name
+	uint16_t total_count = 0;
+	for (size_t irec = 0; irec < record_count; ++irec) {
+		if (!mdns_record_is_txt_pair(records + irec) ||
+		    mdns_answer_is_first_txt_pair(records, irec))
+			++total_count;
+	}
+	return total_count;
+}
+
+static inline int
+mdns_packet_add_txt_record(mdns_packet_t* packet, mdns_entry_type_t section,
+                           const mdns_record_t* records, size_t record_count, uint16_t rclass,
+                           uint32_t ttl) {
+	for (size_t irec = 0; irec < record_count; ++irec) {
+		if (!mdns_record_is_txt_pair(records + irec) ||
+		    !mdns_answer_is_first_txt_pair(records, irec))
+			continue;
+
+		while (1) {
+			mdns_string_table_t string_table = packet->string_table;
+			void* data = mdns_answer_add_txt_record(packet->buffer, packet->capacity,
+			                                        packet->data, records, record_count, irec,
+			                                        rclass, ttl, &packet->string_table);
+			if (data) {
+				packet->data = data;
+				++packet->count[section];
+				break;
+			}
+			if (mdns_packet_overflow(packet, &string_table, 0))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static inline int
+mdns_packet_add_record(mdns_packet_t* packet, mdns_entry_type_t section, mdns_record_t record) {
+	// A single TXT key-value pair is added as a record with one string
+	if (mdns_record_is_txt_pair(&record))
+		return mdns_packet_add_txt_record(packet, section, &record, 1, record.rclass, record.ttl);
+
+	while (1) {
+		mdns_string_table_t string_table = packet->string_table;
+		void* data = mdns_answer_add_record(packet->buffer, packet->capacity, packet->data, record,
+		                                    &packet->string_table);
+		if (data) {
+			packet->data = data;
+			++packet->count[section];
+			return 0;
+		}
+		if (mdns_packet_overflow(packet, &string_table, 0))
+			return -1;
+	}
+}
+
+static inline int
+mdns_query_answer_unicast(int sock, const void* address, size_t address_size, void* buffer,
+                          size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
+                          const char* name, size_t name_length, mdns_record_t answer,
+                          const mdns_record_t* authority, size_t authority_count,
+                          const mdns_record_t* additional, size_t additional_count) {
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	// According to RFC 6762:
+	// The cache-flush bit MUST NOT be set in any resource records in a response message
+	// sent in legacy unicast responses to UDP ports other than 5353.
+	uint16_t rclass = MDNS_CLASS_IN;
+	uint32_t ttl = 10;
+
+	// Basic answer structure, each packet starts with the question
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, address, address_size, buffer, capacity, query_id, 0x8400);
+	if (mdns_packet_set_question(&packet, record_type, name, name_length,
+	                             MDNS_UNICAST_RESPONSE | MDNS_CLASS_IN))
+		return -1;
+
+	// Fill in answer
+	answer.rclass = rclass;
+	answer.ttl = ttl;
+	if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ANSWER, answer))
+		return -1;
+
+	// Fill in authority records
+	for (size_t irec = 0; irec < authority_count; ++irec) {
+		mdns_record_t record = authority[irec];
+		if (mdns_record_is_txt_pair(&record))
+			continue;
+		record.rclass = rclass;
+		if (!record.ttl)
+			record.ttl = ttl;
+		if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_AUTHORITY, record))
+			return -1;
+	}
+	if (mdns_packet_add_txt_record(&packet, MDNS_ENTRYTYPE_AUTHORITY, authority, authority_count,
+	                               rclass, ttl))
+		return -1;
+
+	// Fill in additional records
+	for (size_t irec = 0; irec < additional_count; ++irec) {
+		mdns_record_t record = additional[irec];
+		if (mdns_record_is_txt_pair(&record))
+			continue;
+		record.rclass = rclass;
+		if (!record.ttl)
+			record.ttl = ttl;
+		if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ADDITIONAL, record))
+			return -1;
+	}
+	if (mdns_packet_add_txt_record(&packet, MDNS_ENTRYTYPE_ADDITIONAL, additional,
+	                               additional_count, rclass, ttl))
+		return -1;
+
+	return mdns_packet_flush(&packet, 0);
+}
+
+static inline int
+mdns_answer_multicast_rclass_ttl(int sock, void* buffer, size_t capacity, mdns_record_t answer,
+                                 const mdns_record_t* authority, size_t authority_count,
+                                 const mdns_record_t* additional, size_t additional_count,
+                                 uint16_t rclass, uint32_t ttl) {
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, 0, 0x8400);
+
+	// Fill in answer
+	mdns_record_t record = answer;
+	mdns_record_update_rclass_ttl(&record, rclass, ttl);
+	if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ANSWER, record))
+		return -1;
+
+	// Fill in authority records
+	for (size_t irec = 0; irec < authority_count; ++irec) {
+		record = authority[irec];
+		if (mdns_record_is_txt_pair(&record))
+			continue;
+		mdns_record_update_rclass_ttl(&record, rclass, ttl);
+		if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_AUTHORITY, record))
+			return -1;
+	}
+	if (mdns_packet_add_txt_record(&packet, MDNS_ENTRYTYPE_AUTHORITY, authority, authority_count,
+	                               rclass, ttl))
+		return -1;
+
+	// Fill in additional records
+	for (size_t irec = 0; irec < additional_count; ++irec) {
+		record = additional[irec];
+		if (mdns_record_is_txt_pair(&record))
+			continue;
+		mdns_record_update_rclass_ttl(&record, rclass, ttl);
+		if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ADDITIONAL, record))
+			return -1;
+	}
+	if (mdns_packet_add_txt_record(&packet, MDNS_ENTRYTYPE_ADDITIONAL, additional,
+	                               additional_count, rclass, ttl))
+		return -1;
+
+	return mdns_packet_flush(&packet, 0);
+}
+
+static inline int
+mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
+                            const mdns_record_t* authority, size_t authority_count,
+                            const mdns_record_t* additional, size_t additional_count) {
+	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
+	                                        authority_count, additional, additional_count,
+	                                        MDNS_CLASS_IN, 60);
+}
+
+static inline int
+mdns_announce_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
+                        const mdns_record_t* authority, size_t authority_count,
+                        const  mdns_record_t* additional, size_t additional_count) {
+	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
+	                                        authority_count, additional, additional_count,
+	                                        MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 60);
+}
+
+static inline int
+mdns_goodbye_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
+                       const mdns_record_t* authority, size_t authority_count,
+                       const mdns_record_t* additional, size_t additional_count) {
+	// Goodbye should have ttl of 0
+	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
+	                                        authority_count, additional, additional_count,
+	                                        MDNS_CLASS_IN, 0);
+}
+
+static inline int
+mdns_answer_multicast_bulk(int sock, void* buffer, size_t capacity, const mdns_record_t* records,
+                           size_t record_count, size_t* cursor, size_t max_packets,
+                           uint16_t rclass, uint32_t ttl) {
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, 0, 0x8400);
+
+	size_t irec = *cursor;
+	while (irec < record_count) {
+		mdns_record_t record = records[irec];
+		mdns_record_update_rclass_ttl(&record, rclass, ttl);
+		size_t sent = packet.sent;
+		size_t group = 1;
+		if (mdns_record_is_txt_pair(&record)) {
+			// Coalesce consecutive key-value pairs for the same name into one record
+			while (((irec + group) < record_count) &&
+			       mdns_record_is_txt_pair(records + irec + group) &&
+			       mdns_string_equal_dotted(MDNS_STRING_ARGS(records[irec + group].name),
+			                                MDNS_STRING_ARGS(record.name)))
+				++group;
+			if (mdns_packet_add_txt_record(&packet, MDNS_ENTRYTYPE_ANSWER, records + irec, group,
+			                               rclass, ttl))
+				return -1;
+		} else if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ANSWER, record)) {
+			return -1;
+		}
+
+		// A packet was sent to make room for this record, stop if the packet limit is reached
+		// and leave the record in the unsent packet for the next call
+		if ((packet.sent != sent) && max_packets && (packet.sent >= max_packets)) {
+			*cursor = irec;
+			return (int)packet.sent;
+		}
+		irec += group;
+	}
+
+	if (mdns_packet_flush(&packet, 0))
+		return -1;
+	*cursor = record_count;
+	return (int)packet.sent;
+}
+
+static inline int
+mdns_announce_multicast_bulk(int sock, void* buffer, size_t capacity, const mdns_record_t* records,
+                             size_t record_count, size_t* cursor, size_t max_packets) {
+	return mdns_answer_multicast_bulk(sock, buffer, capacity, records, record_count, cursor,
+	                                  max_packets, MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 60);
+}
+
+static inline int
+mdns_goodbye_multicast_bulk(int sock, void* buffer, size_t capacity, const mdns_record_t* records,
+                            size_t record_count, size_t* cursor, size_t max_packets) {
+	// Goodbye should have ttl of 0
+	return mdns_answer_multicast_bulk(sock, buffer, capacity, records, record_count, cursor,
+	                                  max_packets, MDNS_CLASS_IN, 0);
+}
+
+static inline uint32_t
+mdns_random(uint32_t* state) {
+	// Xorshift generator, only used for timing jitter so quality is not a concern
+	uint32_t val = *state ? *state : 0x9E3779B9U;
+	val ^= val << 13;
+	val ^= val >> 17;
+	val ^= val << 5;
+	*state = val;
+	return val;
+}
+
+static inline int
+mdns_record_txt_contains(const void* buffer, size_t size, size_t offset, size_t length,
+                         const mdns_record_txt_t* txt) {
+	size_t end = offset + length;
+	if (end > size)
+		return 0;
+	size_t string_length = txt->key.length + txt->value.length + 1;
+	while (offset < end) {
+		const char* strdata = (const char*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+		size_t sublength = *(const unsigned char*)strdata;
+		if (sublength >= (end - offset))
+			break;
+		if ((sublength == string_length) && !memcmp(strdata + 1, txt->key.str, txt->key.length) &&
+		    (strdata[1 + txt->key.length] == '=') &&
+		    !memcmp(strdata + 2 + txt->key.length, txt->value.str, txt->value.length))
+			return 1;
+		offset += sublength + 1;
+	}
+	return 0;
+}
+
+static inline uint64_t
+mdns_record_hash(const mdns_record_t* record) {
+	uint64_t hash = mdns_string_hash(MDNS_HASH_SEED, MDNS_STRING_ARGS(record->name));
+	uint16_t rtype = (uint16_t)record->type;
+	hash = mdns_hash_data(hash, &rtype, sizeof(rtype));
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			hash = mdns_string_hash(hash, MDNS_STRING_ARGS(record->data.ptr.name));
+			break;
+
+		case MDNS_RECORDTYPE_SRV:
+			hash = mdns_hash_data(hash, &record->data.srv.priority, sizeof(uint16_t));
+			hash = mdns_hash_data(hash, &record->data.srv.weight, sizeof(uint16_t));
+			hash = mdns_hash_data(hash, &record->data.srv.port, sizeof(uint16_t));
+			hash = mdns_string_hash(hash, MDNS_STRING_ARGS(record->data.srv.name));
+			break;
+
+		case MDNS_RECORDTYPE_A:
+			hash = mdns_hash_data(hash, &record->data.a.addr.sin_addr, 4);
+			break;
+
+		case MDNS_RECORDTYPE_AAAA:
+			hash = mdns_hash_data(hash, &record->data.aaaa.addr.sin6_addr, 16);
+			break;
+
+		case MDNS_RECORDTYPE_TXT:
+			if (!mdns_record_is_txt_pair(record))
+				hash = mdns_hash_data(hash, record->data.txt.value.str,
+				                      record->data.txt.value.length);
+			break;
+
+		case MDNS_RECORDTYPE_NSEC:
+			hash = mdns_string_hash(hash, MDNS_STRING_ARGS(record->data.nsec.name));
+			hash = mdns_hash_data(hash, record->data.nsec.bitmap, sizeof(record->data.nsec.bitmap));
+			break;
+
+		default:
+			break;
+	}
+	return hash;
+}
+
+static inline int
+mdns_record_equal(const mdns_record_t* lhs, const mdns_record_t* rhs) {
+	if ((lhs->type != rhs->type) ||
+	    !mdns_string_equal_dotted(MDNS_STRING_ARGS(lhs->name), MDNS_STRING_ARGS(rhs->name)))
+		return 0;
+	switch (lhs->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return mdns_string_equal_dotted(MDNS_STRING_ARGS(lhs->data.ptr.name),
+			                                MDNS_STRING_ARGS(rhs->data.ptr.name));
+
+		case MDNS_RECORDTYPE_SRV:
+			return (lhs->data.srv.priority == rhs->data.srv.priority) &&
+			       (lhs->data.srv.weight == rhs->data.srv.weight) &&
+			       (lhs->data.srv.port == rhs->data.srv.port) &&
+			       mdns_string_equal_dotted(MDNS_STRING_ARGS(lhs->data.srv.name),
+			                                MDNS_STRING_ARGS(rhs->data.srv.name));
+
+		case MDNS_RECORDTYPE_A:
+			return !memcmp(&lhs->data.a.addr.sin_addr, &rhs->data.a.addr.sin_addr, 4);
+
+		case MDNS_RECORDTYPE_AAAA:
+			return !memcmp(&lhs->data.aaaa.addr.sin6_addr, &rhs->data.aaaa.addr.sin6_addr, 16);
+
+		case MDNS_RECORDTYPE_TXT:
+			return (lhs->data.txt.key.length == rhs->data.txt.key.length) &&
+			       (lhs->data.txt.value.length == rhs->data.txt.value.length) &&
+			       !memcmp(lhs->data.txt.key.str, rhs->data.txt.key.str,
+			               lhs->data.txt.key.length) &&
+			       !memcmp(lhs->data.txt.value.str, rhs->data.txt.value.str,
+			               lhs->data.txt.value.length);
+
+		case MDNS_RECORDTYPE_NSEC:
+			return mdns_string_equal_dotted(MDNS_STRING_ARGS(lhs->data.nsec.name),
+			                                MDNS_STRING_ARGS(rhs->data.nsec.name)) &&
+			       !memcmp(lhs->data.nsec.bitmap, rhs->data.nsec.bitmap,
+			               sizeof(lhs->data.nsec.bitmap));
+
+		default:
+			break;
+	}
+	return 0;
+}
+
+static inline int
+mdns_record_equal_wire(const mdns_record_t* record, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype, size_t record_offset,
+                       size_t record_length) {
+	if (((uint16_t)record->type != rtype) || (size < (record_offset + record_length)))
+		return 0;
+	if (!mdns_string_equal_name(buffer, size, name_offset, MDNS_STRING_ARGS(record->name)))
+		return 0;
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return mdns_string_equal_name(buffer, size, record_offset,
+			                              MDNS_STRING_ARGS(record->data.ptr.name));
+
+		case MDNS_RECORDTYPE_SRV: {
+			if (record_length < 8)
+				return 0;
+			const uint16_t* recorddata =
+			    (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, record_offset);
+			if ((mdns_ntohs(recorddata) != record->data.srv.priority) ||
+			    (mdns_ntohs(recorddata + 1) != record->data.srv.weight) ||
+			    (mdns_ntohs(recorddata + 2) != record->data.srv.port))
+				return 0;
+			return mdns_string_equal_name(buffer, size, record_offset + 6,
+			                              MDNS_STRING_ARGS(record->data.srv.name));
+		}
+
+		case MDNS_RECORDTYPE_A:
+			return (record_length == 4) &&
+			       !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, record_offset),
+			               &record->data.a.addr.sin_addr.s_addr, 4);
+
+		case MDNS_RECORDTYPE_AAAA:
+			return (record_length == 16) &&
+			       !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, record_offset),
+			               &record->data.aaaa.addr.sin6_addr, 16);
+
+		case MDNS_RECORDTYPE_TXT:
+			if (!mdns_record_is_txt_pair(record))
+				return (record_length == record->data.txt.value.length) &&
+				       !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, record_offset),
+				               record->data.txt.value.str, record_length);
+			// Key-value pairs are coalesced into one record when sent, so match any record
+			// containing the pair
+			return mdns_record_txt_contains(buffer, size, record_offset, record_length,
+			                                &record->data.txt);
+
+		case MDNS_RECORDTYPE_NSEC: {
+			if (!mdns_string_equal_name(buffer, size, record_offset,
+			                            MDNS_STRING_ARGS(record->data.nsec.name)))
+				return 0;
+			mdns_record_nsec_t nsec =
+			    mdns_record_parse_nsec(buffer, size, record_offset, record_length, 0, 0);
+			return !memcmp(nsec.bitmap, record->data.nsec.bitmap, sizeof(nsec.bitmap));
+		}
+
+		default:
+			break;
+	}
+	return 0;
+}
+
+static inline uint64_t
+mdns_record_hash_wire(const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                      size_t record_offset, size_t record_length) {
+	uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, buffer, size, name_offset);
+	hash = mdns_hash_data(hash, &rtype, sizeof(rtype));
+	if (size < (record_offset + record_length))
+		return hash;
+	const void* recorddata = MDNS_POINTER_OFFSET_CONST(buffer, record_offset);
+	switch (rtype) {
+		case MDNS_RECORDTYPE_PTR:
+			hash = mdns_string_hash_name(hash, buffer, size, record_offset);
+			break;
+
+		case MDNS_RECORDTYPE_SRV: {
+			if (record_length < 8)
+				break;
+			// Hash the fields in host byte order like mdns_record_hash
+			uint16_t fields[3];
+			for (int ifield = 0; ifield < 3; ++ifield) {
+				fields[ifield] = mdns_ntohs(MDNS_POINTER_OFFSET_CONST(recorddata, ifield * 2));
+				hash = mdns_hash_data(hash, fields + ifield, sizeof(uint16_t));
+			}
+			hash = mdns_string_hash_name(hash, buffer, size, record_offset + 6);
+			break;
+		}
+
+		case MDNS_RECORDTYPE_A:
+		case MDNS_RECORDTYPE_AAAA:
+		case MDNS_RECORDTYPE_TXT:
+			hash = mdns_hash_data(hash, recorddata, record_length);
+			break;
+
+		case MDNS_RECORDTYPE_NSEC: {
+			mdns_record_nsec_t nsec =
+			    mdns_record_parse_nsec(buffer, size, record_offset, record_length, 0, 0);
+			hash = mdns_string_hash_name(hash, buffer, size, record_offset);
+			hash = mdns_hash_data(hash, nsec.bitmap, sizeof(nsec.bitmap));
+			break;
+		}
+
+		default:
+			break;
+	}
+	return hash;
+}
+
+static inline size_t
+mdns_string_expand(const void* buffer, size_t size, size_t offset, void* data, size_t capacity) {
+	// Copy the labels of the name following any compression references
+	uint8_t* out = (uint8_t*)data;
+	size_t used = 0;
+	unsigned int counter = 0;
+	mdns_string_pair_t substr;
+	do {
+		substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS) ||
+		    ((capacity - used) <= substr.length))
+			return 0;
+		out[used++] = (uint8_t)substr.length;
+		memcpy(out + used, MDNS_POINTER_OFFSET_CONST(buffer, substr.offset), substr.length);
+		used += substr.length;
+		offset = substr.offset + substr.length;
+	} while (substr.length);
+	return used;
+}
+
+static inline size_t
+mdns_record_data_expand(const void* buffer, size_t size, size_t offset, size_t length,
+                        uint16_t rtype, void* data, size_t capacity) {
+	if (!length || (size < (offset + length)))
+		return 0;
+	switch (rtype) {
+		case MDNS_RECORDTYPE_PTR:
+			return mdns_string_expand(buffer, size, offset, data, capacity);
+
+		case MDNS_RECORDTYPE_SRV: {
+			// Priority, weight and port followed by the target name
+			if ((length <= 6) || (capacity <= 6))
+				return 0;
+			memcpy(data, MDNS_POINTER_OFFSET_CONST(buffer, offset), 6);
+			size_t name_size = mdns_string_expand(buffer, size, offset + 6,
+			                                      MDNS_POINTER_OFFSET(data, 6), capacity - 6);
+			return name_size ? (name_size + 6) : 0;
+		}
+
+		case MDNS_RECORDTYPE_NSEC: {
+			// Next domain name followed by the type bitmap
+			size_t bitmap_offset = offset;
+			if (!mdns_string_skip(buffer, size, &bitmap_offset) ||
+			    (bitmap_offset > (offset + length)))
+				return 0;
+			size_t bitmap_size = (offset + length) - bitmap_offset;
+			size_t name_size = mdns_string_expand(buffer, size, offset, data, capacity);
+			if (!name_size || ((capacity - name_size) < bitmap_size))
+				return 0;
+			memcpy(MDNS_POINTER_OFFSET(data, name_size),
+			       MDNS_POINTER_OFFSET_CONST(buffer, bitmap_offset), bitmap_size);
+			return name_size + bitmap_size;
+		}
+
+		default:
+			if (capacity < length)
+				return 0;
+			memcpy(data, MDNS_POINTER_OFFSET_CONST(buffer, offset), length);
+			return length;
+	}
+}
+
+static inline void
+mdns_ratelimit_init(mdns_ratelimit_t* ratelimit, mdns_ratelimit_entry_t* entries, size_t capacity) {
+	memset(ratelimit, 0, sizeof(mdns_ratelimit_t));
+	memset(entries, 0, sizeof(mdns_ratelimit_entry_t) * capacity);
+	ratelimit->entries = entries;
+	ratelimit->capacity = capacity;
+}
+
+static inline int
+mdns_ratelimit_allow(mdns_ratelimit_t* ratelimit, uint64_t now, uint64_t record_hash,
+                     uint32_t link_id, int probe_defense) {
+	if (!ratelimit->capacity)
+		return 1;
+
+	// A zero key marks an unused slot
+	uint64_t key = mdns_hash_data(record_hash, &link_id, sizeof(link_id));
+	if (!key)
+		key = 1;
+
+	// Search a small window of slots for the record. If not found, take over the slot with the
+	// oldest time which is most likely expired
+	size_t islot = (size_t)(key % ratelimit->capacity);
+	mdns_ratelimit_entry_t* oldest = 0;
+	for (size_t iprobe = 0; iprobe < MDNS_RATELIMIT_PROBE; ++iprobe) {
+		mdns_ratelimit_entry_t* entry = ratelimit->entries + islot;
+		if (entry->key == key) {
+			uint64_t interval =
+			    probe_defense ? MDNS_PROBE_DEFENSE_INTERVAL : MDNS_MULTICAST_INTERVAL;
+			if ((now >= entry->last) && ((now - entry->last) < interval)) {
+				++ratelimit->suppressed;
+				return 0;
+			}
+			entry->last = now;
+			return 1;
+		}
+		if (!oldest || !entry->key || (oldest->key && (entry->last < oldest->last)))
+			oldest = entry;
+		if (++islot >= ratelimit->capacity)
+			islot = 0;
+	}
+
+	if (oldest->key && (now >= oldest->last) && ((now - oldest->last) < MDNS_MULTICAST_INTERVAL))
+		++ratelimit->evicted;
+	oldest->key = key;
+	oldest->last = now;
+	return 1;
+}
+
+static inline void
+mdns_scheduler_init(mdns_scheduler_t* scheduler, mdns_scheduled_record_t* records, size_t capacity,
+                    uint32_t seed) {
+	memset(scheduler, 0, sizeof(mdns_scheduler_t));
+	scheduler->records = records;
+	scheduler->capacity = capacity;
+	scheduler->next = MDNS_TIME_NEVER;
+	scheduler->random_state = seed;
+}
+
+static inline void
+mdns_scheduler_set_ratelimit(mdns_scheduler_t* scheduler, mdns_ratelimit_t* ratelimit) {
+	scheduler->ratelimit = ratelimit;
+}
+
+// Insert a pending record in the index
+static inline void
+mdns_scheduler_index_link(mdns_scheduler_t* scheduler, size_t irec) {
+	size_t slot = (size_t)(scheduler->records[irec].hash % scheduler->index_capacity);
+	while (scheduler->index[slot] != MDNS_INVALID_POS)
+		slot = (slot + 1) % scheduler->index_capacity;
+	scheduler->index[slot] = irec;
+}
+
+// Remove a pending record from the index, moving back the following entries in the probe
+// sequence to fill the hole
+static inline void
+mdns_scheduler_index_unlink(mdns_scheduler_t* scheduler, size_t irec) {
+	size_t capacity = scheduler->index_capacity;
+	size_t* index = scheduler->index;
+	size_t hole = (size_t)(scheduler->records[irec].hash % capacity);
+	while (index[hole] != irec) {
+		if (index[hole] == MDNS_INVALID_POS)
+			return;
+		hole = (hole + 1) % capacity;
+	}
+	for (size_t slot = (hole + 1) % capacity; index[slot] != MDNS_INVALID_POS;
+	     slot = (slot + 1) % capacity) {
+		size_t home = (size_t)(scheduler->records[index[slot]].hash % capacity);
+		// Move the entry unless its home slot is cyclically between the hole and its slot
+		int between = (hole <= slot) ? ((home > hole) && (home <= slot)) :
+		                               ((home > hole) || (home <= slot));
+		if (!between) {
+			index[hole] = index[slot];
+			hole = slot;
+		}
+	}
+	index[hole] = MDNS_INVALID_POS;
+}
+
+// Index all pending records again, after the records have been moved
+static inline void
+mdns_scheduler_index_rebuild(mdns_scheduler_t* scheduler) {
+	if (!scheduler->index_capacity)
+		return;
+	for (size_t slot = 0; slot < scheduler->index_capacity; ++slot)
+		scheduler->index[slot] = MDNS_INVALID_POS;
+	for (size_t irec = 0; irec < scheduler->count; ++irec)
+		mdns_scheduler_index_link(scheduler, irec);
+}
+
+static inline int
+mdns_scheduler_set_index(mdns_scheduler_t* scheduler, size_t* index, size_t capacity) {
+	if (capacity && (capacity <= scheduler->capacity))
+		return -1;
+	scheduler->index = index;
+	scheduler->index_capacity = capacity;
+	mdns_scheduler_index_rebuild(scheduler);
+	return 0;
+}
+
+// Remove a pending record, replacing it with the last pending record
+static inline void
+mdns_scheduler_remove(mdns_scheduler_t* scheduler, size_t irec) {
+	size_t last = --scheduler->count;
+	if (scheduler->index_capacity) {
+		mdns_scheduler_index_unlink(scheduler, irec);
+		if (irec != last) {
+			// Point the index entry of the last record to its new position
+			size_t slot = (size_t)(scheduler->records[last].hash % scheduler->index_capacity);
+			while (scheduler->index[slot] != last)
+				slot = (slot + 1) % scheduler->index_capacity;
+			scheduler->index[slot] = irec;
+		}
+	}
+	scheduler->records[irec] = scheduler->records[last];
+}
+
+static inline void
+mdns_scheduler_update_next(mdns_scheduler_t* scheduler) {
+	scheduler->next = MDNS_TIME_NEVER;
+	for (size_t irec = 0; irec < scheduler->count; ++irec) {
+		if (scheduler->records[irec].deadline < scheduler->next)
+			scheduler->next = scheduler->records[irec].deadline;
+	}
+}
+
+static inline int
+mdns_scheduler_insert(mdns_scheduler_t* scheduler, mdns_record_t record, uint64_t deadline,
+                      mdns_entry_type_t section, int probe_defense) {
+	mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+
+	uint64_t hash = mdns_record_hash(&record);
+	mdns_scheduled_record_t* scheduled = 0;
+	if (scheduler->index_capacity) {
+		for (size_t slot = (size_t)(hash % scheduler->index_capacity);
+		     !scheduled && (scheduler->index[slot] != MDNS_INVALID_POS);
+		     slot = (slot + 1) % scheduler->index_capacity) {
+			mdns_scheduled_record_t* pending = scheduler->records + scheduler->index[slot];
+			if ((pending->hash == hash) && mdns_record_equal(&pending->record, &record))
+				scheduled = pending;
+		}
+	} else {
+		for (size_t irec = 0; !scheduled && (irec < scheduler->count); ++irec) {
+			mdns_scheduled_record_t* pending = scheduler->records + irec;
+			if ((pending->hash == hash) && mdns_record_equal(&pending->record, &record))
+				scheduled = pending;
+		}
+	}
+
+	if (scheduled) {
+		// Merge with the pending record, an answer takes precedence over an additional record
+		if (section == MDNS_ENTRYTYPE_ANSWER)
+			scheduled->section = MDNS_ENTRYTYPE_ANSWER;
+		if (deadline < scheduled->deadline)
+			scheduled->deadline = deadline;
+		if (probe_defense)
+			scheduled->probe_defense = 1;
+	} else {
+		if (scheduler->count >= scheduler->capacity)
+			return -1;
+		scheduled = scheduler->records + scheduler->count++;
+		scheduled->record = record;
+		scheduled->hash = hash;
+		scheduled->deadline = deadline;
+		scheduled->section = section;
+		scheduled->probe_defense = probe_defense;
+		scheduled->flags = 0;
+		if (scheduler->index_capacity)
+			mdns_scheduler_index_link(scheduler, scheduler->count - 1);
+	}
+
+	if (deadline < scheduler->next)
+		scheduler->next = deadline;
+	return 0;
+}
+
+// Answers with shared records are delayed by a random interval, other answers are due now
+static inline uint64_t
+mdns_scheduler_answer_deadline(mdns_scheduler_t* scheduler, uint64_t now, int shared) {
+	if (!shared)
+		return now;
+	uint32_t range = MDNS_SHARED_DELAY_MAX - MDNS_SHARED_DELAY_MIN + 1;
+	return now + MDNS_SHARED_DELAY_MIN + (mdns_random(&scheduler->random_state) % range);
+}
+
+static inline int
+mdns_scheduler_add(mdns_scheduler_t* scheduler, uint64_t now, mdns_record_t answer,
+                   const mdns_record_t* additional, size_t additional_count) {
+	uint64_t deadline =
+	    mdns_scheduler_answer_deadline(scheduler, now, answer.type == MDNS_RECORDTYPE_PTR);
+
+	if (mdns_scheduler_insert(scheduler, answer, deadline, MDNS_ENTRYTYPE_ANSWER, 0))
+		return -1;
+	for (size_t irec = 0; irec < additional_count; ++irec) {
+		if (mdns_scheduler_insert(scheduler, additional[irec], deadline,
+		                          MDNS_ENTRYTYPE_ADDITIONAL, 0))
+			return -1;
+	}
+	return 0;
+}
+
+static inline size_t
+mdns_scheduler_suppress(mdns_scheduler_t* scheduler, const void* buffer, size_t size,
+                        size_t name_offset, uint16_t rtype, uint32_t ttl, size_t record_offset,
+                        size_t record_length) {
+	// A received TXT record also cancels the pending key-value pairs of the name it contains,
+	// which are pending under the hash of the name and type only
+	uint64_t hash[2];
+	hash[0] = mdns_record_hash_wire(buffer, size, name_offset, rtype, record_offset,
+	                                record_length);
+	hash[1] = (rtype == MDNS_RECORDTYPE_TXT) ?
+	              mdns_record_hash_wire(buffer, size, name_offset, rtype, record_offset, 0) :
+	              hash[0];
+	size_t cancelled = 0;
+	if (scheduler->index_capacity) {
+		for (int ihash = 0; ihash < ((hash[1] != hash[0]) ? 2 : 1); ++ihash) {
+			size_t home = (size_t)(hash[ihash] % scheduler->index_capacity);
+			size_t slot = home;
+			while (scheduler->index[slot] != MDNS_INVALID_POS) {
+				size_t irec = scheduler->index[slot];
+				mdns_scheduled_record_t* scheduled = scheduler->records + irec;
+				if ((scheduled->hash == hash[ihash]) && (ttl >= scheduled->record.ttl) &&
+				    mdns_record_equal_wire(&scheduled->record, buffer, size, name_offset, rtype,
+				                           record_offset, record_length)) {
+					// Removing moves entries of the probe sequence, so start over
+					mdns_scheduler_remove(scheduler, irec);
+					++cancelled;
+					slot = home;
+				} else {
+					slot = (slot + 1) % scheduler->index_capacity;
+				}
+			}
+		}
+	} else {
+		size_t irec = 0;
+		while (irec < scheduler->count) {
+			mdns_scheduled_record_t* scheduled = scheduler->records + irec;
+			if (((scheduled->hash == hash[0]) || (scheduled->hash == hash[1])) &&
+			    (ttl >= scheduled->record.ttl) &&
+			    mdns_record_equal_wire(&scheduled->record, buffer, size, name_offset, rtype,
+			                           record_offset, record_length)) {
+				mdns_scheduler_remove(scheduler, irec);
+				++cancelled;
+			} else {
+				++irec;
+			}
+		}
+	}
+	if (cancelled) {
+		scheduler->suppressed += cancelled;
+		mdns_scheduler_update_next(scheduler);
+	}
+	return cancelled;
+}
+
+static inline uint64_t
+mdns_scheduler_next_deadline(const mdns_scheduler_t* scheduler) {
+	return scheduler->next;
+}
+
+// Start walking the due TXT key-value pairs with the same name and section as the given record.
+// Pairs of a name all have the same record hash, so with an index the walk only visits the probe
+// sequence of the hash, otherwise the due records from the given record on
+static inline size_t
+mdns_scheduler_txt_begin(const mdns_scheduler_t* scheduler, size_t first) {
+	if (scheduler->index_capacity)
+		return (size_t)(scheduler->records[first].hash % scheduler->index_capacity);
+	return first;
+}
+
+// Get the next due TXT key-value pair in the walk, or MDNS_INVALID_POS at the end
+static inline size_t
+mdns_scheduler_txt_next(const mdns_scheduler_t* scheduler, size_t due, size_t first,
+                        size_t* cursor) {
+	const mdns_scheduled_record_t* scheduled = scheduler->records + first;
+	while (1) {
+		size_t irec;
+		if (scheduler->index_capacity) {
+			irec = scheduler->index[*cursor];
+			if (irec == MDNS_INVALID_POS)
+				return MDNS_INVALID_POS;
+			*cursor = (*cursor + 1) % scheduler->index_capacity;
+		} else {
+			if (*cursor >= due)
+				return MDNS_INVALID_POS;
+			irec = (*cursor)++;
+		}
+		const mdns_scheduled_record_t* next = scheduler->records + irec;
+		if ((irec < due) && (next->hash == scheduled->hash) &&
+		    (next->section == scheduled->section) && mdns_record_is_txt_pair(&next->record) &&
+		    mdns_string_equal_dotted(MDNS_STRING_ARGS(next->record.name),
+		                             MDNS_STRING_ARGS(scheduled->record.name)))
+			return irec;
+	}
+}
+
+static inline void*
+mdns_scheduler_add_txt_record(mdns_scheduler_t* scheduler, size_t due, size_t first,
+                              void* buffer, size_t capacity, void* data,
+                              mdns_string_table_t* string_table) {
+	// Coalesce all pending TXT key-value pairs for the same name into one record
+	mdns_scheduled_record_t* scheduled = scheduler->records + first;
+	data = mdns_answer_add_record_header(buffer, capacity, data, scheduled->record, string_table);
+	if (!data)
+		return 0;
+	void* record_length = MDNS_POINTER_OFFSET(data, -2);
+	void* record_data = data;
+	size_t cursor = mdns_scheduler_txt_begin(scheduler, first);
+	size_t irec;
+	while (data && ((irec = mdns_scheduler_txt_next(scheduler, due, first, &cursor)) !=
+	                MDNS_INVALID_POS)) {
+		if (!scheduler->records[irec].flags)
+			data = mdns_answer_add_txt_value(buffer, capacity, data,
+			                                 &scheduler->records[irec].record);
+	}
+	if (data)
+		mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+	return data;
+}
+
+static inline void
+mdns_scheduler_mark_txt_record(mdns_scheduler_t* scheduler, size_t due, size_t first) {
+	size_t cursor = mdns_scheduler_txt_begin(scheduler, first);
+	size_t irec;
+	while ((irec = mdns_scheduler_txt_next(scheduler, due, first, &cursor)) != MDNS_INVALID_POS)
+		scheduler->records[irec].flags = 1;
+}
+
+static inline int
+mdns_scheduler_add_section(mdns_scheduler_t* scheduler, size_t due, mdns_entry_type_t section,
+                           mdns_packet_t* packet, uint64_t now) {
+	for (size_t irec = 0; irec < due; ++irec) {
+		mdns_scheduled_record_t* scheduled = scheduler->records + irec;
+		if ((scheduled->section != section) || scheduled->flags)
+			continue;
+		if (scheduler->ratelimit &&
+		    !mdns_ratelimit_allow(scheduler->ratelimit, now, scheduled->hash,
+		                          (uint32_t)packet->sock, scheduled->probe_defense)) {
+			if (mdns_record_is_txt_pair(&scheduled->record))
+				mdns_scheduler_mark_txt_record(scheduler, due, irec);
+			scheduled->flags = 1;
+			continue;
+		}
+		if (!mdns_record_is_txt_pair(&scheduled->record)) {
+			scheduled->flags = 1;
+			if (mdns_packet_add_record(packet, section, scheduled->record))
+				return -1;
+			continue;
+		}
+
+		while (1) {
+			mdns_string_table_t string_table = packet->string_table;
+			void* data = mdns_scheduler_add_txt_record(scheduler, due, irec, packet->buffer,
+			                                           packet->capacity, packet->data,
+			                                           &packet->string_table);
+			if (data) {
+				packet->data = data;
+				++packet->count[section];
+				break;
+			}
+			if (mdns_packet_overflow(packet, &string_table, 0))
+				return -1;
+		}
+		mdns_scheduler_mark_txt_record(scheduler, due, irec);
+	}
+	return 0;
+}
+
+static inline int
+mdns_scheduler_send(mdns_scheduler_t* scheduler, int sock, void* buffer, size_t capacity,
+                    uint64_t now) {
+	if (!scheduler->count || (scheduler->next > now))
+		return 0;
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	// Move all records due within the aggregation window to the front
+	uint64_t limit = now + MDNS_AGGREGATION_WINDOW;
+	size_t due = 0;
+	for (size_t irec = 0; irec < scheduler->count; ++irec) {
+		mdns_scheduled_record_t* scheduled = scheduler->records + irec;
+		if (scheduled->deadline > limit)
+			continue;
+		scheduled->flags = 0;
+		if (irec != due) {
+			mdns_scheduled_record_t swap = scheduler->records[due];
+			scheduler->records[due] = *scheduled;
+			*scheduled = swap;
+		}
+		++due;
+	}
+	mdns_scheduler_index_rebuild(scheduler);
+
+	// Answers first followed by additional records, split over as many packets as needed
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, 0, 0x8400);
+	int ret = mdns_scheduler_add_section(scheduler, due, MDNS_ENTRYTYPE_ANSWER, &packet, now);
+	if (!ret)
+		ret = mdns_scheduler_add_section(scheduler, due, MDNS_ENTRYTYPE_ADDITIONAL, &packet, now);
+	if (!ret)
+		ret = mdns_packet_flush(&packet, 0);
+
+	// Remove the due records from the pending set, even if send fails
+	scheduler->count -= due;
+	memmove(scheduler->records, scheduler->records + due,
+	        sizeof(mdns_scheduled_record_t) * scheduler->count);
+	mdns_scheduler_index_rebuild(scheduler);
+	mdns_scheduler_update_next(scheduler);
+
+	if (ret)
+		return -1;
+	return (int)packet.sent;
+}
+
+static inline void
+mdns_responder_init(mdns_responder_t* responder, mdns_responder_entry_t* entries, size_t capacity,
+                    size_t* buckets, size_t bucket_count) {
+	memset(responder, 0, sizeof(mdns_responder_t));
+	responder->entries = entries;
+	responder->capacity = capacity;
+	responder->free = MDNS_INVALID_POS;
+	responder->buckets = buckets;
+	responder->bucket_count = bucket_count;
+	for (size_t ibucket = 0; ibucket < bucket_count; ++ibucket)
+		buckets[ibucket] = MDNS_INVALID_POS;
+}
+
+// Find the link to the first record with the given name and type in the bucket chain. Only the
+// first record of a set is keyed by the name hash, the other records are keyed by record hash
+static inline size_t*
+mdns_responder_find_link(const mdns_responder_t* responder, uint64_t hash, const char* name,
+                         size_t length, uint16_t rtype) {
+	if (!responder->bucket_count)
+		return 0;
+	size_t* link = responder->buckets + (hash % responder->bucket_count);
+	while (*link != MDNS_INVALID_POS) {
+		mdns_responder_entry_t* entry = responder->entries + *link;
+		if ((entry->prev == MDNS_INVALID_POS) && (entry->hash == hash) &&
+		    ((uint16_t)entry->record.type == rtype) &&
+		    mdns_string_equal_dotted(name, length, MDNS_STRING_ARGS(entry->record.name)))
+			return link;
+		link = &entry->next;
+	}
+	return 0;
+}
+
+// Find the link to a record in the bucket chain which is not the first record of its set
+static inline size_t*
+mdns_responder_find_member_link(const mdns_responder_t* responder, uint64_t hash,
+                                const mdns_record_t* record) {
+	size_t* link = responder->buckets + (hash % responder->bucket_count);
+	while (*link != MDNS_INVALID_POS) {
+		mdns_responder_entry_t* entry = responder->entries + *link;
+		if ((entry->prev != MDNS_INVALID_POS) && (entry->hash == hash) &&
+		    mdns_record_equal(&entry->record, record))
+			return link;
+		link = &entry->next;
+	}
+	return 0;
+}
+
+// Remove the given entry from its bucket chain
+static inline void
+mdns_responder_unlink(mdns_responder_t* responder, size_t index) {
+	size_t* link = responder->buckets + (responder->entries[index].hash % responder->bucket_count);
+	while (*link != index)
+		link = &responder->entries[*link].next;
+	*link = responder->entries[index].next;
+}
+
+// Insert the given entry first in the bucket chain for its hash
+static inline void
+mdns_responder_link(mdns_responder_t* responder, size_t index) {
+	mdns_responder_entry_t* entry = responder->entries + index;
+	size_t* bucket = responder->buckets + (entry->hash % responder->bucket_count);
+	entry->next = *bucket;
+	*bucket = index;
+}
+
+static inline int
+mdns_responder_add_subtype(mdns_responder_t* responder, mdns_string_t subtype_name,
+                           const mdns_record_t* record) {
+	return mdns_responder_add(responder, mdns_record_subtype(record, subtype_name));
+}
+
+static inline int
+mdns_responder_remove_subtype(mdns_responder_t* responder, mdns_string_t subtype_name,
+                              const mdns_record_t* record) {
+	mdns_record_t subtype_record = mdns_record_subtype(record, subtype_name);
+	return mdns_responder_remove(responder, &subtype_record);
+}
+
+// Get the address bytes of an address record, returns the size of the address or 0 if the record
+// is not an address record
+static inline size_t
+mdns_record_address(const mdns_record_t* record, const void** bytes) {
+	if (record->type == MDNS_RECORDTYPE_A) {
+		*bytes = &record->data.a.addr.sin_addr;
+		return 4;
+	}
+	if (record->type == MDNS_RECORDTYPE_AAAA) {
+		*bytes = &record->data.aaaa.addr.sin6_addr;
+		return 16;
+	}
+	return 0;
+}
+
+// Insert an address record entry in the address index
+static inline void
+mdns_responder_address_link(mdns_responder_t* responder, size_t index) {
+	const void* bytes;
+	size_t bytes_size = mdns_record_address(&responder->entries[index].record, &bytes);
+	size_t slot = mdns_hash_data(MDNS_HASH_SEED, bytes, bytes_size) % responder->address_capacity;
+	while (responder->addresses[slot] != MDNS_INVALID_POS)
+		slot = (slot + 1) % responder->address_capacity;
+	responder->addresses[slot] = index;
+	++responder->address_count;
+}
+
+// Remove an address record entry from the address index, moving back the following entries
+// in the probe sequence to fill the hole
+static inline void
+mdns_responder_address_unlink(mdns_responder_t* responder, size_t index) {
+	size_t capacity = responder->address_capacity;
+	size_t* addresses = responder->addresses;
+	const void* bytes;
+	size_t bytes_size = mdns_record_address(&responder->entries[index].record, &bytes);
+	size_t hole = mdns_hash_data(MDNS_HASH_SEED, bytes, bytes_size) % capacity;
+	while (addresses[hole] != index) {
+		if (addresses[hole] == MDNS_INVALID_POS)
+			return;
+		hole = (hole + 1) % capacity;
+	}
+	for (size_t slot = (hole + 1) % capacity; addresses[slot] != MDNS_INVALID_POS;
+	     slot = (slot + 1) % capacity) {
+		bytes_size = mdns_record_address(&responder->entries[addresses[slot]].record, &bytes);
+		size_t home = mdns_hash_data(MDNS_HASH_SEED, bytes, bytes_size) % capacity;
+		// Move the entry unless its home slot is cyclically between the hole and its slot
+		int between = (hole <= slot) ? ((home > hole) && (home <= slot)) :
+		                               ((home > hole) || (home <= slot));
+		if (!between) {
+			addresses[hole] = addresses[slot];
+			hole = slot;
+		}
+	}
+	addresses[hole] = MDNS_INVALID_POS;
+	--responder->address_count;
+}
+
+static inline int
+mdns_responder_set_address_index(mdns_responder_t* responder, size_t* addresses,
+                                 size_t capacity) {
+	responder->addresses = addresses;
+	responder->address_capacity = capacity;
+	responder->address_count = 0;
+	if (!capacity)
+		return 0;
+	for (size_t slot = 0; slot < capacity; ++slot)
+		addresses[slot] = MDNS_INVALID_POS;
+	// Every registered record is linked in a bucket chain
+	for (size_t ibucket = 0; ibucket < responder->bucket_count; ++ibucket) {
+		for (size_t ientry = responder->buckets[ibucket]; ientry != MDNS_INVALID_POS;
+		     ientry = responder->entries[ientry].next) {
+			const void* bytes;
+			if (!mdns_record_address(&responder->entries[ientry].record, &bytes))
+				continue;
+			if ((responder->address_count + 1) >= capacity)
+				return -1;
+			mdns_responder_address_link(responder, ientry);
+		}
+	}
+	return 0;
+}
+
+static inline size_t
+mdns_responder_find_address(const mdns_responder_t* responder, const struct sockaddr* addr) {
+	if (!responder->address_capacity)
+		return MDNS_INVALID_POS;
+	const void* bytes;
+	size_t bytes_size;
+	if (addr->sa_family == AF_INET) {
+		bytes = &((const struct sockaddr_in*)addr)->sin_addr;
+		bytes_size = 4;
+	} else if (addr->sa_family == AF_INET6) {
+		bytes = &((const struct sockaddr_in6*)addr)->sin6_addr;
+		bytes_size = 16;
+	} else {
+		return MDNS_INVALID_POS;
+	}
+	size_t capacity = responder->address_capacity;
+	for (size_t slot = mdns_hash_data(MDNS_HASH_SEED, bytes, bytes_size) % capacity;
+	     responder->addresses[slot] != MDNS_INVALID_POS; slot = (slot + 1) % capacity) {
+		size_t index = responder->addresses[slot];
+		const void* entry_bytes;
+		if ((mdns_record_address(&responder->entries[index].record, &entry_bytes) ==
+		     bytes_size) &&
+		    !memcmp(entry_bytes, bytes, bytes_size))
+			return index;
+	}
+	return MDNS_INVALID_POS;
+}
+
+static inline size_t
+mdns_responder_find(const mdns_responder_t* responder, const char* name, size_t length,
+                    mdns_record_type_t type) {
+	uint64_t hash = mdns_string_hash(MDNS_HASH_SEED, name, length);
+	size_t* link = mdns_responder_find_link(responder, hash, name, length, (uint16_t)type);
+	return link ? *link : MDNS_INVALID_POS;
+}
+
+// Register a record valid on the interface with the given index, or all interfaces if zero
+static inline int
+mdns_responder_insert(mdns_responder_t* responder, mdns_record_t record, unsigned int if_index) {
+	if (!responder->bucket_count)
+		return -1;
+	uint64_t name_hash = mdns_string_hash(MDNS_HASH_SEED, MDNS_STRING_ARGS(record.name));
+	uint64_t record_hash = mdns_record_hash(&record);
+	size_t* link = mdns_responder_find_link(responder, name_hash, MDNS_STRING_ARGS(record.name),
+	                                        (uint16_t)record.type);
+	size_t first = link ? *link : MDNS_INVALID_POS;
+	if (first != MDNS_INVALID_POS) {
+		size_t* member = 0;
+		size_t existing = MDNS_INVALID_POS;
+		if (mdns_record_equal(&responder->entries[first].record, &record))
+			existing = first;
+		else if ((member = mdns_responder_find_member_link(responder, record_hash, &record)) != 0)
+			existing = *member;
+		if (existing != MDNS_INVALID_POS) {
+			// The same record on another interface is valid on all interfaces
+			if (responder->entries[existing].if_index != if_index)
+				responder->entries[existing].if_index = 0;
+			return 0;
+		}
+	}
+
+	const void* address_bytes;
+	int indexed = responder->address_capacity && mdns_record_address(&record, &address_bytes);
+	if (indexed && ((responder->address_count + 1) >= responder->address_capacity))
+		return -1;
+
+	size_t index;
+	if (responder->free != MDNS_INVALID_POS) {
+		index = responder->free;
+		responder->free = responder->entries[index].next;
+	} else if (responder->used < responder->capacity) {
+		index = responder->used++;
+	} else {
+		return -1;
+	}
+
+	mdns_responder_entry_t* entry = responder->entries + index;
+	entry->record = record;
+	entry->if_index = if_index;
+	if (first != MDNS_INVALID_POS) {
+		// Link the record into the set after the first record
+		mdns_responder_entry_t* first_entry = responder->entries + first;
+		entry->hash = record_hash;
+		entry->prev = first;
+		entry->same = first_entry->same;
+		if (first_entry->same != MDNS_INVALID_POS)
+			responder->entries[first_entry->same].prev = index;
+		first_entry->same = index;
+	} else {
+		entry->hash = name_hash;
+		entry->prev = MDNS_INVALID_POS;
+		entry->same = MDNS_INVALID_POS;
+	}
+	mdns_responder_link(responder, index);
+	if (indexed)
+		mdns_responder_address_link(responder, index);
+	++responder->count;
+	return 0;
+}
+
+static inline int
+mdns_responder_add(mdns_responder_t* responder, mdns_record_t record) {
+	return mdns_responder_insert(responder, record, 0);
+}
+
+static inline int
+mdns_responder_add_address(mdns_responder_t* responder, mdns_record_t record,
+                           unsigned int if_index) {
+	const void* address_bytes;
+	if (!mdns_record_address(&record, &address_bytes))
+		return -1;
+	return mdns_responder_insert(responder, record, if_index);
+}
+
+static inline int
+mdns_responder_copy(mdns_responder_t* responder, const mdns_responder_t* source) {
+	if ((responder->bucket_count == source->bucket_count) &&
+	    (responder->capacity >= source->used)) {
+		memcpy(responder->entries, source->entries, sizeof(mdns_responder_entry_t) * source->used);
+		memcpy(responder->buckets, source->buckets, sizeof(size_t) * source->bucket_count);
+		responder->used = source->used;
+		responder->count = source->count;
+		responder->free = source->free;
+		return mdns_responder_set_address_index(responder, responder->addresses,
+		                                        responder->address_capacity);
+	}
+
+	// Every registered record is linked in a bucket chain, keyed by either name or record hash
+	size_t* addresses = responder->addresses;
+	size_t address_capacity = responder->address_capacity;
+	mdns_responder_init(responder, responder->entries, responder->capacity, responder->buckets,
+	                    responder->bucket_count);
+	mdns_responder_set_address_index(responder, addresses, address_capacity);
+	for (size_t ibucket = 0; ibucket < source->bucket_count; ++ibucket) {
+		for (size_t ientry = source->buckets[ibucket]; ientry != MDNS_INVALID_POS;
+		     ientry = source->entries[ientry].next) {
+			if (mdns_responder_insert(responder, source->entries[ientry].record,
+			                          source->entries[ientry].if_index))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static inline int
+mdns_responder_remove(mdns_responder_t* responder, const mdns_record_t* record) {
+	uint64_t name_hash = mdns_string_hash(MDNS_HASH_SEED, MDNS_STRING_ARGS(record->name));
+	size_t* link = mdns_responder_find_link(responder, name_hash, MDNS_STRING_ARGS(record->name),
+	                                        (uint16_t)record->type);
+	if (!link)
+		return -1;
+
+	mdns_responder_entry_t* entries = responder->entries;
+	size_t index = *link;
+	if (mdns_record_equal(&entries[index].record, record)) {
+		// Removing the first record of a set, the next record in the set takes its place and
+		// is keyed by the name hash instead
+		*link = entries[index].next;
+		size_t promoted = entries[index].same;
+		if (promoted != MDNS_INVALID_POS) {
+			mdns_responder_unlink(responder, promoted);
+			entries[promoted].hash = name_hash;
+			entries[promoted].prev = MDNS_INVALID_POS;
+			mdns_responder_link(responder, promoted);
+		}
+	} else {
+		link = mdns_responder_find_member_link(responder, mdns_record_hash(record), record);
+		if (!link)
+			return -1;
+		index = *link;
+		*link = entries[index].next;
+		entries[entries[index].prev].same = entries[index].same;
+		if (entries[index].same != MDNS_INVALID_POS)
+			entries[entries[index].same].prev = entries[index].prev;
+	}
+
+	const void* address_bytes;
+	if (responder->address_capacity && mdns_record_address(&entries[index].record, &address_bytes))
+		mdns_responder_address_unlink(responder, index);
+	entries[index].next = responder->free;
+	responder->free = index;
+	--responder->count;
+	return 0;
+}
+
+// Check if a registered record is valid on the interface with the given index, zero meaning any
+static inline int
+mdns_responder_entry_valid(const mdns_responder_entry_t* entry, unsigned int if_index) {
+	return !entry->if_index || !if_index || (entry->if_index == if_index);
+}
+
+// Find the first record of a set valid on the interface with the given index. Sets are used from
+// their first valid record, the records before it are never answered on the interface. Returns
+// MDNS_INVALID_POS if no record in the set is valid on the interface
+static inline size_t
+mdns_responder_set_first(const mdns_responder_t* responder, size_t set, unsigned int if_index) {
+	while ((set != MDNS_INVALID_POS) &&
+	       !mdns_responder_entry_valid(responder->entries + set, if_index))
+		set = responder->entries[set].same;
+	return set;
+}
+
+// Find the registered records with the given name and type valid on the given interface
+static inline size_t
+mdns_responder_find_valid(const mdns_responder_t* responder, const char* name, size_t length,
+                          mdns_record_type_t type, unsigned int if_index) {
+	return mdns_responder_set_first(responder, mdns_responder_find(responder, name, length, type),
+	                                if_index);
+}
+
+// Add a record set to the additional record sets of a response, unless already in the answer
+// or additional sections. Additional records are optional, so sets are dropped if full. Sets of
+// a scheduled response are not compared with the other additional sets, as the scheduler merges
+// equal records, which keeps a PTR answer enumerating many instances linear in the instances
+static inline void
+mdns_responder_add_additional(mdns_responder_context_t* context, const size_t* answer,
+                              size_t answer_count, size_t* additional_count, int scheduled,
+                              size_t set) {
+	if ((set == MDNS_INVALID_POS) || (*additional_count >= context->additional_capacity))
+		return;
+	for (size_t iset = 0; iset < answer_count; ++iset) {
+		if (answer[iset] == set)
+			return;
+	}
+	for (size_t iset = 0; !scheduled && (iset < *additional_count); ++iset) {
+		if (context->additional[iset] == set)
+			return;
+	}
+	context->additional[(*additional_count)++] = set;
+}
+
+static inline void*
+mdns_responder_add_txt_record(const mdns_responder_t* responder, size_t set, void* buffer,
+                              size_t capacity, void* data, uint16_t rclass, uint32_t ttl,
+                              mdns_string_table_t* string_table) {
+	// Coalesce all key-value pairs in the set into one record
+	void* record_length = 0;
+	void* record_data = 0;
+	for (size_t ientry = set; data && (ientry != MDNS_INVALID_POS);
+	     ientry = responder->entries[ientry].same) {
+		const mdns_record_t* record = &responder->entries[ientry].record;
+		if (!mdns_record_is_txt_pair(record))
+			continue;
+		if (!record_data) {
+			mdns_record_t header = *record;
+			header.rclass = rclass;
+			header.ttl = ttl;
+			data = mdns_answer_add_record_header(buffer, capacity, data, header, string_table);
+			if (!data)
+				return 0;
+			record_length = MDNS_POINTER_OFFSET(data, -2);
+			record_data = data;
+		}
+		data = mdns_answer_add_txt_value(buffer, capacity, data, record);
+	}
+	if (data && record_data)
+		mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+	return data;
+}
+
+static inline int
+mdns_responder_add_set(const mdns_responder_t* responder, size_t set, mdns_packet_t* packet,
+                       mdns_entry_type_t section, int legacy, unsigned int if_index) {
+	int has_txt_pair = 0;
+	mdns_record_t record;
+	for (size_t ientry = set; ientry != MDNS_INVALID_POS;
+	     ientry = responder->entries[ientry].same) {
+		if (!mdns_responder_entry_valid(responder->entries + ientry, if_index))
+			continue;
+		record = responder->entries[ientry].record;
+		// Legacy unicast responses must not set the cache-flush bit and use a short TTL
+		if (legacy) {
+			record.rclass = MDNS_CLASS_IN;
+			record.ttl = 10;
+		} else {
+			mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+		}
+		if (mdns_record_is_txt_pair(&record)) {
+			has_txt_pair = 1;
+			continue;
+		}
+		if (mdns_packet_add_record(packet, section, record))
+			return -1;
+	}
+	if (!has_txt_pair)
+		return 0;
+
+	record = responder->entries[set].record;
+	if (legacy) {
+		record.rclass = MDNS_CLASS_IN;
+		record.ttl = 10;
+	} else {
+		mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+	}
+	while (1) {
+		mdns_string_table_t string_table = packet->string_table;
+		void* data =
+		    mdns_responder_add_txt_record(responder, set, packet->buffer, packet->capacity,
+		                                  packet->data, record.rclass, record.ttl,
+		                                  &packet->string_table);
+		if (data) {
+			packet->data = data;
+			++packet->count[section];
+			return 0;
+		}
+		if (mdns_packet_overflow(packet, &string_table, 0))
+			return -1;
+	}
+}
+
+static inline void
+mdns_responder_schedule_set(const mdns_responder_t* responder, size_t set,
+                            mdns_scheduler_t* scheduler, uint64_t deadline,
+                            mdns_entry_type_t section, int probe_defense, unsigned int if_index) {
+	// Records that do not fit are dropped and counted, the rest of the set is still scheduled
+	for (size_t ientry = set; ientry != MDNS_INVALID_POS;
+	     ientry = responder->entries[ientry].same) {
+		if (!mdns_responder_entry_valid(responder->entries + ientry, if_index))
+			continue;
+		if (mdns_scheduler_insert(scheduler, responder->entries[ientry].record, deadline,
+		                          section, probe_defense))
+			++scheduler->dropped;
+	}
+}
+
+// Make the NSEC record listing the types registered for the name with the given hash and valid
+// on the given interface, if the name has unique records. Names with only PTR records are shared
+// (service types and reverse mappings), and other responders may have the asked type. Returns 0
+// if the name has unique records, <0 if not
+static inline int
+mdns_responder_make_nsec(const mdns_responder_t* responder, uint64_t hash, const void* buffer,
+                         size_t size, size_t name_offset, unsigned int if_index,
+                         mdns_record_t* nsec) {
+	memset(nsec, 0, sizeof(mdns_record_t));
+	int unique = 0;
+	for (size_t ientry = responder->buckets[hash % responder->bucket_count];
+	     ientry != MDNS_INVALID_POS; ientry = responder->entries[ientry].next) {
+		const mdns_responder_entry_t* entry = responder->entries + ientry;
+		if ((entry->prev != MDNS_INVALID_POS) || (entry->hash != hash) ||
+		    !mdns_string_equal_name(buffer, size, name_offset,
+		                            MDNS_STRING_ARGS(entry->record.name)) ||
+		    (mdns_responder_set_first(responder, ientry, if_index) == MDNS_INVALID_POS))
+			continue;
+		if (entry->record.type != MDNS_RECORDTYPE_PTR) {
+			if (!unique) {
+				nsec->name = entry->record.name;
+				nsec->ttl = entry->record.ttl;
+			}
+			unique = 1;
+		}
+		mdns_record_nsec_set_type(&nsec->data.nsec, (uint16_t)entry->record.type);
+	}
+	if (!unique)
+		return -1;
+	nsec->type = MDNS_RECORDTYPE_NSEC;
+	nsec->data.nsec.name = nsec->name;
+	nsec->rclass = MDNS_CLASS_IN | MDNS_CACHE_FLUSH;
+	return 0;
+}
+
+// Send or schedule a single record, used for negative answers
+static inline int
+mdns_responder_answer_record(mdns_responder_context_t* context, int sock,
+                             const struct sockaddr* from, size_t addrlen, uint16_t query_id,
+                             uint16_t rtype, int legacy, int unicast, int schedule,
+                             int probe_defense, mdns_record_t record) {
+	if (legacy) {
+		record.rclass = MDNS_CLASS_IN;
+		record.ttl = 10;
+	} else {
+		mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+	}
+	mdns_scheduler_t* scheduler = unicast ? 0 : context->scheduler;
+	if (scheduler && schedule) {
+		uint64_t deadline = mdns_scheduler_answer_deadline(scheduler, context->now, 0);
+		if (mdns_scheduler_insert(scheduler, record, deadline, MDNS_ENTRYTYPE_ANSWER,
+		                          probe_defense)) {
+			++scheduler->dropped;
+			return 0;
+		}
+		return 1;
+	}
+	// Records that cannot be scheduled are still rate limited
+	if (scheduler && scheduler->ratelimit &&
+	    !mdns_ratelimit_allow(scheduler->ratelimit, context->now, mdns_record_hash(&record),
+	                          (uint32_t)sock, probe_defense))
+		return 0;
+
+	if (context->capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, unicast ? from : 0, unicast ? addrlen : 0, context->buffer,
+	                 context->capacity, legacy ? query_id : 0, 0x8400);
+	if (legacy && mdns_packet_set_question(&packet, (mdns_record_type_t)rtype, record.name.str,
+	                                       record.name.length, MDNS_CLASS_IN))
+		return -1;
+	if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ANSWER, record) ||
+	    mdns_packet_flush(&packet, 0))
+		return -1;
+	return 1;
+}
+
+static inline int
+mdns_responder_answer(mdns_responder_context_t* context, int sock, const struct sockaddr* from,
+                      size_t addrlen, uint16_t query_id, uint16_t rtype, uint16_t rclass,
+                      const void* buffer, size_t size, size_t name_offset) {
+	const mdns_responder_t* responder = context->responder;
+	if (!responder || !responder->bucket_count)
+		return 0;
+	unsigned int if_index = context->if_index;
+
+	// Find the answer record sets, one set for a specific type or one set per type for ANY, each
+	// from its first record valid on the interface
+	size_t answer[8];
+	size_t answer_count = 0;
+	uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, buffer, size, name_offset);
+	for (size_t ientry = responder->buckets[hash % responder->bucket_count];
+	     ientry != MDNS_INVALID_POS; ientry = responder->entries[ientry].next) {
+		const mdns_responder_entry_t* entry = responder->entries + ientry;
+		if ((entry->prev != MDNS_INVALID_POS) || (entry->hash != hash) ||
+		    ((rtype != MDNS_RECORDTYPE_ANY) && ((uint16_t)entry->record.type != rtype)) ||
+		    !mdns_string_equal_name(buffer, size, name_offset,
+		                            MDNS_STRING_ARGS(entry->record.name)))
+			continue;
+		size_t first = mdns_responder_set_first(responder, ientry, if_index);
+		if (first == MDNS_INVALID_POS)
+			continue;
+		answer[answer_count++] = first;
+		if ((rtype != MDNS_RECORDTYPE_ANY) || (answer_count >= (sizeof(answer) / sizeof(size_t))))
+			break;
+	}
+
+	// Questions from a port other than the mDNS port are legacy unicast queries which must be
+	// answered by unicast to the source port (RFC 6762 section 6.7)
+	uint16_t port = 0;
+	if (from && (from->sa_family == AF_INET))
+		port = ntohs(((const struct sockaddr_in*)from)->sin_port);
+	else if (from && (from->sa_family == AF_INET6))
+		port = ntohs(((const struct sockaddr_in6*)from)->sin6_port);
+	int legacy = from && (port != MDNS_PORT);
+	int unicast = legacy || (from && (rclass & MDNS_UNICAST_RESPONSE));
+
+	// Probe queries carry the proposed records in the authority section. Answers defending our
+	// records against a probe may be multicast every 250ms (RFC 6762 section 6)
+	int probe = (size >= sizeof(struct mdns_header_t)) &&
+	            (mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, 8)) != 0);
+
+	mdns_record_t nsec;
+	if (!answer_count) {
+		// Reverse mapping questions are answered from the address index. The name of the
+		// answer is made on the stack, so it is sent directly instead of through the scheduler,
+		// but still rate limited
+		struct sockaddr_storage reverse_addr;
+		size_t address_entry = MDNS_INVALID_POS;
+		if (((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) &&
+		    responder->address_capacity &&
+		    !mdns_reverse_name_parse(buffer, size, name_offset, &reverse_addr))
+			address_entry =
+			    mdns_responder_find_address(responder, (const struct sockaddr*)&reverse_addr);
+		if ((address_entry != MDNS_INVALID_POS) &&
+		    mdns_responder_entry_valid(responder->entries + address_entry, if_index)) {
+			const mdns_record_t* address_record = &responder->entries[address_entry].record;
+			char reverse_name[80];
+			mdns_record_t reverse;
+			memset(&reverse, 0, sizeof(mdns_record_t));
+			reverse.name = mdns_reverse_name_make(reverse_name, sizeof(reverse_name),
+			                                      (const struct sockaddr*)&reverse_addr);
+			reverse.type = MDNS_RECORDTYPE_PTR;
+			reverse.data.ptr.name = address_record->name;
+			reverse.rclass = MDNS_CLASS_IN | MDNS_CACHE_FLUSH;
+			reverse.ttl = address_record->ttl;
+			return mdns_responder_answer_record(context, sock, from, addrlen, query_id,
+			                                    MDNS_RECORDTYPE_PTR, legacy, unicast, 0, probe,
+			                                    reverse);
+		}
+
+		// Assert that the asked type does not exist for a name we own (RFC 6762 section 6.1)
+		if ((rtype == MDNS_RECORDTYPE_ANY) ||
+		    mdns_responder_make_nsec(responder, hash, buffer, size, name_offset, if_index, &nsec))
+			return 0;
+		return mdns_responder_answer_record(context, sock, from, addrlen, query_id, rtype,
+		                                    legacy, unicast, 1, probe, nsec);
+	}
+
+	// Pick additional records according to RFC 6763 section 12. PTR answers get the SRV and TXT
+	// records of the service instance, and SRV records get the address records of the target
+	// host. Address records get the address records of the other type, or a NSEC record if the
+	// host has no address of the other type
+	int scheduled = !unicast && context->scheduler;
+	int answer_records = 0;
+	int shared = 0;
+	int has_nsec = 0;
+	size_t additional_count = 0;
+	for (size_t iset = 0; iset < answer_count; ++iset) {
+		for (size_t ientry = answer[iset]; ientry != MDNS_INVALID_POS;
+		     ientry = responder->entries[ientry].same) {
+			if (!mdns_responder_entry_valid(responder->entries + ientry, if_index))
+				continue;
+			const mdns_record_t* record = &responder->entries[ientry].record;
+			++answer_records;
+			if (additional_count >= context->additional_capacity)
+				continue;
+			switch (record->type) {
+				case MDNS_RECORDTYPE_PTR:
+					shared = 1;
+					mdns_responder_add_additional(
+					    context, answer, answer_count, &additional_count, scheduled,
+					    mdns_responder_find_valid(responder,
+					                              MDNS_STRING_ARGS(record->data.ptr.name),
+					                              MDNS_RECORDTYPE_SRV, if_index));
+					mdns_responder_add_additional(
+					    context, answer, answer_count, &additional_count, scheduled,
+					    mdns_responder_find_valid(responder,
+					                              MDNS_STRING_ARGS(record->data.ptr.name),
+					                              MDNS_RECORDTYPE_TXT, if_index));
+					break;
+
+				case MDNS_RECORDTYPE_SRV:
+					mdns_responder_add_additional(
+					    context, answer, answer_count, &additional_count, scheduled,
+					    mdns_responder_find_valid(responder,
+					                              MDNS_STRING_ARGS(record->data.srv.name),
+					                              MDNS_RECORDTYPE_A, if_index));
+					mdns_responder_add_additional(
+					    context, answer, answer_count, &additional_count, scheduled,
+					    mdns_responder_find_valid(responder,
+					                              MDNS_STRING_ARGS(record->data.srv.name),
+					                              MDNS_RECORDTYPE_AAAA, if_index));
+					break;
+
+				case MDNS_RECORDTYPE_A:
+				case MDNS_RECORDTYPE_AAAA: {
+					size_t other = mdns_responder_find_valid(
+					    responder, MDNS_STRING_ARGS(record->name),
+					    (record->type == MDNS_RECORDTYPE_A) ? MDNS_RECORDTYPE_AAAA :
+					                                          MDNS_RECORDTYPE_A,
+					    if_index);
+					if (other != MDNS_INVALID_POS)
+						mdns_responder_add_additional(context, answer, answer_count,
+						                              &additional_count, scheduled, other);
+					else if (!has_nsec && (rtype != MDNS_RECORDTYPE_ANY))
+						has_nsec = !mdns_responder_make_nsec(responder, hash, buffer, size,
+						                                     name_offset, if_index, &nsec);
+					break;
+				}
+
+				default:
+					break;
+			}
+		}
+	}
+	// Address records for the targets of SRV records added as additional records
+	for (size_t iset = 0; iset < additional_count; ++iset) {
+		for (size_t ientry = context->additional[iset]; ientry != MDNS_INVALID_POS;
+		     ientry = responder->entries[ientry].same) {
+			const mdns_record_t* record = &responder->entries[ientry].record;
+			if (record->type != MDNS_RECORDTYPE_SRV)
+				break;
+			mdns_responder_add_additional(
+			    context, answer, answer_count, &additional_count, scheduled,
+			    mdns_responder_find_valid(responder, MDNS_STRING_ARGS(record->data.srv.name),
+			                              MDNS_RECORDTYPE_A, if_index));
+			mdns_responder_add_additional(
+			    context, answer, answer_count, &additional_count, scheduled,
+			    mdns_responder_find_valid(responder, MDNS_STRING_ARGS(record->data.srv.name),
+			                              MDNS_RECORDTYPE_AAAA, if_index));
+		}
+	}
+
+	if (has_nsec) {
+		if (legacy) {
+			nsec.rclass = MDNS_CLASS_IN;
+			nsec.ttl = 10;
+		} else {
+			mdns_record_update_rclass_ttl(&nsec, MDNS_CLASS_IN, 60);
+		}
+	}
+
+	// Multicast answers always go through the scheduler if set, so that they are delayed,
+	// suppressed and rate limited. Answers are scheduled before additional records, so records
+	// that do not fit in the scheduler storage are dropped from the additional records first.
+	// The scheduler must hold the largest answer, like a PTR answer enumerating all instances
+	mdns_scheduler_t* scheduler = context->scheduler;
+	if (scheduled) {
+		uint64_t deadline = mdns_scheduler_answer_deadline(scheduler, context->now, shared);
+		for (size_t iset = 0; iset < answer_count; ++iset)
+			mdns_responder_schedule_set(responder, answer[iset], scheduler, deadline,
+			                            MDNS_ENTRYTYPE_ANSWER, probe, if_index);
+		for (size_t iset = 0; iset < additional_count; ++iset)
+			mdns_responder_schedule_set(responder, context->additional[iset], scheduler,
+			                            deadline, MDNS_ENTRYTYPE_ADDITIONAL, probe, if_index);
+		if (has_nsec &&
+		    mdns_scheduler_insert(scheduler, nsec, deadline, MDNS_ENTRYTYPE_ADDITIONAL, probe))
+			++scheduler->dropped;
+		return answer_records;
+	}
+
+	if (context->capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, unicast ? from : 0, unicast ? addrlen : 0, context->buffer,
+	                 context->capacity, legacy ? query_id : 0, 0x8400);
+	if (legacy) {
+		const mdns_record_t* record = &responder->entries[answer[0]].record;
+		if (mdns_packet_set_question(&packet, (mdns_record_type_t)rtype, record->name.str,
+		                             record->name.length, MDNS_CLASS_IN))
+			return -1;
+	}
+	for (size_t iset = 0; iset < answer_count; ++iset) {
+		if (mdns_responder_add_set(responder, answer[iset], &packet, MDNS_ENTRYTYPE_ANSWER,
+		                           legacy, if_index))
+			return -1;
+	}
+	for (size_t iset = 0; iset < additional_count; ++iset) {
+		if (mdns_responder_add_set(responder, context->additional[iset], &packet,
+		                           MDNS_ENTRYTYPE_ADDITIONAL, legacy, if_index))
+			return -1;
+	}
+	if (has_nsec && mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ADDITIONAL, nsec))
+		return -1;
+	if (mdns_packet_flush(&packet, 0))
+		return -1;
+	return answer_records;
+}
+
+static inline int
+mdns_responder_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                        mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                        uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                        size_t name_offset, size_t name_length, size_t record_offset,
+                        size_t record_length, void* user_data) {
+	(void)sizeof(name_length);
+	mdns_responder_context_t* context = (mdns_responder_context_t*)user_data;
+	if ((entry == MDNS_ENTRYTYPE_QUESTION) && context->publisher) {
+		// Answer from the published record set, held until the answer is sent or scheduled
+		mdns_snapshot_t* snapshot = mdns_publisher_acquire(context->publisher);
+		const mdns_responder_t* responder = context->responder;
+		context->responder = snapshot->responder;
+		mdns_responder_answer(context, sock, from, addrlen, query_id, rtype, rclass, data, size,
+		                      name_offset);
+		context->responder = responder;
+		mdns_publisher_release(snapshot);
+	} else if (entry == MDNS_ENTRYTYPE_QUESTION) {
+		mdns_responder_answer(context, sock, from, addrlen, query_id, rtype, rclass, data, size,
+		                      name_offset);
+	} else if ((entry == MDNS_ENTRYTYPE_ANSWER) && context->scheduler) {
+		mdns_scheduler_suppress(context->scheduler, data, size, name_offset, rtype, ttl,
+		                        record_offset, record_length);
+	}
+	return 0;
+}
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+static inline long
+mdns_atomic_add(volatile long* value, long add) {
+	return InterlockedExchangeAdd(value, add) + add;
+}
+
+static inline void*
+mdns_atomic_load_ptr(void* volatile* ptr) {
+	return InterlockedCompareExchangePointer(ptr, 0, 0);
+}
+
+static inline void*
+mdns_atomic_exchange_ptr(void* volatile* ptr, void* value) {
+	return InterlockedExchangePointer(ptr, value);
+}
+
+static inline long
+mdns_atomic_load(volatile long* value) {
+	return InterlockedCompareExchange(value, 0, 0);
+}
+
+static inline void
+mdns_atomic_store(volatile long* value, long store) {
+	InterlockedExchange(value, store);
+}
+
+static inline int
+mdns_atomic_cas(volatile long* value, long expected, long desired) {
+	return InterlockedCompareExchange(value, desired, expected) == expected;
+}
+
+#else
+
+static inline long
+mdns_atomic_add(volatile long* value, long add) {
+	return __atomic_add_fetch(value, add, __ATOMIC_SEQ_CST);
+}
+
+static inline void*
+mdns_atomic_load_ptr(void* volatile* ptr) {
+	return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+static inline void*
+mdns_atomic_exchange_ptr(void* volatile* ptr, void* value) {
+	return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline long
+mdns_atomic_load(volatile long* value) {
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+mdns_atomic_store(volatile long* value, long store) {
+	__atomic_store_n(value, store, __ATOMIC_SEQ_CST);
+}
+
+static inline int
+mdns_atomic_cas(volatile long* value, long expected, long desired) {
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_SEQ_CST,
+	                                   __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+static inline void
+mdns_snapshot_init(mdns_snapshot_t* snapshot, const mdns_responder_t* responder) {
+	snapshot->responder = responder;
+	snapshot->readers = 0;
+}
+
+static inline int
+mdns_snapshot_in_use(const mdns_snapshot_t* snapshot) {
+	return mdns_atomic_add((volatile long*)&snapshot->readers, 0) > 0;
+}
+
+static inline void
+mdns_publisher_init(mdns_publisher_t* publisher, mdns_snapshot_t* snapshot) {
+	mdns_atomic_exchange_ptr((void* volatile*)&publisher->current, snapshot);
+}
+
+static inline mdns_snapshot_t*
+mdns_publisher_publish(mdns_publisher_t* publisher, mdns_snapshot_t* snapshot) {
+	return (mdns_snapshot_t*)mdns_atomic_exchange_ptr((void* volatile*)&publisher->current,
+	                                                  snapshot);
+}
+
+static inline mdns_snapshot_t*
+mdns_publisher_acquire(mdns_publisher_t* publisher) {
+	// Count the reader before checking that the snapshot is still published. A writer replacing
+	// the snapshot in between either sees the reader count, or the reader sees the new snapshot
+	// and retries, so a snapshot is never used after the writer found it unused
+	for (;;) {
+		mdns_snapshot_t* snapshot =
+		    (mdns_snapshot_t*)mdns_atomic_load_ptr((void* volatile*)&publisher->current);
+		mdns_atomic_add(&snapshot->readers, 1);
+		if (mdns_atomic_load_ptr((void* volatile*)&publisher->current) == snapshot)
+			return snapshot;
+		mdns_atomic_add(&snapshot->readers, -1);
+	}
+}
+
+static inline void
+mdns_publisher_release(mdns_snapshot_t* snapshot) {
+	mdns_atomic_add(&snapshot->readers, -1);
+}
+
+// Ring positions wrap around, so positions are compared by their difference
+static inline long
+mdns_ring_position(long position, long add) {
+	return (long)((unsigned long)position + (unsigned long)add);
+}
+
+static inline long
+mdns_ring_distance(long position, long base) {
+	return (long)((unsigned long)position - (unsigned long)base);
+}
+
+static inline int
+mdns_ring_init(mdns_ring_t* ring, int sock, mdns_datagram_t* slots, size_t capacity,
+               void* buffer, size_t slot_size) {
+	if (!capacity || (capacity & (capacity - 1)))
+		return -1;
+	memset(ring, 0, sizeof(mdns_ring_t));
+	ring->sock = sock;
+	ring->slots = slots;
+	ring->buffer = buffer;
+	ring->slot_size = slot_size;
+	ring->mask = (long)(capacity - 1);
+	// Each slot sequence holds the position the slot is next written at, or the position plus
+	// one once written and ready to be parsed
+	for (size_t islot = 0; islot < capacity; ++islot)
+		slots[islot].sequence = (long)islot;
+	return 0;
+}
+
+static inline int
+mdns_ring_receive(mdns_ring_t* ring) {
+	int sock = ring->sock;
+	struct sockaddr* saddr;
+	socklen_t addrlen;
+	mdns_ssize_t ret;
+	long head = ring->head;
+	mdns_datagram_t* slot = ring->slots + (head & ring->mask);
+	if (mdns_atomic_load(&slot->sequence) != head) {
+		// Full, discard the packet by reading it into a short buffer
+		struct sockaddr_in6 addr;
+		char discard[4];
+		saddr = (struct sockaddr*)&addr;
+		addrlen = sizeof(addr);
+		ret = recvfrom(sock, discard, (mdns_size_t)sizeof(discard), 0, saddr, &addrlen);
+#ifdef _WIN32
+		// A truncated packet is still removed from the socket, but reported as an error
+		if ((ret < 0) && (WSAGetLastError() != WSAEMSGSIZE))
+			return 0;
+#else
+		if (ret < 0)
+			return 0;
+#endif
+		mdns_atomic_add(&ring->dropped, 1);
+		return -1;
+	}
+
+	void* data = MDNS_POINTER_OFFSET(ring->buffer, ring->slot_size * (size_t)(head & ring->mask));
+	memset(&slot->from, 0, sizeof(slot->from));
+	saddr = (struct sockaddr*)&slot->from;
+	addrlen = sizeof(slot->from);
+#ifdef __APPLE__
+	saddr->sa_len = sizeof(slot->from);
+#endif
+	ret = recvfrom(sock, (char*)data, (mdns_size_t)ring->slot_size, 0, saddr, &addrlen);
+	if (ret <= 0)
+		return 0;
+
+	slot->size = (size_t)ret;
+	slot->addrlen = (size_t)addrlen;
+	// Publish the slot to the workers. The ring has a single receive thread, so the head is only
+	// written here
+	mdns_atomic_store(&slot->sequence, mdns_ring_position(head, 1));
+	mdns_atomic_store(&ring->head, mdns_ring_position(head, 1));
+	mdns_atomic_add(&ring->received, 1);
+	return (int)ret;
+}
+
+static inline size_t
+mdns_ring_process(mdns_ring_t* ring, size_t max_count, mdns_record_callback_fn callback,
+                  void* user_data) {
+	size_t count = 0;
+	long tail = mdns_atomic_load(&ring->tail);
+	while (count < max_count) {
+		mdns_datagram_t* slot = ring->slots + (tail & ring->mask);
+		long distance =
+		    mdns_ring_distance(mdns_atomic_load(&slot->sequence), mdns_ring_position(tail, 1));
+		if (distance < 0)
+			break;
+		if ((distance > 0) || !mdns_atomic_cas(&ring->tail, tail, mdns_ring_position(tail, 1))) {
+			// Another worker took the slot
+			tail = mdns_atomic_load(&ring->tail);
+			continue;
+		}
+
+		const void* data =
+		    MDNS_POINTER_OFFSET(ring->buffer, ring->slot_size * (size_t)(tail & ring->mask));
+		mdns_socket_parse(ring->sock, (const struct sockaddr*)&slot->from, slot->addrlen, data,
+		                  slot->size, callback, user_data);
+
+		// Hand the slot back to the receive thread for the next lap of the ring
+		mdns_atomic_store(&slot->sequence, mdns_ring_position(tail, ring->mask + 1));
+		mdns_atomic_add(&ring->processed, 1);
+		tail = mdns_ring_position(tail, 1);
+		++count;
+	}
+	return count;
+}
+
+static inline size_t
+mdns_ring_pending(mdns_ring_t* ring) {
+	long distance =
+	    mdns_ring_distance(mdns_atomic_load(&ring->head), mdns_atomic_load(&ring->tail));
+	return (distance > 0) ? (size_t)distance : 0;
+}
+
+static inline void
+mdns_cache_init(mdns_cache_t* cache, mdns_cache_entry_t* entries, size_t capacity, size_t* buckets,
+                size_t bucket_count, uint64_t now) {
+	memset(cache, 0, sizeof(mdns_cache_t));
+	cache->entries = entries;
+	cache->capacity = capacity;
+	cache->free = MDNS_INVALID_POS;
+	cache->buckets = buckets;
+	cache->bucket_count = bucket_count;
+	cache->now = now;
+	cache->tick = now / MDNS_CACHE_WHEEL_TICK;
+	cache->refresh_pending = MDNS_INVALID_POS;
+	cache->random_state = (uint32_t)now;
+	for (size_t ibucket = 0; ibucket < bucket_count; ++ibucket)
+		buckets[ibucket] = MDNS_INVALID_POS;
+	for (size_t islot = 0; islot < (MDNS_CACHE_WHEEL_LEVELS * MDNS_CACHE_WHEEL_SLOTS); ++islot)
+		cache->wheel[islot] = MDNS_INVALID_POS;
+}
+
+static inline void
+mdns_cache_set_callback(mdns_cache_t* cache, mdns_cache_callback_fn callback, void* user_data) {
+	cache->callback = callback;
+	cache->user_data = user_data;
+}
+
+static inline void
+mdns_cache_set_filter(mdns_cache_t* cache, mdns_cache_filter_fn filter, void* user_data) {
+	cache->filter = filter;
+	cache->filter_user_data = user_data;
+}
+
+static inline void
+mdns_cache_set_budget(mdns_cache_t* cache, size_t max_records, size_t max_bytes) {
+	cache->max_records = max_records;
+	cache->max_bytes = max_bytes;
+}
+
+static inline int
+mdns_cache_filter_domain(const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                         void* user_data) {
+	(void)sizeof(rtype);
+	const char* domain = (const char*)user_data;
+	size_t length = strlen(domain);
+	// Compare the domain with each suffix of the name, dropping one label at a time
+	size_t offset = name_offset;
+	unsigned int counter = 0;
+	while (counter++ < MDNS_MAX_SUBSTRINGS) {
+		if (mdns_string_equal_name(buffer, size, offset, domain, length))
+			return 1;
+		mdns_string_pair_t substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || !substr.length)
+			break;
+		offset = substr.offset + substr.length;
+	}
+	return 0;
+}
+
+// Link an entry in the wheel slot for the tick of its expiry or next refresh, whichever is first,
+// relative to the next tick to process. The level is given by the number of ticks until due, and
+// the slot within the level by the due tick. Entries due beyond the range of the wheel are linked
+// again when their slot is due
+static inline void
+mdns_cache_timer_link(mdns_cache_t* cache, size_t index) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	uint64_t range = (uint64_t)1 << (MDNS_CACHE_WHEEL_BITS * MDNS_CACHE_WHEEL_LEVELS);
+	uint64_t due = (entry->refresh < entry->expire) ? entry->refresh : entry->expire;
+	uint64_t due_tick = (due + (MDNS_CACHE_WHEEL_TICK - 1)) / MDNS_CACHE_WHEEL_TICK;
+	if (due_tick < cache->tick)
+		due_tick = cache->tick;
+	else if ((due_tick - cache->tick) >= range)
+		due_tick = cache->tick + range - 1;
+	uint64_t delta = due_tick - cache->tick;
+	unsigned int level = 0;
+	while (((level + 1) < MDNS_CACHE_WHEEL_LEVELS) &&
+	       (delta >> (MDNS_CACHE_WHEEL_BITS * (level + 1))))
+		++level;
+	size_t slot = (level * MDNS_CACHE_WHEEL_SLOTS) +
+	              (size_t)((due_tick >> (MDNS_CACHE_WHEEL_BITS * level)) &
+	                       (MDNS_CACHE_WHEEL_SLOTS - 1));
+	entry->timer_slot = (uint32_t)slot;
+	entry->timer_prev = MDNS_INVALID_POS;
+	entry->timer_next = cache->wheel[slot];
+	if (entry->timer_next != MDNS_INVALID_POS)
+		cache->entries[entry->timer_next].timer_prev = index;
+	cache->wheel[slot] = index;
+}
+
+static inline void
+mdns_cache_timer_unlink(mdns_cache_t* cache, size_t index) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	if (entry->timer_prev != MDNS_INVALID_POS)
+		cache->entries[entry->timer_prev].timer_next = entry->timer_next;
+	else
+		cache->wheel[entry->timer_slot] = entry->timer_next;
+	if (entry->timer_next != MDNS_INVALID_POS)
+		cache->entries[entry->timer_next].timer_prev = entry->timer_prev;
+}
+
+// Set the time of the next refresh query of an entry of interest, skipping refreshes in the past.
+// The caller links the entry in the wheel again
+static inline void
+mdns_cache_refresh_schedule(mdns_cache_t* cache, mdns_cache_entry_t* entry, uint64_t now) {
+	entry->refresh = MDNS_TIME_NEVER;
+	if (!entry->interest)
+		return;
+	uint64_t lifetime = (uint64_t)entry->ttl * 1000;
+	while (entry->refreshes < MDNS_CACHE_REFRESH_COUNT) {
+		uint64_t percent =
+		    MDNS_CACHE_REFRESH_START + ((uint64_t)entry->refreshes * MDNS_CACHE_REFRESH_STEP);
+		uint64_t jitter = mdns_random(&cache->random_state) %
+		                  (((lifetime * MDNS_CACHE_REFRESH_JITTER) / 100) + 1);
+		// Relative to the expiry, since the time received is clamped for records restored from a
+		// cache image received before the start of the clock
+		uint64_t left = (lifetime * (100 - percent)) / 100;
+		uint64_t refresh = ((entry->expire > left) ? (entry->expire - left) : 0) + jitter;
+		if (refresh > now) {
+			entry->refresh = refresh;
+			return;
+		}
+		++entry->refreshes;
+	}
+}
+
+// Remove an entry from the list of entries waiting for a refresh query
+static inline void
+mdns_cache_refresh_cancel(mdns_cache_t* cache, size_t index) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	if (!entry->refresh_pending)
+		return;
+	size_t* link = &cache->refresh_pending;
+	while (*link != index)
+		link = &cache->entries[*link].refresh_next;
+	*link = entry->refresh_next;
+	entry->refresh_pending = 0;
+}
+
+// Set the expiry of an entry, restarting the refresh schedule of an entry that was received
+// again, or stopping refreshes of an entry that is about to be removed
+static inline void
+mdns_cache_set_expire(mdns_cache_t* cache, size_t index, uint64_t now, uint64_t expire,
+                      int renewed) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	mdns_cache_timer_unlink(cache, index);
+	mdns_cache_refresh_cancel(cache, index);
+	entry->expire = expire;
+	entry->refreshes = renewed ? 0 : MDNS_CACHE_REFRESH_COUNT;
+	mdns_cache_refresh_schedule(cache, entry, now);
+	mdns_cache_timer_link(cache, index);
+}
+
+// Queue an entry for a refresh query and schedule the next one
+static inline void
+mdns_cache_refresh_mark(mdns_cache_t* cache, size_t index, uint64_t now) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	if (!entry->refresh_pending) {
+		entry->refresh_pending = 1;
+		entry->refresh_next = cache->refresh_pending;
+		cache->refresh_pending = index;
+	}
+	++entry->refreshes;
+	mdns_cache_refresh_schedule(cache, entry, now);
+}
+
+// Queue an entry that is due for a refresh query, together with the other entries of interest with
+// the same name and type due within the jitter window, so the set is refreshed by one question.
+// Entries in the wheel slot being processed are handled by the caller
+static inline void
+mdns_cache_refresh_due(mdns_cache_t* cache, size_t index, uint64_t now, size_t slot) {
+	mdns_cache_refresh_mark(cache, index, now);
+	const mdns_cache_entry_t* entry = cache->entries + index;
+	uint64_t window = now + (((uint64_t)entry->ttl * 1000 * MDNS_CACHE_REFRESH_JITTER) / 100);
+	for (size_t iother = cache->buckets[entry->hash % cache->bucket_count];
+	     iother != MDNS_INVALID_POS; iother = cache->entries[iother].next) {
+		const mdns_cache_entry_t* other = cache->entries + iother;
+		size_t lhs_offset = 0;
+		size_t rhs_offset = 0;
+		if ((iother == index) || !other->interest || other->refresh_pending ||
+		    (other->refresh > window) || (other->timer_slot == slot) ||
+		    (other->hash != entry->hash) || (other->rtype != entry->rtype) ||
+		    !mdns_string_equal(other->storage, other->name_size, &lhs_offset, entry->storage,
+		                       entry->name_size, &rhs_offset))
+			continue;
+		mdns_cache_timer_unlink(cache, iother);
+		mdns_cache_refresh_mark(cache, iother, now);
+		mdns_cache_timer_link(cache, iother);
+	}
+}
+
+static inline void
+mdns_cache_set_interest(mdns_cache_t* cache, size_t entry, int interest) {
+	mdns_cache_entry_t* record = cache->entries + entry;
+	record->interest = interest ? 1 : 0;
+	if (!interest)
+		mdns_cache_refresh_cancel(cache, entry);
+	mdns_cache_timer_unlink(cache, entry);
+	mdns_cache_refresh_schedule(cache, record, cache->now);
+	mdns_cache_timer_link(cache, entry);
+}
+
+static inline int
+mdns_cache_refresh_send(mdns_cache_t* cache, const int* sockets, size_t socket_count,
+                        void* buffer, size_t capacity) {
+	if (cache->refresh_pending == MDNS_INVALID_POS)
+		return 0;
+
+	int sent = 0;
+	for (size_t isock = 0; isock < socket_count; ++isock) {
+		mdns_packet_t packet;
+		mdns_packet_init(&packet, sockets[isock], 0, 0, buffer, capacity, 0, 0);
+		for (size_t ientry = cache->refresh_pending; ientry != MDNS_INVALID_POS;
+		     ientry = cache->entries[ientry].refresh_next) {
+			const mdns_cache_entry_t* entry = cache->entries + ientry;
+			// Ask once per name and type, by the first entry of the set waiting for a refresh
+			int duplicate = 0;
+			for (size_t iother = cache->buckets[entry->hash % cache->bucket_count];
+			     iother != ientry; iother = cache->entries[iother].next) {
+				const mdns_cache_entry_t* other = cache->entries + iother;
+				size_t lhs_offset = 0;
+				size_t rhs_offset = 0;
+				if (other->refresh_pending && (other->hash == entry->hash) &&
+				    (other->rtype == entry->rtype) &&
+				    mdns_string_equal(other->storage, other->name_size, &lhs_offset,
+				                      entry->storage, entry->name_size, &rhs_offset)) {
+					duplicate = 1;
+					break;
+				}
+			}
+			if (duplicate)
+				continue;
+			char name_buffer[256];
+			mdns_string_t name =
+			    mdns_cache_entry_name(cache, ientry, name_buffer, sizeof(name_buffer));
+			if (mdns_packet_add_question(&packet, (mdns_record_type_t)entry->rtype, name.str,
+			                             name.length, MDNS_CLASS_IN))
+				return -1;
+			if (!isock)
+				++cache->refreshed;
+		}
+		if (mdns_packet_flush(&packet, 0))
+			return -1;
+		sent += (int)packet.sent;
+	}
+
+	while (cache->refresh_pending != MDNS_INVALID_POS) {
+		mdns_cache_entry_t* entry = cache->entries + cache->refresh_pending;
+		cache->refresh_pending = entry->refresh_next;
+		entry->refresh_pending = 0;
+	}
+	return sent;
+}
+
+// Unlink an entry already unlinked from the wheel from its bucket chain and free it
+static inline void
+mdns_cache_free(mdns_cache_t* cache, size_t index) {
+	mdns_cache_entry_t* entry = cache->entries + index;
+	if (cache->callback)
+		cache->callback(cache, index, MDNS_CACHEEVENT_REMOVED, cache->user_data);
+	mdns_cache_refresh_cancel(cache, index);
+	size_t* link = cache->buckets + (entry->hash % cache->bucket_count);
+	while (*link != index)
+		link = &cache->entries[*link].next;
+	*link = entry->next;
+	cache->bytes -= (size_t)entry->name_size + entry->data_size;
+	entry->name_size = 0;
+	entry->data_size = 0;
+	entry->next = cache->free;
+	cache->free = index;
+	--cache->count;
+}
+
+static inline void
+mdns_cache_remove(mdns_cache_t* cache, size_t entry) {
+	mdns_cache_timer_unlink(cache, entry);
+	mdns_cache_free(cache, entry);
+}
+
+// Remove the record expiring first to make room for a new record. Beyond the first level of the
+// wheel the slots are coarse, so the evicted record is one of the records expiring first
+static inline int
+mdns_cache_evict(mdns_cache_t* cache) {
+	for (unsigned int level = 0; level < MDNS_CACHE_WHEEL_LEVELS; ++level) {
+		size_t base = (size_t)(cache->tick >> (MDNS_CACHE_WHEEL_BITS * level));
+		for (size_t islot = 0; islot < MDNS_CACHE_WHEEL_SLOTS; ++islot) {
+			size_t slot = (level * MDNS_CACHE_WHEEL_SLOTS) +
+			              ((base + islot) & (MDNS_CACHE_WHEEL_SLOTS - 1));
+			if (cache->wheel[slot] != MDNS_INVALID_POS) {
+				mdns_cache_remove(cache, cache->wheel[slot]);
+				++cache->evicted;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+static inline size_t
+mdns_cache_add(mdns_cache_t* cache, uint64_t now, const void* buffer, size_t size,
+               size_t name_offset, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+               size_t record_offset, size_t record_length) {
+	if (!cache->capacity || !cache->bucket_count)
+		return MDNS_INVALID_POS;
+	if (cache->filter &&
+	    !cache->filter(buffer, size, name_offset, rtype, cache->filter_user_data)) {
+		++cache->filtered;
+		return MDNS_INVALID_POS;
+	}
+
+	// Records are stored and compared in canonical form, the uncompressed name followed by the
+	// uncompressed data
+	uint8_t storage[MDNS_CACHE_RECORD_SIZE];
+	size_t name_size = mdns_string_expand(buffer, size, name_offset, storage, sizeof(storage));
+	size_t data_size = 0;
+	if (name_size)
+		data_size = mdns_record_data_expand(buffer, size, record_offset, record_length, rtype,
+		                                    storage + name_size, sizeof(storage) - name_size);
+	if (!data_size) {
+		++cache->dropped;
+		return MDNS_INVALID_POS;
+	}
+
+	int flush = (rclass & MDNS_CACHE_FLUSH) ? 1 : 0;
+	rclass &= (uint16_t)~MDNS_CACHE_FLUSH;
+	uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, storage, name_size, 0);
+
+	// Find the record if already cached. A record with the cache flush bit flushes the other
+	// records of the set received more than a second ago (RFC 6762 section 10.2)
+	size_t found = MDNS_INVALID_POS;
+	for (size_t ientry = cache->buckets[hash % cache->bucket_count]; ientry != MDNS_INVALID_POS;
+	     ientry = cache->entries[ientry].next) {
+		mdns_cache_entry_t* entry = cache->entries + ientry;
+		size_t lhs_offset = 0;
+		size_t rhs_offset = 0;
+		if ((entry->hash != hash) || (entry->rtype != rtype) || (entry->rclass != rclass) ||
+		    !mdns_string_equal(entry->storage, entry->name_size, &lhs_offset, storage, name_size,
+		                       &rhs_offset))
+			continue;
+		if ((entry->data_size == data_size) &&
+		    !memcmp(entry->storage + entry->name_size, storage + name_size, data_size)) {
+			found = ientry;
+		} else if (flush && ((entry->received + MDNS_CACHE_FLUSH_DELAY) < now) &&
+		           (entry->expire > (now + MDNS_CACHE_FLUSH_DELAY))) {
+			entry->ttl = 1;
+			mdns_cache_set_expire(cache, ientry, now, now + MDNS_CACHE_FLUSH_DELAY, 0);
+			if (cache->callback)
+				cache->callback(cache, ientry, MDNS_CACHEEVENT_UPDATED, cache->user_data);
+		}
+	}
+
+	if (found != MDNS_INVALID_POS) {
+		mdns_cache_entry_t* entry = cache->entries + found;
+		if (ttl) {
+			entry->ttl = ttl;
+			entry->received = now;
+			mdns_cache_set_expire(cache, found, now, now + ((uint64_t)ttl * 1000), 1);
+		} else if (entry->expire > (now + MDNS_CACHE_FLUSH_DELAY)) {
+			// Goodbye, remove the record in one second (RFC 6762 section 10.1)
+			entry->ttl = 1;
+			mdns_cache_set_expire(cache, found, now, now + MDNS_CACHE_FLUSH_DELAY, 0);
+		}
+		if (cache->callback)
+			cache->callback(cache, found, MDNS_CACHEEVENT_UPDATED, cache->user_data);
+		return found;
+	}
+
+	// Nothing to remove for a goodbye of a record not cached
+	if (!ttl)
+		return MDNS_INVALID_POS;
+
+	if ((cache->free == MDNS_INVALID_POS) && (cache->used >= cache->capacity) &&
+	    mdns_cache_evict(cache))
+		return MDNS_INVALID_POS;
+	while ((cache->max_records && (cache->count >= cache->max_records)) ||
+	       (cache->max_bytes && ((cache->bytes + name_size + data_size) > cache->max_bytes))) {
+		if (mdns_cache_evict(cache))
+			return MDNS_INVALID_POS;
+	}
+
+	size_t index;
+	if (cache->free != MDNS_INVALID_POS) {
+		index = cache->free;
+		cache->free = cache->entries[index].next;
+	} else {
+		index = cache->used++;
+	}
+
+	mdns_cache_entry_t* entry = cache->entries + index;
+	entry->hash = hash;
+	entry->received = now;
+	entry->expire = now + ((uint64_t)ttl * 1000);
+	entry->refresh = MDNS_TIME_NEVER;
+	entry->ttl = ttl;
+	entry->interest = 0;
+	entry->refreshes = 0;
+	entry->refresh_pending = 0;
+	entry->rtype = rtype;
+	entry->rclass = rclass;
+	entry->name_size = (uint16_t)name_size;
+	entry->data_size = (uint16_t)data_size;
+	memcpy(entry->storage, storage, name_size + data_size);
+	cache->bytes += name_size + data_size;
+
+	size_t* bucket = cache->buckets + (hash % cache->bucket_count);
+	entry->next = *bucket;
+	*bucket = index;
+	mdns_cache_timer_link(cache, index);
+	++cache->count;
+
+	if (cache->callback)
+		cache->callback(cache, index, MDNS_CACHEEVENT_ADDED, cache->user_data);
+	return index;
+}
+
+static inline int
+mdns_cache_record_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                           mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                           uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                           size_t name_offset, size_t name_length, size_t record_offset,
+                           size_t record_length, void* user_data) {
+	(void)sizeof(sock);
+	(void)sizeof(addrlen);
+	(void)sizeof(query_id);
+	(void)sizeof(name_length);
+	mdns_cache_t* cache = (mdns_cache_t*)user_data;
+	// Known answers and proposed records in queries are not authoritative
+	if ((entry == MDNS_ENTRYTYPE_QUESTION) || (size < sizeof(struct mdns_header_t)) ||
+	    !(mdns_ntohs(MDNS_POINTER_OFFSET_CONST(data, 2)) & 0x8000))
+		return 0;
+	uint16_t port = 0;
+	if (from && (from->sa_family == AF_INET))
+		port = ntohs(((const struct sockaddr_in*)from)->sin_port);
+	else if (from && (from->sa_family == AF_INET6))
+		port = ntohs(((const struct sockaddr_in6*)from)->sin6_port);
+	if (port != MDNS_PORT)
+		return 0;
+	mdns_cache_add(cache, cache->now, data, size, name_offset, rtype, rclass, ttl, record_offset,
+	               record_length);
+	return 0;
+}
+
+static inline size_t
+mdns_cache_expire(mdns_cache_t* cache, uint64_t now) {
+	size_t expired = 0;
+	uint64_t now_tick = now / MDNS_CACHE_WHEEL_TICK;
+	cache->now = now;
+	// An empty wheel can skip ahead instead of turning
+	if (!cache->count && (cache->tick <= now_tick))
+		cache->tick = now_tick + 1;
+	while (cache->tick <= now_tick) {
+		uint64_t tick = cache->tick;
+
+		// When a level has turned a full lap, the due slot of the level above is moved down
+		for (unsigned int level = MDNS_CACHE_WHEEL_LEVELS - 1; level > 0; --level) {
+			if (tick & (((uint64_t)1 << (MDNS_CACHE_WHEEL_BITS * level)) - 1))
+				continue;
+			size_t slot = (level * MDNS_CACHE_WHEEL_SLOTS) +
+			              (size_t)((tick >> (MDNS_CACHE_WHEEL_BITS * level)) &
+			                       (MDNS_CACHE_WHEEL_SLOTS - 1));
+			size_t index = cache->wheel[slot];
+			cache->wheel[slot] = MDNS_INVALID_POS;
+			while (index != MDNS_INVALID_POS) {
+				size_t next = cache->entries[index].timer_next;
+				mdns_cache_timer_link(cache, index);
+				index = next;
+			}
+		}
+
+		// Records in the slot of the first level expire or are due for a refresh at this tick,
+		// except records beyond the range of the wheel which are linked again
+		size_t slot = (size_t)(tick & (MDNS_CACHE_WHEEL_SLOTS - 1));
+		size_t index = cache->wheel[slot];
+		cache->wheel[slot] = MDNS_INVALID_POS;
+		cache->tick = tick + 1;
+		while (index != MDNS_INVALID_POS) {
+			mdns_cache_entry_t* entry = cache->entries + index;
+			size_t next = entry->timer_next;
+			if (entry->expire <= now) {
+				mdns_cache_free(cache, index);
+				++expired;
+				index = next;
+				continue;
+			}
+			if (entry->refresh <= now)
+				mdns_cache_refresh_due(cache, index, now, slot);
+			mdns_cache_timer_link(cache, index);
+			index = next;
+		}
+	}
+	return expired;
+}
+
+static inline size_t
+mdns_cache_find(const mdns_cache_t* cache, const char* name, size_t length, uint16_t rtype,
+                size_t previous) {
+	if (!cache->bucket_count)
+		return MDNS_INVALID_POS;
+	uint64_t hash = mdns_string_hash(MDNS_HASH_SEED, name, length);
+	size_t index = (previous != MDNS_INVALID_POS) ? cache->entries[previous].next :
+	                                                cache->buckets[hash % cache->bucket_count];
+	for (; index != MDNS_INVALID_POS; index = cache->entries[index].next) {
+		const mdns_cache_entry_t* entry = cache->entries + index;
+		if ((entry->hash == hash) &&
+		    ((rtype == MDNS_RECORDTYPE_ANY) || (entry->rtype == rtype)) &&
+		    (entry->expire > cache->now) &&
+		    mdns_string_equal_name(entry->storage, entry->name_size, 0, name, length))
+			return index;
+	}
+	return MDNS_INVALID_POS;
+}
+
+static inline mdns_string_t
+mdns_cache_entry_name(const mdns_cache_t* cache, size_t entry, char* buffer, size_t capacity) {
+	size_t offset = 0;
+	return mdns_string_extract(cache->entries[entry].storage, cache->entries[entry].name_size,
+	                           &offset, buffer, capacity);
+}
+
+static inline uint32_t
+mdns_cache_entry_ttl(const mdns_cache_t* cache, size_t entry) {
+	uint64_t expire = cache->entries[entry].expire;
+	if (expire <= cache->now)
+		return 0;
+	return (uint32_t)((expire - cache->now + 999) / 1000);
+}
+
+// Check if the PTR record of an instance of a browsed service type is in the cache, given the
+// uncompressed name of the instance
+static inline int
+mdns_browser_has_instance(const mdns_cache_t* cache, const mdns_browse_t* browse,
+                          const void* instance, size_t instance_size) {
+	for (size_t ientry = mdns_cache_find(cache, browse->name, browse->length,
+	                                     MDNS_RECORDTYPE_PTR, MDNS_INVALID_POS);
+	     ientry != MDNS_INVALID_POS; ientry = mdns_cache_find(cache, browse->name, browse->length,
+	                                                          MDNS_RECORDTYPE_PTR, ientry)) {
+		const mdns_cache_entry_t* entry = cache->entries + ientry;
+		size_t lhs_offset = entry->name_size;
+		size_t rhs_offset = 0;
+		if (mdns_string_equal(entry->storage, (size_t)entry->name_size + entry->data_size,
+		                      &lhs_offset, instance, instance_size, &rhs_offset))
+			return 1;
+	}
+	return 0;
+}
+
+// Cache callback translating changes of cached records into events for the browsed types
+static inline void
+mdns_browser_cache_callback(mdns_cache_t* cache, size_t entry, mdns_cache_event_t event,
+                            void* user_data) {
+	mdns_browser_t* browser = (mdns_browser_t*)user_data;
+	const mdns_cache_entry_t* record = cache->entries + entry;
+	size_t size = (size_t)record->name_size + record->data_size;
+	char instance_buffer[256];
+	if ((record->rtype == MDNS_RECORDTYPE_PTR) && (event != MDNS_CACHEEVENT_UPDATED)) {
+		// A PTR record for the type names an instance
+		for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+			const mdns_browse_t* browse = browser->browses + ibrowse;
+			if ((browse->hash != record->hash) ||
+			    !mdns_string_equal_name(record->storage, size, 0, browse->name, browse->length))
+				continue;
+			mdns_string_t instance =
+			    mdns_record_parse_ptr(record->storage, size, record->name_size, record->data_size,
+			                          instance_buffer, sizeof(instance_buffer));
+			browse->callback(browser, browse,
+			                 (event == MDNS_CACHEEVENT_ADDED) ? MDNS_BROWSEEVENT_ADDED :
+			                                                    MDNS_BROWSEEVENT_REMOVED,
+			                 instance, entry, browse->user_data);
+		}
+	} else if (((record->rtype == MDNS_RECORDTYPE_SRV) || (record->rtype == MDNS_RECORDTYPE_TXT)) &&
+	           (event == MDNS_CACHEEVENT_ADDED) && (record->name_size > 1)) {
+		// A new or changed SRV or TXT record of an instance, the type follows the first label
+		size_t type_offset = 1 + (size_t)record->storage[0];
+		uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, record->storage, size, type_offset);
+		for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+			const mdns_browse_t* browse = browser->browses + ibrowse;
+			if ((browse->hash != hash) ||
+			    !mdns_string_equal_name(record->storage, size, type_offset, browse->name,
+			                            browse->length) ||
+			    !mdns_browser_has_instance(cache, browse, record->storage, record->name_size))
+				continue;
+			size_t offset = 0;
+			mdns_string_t instance = mdns_string_extract(record->storage, size, &offset,
+			                                             instance_buffer, sizeof(instance_buffer));
+			browse->callback(browser, browse, MDNS_BROWSEEVENT_UPDATED, instance, entry,
+			                 browse->user_data);
+		}
+	}
+	if (browser->cache_callback)
+		browser->cache_callback(cache, entry, event, browser->cache_user_data);
+}
+
+static inline void
+mdns_browser_init(mdns_browser_t* browser, mdns_browse_t* browses, size_t capacity,
+                  mdns_cache_t* cache, uint32_t seed) {
+	memset(browser, 0, sizeof(mdns_browser_t));
+	browser->browses = browses;
+	browser->capacity = capacity;
+	browser->cache = cache;
+	browser->cache_callback = cache->callback;
+	browser->cache_user_data = cache->user_data;
+	browser->random_state = seed;
+	mdns_cache_set_callback(cache, mdns_browser_cache_callback, browser);
+}
+
+static inline int
+mdns_browser_add(mdns_browser_t* browser, uint64_t now, const char* name, size_t length,
+                 mdns_browse_callback_fn callback, void* user_data) {
+	if (browser->count >= browser->capacity)
+		return -1;
+	size_t index = browser->count++;
+	mdns_browse_t* browse = browser->browses + index;
+	browse->name = name;
+	browse->length = length;
+	browse->hash = mdns_string_hash(MDNS_HASH_SEED, name, length);
+	browse->deadline = now + MDNS_BROWSE_DELAY_MIN +
+	                   (mdns_random(&browser->random_state) %
+	                    (MDNS_BROWSE_DELAY_MAX - MDNS_BROWSE_DELAY_MIN + 1));
+	browse->interval = MDNS_BROWSE_INTERVAL;
+	browse->callback = callback;
+	browse->user_data = user_data;
+
+	const mdns_cache_t* cache = browser->cache;
+	char instance_buffer[256];
+	for (size_t ientry = mdns_cache_find(cache, name, length, MDNS_RECORDTYPE_PTR,
+	                                     MDNS_INVALID_POS);
+	     ientry != MDNS_INVALID_POS;
+	     ientry = mdns_cache_find(cache, name, length, MDNS_RECORDTYPE_PTR, ientry)) {
+		const mdns_cache_entry_t* entry = cache->entries + ientry;
+		mdns_string_t instance = mdns_record_parse_ptr(
+		    entry->storage, (size_t)entry->name_size + entry->data_size, entry->name_size,
+		    entry->data_size, instance_buffer, sizeof(instance_buffer));
+		callback(browser, browse, MDNS_BROWSEEVENT_ADDED, instance, ientry, user_data);
+	}
+	return (int)index;
+}
+
+static inline int
+mdns_browser_remove(mdns_browser_t* browser, const char* name, size_t length) {
+	for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+		mdns_browse_t* browse = browser->browses + ibrowse;
+		if ((browse->length == length) && !strncasecmp(browse->name, name, length)) {
+			*browse = browser->browses[--browser->count];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline uint64_t
+mdns_browser_next_deadline(const mdns_browser_t* browser) {
+	uint64_t next = MDNS_TIME_NEVER;
+	for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+		if (browser->browses[ibrowse].deadline < next)
+			next = browser->browses[ibrowse].deadline;
+	}
+	return next;
+}
+
+static inline int
+mdns_browser_send(mdns_browser_t* browser, const int* sockets, size_t socket_count, void* buffer,
+                  size_t capacity, uint64_t now) {
+	uint64_t due = now + MDNS_AGGREGATION_WINDOW;
+	if (mdns_browser_next_deadline(browser) > due)
+		return 0;
+
+	const mdns_cache_t* cache = browser->cache;
+	int sent = 0;
+	for (size_t isock = 0; isock < socket_count; ++isock) {
+		mdns_packet_t packet;
+		mdns_packet_init(&packet, sockets[isock], 0, 0, buffer, capacity, 0, 0);
+		for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+			const mdns_browse_t* browse = browser->browses + ibrowse;
+			if ((browse->deadline <= due) &&
+			    mdns_packet_add_question(&packet, MDNS_RECORDTYPE_PTR, browse->name,
+			                             browse->length, MDNS_CLASS_IN))
+				return -1;
+		}
+
+		// Known answers continue in the next packet if they do not fit, with the truncated (TC)
+		// bit set on the packets before it (RFC 6762 section 7.2)
+		packet.flags = 0x0200;
+		for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+			const mdns_browse_t* browse = browser->browses + ibrowse;
+			if (browse->deadline > due)
+				continue;
+			for (size_t ientry = mdns_cache_find(cache, browse->name, browse->length,
+			                                     MDNS_RECORDTYPE_PTR, MDNS_INVALID_POS);
+			     ientry != MDNS_INVALID_POS;
+			     ientry = mdns_cache_find(cache, browse->name, browse->length,
+			                              MDNS_RECORDTYPE_PTR, ientry)) {
+				const mdns_cache_entry_t* entry = cache->entries + ientry;
+				if ((entry->expire <= now) ||
+				    ((entry->expire - now) <= ((uint64_t)entry->ttl * 500)))
+					continue;
+				char instance_buffer[256];
+				mdns_record_t record;
+				memset(&record, 0, sizeof(mdns_record_t));
+				record.name.str = browse->name;
+				record.name.length = browse->length;
+				record.type = MDNS_RECORDTYPE_PTR;
+				record.data.ptr.name = mdns_record_parse_ptr(
+				    entry->storage, (size_t)entry->name_size + entry->data_size, entry->name_size,
+				    entry->data_size, instance_buffer, sizeof(instance_buffer));
+				record.rclass = MDNS_CLASS_IN;
+				record.ttl = (uint32_t)((entry->expire - now) / 1000);
+				if (mdns_packet_add_record(&packet, MDNS_ENTRYTYPE_ANSWER, record))
+					return -1;
+			}
+		}
+		packet.flags = 0;
+		if (mdns_packet_flush(&packet, 0))
+			return -1;
+		sent += (int)packet.sent;
+	}
+
+	for (size_t ibrowse = 0; ibrowse < browser->count; ++ibrowse) {
+		mdns_browse_t* browse = browser->browses + ibrowse;
+		if (browse->deadline > due)
+			continue;
+		uint32_t jitter =
+		    mdns_random(&browser->random_state) % ((browse->interval / MDNS_BROWSE_JITTER) + 1);
+		browse->deadline = now + browse->interval + jitter;
+		browse->interval = (browse->interval < (MDNS_BROWSE_INTERVAL_MAX / 2)) ?
+		                       (browse->interval * 2) :
+		                       MDNS_BROWSE_INTERVAL_MAX;
+	}
+	return sent;
+}
+
+static inline int
+mdns_cache_entry_address(const mdns_cache_t* cache, size_t entry, struct sockaddr_storage* addr) {
+	const mdns_cache_entry_t* record = cache->entries + entry;
+	size_t size = (size_t)record->name_size + record->data_size;
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if (record->rtype == MDNS_RECORDTYPE_A) {
+		mdns_record_parse_a(record->storage, size, record->name_size, record->data_size,
+		                    (struct sockaddr_in*)addr);
+		return 0;
+	}
+	if (record->rtype == MDNS_RECORDTYPE_AAAA) {
+		mdns_record_parse_aaaa(record->storage, size, record->name_size, record->data_size,
+		                       (struct sockaddr_in6*)addr);
+		return 0;
+	}
+	return -1;
+}
+
+static inline size_t
+mdns_cache_image_size(size_t capacity) {
+	return sizeof(mdns_cache_image_t) + (capacity * sizeof(mdns_cache_entry_t));
+}
+
+// Convert a time stored in a cache image to the cache time of this process
+static inline uint64_t
+mdns_cache_image_time(uint64_t time, int64_t stored_offset, int64_t offset) {
+	if (time == MDNS_TIME_NEVER)
+		return time;
+	int64_t shift = stored_offset - offset;
+	if ((shift < 0) && (time < (uint64_t)-shift))
+		return 0;
+	return time + (uint64_t)shift;
+}
+
+static inline int
+mdns_cache_attach(mdns_cache_t* cache, void* image, size_t size, size_t* buckets,
+                  size_t bucket_count, uint64_t now, uint64_t wall) {
+	if (size < mdns_cache_image_size(1))
+		return -1;
+	mdns_cache_image_t* header = (mdns_cache_image_t*)image;
+	mdns_cache_entry_t* entries =
+	    (mdns_cache_entry_t*)(void*)((uint8_t*)image + sizeof(mdns_cache_image_t));
+	size_t capacity = (size - sizeof(mdns_cache_image_t)) / sizeof(mdns_cache_entry_t);
+	mdns_cache_init(cache, entries, capacity, buckets, bucket_count, now);
+
+	int64_t offset = (int64_t)wall - (int64_t)now;
+	if ((header->magic != MDNS_CACHE_IMAGE_MAGIC) ||
+	    (header->version != MDNS_CACHE_IMAGE_VERSION) ||
+	    (header->header_size != sizeof(mdns_cache_image_t)) ||
+	    (header->entry_size != sizeof(mdns_cache_entry_t)) || (header->capacity != capacity)) {
+		memset(image, 0, mdns_cache_image_size(capacity));
+		header->magic = MDNS_CACHE_IMAGE_MAGIC;
+		header->version = MDNS_CACHE_IMAGE_VERSION;
+		header->header_size = sizeof(mdns_cache_image_t);
+		header->entry_size = sizeof(mdns_cache_entry_t);
+		header->capacity = capacity;
+		header->clock_offset = offset;
+		return 0;
+	}
+
+	// The entries are written in place while the cache runs, so the hash chains, timers and free
+	// list are linked again from the entries rather than trusting the links of a process that may
+	// not have exited cleanly
+	int64_t stored_offset = header->clock_offset;
+	header->clock_offset = offset;
+	size_t restored = 0;
+	for (size_t ientry = 0; ientry < capacity; ++ientry) {
+		mdns_cache_entry_t* entry = entries + ientry;
+		if (!entry->name_size)
+			continue;
+		entry->received = mdns_cache_image_time(entry->received, stored_offset, offset);
+		entry->expire = mdns_cache_image_time(entry->expire, stored_offset, offset);
+		entry->refresh = mdns_cache_image_time(entry->refresh, stored_offset, offset);
+		if ((entry->expire <= now) ||
+		    (((size_t)entry->name_size + entry->data_size) > MDNS_CACHE_RECORD_SIZE)) {
+			entry->name_size = 0;
+			continue;
+		}
+		entry->refresh_pending = 0;
+		size_t* bucket = buckets + (entry->hash % bucket_count);
+		entry->next = *bucket;
+		*bucket = ientry;
+		mdns_cache_timer_link(cache, ientry);
+		cache->bytes += (size_t)entry->name_size + entry->data_size;
+		cache->used = ientry + 1;
+		++restored;
+	}
+	for (size_t ientry = cache->used; ientry > 0; --ientry) {
+		if (!entries[ientry - 1].name_size) {
+			entries[ientry - 1].next = cache->free;
+			cache->free = ientry - 1;
+		}
+	}
+	cache->count = restored;
+	mdns_cache_expire(cache, now);
+	return (int)restored;
+}
+
+static inline int
+mdns_resolve_type_match(uint16_t request_type, uint16_t rtype) {
+	if (request_type == MDNS_RECORDTYPE_ANY)
+		return (rtype == MDNS_RECORDTYPE_A) || (rtype == MDNS_RECORDTYPE_AAAA);
+	return request_type == rtype;
+}
+
+// Find a fresh cached address record for the name
+static inline size_t
+mdns_resolver_find(const mdns_resolver_t* resolver, const char* name, size_t length,
+                   uint16_t rtype) {
+	const mdns_cache_t* cache = resolver->cache;
+	for (size_t ientry = mdns_cache_find(cache, name, length, MDNS_RECORDTYPE_ANY,
+	                                     MDNS_INVALID_POS);
+	     ientry != MDNS_INVALID_POS;
+	     ientry = mdns_cache_find(cache, name, length, MDNS_RECORDTYPE_ANY, ientry)) {
+		const mdns_cache_entry_t* entry = cache->entries + ientry;
+		// Records said goodbye to or flushed are about to be removed
+		if (mdns_resolve_type_match(rtype, entry->rtype) &&
+		    (entry->expire > (cache->now + MDNS_CACHE_FLUSH_DELAY)))
+			return ientry;
+	}
+	return MDNS_INVALID_POS;
+}
+
+// Complete a request and remove it from the pending requests
+static inline void
+mdns_resolver_complete(mdns_resolver_t* resolver, size_t index, size_t entry) {
+	mdns_resolve_t request = resolver->requests[index];
+	resolver->requests[index] = resolver->requests[--resolver->count];
+	request.callback(resolver, request.name, request.length, entry, request.user_data);
+	if (resolver->arena)
+		mdns_arena_free(resolver->arena, (void*)request.name, request.length);
+}
+
+// Cache callback completing the requests waiting for a received address record
+static inline void
+mdns_resolver_cache_callback(mdns_cache_t* cache, size_t entry, mdns_cache_event_t event,
+                             void* user_data) {
+	mdns_resolver_t* resolver = (mdns_resolver_t*)user_data;
+	const mdns_cache_entry_t* record = cache->entries + entry;
+	if ((event != MDNS_CACHEEVENT_REMOVED) &&
+	    (record->expire > (cache->now + MDNS_CACHE_FLUSH_DELAY))) {
+		size_t size = (size_t)record->name_size + record->data_size;
+		size_t irequest = 0;
+		while (irequest < resolver->count) {
+			const mdns_resolve_t* request = resolver->requests + irequest;
+			if ((request->hash == record->hash) &&
+			    mdns_resolve_type_match(request->rtype, record->rtype) &&
+			    mdns_string_equal_name(record->storage, size, 0, request->name,
+			                           request->length))
+				mdns_resolver_complete(resolver, irequest, entry);
+			else
+				++irequest;
+		}
+	}
+	if (resolver->cache_callback)
+		resolver->cache_callback(cache, entry, event, resolver->cache_user_data);
+}
+
+static inline void
+mdns_resolver_init(mdns_resolver_t* resolver, mdns_resolve_t* requests, size_t capacity,
+                   mdns_cache_t* cache) {
+	memset(resolver, 0, sizeof(mdns_resolver_t));
+	resolver->requests = requests;
+	resolver->capacity = capacity;
+	resolver->cache = cache;
+	resolver->cache_callback = cache->callback;
+	resolver->cache_user_data = cache->user_data;
+	mdns_cache_set_callback(cache, mdns_resolver_cache_callback, resolver);
+}
+
+static inline void
+mdns_resolver_set_arena(mdns_resolver_t* resolver, mdns_arena_t* arena) {
+	resolver->arena = arena;
+}
+
+static inline int
+mdns_resolve(mdns_resolver_t* resolver, uint64_t now, const char* name, size_t length,
+             mdns_record_type_t rtype, uint32_t timeout, mdns_resolve_callback_fn callback,
+             void* user_data) {
+	size_t entry = mdns_resolver_find(resolver, name, length, (uint16_t)rtype);
+	if (entry != MDNS_INVALID_POS) {
+		callback(resolver, name, length, entry, user_data);
+		return 1;
+	}
+	if (resolver->count >= resolver->capacity)
+		return -1;
+	if (resolver->arena) {
+		char* copy = (char*)mdns_arena_alloc(resolver->arena, length);
+		if (!copy)
+			return -1;
+		memcpy(copy, name, length);
+		name = copy;
+	}
+
+	mdns_resolve_t* request = resolver->requests + resolver->count++;
+	request->name = name;
+	request->length = length;
+	request->hash = mdns_string_hash(MDNS_HASH_SEED, name, length);
+	request->rtype = (uint16_t)rtype;
+	request->deadline = now;
+	request->timeout = now + timeout;
+	request->interval = MDNS_RESOLVE_INTERVAL;
+	request->callback = callback;
+	request->user_data = user_data;
+
+	// Join the query schedule of a pending request for the same name asking for the type, either
+	// the same type or ANY which asks for both A and AAAA records
+	for (size_t irequest = 0; irequest < (resolver->count - 1); ++irequest) {
+		const mdns_resolve_t* pending = resolver->requests + irequest;
+		if ((pending->hash == request->hash) &&
+		    ((pending->rtype == request->rtype) || (pending->rtype == MDNS_RECORDTYPE_ANY)) &&
+		    (pending->length == length) && !strncasecmp(pending->name, name, length)) {
+			request->deadline = pending->deadline;
+			request->interval = pending->interval;
+			++resolver->coalesced;
+			break;
+		}
+	}
+	return 0;
+}
+
+static inline uint64_t
+mdns_resolver_next_deadline(const mdns_resolver_t* resolver) {
+	uint64_t next = MDNS_TIME_NEVER;
+	for (size_t irequest = 0; irequest < resolver->count; ++irequest) {
+		const mdns_resolve_t* request = resolver->requests + irequest;
+		if (request->deadline < next)
+			next = request->deadline;
+		if (request->timeout < next)
+			next = request->timeout;
+	}
+	return next;
+}
+
+// Check if an earlier request due for a query has the same name and asks for the given A or AAAA
+// type, either directly or with ANY, so the question is already in the packet
+static inline int
+mdns_resolver_is_duplicate(const mdns_resolver_t* resolver, size_t index, uint64_t due,
+                           uint16_t rtype) {
+	const mdns_resolve_t* request = resolver->requests + index;
+	for (size_t irequest = 0; irequest < index; ++irequest) {
+		const mdns_resolve_t* other = resolver->requests + irequest;
+		if ((other->deadline <= due) && (other->hash == request->hash) &&
+		    ((other->rtype == rtype) || (other->rtype == MDNS_RECORDTYPE_ANY)) &&
+		    (other->length == request->length) &&
+		    !strncasecmp(other->name, request->name, request->length))
+			return 1;
+	}
+	return 0;
+}
+
+static inline int
+mdns_resolver_send(mdns_resolver_t* resolver, const int* sockets, size_t socket_count,
+                   void* buffer, size_t capacity, uint64_t now) {
+	// Complete the requests that timed out without an answer
+	size_t irequest = 0;
+	while (irequest < resolver->count) {
+		if (resolver->requests[irequest].timeout <= now)
+			mdns_resolver_complete(resolver, irequest, MDNS_INVALID_POS);
+		else
+			++irequest;
+	}
+
+	uint64_t due = now + MDNS_AGGREGATION_WINDOW;
+	if (mdns_resolver_next_deadline(resolver) > due)
+		return 0;
 
-		// Make sure we get a question of class IN or ANY
-		if (!((class_without_flushbit == MDNS_CLASS_IN) ||
-		      (class_without_flushbit == MDNS_CLASS_ANY))) {
-			break;
+	int sent = 0;
+	for (size_t isock = 0; isock < socket_count; ++isock) {
+		mdns_packet_t packet;
+		mdns_packet_init(&packet, sockets[isock], 0, 0, buffer, capacity, 0, 0);
+		for (irequest = 0; irequest < resolver->count; ++irequest) {
+			const mdns_resolve_t* request = resolver->requests + irequest;
+			if (request->deadline > due)
+				continue;
+			if ((request->rtype != MDNS_RECORDTYPE_AAAA) &&
+			    !mdns_resolver_is_duplicate(resolver, irequest, due, MDNS_RECORDTYPE_A) &&
+			    mdns_packet_add_question(&packet, MDNS_RECORDTYPE_A, request->name,
+			                             request->length, MDNS_CLASS_IN))
+				return -1;
+			if ((request->rtype != MDNS_RECORDTYPE_A) &&
+			    !mdns_resolver_is_duplicate(resolver, irequest, due, MDNS_RECORDTYPE_AAAA) &&
+			    mdns_packet_add_question(&packet, MDNS_RECORDTYPE_AAAA, request->name,
+			                             request->length, MDNS_CLASS_IN))
+				return -1;
 		}
+		if (mdns_packet_flush(&packet, 0))
+			return -1;
+		sent += (int)packet.sent;
+	}
 
-		if (dns_sd && flags)
+	for (irequest = 0; irequest < resolver->count; ++irequest) {
+		mdns_resolve_t* request = resolver->requests + irequest;
+		if (request->deadline > due)
 			continue;
-
-		++total_records;
-		if (callback && callback(sock, saddr, addrlen, MDNS_ENTRYTYPE_QUESTION, query_id, rtype,
-		                         rclass, 0, buffer, data_size, question_offset, length,
-		                         question_offset, length, user_data))
-			return total_records;
+		request->deadline = now + request->interval;
+		request->interval = (request->interval < (MDNS_RESOLVE_INTERVAL_MAX / 2)) ?
+		                        request->interval * 2 :
+		                        MDNS_RESOLVE_INTERVAL_MAX;
 	}
+	return sent;
+}
 
-	size_t offset = MDNS_POINTER_DIFF(data, buffer);
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ANSWER, query_id, answer_rrs, callback, user_data);
-	total_records += records;
-	if (records != answer_rrs)
-		return total_records;
+static inline void
+mdns_querier_init(mdns_querier_t* querier, mdns_question_t* questions, size_t capacity) {
+	memset(querier, 0, sizeof(mdns_querier_t));
+	querier->questions = questions;
+	querier->capacity = capacity;
+}
 
-	records =
-	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
-	total_records += records;
-	if (records != authority_rrs)
-		return total_records;
+static inline int
+mdns_querier_add(mdns_querier_t* querier, uint64_t now, mdns_record_type_t rtype, const char* name,
+                 size_t length, uint32_t timeout, mdns_record_callback_fn callback,
+                 void* user_data) {
+	if (querier->count >= querier->capacity)
+		return -1;
+	mdns_question_t* question = querier->questions + querier->count++;
+	question->name = name;
+	question->length = length;
+	question->hash = mdns_string_hash(MDNS_HASH_SEED, name, length);
+	question->rtype = (uint16_t)rtype;
+	question->sent = 0;
+	question->matched = 0;
+	question->deadline = now + MDNS_QUERY_WINDOW;
+	question->expire = now + timeout;
+	question->callback = callback;
+	question->user_data = user_data;
+	querier->filter |= (uint64_t)1 << (question->hash & 63);
+	return 0;
+}
 
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
-	                             user_data);
+static inline void
+mdns_querier_cancel(mdns_querier_t* querier, void* user_data) {
+	querier->filter = 0;
+	for (size_t iq = 0; iq < querier->count;) {
+		const mdns_question_t* question = querier->questions + iq;
+		if (question->user_data == user_data) {
+			querier->questions[iq] = querier->questions[--querier->count];
+			continue;
+		}
+		if (!question->sent)
+			querier->filter |= (uint64_t)1 << (question->hash & 63);
+		++iq;
+	}
+}
 
-	return total_records;
+static inline uint64_t
+mdns_querier_next_deadline(const mdns_querier_t* querier) {
+	uint64_t deadline = MDNS_TIME_NEVER;
+	for (size_t iq = 0; iq < querier->count; ++iq) {
+		const mdns_question_t* question = querier->questions + iq;
+		if (!question->sent && (question->deadline < deadline))
+			deadline = question->deadline;
+		if (question->expire < deadline)
+			deadline = question->expire;
+	}
+	return deadline;
 }
 
+// Check if an earlier pending question asks the same
 static inline int
-mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
-                size_t capacity, uint16_t query_id) {
-	mdns_query_t query;
-	query.type = type;
-	query.name = name;
-	query.length = length;
-	return mdns_multiquery_send(sock, &query, 1, buffer, capacity, query_id);
+mdns_querier_is_duplicate(const mdns_querier_t* querier, size_t index) {
+	const mdns_question_t* question = querier->questions + index;
+	for (size_t iq = 0; iq < index; ++iq) {
+		const mdns_question_t* other = querier->questions + iq;
+		if (!other->sent && (other->hash == question->hash) && (other->rtype == question->rtype) &&
+		    (other->length == question->length) &&
+		    !strncasecmp(other->name, question->name, question->length))
+			return 1;
+	}
+	return 0;
 }
 
 static inline int
-mdns_multiquery_send(int sock, const mdns_query_t* query, size_t count, void* buffer, size_t capacity,
-                     uint16_t query_id) {
-	if (!count || (capacity < (sizeof(struct mdns_header_t) + (6 * count))))
-		return -1;
-
-	// Ask for a unicast response since it's a one-shot query
-	uint16_t rclass = MDNS_CLASS_IN | MDNS_UNICAST_RESPONSE;
+mdns_querier_send(mdns_querier_t* querier, const int* sockets, size_t socket_count, void* buffer,
+                  size_t capacity, uint64_t now) {
+	for (size_t iq = 0; iq < querier->count;) {
+		if (querier->questions[iq].expire <= now)
+			querier->questions[iq] = querier->questions[--querier->count];
+		else
+			++iq;
+	}
 
-	struct sockaddr_storage addr_storage;
-	struct sockaddr* saddr = (struct sockaddr*)&addr_storage;
-	socklen_t saddrlen = sizeof(addr_storage);
-	if (getsockname(sock, saddr, &saddrlen) == 0) {
-		if ((saddr->sa_family == AF_INET) &&
-		    (ntohs(((struct sockaddr_in*)saddr)->sin_port) == MDNS_PORT))
-			rclass &= ~MDNS_UNICAST_RESPONSE;
-		else if ((saddr->sa_family == AF_INET6) &&
-		         (ntohs(((struct sockaddr_in6*)saddr)->sin6_port) == MDNS_PORT))
-			rclass &= ~MDNS_UNICAST_RESPONSE;
+	int due = 0;
+	for (size_t iq = 0; iq < querier->count; ++iq) {
+		if (!querier->questions[iq].sent && (querier->questions[iq].deadline <= now))
+			due = 1;
 	}
+	if (!due)
+		return 0;
 
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	// Query ID
-	header->query_id = htons((unsigned short)query_id);
-	// Flags
-	header->flags = 0;
-	// Questions
-	header->questions = htons((unsigned short)count);
-	// No answer, authority or additional RRs
-	header->answer_rrs = 0;
-	header->authority_rrs = 0;
-	header->additional_rrs = 0;
-	// Fill in questions
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
-	for (size_t iq = 0; iq < count; ++iq) {
-		// Name string
-		data = mdns_string_make(buffer, capacity, data, query[iq].name, query[iq].length, 0);
-		if (!data)
-			return -1;
-		size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-		if (remain < 4)
+	int sent = 0;
+	for (size_t isock = 0; isock < socket_count; ++isock) {
+		uint16_t rclass = mdns_query_class(sockets[isock]);
+		mdns_packet_t packet;
+		mdns_packet_init(&packet, sockets[isock], 0, 0, buffer, capacity, 0, 0);
+		for (size_t iq = 0; iq < querier->count; ++iq) {
+			const mdns_question_t* question = querier->questions + iq;
+			if (question->sent)
+				continue;
+			if (mdns_querier_is_duplicate(querier, iq)) {
+				if (!isock)
+					++querier->deduplicated;
+				continue;
+			}
+			if (mdns_packet_add_question(&packet, (mdns_record_type_t)question->rtype,
+			                             question->name, question->length, rclass))
+				return -1;
+		}
+		if (mdns_packet_flush(&packet, 0))
 			return -1;
-		// Record type
-		data = mdns_htons(data, query[iq].type);
-		//! Optional unicast response based on local port, class IN
-		data = mdns_htons(data, rclass);
+		sent += (int)packet.sent;
 	}
+	for (size_t iq = 0; iq < querier->count; ++iq)
+		querier->questions[iq].sent = 1;
+	querier->filter = 0;
+	querier->packets += (size_t)sent;
+	return sent;
+}
 
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
-	if (mdns_multicast_send(sock, buffer, (size_t)tosend))
-		return -1;
-	return query_id;
+// Treat the pending questions asked by another host as sent. The filter has one bit set per hash
+// of a pending question, so most questions on the link are rejected without comparing names
+static inline void
+mdns_querier_suppress(mdns_querier_t* querier, uint16_t rtype, const void* data, size_t size,
+                      size_t name_offset) {
+	if (!querier->filter)
+		return;
+	uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, data, size, name_offset);
+	if (!(querier->filter & ((uint64_t)1 << (hash & 63))))
+		return;
+	for (size_t iq = 0; iq < querier->count; ++iq) {
+		mdns_question_t* question = querier->questions + iq;
+		if (question->sent || (question->hash != hash) ||
+		    ((rtype != MDNS_RECORDTYPE_ANY) && (rtype != question->rtype)) ||
+		    !mdns_string_equal_name(data, size, name_offset, question->name, question->length))
+			continue;
+		question->sent = 1;
+		++querier->suppressed;
+	}
 }
 
-static inline size_t
-mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
-                void* user_data, int only_query_id) {
-	struct sockaddr_in6 addr;
-	struct sockaddr* saddr = (struct sockaddr*)&addr;
-	socklen_t addrlen = sizeof(addr);
-	memset(&addr, 0, sizeof(addr));
-#ifdef __APPLE__
-	saddr->sa_len = sizeof(addr);
-#endif
-	mdns_ssize_t ret = recvfrom(sock, (char*)buffer, (mdns_size_t)capacity, 0, saddr, &addrlen);
-	if (ret <= 0)
+static inline int
+mdns_querier_record_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                             mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                             uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                             size_t name_offset, size_t name_length, size_t record_offset,
+                             size_t record_length, void* user_data) {
+	mdns_querier_t* querier = (mdns_querier_t*)user_data;
+	if (size < sizeof(struct mdns_header_t))
+		return 0;
+	if (!(mdns_ntohs(MDNS_POINTER_OFFSET_CONST(data, 2)) & 0x8000)) {
+		// Only a query from port 5353 without unicast response and known answers gets the
+		// answers multicast in full to all hosts
+		uint16_t port = 0;
+		if (from && (from->sa_family == AF_INET))
+			port = ntohs(((const struct sockaddr_in*)from)->sin_port);
+		else if (from && (from->sa_family == AF_INET6))
+			port = ntohs(((const struct sockaddr_in6*)from)->sin6_port);
+		if ((entry == MDNS_ENTRYTYPE_QUESTION) && (port == MDNS_PORT) &&
+		    !(rclass & MDNS_UNICAST_RESPONSE) && !mdns_ntohs(MDNS_POINTER_OFFSET_CONST(data, 6)))
+			mdns_querier_suppress(querier, rtype, data, size, name_offset);
+		return 0;
+	}
+	if (entry == MDNS_ENTRYTYPE_QUESTION)
 		return 0;
 
-	size_t data_size = (size_t)ret;
-	const uint16_t* data = (const uint16_t*)buffer;
+	// A new packet starts over which questions are answered by the response. Answers following
+	// other records also start a new packet, since answers come first in a packet
+	if ((querier->matched_sequence != querier->sequence) ||
+	    ((entry == MDNS_ENTRYTYPE_ANSWER) && (querier->last_entry != MDNS_ENTRYTYPE_ANSWER))) {
+		for (size_t iq = 0; iq < querier->count; ++iq)
+			querier->questions[iq].matched = 0;
+		querier->matched_sequence = querier->sequence;
+	}
+	querier->last_entry = entry;
+
+	if (entry == MDNS_ENTRYTYPE_ANSWER) {
+		uint64_t hash = mdns_string_hash_name(MDNS_HASH_SEED, data, size, name_offset);
+		for (size_t iq = 0; iq < querier->count; ++iq) {
+			mdns_question_t* question = querier->questions + iq;
+			if ((question->hash != hash) ||
+			    ((question->rtype != MDNS_RECORDTYPE_ANY) && (question->rtype != rtype)) ||
+			    !mdns_string_equal_name(data, size, name_offset, question->name,
+			                            question->length))
+				continue;
+			question->matched = 1;
+			question->callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+			                   size, name_offset, name_length, record_offset, record_length,
+			                   question->user_data);
+		}
+	} else {
+		for (size_t iq = 0; iq < querier->count; ++iq) {
+			mdns_question_t* question = querier->questions + iq;
+			if (question->matched)
+				question->callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+				                   size, name_offset, name_length, record_offset, record_length,
+				                   question->user_data);
+		}
+	}
+	return 0;
+}
 
-	uint16_t query_id = mdns_ntohs(data++);
-	uint16_t flags = mdns_ntohs(data++);
-	uint16_t questions = mdns_ntohs(data++);
-	uint16_t answer_rrs = mdns_ntohs(data++);
-	uint16_t authority_rrs = mdns_ntohs(data++);
-	uint16_t additional_rrs = mdns_ntohs(data++);
-	(void)sizeof(flags);
+static inline size_t
+mdns_querier_recv(mdns_querier_t* querier, int sock, void* buffer, size_t capacity) {
+	++querier->sequence;
+	return mdns_socket_listen(sock, buffer, capacity, mdns_querier_record_callback, querier);
+}
 
-	if ((only_query_id > 0) && (query_id != only_query_id))
-		return 0;  // Not a reply to the wanted one-shot query
+static inline void
+mdns_arena_init(mdns_arena_t* arena, void* memory, size_t capacity) {
+	memset(arena, 0, sizeof(mdns_arena_t));
+	size_t align = (size_t)((uintptr_t)memory & (MDNS_ARENA_CLASS_MIN - 1));
+	if (align)
+		align = MDNS_ARENA_CLASS_MIN - align;
+	arena->memory = (uint8_t*)memory + ((capacity > align) ? align : capacity);
+	arena->capacity = (capacity > align) ? (capacity - align) : 0;
+	for (size_t iclass = 0; iclass < MDNS_ARENA_CLASS_COUNT; ++iclass)
+		arena->free[iclass] = MDNS_INVALID_POS;
+}
 
-	// Skip questions part
-	int i;
-	for (i = 0; i < questions; ++i) {
-		size_t offset = MDNS_POINTER_DIFF(data, buffer);
-		if (!mdns_string_skip(buffer, data_size, &offset))
+static inline void*
+mdns_arena_alloc(mdns_arena_t* arena, size_t size) {
+	size_t iclass = 0;
+	size_t block_size = MDNS_ARENA_CLASS_MIN;
+	while (block_size < size) {
+		if (++iclass == MDNS_ARENA_CLASS_COUNT) {
+			++arena->failed;
 			return 0;
-		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
-		// Record type and class not used, skip
-		// uint16_t rtype = mdns_ntohs(data++);
-		// uint16_t rclass = mdns_ntohs(data++);
-		data += 2;
+		}
+		block_size <<= 1;
 	}
+	size_t offset = arena->free[iclass];
+	if (offset != MDNS_INVALID_POS) {
+		// Freed blocks hold the offset of the next free block of the size class
+		memcpy(arena->free + iclass, arena->memory + offset, sizeof(size_t));
+	} else {
+		if (arena->cursor[iclass] == arena->end[iclass]) {
+			size_t slab_size = (block_size > MDNS_ARENA_SLAB_SIZE) ? block_size :
+			                                                         MDNS_ARENA_SLAB_SIZE;
+			if ((arena->capacity - arena->used) < slab_size) {
+				++arena->failed;
+				return 0;
+			}
+			arena->cursor[iclass] = arena->used;
+			arena->end[iclass] = arena->used + slab_size;
+			arena->used += slab_size;
+		}
+		offset = arena->cursor[iclass];
+		arena->cursor[iclass] += block_size;
+	}
+	arena->allocated += block_size;
+	return arena->memory + offset;
+}
 
-	size_t records = 0;
-	size_t total_records = 0;
-	size_t offset = MDNS_POINTER_DIFF(data, buffer);
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ANSWER, query_id, answer_rrs, callback, user_data);
-	total_records += records;
-	if (records != answer_rrs)
-		return total_records;
-
-	records =
-	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
-	total_records += records;
-	if (records != authority_rrs)
-		return total_records;
+static inline void
+mdns_arena_free(mdns_arena_t* arena, void* block, size_t size) {
+	// Reject blocks that cannot have been allocated from the arena, either larger than the
+	// largest size class or outside the slabs taken
+	if (!block || ((uint8_t*)block < arena->memory) ||
+	    ((uint8_t*)block >= (arena->memory + arena->used)))
+		return;
+	size_t iclass = 0;
+	size_t block_size = MDNS_ARENA_CLASS_MIN;
+	while (block_size < size) {
+		if (++iclass == MDNS_ARENA_CLASS_COUNT)
+			return;
+		block_size <<= 1;
+	}
+	size_t offset = (size_t)((uint8_t*)block - arena->memory);
+	memcpy(block, arena->free + iclass, sizeof(size_t));
+	arena->free[iclass] = offset;
+	arena->allocated -= block_size;
+}
 
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
-	                             user_data);
-	total_records += records;
-	if (records != additional_rrs)
-		return total_records;
+static inline void
+mdns_prober_init(mdns_prober_t* prober, mdns_probe_t* probes, size_t capacity, uint32_t seed) {
+	memset(prober, 0, sizeof(mdns_prober_t));
+	prober->probes = probes;
+	prober->capacity = capacity;
+	prober->next = MDNS_TIME_NEVER;
+	prober->random_state = seed;
+}
 
-	return total_records;
+static inline void
+mdns_prober_update_next(mdns_prober_t* prober) {
+	prober->next = MDNS_TIME_NEVER;
+	for (size_t iprobe = 0; iprobe < prober->count; ++iprobe) {
+		const mdns_probe_t* probe = prober->probes + iprobe;
+		if ((probe->state == MDNS_PROBESTATE_PROBING) && (probe->deadline < prober->next))
+			prober->next = probe->deadline;
+	}
 }
 
-static inline void*
-mdns_answer_add_question_unicast(void* buffer, size_t capacity, void* data,
-                                 mdns_record_type_t record_type, const char* name,
-                                 size_t name_length, mdns_string_table_t* string_table) {
-	data = mdns_string_make(buffer, capacity, data, name, name_length, string_table);
-	if (!data)
-		return 0;
-	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-	if (remain < 4)
-		return 0;
+static inline int
+mdns_prober_add(mdns_prober_t* prober, uint64_t now, const char* name, size_t length,
+                const mdns_record_t* records, size_t record_count) {
+	if (prober->count >= prober->capacity)
+		return -1;
 
-	data = mdns_htons(data, record_type);
-	data = mdns_htons(data, MDNS_UNICAST_RESPONSE | MDNS_CLASS_IN);
+	uint64_t deadline = MDNS_TIME_NEVER;
+	if ((prober->conflict_count >= MDNS_PROBE_CONFLICT_LIMIT) &&
+	    ((now - prober->conflict_start) <= MDNS_PROBE_CONFLICT_WINDOW)) {
+		deadline = now + MDNS_PROBE_CONFLICT_DELAY;
+	} else {
+		// Join the next probe packet of names already probing, otherwise wait a random delay to
+		// avoid probing in step with other hosts starting at the same time
+		for (size_t iprobe = 0; iprobe < prober->count; ++iprobe) {
+			const mdns_probe_t* probe = prober->probes + iprobe;
+			if ((probe->state == MDNS_PROBESTATE_PROBING) && (probe->sent < MDNS_PROBE_COUNT) &&
+			    (probe->deadline <= (now + MDNS_PROBE_INTERVAL)) && (probe->deadline < deadline))
+				deadline = probe->deadline;
+		}
+		if (deadline == MDNS_TIME_NEVER)
+			deadline = now + (mdns_random(&prober->random_state) % (MDNS_PROBE_WAIT + 1));
+	}
 
-	return data;
+	mdns_probe_t* probe = prober->probes + prober->count;
+	probe->name.str = name;
+	probe->name.length = length;
+	probe->records = records;
+	probe->record_count = record_count;
+	probe->deadline = deadline;
+	probe->state = MDNS_PROBESTATE_PROBING;
+	probe->sent = 0;
+	if (deadline < prober->next)
+		prober->next = deadline;
+	return (int)prober->count++;
 }
 
-static inline void*
-mdns_answer_add_record_header(void* buffer, size_t capacity, void* data, mdns_record_t record,
-                              mdns_string_table_t* string_table) {
-	data = mdns_string_make(buffer, capacity, data, record.name.str, record.name.length, string_table);
-	if (!data)
-		return 0;
-	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-	if (remain < 10)
-		return 0;
+static inline uint64_t
+mdns_prober_next_deadline(const mdns_prober_t* prober) {
+	return prober->next;
+}
 
-	data = mdns_htons(data, record.type);
-	data = mdns_htons(data, record.rclass);
-	data = mdns_htonl(data, record.ttl);
-	data = mdns_htons(data, 0);  // Length, to be filled later
-	return data;
+static inline int
+mdns_probe_is_due(const mdns_probe_t* probe, uint64_t now) {
+	return (probe->state == MDNS_PROBESTATE_PROBING) && (probe->sent < MDNS_PROBE_COUNT) &&
+	       (probe->deadline <= now);
 }
 
-static inline void*
-mdns_answer_add_record(void* buffer, size_t capacity, void* data, mdns_record_t record,
-                       mdns_string_table_t* string_table) {
-	// TXT records will be coalesced into one record later
-	if (!data || (record.type == MDNS_RECORDTYPE_TXT))
-		return data;
+// Upper bound of the size of the question and proposed records for a name, without compression
+static inline size_t
+mdns_probe_size(const mdns_probe_t* probe) {
+	size_t size = probe->name.length + 2 + 4;
+	for (size_t irec = 0; irec < probe->record_count; ++irec) {
+		const mdns_record_t* record = probe->records + irec;
+		size += record->name.length + 2 + 10;
+		switch (record->type) {
+			case MDNS_RECORDTYPE_PTR:
+				size += record->data.ptr.name.length + 2;
+				break;
+			case MDNS_RECORDTYPE_SRV:
+				size += 6 + record->data.srv.name.length + 2;
+				break;
+			case MDNS_RECORDTYPE_A:
+				size += 4;
+				break;
+			case MDNS_RECORDTYPE_AAAA:
+				size += 16;
+				break;
+			case MDNS_RECORDTYPE_TXT:
+				size += record->data.txt.key.length + record->data.txt.value.length + 2;
+				break;
+			default:
+				break;
+		}
+	}
+	return size;
+}
 
-	data = mdns_answer_add_record_header(buffer, capacity, data, record, string_table);
-	if (!data)
+static inline int
+mdns_prober_add_records(mdns_packet_t* packet, const mdns_probe_t* probe) {
+	for (size_t irec = 0; irec < probe->record_count; ++irec) {
+		mdns_record_t record = probe->records[irec];
+		if (mdns_record_is_txt_pair(&record))
+			continue;
+		mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+		if (mdns_packet_add_record(packet, MDNS_ENTRYTYPE_AUTHORITY, record))
+			return -1;
+	}
+	return mdns_packet_add_txt_record(packet, MDNS_ENTRYTYPE_AUTHORITY, probe->records,
+	                                  probe->record_count, MDNS_CLASS_IN, 60);
+}
+
+// Write the questions followed by the proposed records for the due names in the given range to
+// the packet without sending it. Returns 0 if all fit in the packet, <0 if not
+static inline int
+mdns_prober_write(const mdns_prober_t* prober, size_t first, size_t end, mdns_packet_t* packet,
+                  uint64_t now) {
+	mdns_packet_reset(packet);
+	void* buffer = packet->buffer;
+	size_t capacity = packet->capacity;
+	void* data = packet->data;
+	for (size_t iprobe = first; iprobe < end; ++iprobe) {
+		const mdns_probe_t* probe = prober->probes + iprobe;
+		if (!mdns_probe_is_due(probe, now))
+			continue;
+		data = mdns_string_make(buffer, capacity, data, MDNS_STRING_ARGS(probe->name),
+		                        &packet->string_table);
+		if (!data || ((capacity - MDNS_POINTER_DIFF(data, buffer)) < 4))
+			return -1;
+		// The first probe asks for unicast responses
+		data = mdns_htons(data, MDNS_RECORDTYPE_ANY);
+		data = mdns_htons(data, MDNS_CLASS_IN | (probe->sent ? 0 : MDNS_UNICAST_RESPONSE));
+		++packet->count[MDNS_ENTRYTYPE_QUESTION];
+	}
+	for (size_t iprobe = first; iprobe < end; ++iprobe) {
+		const mdns_probe_t* probe = prober->probes + iprobe;
+		if (!mdns_probe_is_due(probe, now))
+			continue;
+		for (size_t irec = 0; irec < probe->record_count; ++irec) {
+			mdns_record_t record = probe->records[irec];
+			if (mdns_record_is_txt_pair(&record)) {
+				if (!mdns_answer_is_first_txt_pair(probe->records, irec))
+					continue;
+				data = mdns_answer_add_txt_record(buffer, capacity, data, probe->records,
+				                                  probe->record_count, irec, MDNS_CLASS_IN, 60,
+				                                  &packet->string_table);
+			} else {
+				mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 60);
+				data = mdns_answer_add_record(buffer, capacity, data, record,
+				                              &packet->string_table);
+			}
+			if (!data)
+				return -1;
+			++packet->count[MDNS_ENTRYTYPE_AUTHORITY];
+		}
+	}
+	packet->data = data;
+	return 0;
+}
+
+static inline int
+mdns_prober_send(mdns_prober_t* prober, int sock, void* buffer, size_t capacity, uint64_t now) {
+	if (!prober->count || (prober->next > now))
 		return 0;
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return -1;
+
+	// Names probed three times without conflict during the following interval are ours
+	for (size_t iprobe = 0; iprobe < prober->count; ++iprobe) {
+		mdns_probe_t* probe = prober->probes + iprobe;
+		if ((probe->state == MDNS_PROBESTATE_PROBING) && (probe->sent >= MDNS_PROBE_COUNT) &&
+		    (probe->deadline <= now))
+			probe->state = MDNS_PROBESTATE_SUCCESS;
+	}
+
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, 0, 0);
+	int ret = 0;
+	size_t first = 0;
+	while (!ret) {
+		while ((first < prober->count) && !mdns_probe_is_due(prober->probes + first, now))
+			++first;
+		if (first >= prober->count)
+			break;
+
+		// All questions precede the authority records, so the names for a packet are selected
+		// before writing it. Start with the names fitting by their uncompressed size, then add
+		// one name at a time while the packet still fits with name compression
+		size_t end = first + 1;
+		size_t total = sizeof(struct mdns_header_t) + mdns_probe_size(prober->probes + first);
+		for (; end < prober->count; ++end) {
+			if (!mdns_probe_is_due(prober->probes + end, now))
+				continue;
+			total += mdns_probe_size(prober->probes + end);
+			if (total > capacity)
+				break;
+		}
+		if (!mdns_prober_write(prober, first, end, &packet, now)) {
+			while (end < prober->count) {
+				size_t next = end;
+				while ((next < prober->count) && !mdns_probe_is_due(prober->probes + next, now))
+					++next;
+				if ((next >= prober->count) ||
+				    mdns_prober_write(prober, first, next + 1, &packet, now))
+					break;
+				end = next + 1;
+			}
+			ret = mdns_prober_write(prober, first, end, &packet, now);
+		} else {
+			// A name with more records than fit in one packet, let the packet builder split it
+			end = first + 1;
+			const mdns_probe_t* probe = prober->probes + first;
+			mdns_packet_reset(&packet);
+			uint16_t rclass = MDNS_CLASS_IN | (probe->sent ? 0 : MDNS_UNICAST_RESPONSE);
+			ret = mdns_packet_add_question(&packet, MDNS_RECORDTYPE_ANY,
+			                               MDNS_STRING_ARGS(probe->name), rclass);
+			if (!ret)
+				ret = mdns_prober_add_records(&packet, probe);
+		}
+		if (!ret)
+			ret = mdns_packet_flush(&packet, 0);
+
+		for (size_t iprobe = first; iprobe < end; ++iprobe) {
+			mdns_probe_t* probe = prober->probes + iprobe;
+			if (!mdns_probe_is_due(probe, now))
+				continue;
+			++probe->sent;
+			probe->deadline = now + MDNS_PROBE_INTERVAL;
+		}
+		first = end;
+	}
+	mdns_prober_update_next(prober);
+
+	if (ret)
+		return -1;
+	return (int)packet.sent;
+}
+
+// Compare two records in canonical form by class, type and data as raw bytes
+static inline int
+mdns_probe_rdata_compare(const mdns_probe_rdata_t* lhs, const void* lhs_data,
+                         const mdns_probe_rdata_t* rhs, const void* rhs_data) {
+	if (lhs->rclass != rhs->rclass)
+		return (lhs->rclass < rhs->rclass) ? -1 : 1;
+	if (lhs->rtype != rhs->rtype)
+		return (lhs->rtype < rhs->rtype) ? -1 : 1;
+	size_t length = (lhs->length < rhs->length) ? lhs->length : rhs->length;
+	int cmp = memcmp(MDNS_POINTER_OFFSET_CONST(lhs_data, lhs->offset),
+	                 MDNS_POINTER_OFFSET_CONST(rhs_data, rhs->offset), length);
+	if (cmp)
+		return (cmp < 0) ? -1 : 1;
+	if (lhs->length != rhs->length)
+		return (lhs->length < rhs->length) ? -1 : 1;
+	return 0;
+}
 
-	// Pointer to length of record to be filled at end
-	void* record_length = MDNS_POINTER_OFFSET(data, -2);
-	void* record_data = data;
+static inline void
+mdns_probe_rdata_sort(mdns_probe_rdata_t* rdata, size_t count, const void* data) {
+	for (size_t irec = 1; irec < count; ++irec) {
+		mdns_probe_rdata_t current = rdata[irec];
+		size_t ipos = irec;
+		while (ipos && (mdns_probe_rdata_compare(&current, data, rdata + ipos - 1, data) < 0)) {
+			rdata[ipos] = rdata[ipos - 1];
+			--ipos;
+		}
+		rdata[ipos] = current;
+	}
+}
 
-	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-	switch (record.type) {
-		case MDNS_RECORDTYPE_PTR:
-			data = mdns_string_make(buffer, capacity, data, record.data.ptr.name.str,
-			                        record.data.ptr.name.length, string_table);
+// Serialize our proposed records without compression and locate the data of each record
+static inline size_t
+mdns_probe_own_rdata(const mdns_probe_t* probe, void* buffer, size_t capacity,
+                     mdns_probe_rdata_t* rdata, size_t rdata_capacity) {
+	void* data = buffer;
+	size_t count = 0;
+	for (size_t irec = 0; (irec < probe->record_count) && (count < rdata_capacity); ++irec) {
+		const mdns_record_t* record = probe->records + irec;
+		void* next;
+		if (mdns_record_is_txt_pair(record)) {
+			if (!mdns_answer_is_first_txt_pair(probe->records, irec))
+				continue;
+			next = mdns_answer_add_txt_record(buffer, capacity, data, probe->records,
+			                                  probe->record_count, irec, MDNS_CLASS_IN, 0, 0);
+		} else {
+			next = mdns_answer_add_record(buffer, capacity, data, *record, 0);
+		}
+		if (!next)
 			break;
 
-		case MDNS_RECORDTYPE_SRV:
-			if (remain <= 6)
-				return 0;
-			data = mdns_htons(data, record.data.srv.priority);
-			data = mdns_htons(data, record.data.srv.weight);
-			data = mdns_htons(data, record.data.srv.port);
-			data = mdns_string_make(buffer, capacity, data, record.data.srv.name.str,
-			                        record.data.srv.name.length, string_table);
-			break;
+		size_t offset = MDNS_POINTER_DIFF(data, buffer);
+		mdns_string_skip(buffer, capacity, &offset);
+		rdata[count].rclass = MDNS_CLASS_IN;
+		rdata[count].rtype = (uint16_t)record->type;
+		rdata[count].length = mdns_ntohs(MDNS_POINTER_OFFSET(buffer, offset + 8));
+		rdata[count].offset = offset + 10;
+		++count;
+		data = next;
+	}
+	return count;
+}
 
-		case MDNS_RECORDTYPE_A:
-			if (remain < 4)
-				return 0;
-			memcpy(data, &record.data.a.addr.sin_addr.s_addr, 4);
-			data = MDNS_POINTER_OFFSET(data, 4);
-			break;
+// Collect the authority records for the probed name in a received probe in canonical form
+static inline size_t
+mdns_probe_peer_rdata(const mdns_probe_t* probe, const void* buffer, size_t size, void* data,
+                      size_t capacity, mdns_probe_rdata_t* rdata, size_t rdata_capacity) {
+	if (size < sizeof(struct mdns_header_t))
+		return 0;
+	const uint16_t* header = (const uint16_t*)buffer;
+	size_t questions = mdns_ntohs(header + 2);
+	size_t answer_rrs = mdns_ntohs(header + 3);
+	size_t authority_rrs = mdns_ntohs(header + 4);
+
+	size_t offset = sizeof(struct mdns_header_t);
+	for (size_t iquestion = 0; iquestion < questions; ++iquestion) {
+		if (!mdns_string_skip(buffer, size, &offset) || ((offset + 4) > size))
+			return 0;
+		offset += 4;
+	}
 
-		case MDNS_RECORDTYPE_AAAA:
-			if (remain < 16)
-				return 0;
-			memcpy(data, &record.data.aaaa.addr.sin6_addr, 16);  // ipv6 address
-			data = MDNS_POINTER_OFFSET(data, 16);
+	size_t used = 0;
+	size_t count = 0;
+	for (size_t irec = 0; irec < (answer_rrs + authority_rrs); ++irec) {
+		size_t name_offset = offset;
+		if (!mdns_string_skip(buffer, size, &offset) || ((offset + 10) > size))
 			break;
-
-		default:
+		const uint16_t* record = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+		uint16_t rtype = mdns_ntohs(record);
+		uint16_t rclass = mdns_ntohs(record + 1);
+		size_t length = mdns_ntohs(record + 4);
+		offset += 10;
+		if (length > (size - offset))
 			break;
+
+		if ((irec >= answer_rrs) && (count < rdata_capacity) &&
+		    mdns_string_equal_name(buffer, size, name_offset, MDNS_STRING_ARGS(probe->name))) {
+			size_t data_size = mdns_record_data_expand(buffer, size, offset, length, rtype,
+			                                           MDNS_POINTER_OFFSET(data, used),
+			                                           capacity - used);
+			if (!data_size)
+				break;
+			rdata[count].rclass = rclass & (uint16_t)~MDNS_CACHE_FLUSH;
+			rdata[count].rtype = rtype;
+			rdata[count].offset = used;
+			rdata[count].length = data_size;
+			used += data_size;
+			++count;
+		}
+		offset += length;
 	}
+	return count;
+}
 
-	if (!data)
+// Compare our proposed records with the records of a simultaneous probe from another host, both
+// sorted, record by record until a difference is found. If all compared records are equal the
+// host with more records wins. Returns <0 if we lose, >0 if we win, 0 if the records are equal
+// (for example our own probe looped back)
+static inline int
+mdns_probe_tiebreak(const mdns_probe_t* probe, const void* buffer, size_t size) {
+	uint8_t own_data[MDNS_PROBE_TIEBREAK_SIZE];
+	uint8_t peer_data[MDNS_PROBE_TIEBREAK_SIZE];
+	mdns_probe_rdata_t own[MDNS_PROBE_TIEBREAK_RECORDS];
+	mdns_probe_rdata_t peer[MDNS_PROBE_TIEBREAK_RECORDS];
+
+	size_t own_count = mdns_probe_own_rdata(probe, own_data, sizeof(own_data), own,
+	                                        MDNS_PROBE_TIEBREAK_RECORDS);
+	size_t peer_count = mdns_probe_peer_rdata(probe, buffer, size, peer_data, sizeof(peer_data),
+	                                          peer, MDNS_PROBE_TIEBREAK_RECORDS);
+	if (!peer_count)
 		return 0;
+	mdns_probe_rdata_sort(own, own_count, own_data);
+	mdns_probe_rdata_sort(peer, peer_count, peer_data);
 
-	// Fill record length
-	mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
-	return data;
-}
-
-static inline void
-mdns_record_update_rclass_ttl(mdns_record_t* record, uint16_t rclass, uint32_t ttl) {
-	if (!record->rclass)
-		record->rclass = rclass;
-	if (!record->ttl || !ttl)
-		record->ttl = ttl;
-	record->rclass &= (uint16_t)(MDNS_CLASS_IN | MDNS_CACHE_FLUSH);
-	// Never flush PTR record
-	if (record->type == MDNS_RECORDTYPE_PTR)
-		record->rclass &= ~(uint16_t)MDNS_CACHE_FLUSH;
+	for (size_t irec = 0; (irec < own_count) && (irec < peer_count); ++irec) {
+		int cmp = mdns_probe_rdata_compare(own + irec, own_data, peer + irec, peer_data);
+		if (cmp)
+			return cmp;
+	}
+	if (own_count != peer_count)
+		return (own_count < peer_count) ? -1 : 1;
+	return 0;
 }
 
-static inline void*
-mdns_answer_add_txt_record(void* buffer, size_t capacity, void* data, const mdns_record_t* records,
-                           size_t record_count, uint16_t rclass, uint32_t ttl,
-                           mdns_string_table_t* string_table) {
-	// Pointer to length of record to be filled at end
-	void* record_length = 0;
-	void* record_data = 0;
+static inline size_t
+mdns_prober_receive(mdns_prober_t* prober, uint64_t now, mdns_entry_type_t entry,
+                    const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                    size_t record_offset, size_t record_length) {
+	if ((entry == MDNS_ENTRYTYPE_QUESTION) || (size < sizeof(struct mdns_header_t)))
+		return 0;
+	// Known answers in queries are not a claim on the name, only responses are
+	const struct mdns_header_t* header = (const struct mdns_header_t*)buffer;
+	int response = (mdns_ntohs(&header->flags) & 0x8000) ? 1 : 0;
+	if (!response && (entry != MDNS_ENTRYTYPE_AUTHORITY))
+		return 0;
 
-	size_t remain = 0;
-	for (size_t irec = 0; data && (irec < record_count); ++irec) {
-		if (records[irec].type != MDNS_RECORDTYPE_TXT)
+	size_t affected = 0;
+	for (size_t iprobe = 0; iprobe < prober->count; ++iprobe) {
+		mdns_probe_t* probe = prober->probes + iprobe;
+		if ((probe->state != MDNS_PROBESTATE_PROBING) ||
+		    !mdns_string_equal_name(buffer, size, name_offset, MDNS_STRING_ARGS(probe->name)))
 			continue;
 
-		mdns_record_t record = records[irec];
-		mdns_record_update_rclass_ttl(&record, rclass, ttl);
-		if (!record_data) {
-			data = mdns_answer_add_record_header(buffer, capacity, data, record, string_table);
-			if (!data)
-				return data;
-			record_length = MDNS_POINTER_OFFSET(data, -2);
-			record_data = data;
+		if (!response) {
+			// Simultaneous probe from another host, the lexicographically later records win
+			// and the loser waits one second before probing again
+			if (mdns_probe_tiebreak(probe, buffer, size) < 0) {
+				probe->sent = 0;
+				probe->deadline = now + MDNS_PROBE_DEFER;
+				++affected;
+			}
+			continue;
 		}
 
-		// TXT strings are unlikely to be shared, just make then raw. Also need one byte for
-		// termination, thus the <= check
-		size_t string_length = record.data.txt.key.length + record.data.txt.value.length + 1;
-		if (!data)
-			return 0;
-		remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-		if ((remain <= string_length) || (string_length > 0x3FFF))
-			return 0;
-
-		unsigned char* strdata = (unsigned char*)data;
-		*strdata++ = (unsigned char)string_length;
-		memcpy(strdata, record.data.txt.key.str, record.data.txt.key.length);
-		strdata += record.data.txt.key.length;
-		*strdata++ = '=';
-		memcpy(strdata, record.data.txt.value.str, record.data.txt.value.length);
-		strdata += record.data.txt.value.length;
+		int proposed = 0;
+		for (size_t irec = 0; !proposed && (irec < probe->record_count); ++irec)
+			proposed = mdns_record_equal_wire(probe->records + irec, buffer, size, name_offset,
+			                                  rtype, record_offset, record_length);
+		if (proposed)
+			continue;
 
-		data = strdata;
+		probe->state = MDNS_PROBESTATE_CONFLICT;
+		if (!prober->conflict_count ||
+		    ((now - prober->conflict_start) > MDNS_PROBE_CONFLICT_WINDOW)) {
+			prober->conflict_start = now;
+			prober->conflict_count = 0;
+		}
+		++prober->conflict_count;
+		++affected;
 	}
+	if (affected)
+		mdns_prober_update_next(prober);
+	return affected;
+}
 
-	// Fill record length
-	if (record_data)
-		mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+static inline void
+mdns_announcer_init(mdns_announcer_t* announcer, mdns_announcement_t* announcements,
+                    size_t capacity) {
+	memset(announcer, 0, sizeof(mdns_announcer_t));
+	announcer->announcements = announcements;
+	announcer->capacity = capacity;
+	announcer->next = MDNS_TIME_NEVER;
+}
 
-	return data;
+static inline void
+mdns_announcer_update_next(mdns_announcer_t* announcer) {
+	announcer->next = MDNS_TIME_NEVER;
+	for (size_t iann = 0; iann < announcer->count; ++iann) {
+		if (announcer->announcements[iann].deadline < announcer->next)
+			announcer->next = announcer->announcements[iann].deadline;
+	}
 }
 
-static inline uint16_t
-mdns_answer_get_record_count(const mdns_record_t* records, size_t record_count) {
-	// TXT records will be coalesced into one record
-	uint16_t total_count = 0;
-	uint16_t txt_record = 0;
-	for (size_t irec = 0; irec < record_count; ++irec) {
-		if (records[irec].type == MDNS_RECORDTYPE_TXT)
-			txt_record = 1;
-		else
-			++total_count;
+static inline int
+mdns_announcement_is_goodbye(const mdns_announcement_t* announcement) {
+	return !announcement->record.ttl;
+}
+
+static inline mdns_announcement_t*
+mdns_announcer_find(mdns_announcer_t* announcer, const mdns_record_t* record) {
+	for (size_t iann = 0; iann < announcer->count; ++iann) {
+		if (mdns_record_equal(&announcer->announcements[iann].record, record))
+			return announcer->announcements + iann;
 	}
-	return total_count + txt_record;
+	return 0;
+}
+
+static inline void
+mdns_announcer_schedule(mdns_announcer_t* announcer, mdns_announcement_t* announcement,
+                        mdns_record_t record, uint64_t now, int remaining) {
+	announcement->record = record;
+	announcement->deadline = now;
+	announcement->interval = MDNS_ANNOUNCE_INTERVAL;
+	announcement->remaining = remaining;
+	announcement->flags = 0;
+	if (now < announcer->next)
+		announcer->next = now;
 }
 
 static inline int
-mdns_query_answer_unicast(int sock, const void* address, size_t address_size, void* buffer,
-                          size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
-                          const char* name, size_t name_length, mdns_record_t answer,
-                          const mdns_record_t* authority, size_t authority_count,
-                          const mdns_record_t* additional, size_t additional_count) {
-	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+mdns_announcer_add(mdns_announcer_t* announcer, uint64_t now, mdns_record_t record) {
+	mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 60);
+	if (!record.ttl)
 		return -1;
 
-	// According to RFC 6762:
-	// The cache-flush bit MUST NOT be set in any resource records in a response message
-	// sent in legacy unicast responses to UDP ports other than 5353.
-	uint16_t rclass = MDNS_CLASS_IN;
-	uint32_t ttl = 10;
-
-	// Basic answer structure
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	header->query_id = htons(query_id);
-	header->flags = htons(0x8400);
-	header->questions = htons(1);
-	header->answer_rrs = htons(1);
-	header->authority_rrs = htons(mdns_answer_get_record_count(authority, authority_count));
-	header->additional_rrs = htons(mdns_answer_get_record_count(additional, additional_count));
+	// Restart a pending announcement, or replace a pending goodbye, for the same record. The sent
+	// count is kept so a goodbye following the restart still knows the record was announced
+	mdns_announcement_t* announcement = mdns_announcer_find(announcer, &record);
+	if (!announcement) {
+		if (announcer->count >= announcer->capacity)
+			return -1;
+		announcement = announcer->announcements + announcer->count++;
+		announcement->sent = 0;
+	}
+	mdns_announcer_schedule(announcer, announcement, record, now, MDNS_ANNOUNCE_COUNT);
+	return 0;
+}
 
-	mdns_string_table_t string_table = {{0}, 0, 0};
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
+static inline int
+mdns_announcer_goodbye(mdns_announcer_t* announcer, uint64_t now, mdns_record_t record) {
+	mdns_record_update_rclass_ttl(&record, MDNS_CLASS_IN, 0);
+
+	mdns_announcement_t* announcement = mdns_announcer_find(announcer, &record);
+	if (announcement && !announcement->sent && !mdns_announcement_is_goodbye(announcement)) {
+		// Never announced, so no host has the record cached
+		*announcement = announcer->announcements[--announcer->count];
+		mdns_announcer_update_next(announcer);
+		return 0;
+	}
+	if (!announcement) {
+		if (announcer->count >= announcer->capacity)
+			return -1;
+		announcement = announcer->announcements + announcer->count++;
+		announcement->sent = 0;
+	}
+	mdns_announcer_schedule(announcer, announcement, record, now, 1);
+	return 0;
+}
 
-	// Fill in question
-	data = mdns_answer_add_question_unicast(buffer, capacity, data, record_type, name, name_length,
-	                                        &string_table);
+static inline int
+mdns_announcer_update(mdns_announcer_t* announcer, uint64_t now, mdns_record_t old_record,
+                      mdns_record_t record) {
+	if (!mdns_record_equal(&old_record, &record) &&
+	    mdns_announcer_goodbye(announcer, now, old_record))
+		return -1;
+	return mdns_announcer_add(announcer, now, record);
+}
 
-	// Fill in answer
-	answer.rclass = rclass;
-	answer.ttl = ttl;
-	data = mdns_answer_add_record(buffer, capacity, data, answer, &string_table);
+static inline uint64_t
+mdns_announcer_next_deadline(const mdns_announcer_t* announcer) {
+	return announcer->next;
+}
 
-	// Fill in authority records
-	for (size_t irec = 0; data && (irec < authority_count); ++irec) {
-		mdns_record_t record = authority[irec];
-		record.rclass = rclass;
-		if (!record.ttl)
-			record.ttl = ttl;
-		data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+static inline void*
+mdns_announcer_add_txt_record(mdns_announcer_t* announcer, size_t due, size_t first,
+                              void* buffer, size_t capacity, void* data,
+                              mdns_string_table_t* string_table) {
+	// Coalesce all due TXT key-value pairs for the same name, either all goodbyes or all
+	// announcements, into one record
+	mdns_announcement_t* announcement = announcer->announcements + first;
+	data = mdns_answer_add_record_header(buffer, capacity, data, announcement->record,
+	                                     string_table);
+	if (!data)
+		return 0;
+	void* record_length = MDNS_POINTER_OFFSET(data, -2);
+	void* record_data = data;
+	for (size_t iann = first; data && (iann < due); ++iann) {
+		mdns_announcement_t* next = announcer->announcements + iann;
+		if (next->flags ||
+		    (mdns_announcement_is_goodbye(next) != mdns_announcement_is_goodbye(announcement)) ||
+		    !mdns_record_is_txt_pair(&next->record) ||
+		    !mdns_string_equal_dotted(MDNS_STRING_ARGS(next->record.name),
+		                              MDNS_STRING_ARGS(announcement->record.name)))
+			continue;
+		data = mdns_answer_add_txt_value(buffer, capacity, data, &next->record);
 	}
-	data = mdns_answer_add_txt_record(buffer, capacity, data, authority, authority_count,
-	                                  rclass, ttl, &string_table);
+	if (data)
+		mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+	return data;
+}
 
-	// Fill in additional records
-	for (size_t irec = 0; data && (irec < additional_count); ++irec) {
-		mdns_record_t record = additional[irec];
-		record.rclass = rclass;
-		if (!record.ttl)
-			record.ttl = ttl;
-		data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+static inline void
+mdns_announcer_mark_txt_record(mdns_announcer_t* announcer, size_t due, size_t first) {
+	mdns_announcement_t* announcement = announcer->announcements + first;
+	for (size_t iann = first; iann < due; ++iann) {
+		mdns_announcement_t* next = announcer->announcements + iann;
+		if ((mdns_announcement_is_goodbye(next) == mdns_announcement_is_goodbye(announcement)) &&
+		    mdns_record_is_txt_pair(&next->record) &&
+		    mdns_string_equal_dotted(MDNS_STRING_ARGS(next->record.name),
+		                             MDNS_STRING_ARGS(announcement->record.name)))
+			next->flags = 1;
 	}
-	data = mdns_answer_add_txt_record(buffer, capacity, data, additional, additional_count,
-	                                  rclass, ttl, &string_table);
-	if (!data)
-		return -1;
+}
+
+static inline int
+mdns_announcer_add_records(mdns_announcer_t* announcer, size_t due, int goodbye,
+                           mdns_packet_t* packet) {
+	for (size_t iann = 0; iann < due; ++iann) {
+		mdns_announcement_t* announcement = announcer->announcements + iann;
+		if (announcement->flags || (mdns_announcement_is_goodbye(announcement) != goodbye))
+			continue;
+		if (!mdns_record_is_txt_pair(&announcement->record)) {
+			announcement->flags = 1;
+			if (mdns_packet_add_record(packet, MDNS_ENTRYTYPE_ANSWER, announcement->record))
+				return -1;
+			continue;
+		}
 
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
-	return mdns_unicast_send(sock, address, address_size, buffer, tosend);
+		while (1) {
+			mdns_string_table_t string_table = packet->string_table;
+			void* data = mdns_announcer_add_txt_record(announcer, due, iann, packet->buffer,
+			                                           packet->capacity, packet->data,
+			                                           &packet->string_table);
+			if (data) {
+				packet->data = data;
+				++packet->count[MDNS_ENTRYTYPE_ANSWER];
+				break;
+			}
+			if (mdns_packet_overflow(packet, &string_table, 0))
+				return -1;
+		}
+		mdns_announcer_mark_txt_record(announcer, due, iann);
+	}
+	return 0;
 }
 
 static inline int
-mdns_answer_multicast_rclass_ttl(int sock, void* buffer, size_t capacity, mdns_record_t answer,
-                                 const mdns_record_t* authority, size_t authority_count,
-                                 const mdns_record_t* additional, size_t additional_count,
-                                 uint16_t rclass, uint32_t ttl) {
+mdns_announcer_send(mdns_announcer_t* announcer, int sock, void* buffer, size_t capacity,
+                    uint64_t now) {
+	if (!announcer->count || (announcer->next > now))
+		return 0;
 	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
 		return -1;
 
-	// Basic answer structure
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	header->query_id = 0;
-	header->flags = htons(0x8400);
-	header->questions = 0;
-	header->answer_rrs = htons(1);
-	header->authority_rrs = htons(mdns_answer_get_record_count(authority, authority_count));
-	header->additional_rrs = htons(mdns_answer_get_record_count(additional, additional_count));
-
-	mdns_string_table_t string_table = {{0}, 0, 0};
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
-
-	// Fill in answer
-	mdns_record_t record = answer;
-	mdns_record_update_rclass_ttl(&record, rclass, ttl);
-	data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
-
-	// Fill in authority records
-	for (size_t irec = 0; data && (irec < authority_count); ++irec) {
-		record = authority[irec];
-		mdns_record_update_rclass_ttl(&record, rclass, ttl);
-		data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+	// Move all announcements due within the aggregation window to the front
+	uint64_t limit = now + MDNS_AGGREGATION_WINDOW;
+	size_t due = 0;
+	for (size_t iann = 0; iann < announcer->count; ++iann) {
+		mdns_announcement_t* announcement = announcer->announcements + iann;
+		if (announcement->deadline > limit)
+			continue;
+		announcement->flags = 0;
+		if (iann != due) {
+			mdns_announcement_t swap = announcer->announcements[due];
+			announcer->announcements[due] = *announcement;
+			*announcement = swap;
+		}
+		++due;
 	}
-	data = mdns_answer_add_txt_record(buffer, capacity, data, authority, authority_count,
-	                                  rclass, ttl, &string_table);
 
-	// Fill in additional records
-	for (size_t irec = 0; data && (irec < additional_count); ++irec) {
-		record = additional[irec];
-		mdns_record_update_rclass_ttl(&record, rclass, ttl);
-		data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+	// Goodbyes first, so a record replaced by an update is removed before the new record is
+	// cached, split over as many packets as needed
+	mdns_packet_t packet;
+	mdns_packet_init(&packet, sock, 0, 0, buffer, capacity, 0, 0x8400);
+	int ret = mdns_announcer_add_records(announcer, due, 1, &packet);
+	if (!ret)
+		ret = mdns_announcer_add_records(announcer, due, 0, &packet);
+	if (!ret)
+		ret = mdns_packet_flush(&packet, 0);
+
+	// Reschedule the following announcements at doubling intervals and remove completed ones,
+	// even if send fails
+	size_t iann = 0;
+	while (iann < due) {
+		mdns_announcement_t* announcement = announcer->announcements + iann;
+		++announcement->sent;
+		if (--announcement->remaining > 0) {
+			announcement->deadline = now + announcement->interval;
+			announcement->interval *= 2;
+			++iann;
+			continue;
+		}
+		*announcement = announcer->announcements[--due];
+		announcer->announcements[due] = announcer->announcements[--announcer->count];
 	}
-	data = mdns_answer_add_txt_record(buffer, capacity, data, additional, additional_count,
-	                                  rclass, ttl, &string_table);
-	if (!data)
+	mdns_announcer_update_next(announcer);
+
+	if (ret)
 		return -1;
+	return (int)packet.sent;
+}
 
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
-	return mdns_multicast_send(sock, buffer, tosend);
+static inline int
+mdns_address_prefix_equal(const uint8_t* lhs, const uint8_t* rhs, unsigned int prefix_length) {
+	size_t bytes = prefix_length / 8;
+	if (memcmp(lhs, rhs, bytes))
+		return 0;
+	unsigned int bits = prefix_length % 8;
+	if (!bits)
+		return 1;
+	uint8_t mask = (uint8_t)(0xFF << (8 - bits));
+	return ((lhs[bytes] ^ rhs[bytes]) & mask) ? 0 : 1;
 }
 
 static inline int
-mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
-                            const mdns_record_t* authority, size_t authority_count,
-                            const mdns_record_t* additional, size_t additional_count) {
-	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
-	                                        authority_count, additional, additional_count,
-	                                        MDNS_CLASS_IN, 60);
+mdns_address_in_network(const struct sockaddr* addr, const struct sockaddr* network,
+                        unsigned int prefix_length) {
+	static const uint8_t mapped_prefix[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+	if (network->sa_family == AF_INET) {
+		const struct sockaddr_in* network_ipv4 = (const struct sockaddr_in*)network;
+		const uint8_t* address;
+		if (addr->sa_family == AF_INET) {
+			address = (const uint8_t*)&((const struct sockaddr_in*)addr)->sin_addr;
+		} else if (addr->sa_family == AF_INET6) {
+			const uint8_t* address_ipv6 =
+			    (const uint8_t*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+			if (memcmp(address_ipv6, mapped_prefix, sizeof(mapped_prefix)))
+				return 0;
+			address = address_ipv6 + sizeof(mapped_prefix);
+		} else {
+			return 0;
+		}
+		if (prefix_length > 32)
+			prefix_length = 32;
+		return mdns_address_prefix_equal(address, (const uint8_t*)&network_ipv4->sin_addr,
+		                                 prefix_length);
+	}
+	if ((network->sa_family != AF_INET6) || (addr->sa_family != AF_INET6))
+		return 0;
+
+	const struct sockaddr_in6* network_ipv6 = (const struct sockaddr_in6*)network;
+	const struct sockaddr_in6* addr_ipv6 = (const struct sockaddr_in6*)addr;
+	const uint8_t* network_address = (const uint8_t*)&network_ipv6->sin6_addr;
+	// Link-local networks (fe80::/10) exist once per interface, identified by the scope
+	if ((network_address[0] == 0xfe) && ((network_address[1] & 0xc0) == 0x80) &&
+	    network_ipv6->sin6_scope_id && addr_ipv6->sin6_scope_id &&
+	    (network_ipv6->sin6_scope_id != addr_ipv6->sin6_scope_id))
+		return 0;
+	if (prefix_length > 128)
+		prefix_length = 128;
+	return mdns_address_prefix_equal((const uint8_t*)&addr_ipv6->sin6_addr, network_address,
+	                                 prefix_length);
+}
+
+static inline mdns_string_t
+mdns_reverse_name_make(char* buffer, size_t capacity, const struct sockaddr* addr) {
+	static const char hex[] = "0123456789abcdef";
+	mdns_string_t name = {buffer, 0};
+	size_t length = 0;
+	if (addr->sa_family == AF_INET) {
+		const uint8_t* bytes = (const uint8_t*)&((const struct sockaddr_in*)addr)->sin_addr;
+		if (capacity < 30)
+			return name;
+		for (int ibyte = 3; ibyte >= 0; --ibyte) {
+			unsigned int value = bytes[ibyte];
+			if (value >= 100)
+				buffer[length++] = (char)('0' + (value / 100));
+			if (value >= 10)
+				buffer[length++] = (char)('0' + ((value / 10) % 10));
+			buffer[length++] = (char)('0' + (value % 10));
+			buffer[length++] = '.';
+		}
+		memcpy(buffer + length, "in-addr.arpa.", 14);
+		name.length = length + 13;
+	} else if (addr->sa_family == AF_INET6) {
+		const uint8_t* bytes = (const uint8_t*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+		if (capacity < 74)
+			return name;
+		for (int ibyte = 15; ibyte >= 0; --ibyte) {
+			buffer[length++] = hex[bytes[ibyte] & 0xF];
+			buffer[length++] = '.';
+			buffer[length++] = hex[bytes[ibyte] >> 4];
+			buffer[length++] = '.';
+		}
+		memcpy(buffer + length, "ip6.arpa.", 10);
+		name.length = length + 9;
+	}
+	return name;
 }
 
 static inline int
-mdns_announce_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
-                        const mdns_record_t* authority, size_t authority_count,
-                        const  mdns_record_t* additional, size_t additional_count) {
-	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
-	                                        authority_count, additional, additional_count,
-	                                        MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 60);
+mdns_reverse_label_equal(const void* buffer, mdns_string_pair_t label, const char* str,
+                         size_t length) {
+	return (label.length == length) &&
+	       !strncasecmp((const char*)MDNS_POINTER_OFFSET_CONST(buffer, label.offset), str, length);
 }
 
 static inline int
-mdns_goodbye_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
-                       const mdns_record_t* authority, size_t authority_count,
-                       const mdns_record_t* additional, size_t additional_count) {
-	// Goodbye should have ttl of 0
-	return mdns_answer_multicast_rclass_ttl(sock, buffer, capacity, answer, authority,
-	                                        authority_count, additional, additional_count,
-	                                        MDNS_CLASS_IN, 0);
+mdns_reverse_name_parse(const void* buffer, size_t size, size_t offset,
+                        struct sockaddr_storage* addr) {
+	// Collect the labels, an IPv6 name has 32 nibble labels followed by "ip6" and "arpa"
+	mdns_string_pair_t labels[35];
+	size_t count = 0;
+	mdns_string_pair_t substr;
+	do {
+		substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || (count >= (sizeof(labels) / sizeof(labels[0]))))
+			return -1;
+		labels[count++] = substr;
+		offset = substr.offset + substr.length;
+	} while (substr.length);
+	--count;
+
+	const uint8_t* data = (const uint8_t*)buffer;
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if ((count == 6) && mdns_reverse_label_equal(buffer, labels[4], "in-addr", 7) &&
+	    mdns_reverse_label_equal(buffer, labels[5], "arpa", 4)) {
+		struct sockaddr_in* addr_ipv4 = (struct sockaddr_in*)addr;
+		uint8_t* bytes = (uint8_t*)&addr_ipv4->sin_addr;
+		for (size_t ilabel = 0; ilabel < 4; ++ilabel) {
+			if (!labels[ilabel].length || (labels[ilabel].length > 3))
+				return -1;
+			unsigned int value = 0;
+			for (size_t ichar = 0; ichar < labels[ilabel].length; ++ichar) {
+				uint8_t c = data[labels[ilabel].offset + ichar];
+				if ((c < '0') || (c > '9'))
+					return -1;
+				value = (value * 10) + (unsigned int)(c - '0');
+			}
+			if (value > 255)
+				return -1;
+			bytes[3 - ilabel] = (uint8_t)value;
+		}
+		addr_ipv4->sin_family = AF_INET;
+#ifdef __APPLE__
+		addr_ipv4->sin_len = sizeof(struct sockaddr_in);
+#endif
+		return 0;
+	}
+	if ((count == 34) && mdns_reverse_label_equal(buffer, labels[32], "ip6", 3) &&
+	    mdns_reverse_label_equal(buffer, labels[33], "arpa", 4)) {
+		struct sockaddr_in6* addr_ipv6 = (struct sockaddr_in6*)addr;
+		uint8_t* bytes = (uint8_t*)&addr_ipv6->sin6_addr;
+		for (size_t ilabel = 0; ilabel < 32; ++ilabel) {
+			if (labels[ilabel].length != 1)
+				return -1;
+			uint8_t c = data[labels[ilabel].offset];
+			unsigned int nibble;
+			if ((c >= '0') && (c <= '9'))
+				nibble = (unsigned int)(c - '0');
+			else if ((c >= 'a') && (c <= 'f'))
+				nibble = (unsigned int)(c - 'a' + 10);
+			else if ((c >= 'A') && (c <= 'F'))
+				nibble = (unsigned int)(c - 'A' + 10);
+			else
+				return -1;
+			// The first label is the low nibble of the last byte
+			bytes[15 - (ilabel / 2)] |= (uint8_t)((ilabel & 1) ? (nibble << 4) : nibble);
+		}
+		addr_ipv6->sin6_family = AF_INET6;
+#ifdef __APPLE__
+		addr_ipv6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+		return 0;
+	}
+	return -1;
 }
 
 static inline mdns_string_t
@@ -1612,6 +7261,36 @@ mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t len
 	return parsed;
 }
 
+static inline mdns_record_nsec_t
+mdns_record_parse_nsec(const void* buffer, size_t size, size_t offset, size_t length,
+                       char* strbuffer, size_t capacity) {
+	mdns_record_nsec_t nsec;
+	memset(&nsec, 0, sizeof(mdns_record_nsec_t));
+	// NSEC record format (RFC 4034 section 4.1), a domain name followed by window blocks of one
+	// byte window number, one byte bitmap length and up to 32 bytes of bitmap
+	if ((size < offset + length) || (length < 2))
+		return nsec;
+	size_t end = offset + length;
+	size_t block = offset;
+	if (!mdns_string_skip(buffer, size, &block) || (block > end))
+		return nsec;
+	if (strbuffer)
+		nsec.name = mdns_string_extract(buffer, size, &offset, strbuffer, capacity);
+	while ((block + 2) <= end) {
+		const uint8_t* blockdata = (const uint8_t*)MDNS_POINTER_OFFSET_CONST(buffer, block);
+		size_t bitmap_length = blockdata[1];
+		if (!bitmap_length || (bitmap_length > 32) || ((block + 2 + bitmap_length) > end))
+			break;
+		if (blockdata[0] == 0) {
+			if (bitmap_length > sizeof(nsec.bitmap))
+				bitmap_length = sizeof(nsec.bitmap);
+			memcpy(nsec.bitmap, blockdata + 2, bitmap_length);
+		}
+		block += 2 + blockdata[1];
+	}
+	return nsec;
+}
+
 #ifdef _WIN32
 #undef strncasecmp
 #endif
@@ -0,0 +1,897 @@
+#include <stdio.h>
+
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdns.h"
+#include "mdnsd.h"
+
+#define MAX_CLIENTS 64
+#define MAX_BROWSES 64
+#define MAX_SUBSCRIPTIONS 256
+#define MAX_RESOLVES 128
+#define CACHE_CAPACITY 1024
+
+typedef struct client_t {
+	int fd;
+	int failed;
+	size_t size;
+	uint8_t buffer[MDNSD_MESSAGE_MAX];
+} client_t;
+
+// A browsed service type shared by all clients browsing for it
+typedef struct browse_type_t {
+	char name[256];
+	size_t length;
+	size_t subscribers;
+} browse_type_t;
+
+typedef struct subscription_t {
+	int client;
+	uint32_t id;
+	browse_type_t* type;
+} subscription_t;
+
+typedef struct resolve_request_t {
+	int client;
+	uint32_t id;
+	int active;
+} resolve_request_t;
+
+static volatile sig_atomic_t running = 1;
+
+static int mdns_sockets[2];
+static int num_mdns_sockets;
+static uint8_t mdns_buffer[2048];
+
+static client_t clients[MAX_CLIENTS];
+static browse_type_t browse_types[MAX_BROWSES];
+static subscription_t subscriptions[MAX_SUBSCRIPTIONS];
+static resolve_request_t resolves[MAX_RESOLVES];
+
+static mdns_cache_entry_t cache_entries[CACHE_CAPACITY];
+static size_t cache_buckets[256];
+static mdns_cache_t cache;
+static mdns_browse_t browses[MAX_BROWSES];
+static mdns_browser_t browser;
+static mdns_resolve_t resolve_slots[MAX_RESOLVES];
+static mdns_resolver_t resolver;
+
+// Names of pending resolves are copied by the resolver into the arena, most hostnames fit in the
+// 32 and 64 byte size classes
+static uint8_t resolve_names[16384];
+static mdns_arena_t resolve_arena;
+
+static uint8_t list_buffer[65536];
+
+static void
+signal_handler(int signal) {
+	(void)sizeof(signal);
+	running = 0;
+}
+
+static uint64_t
+time_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+}
+
+static uint64_t
+time_wall_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+}
+
+static size_t
+padded(size_t size) {
+	return (size + 3) & ~(size_t)3;
+}
+
+// Send a message to a client, optionally passing a file descriptor. A client not keeping up with
+// its messages is disconnected rather than blocking the daemon. The client is closed by the main
+// loop, since sends happen from within the browser and resolver callbacks
+static void
+client_send(int iclient, uint16_t type, uint16_t value, uint32_t id, const void* body,
+            size_t body_size, const char* name, size_t length, int pass_fd) {
+	client_t* client = clients + iclient;
+	if ((client->fd < 0) || client->failed)
+		return;
+	uint8_t message[MDNSD_MESSAGE_MAX];
+	size_t size = sizeof(mdnsd_header_t) + body_size + padded(length);
+	if (size > sizeof(message))
+		return;
+	memset(message, 0, size);
+	mdnsd_header_t* header = (mdnsd_header_t*)(void*)message;
+	header->size = (uint32_t)size;
+	header->type = type;
+	header->value = value;
+	header->id = id;
+	if (body_size)
+		memcpy(message + sizeof(mdnsd_header_t), body, body_size);
+	if (length)
+		memcpy(message + sizeof(mdnsd_header_t) + body_size, name, length);
+
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = size;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	if (pass_fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	if (sendmsg(client->fd, &msg, 0) != (ssize_t)size)
+		client->failed = 1;
+}
+
+static void
+client_error(int iclient, uint32_t id, mdnsd_error_t error) {
+	client_send(iclient, MDNSD_ERROR, (uint16_t)error, id, 0, 0, 0, 0, -1);
+}
+
+static void
+send_instance(const subscription_t* subscription, mdns_browse_event_t event, mdns_string_t instance,
+              size_t entry) {
+	mdnsd_name_t body;
+	memset(&body, 0, sizeof(body));
+	body.ttl = mdns_cache_entry_ttl(&cache, entry);
+	body.length = (uint16_t)instance.length;
+	client_send(subscription->client, MDNSD_INSTANCE, (uint16_t)event, subscription->id, &body,
+	            sizeof(body), instance.str, instance.length, -1);
+}
+
+// Forward the instance events of a browsed type to every client browsing for it, and keep the
+// instances found fresh in the cache
+static void
+browse_callback(mdns_browser_t* browser_, const mdns_browse_t* browse, mdns_browse_event_t event,
+                mdns_string_t instance, size_t entry, void* user_data) {
+	(void)sizeof(browse);
+	browse_type_t* type = (browse_type_t*)user_data;
+	if (event == MDNS_BROWSEEVENT_ADDED)
+		mdns_cache_set_interest(browser_->cache, entry, 1);
+	for (size_t isub = 0; isub < MAX_SUBSCRIPTIONS; ++isub) {
+		if ((subscriptions[isub].client >= 0) && (subscriptions[isub].type == type))
+			send_instance(subscriptions + isub, event, instance, entry);
+	}
+}
+
+static void
+resolve_callback(mdns_resolver_t* resolver_, const char* name, size_t length, size_t entry,
+                 void* user_data) {
+	(void)sizeof(name);
+	(void)sizeof(length);
+	resolve_request_t* request = (resolve_request_t*)user_data;
+	request->active = 0;
+	if (request->client < 0)
+		return;
+	if (entry == MDNS_INVALID_POS) {
+		client_error(request->client, request->id, MDNSD_ERROR_TIMEOUT);
+		return;
+	}
+	struct sockaddr_storage addr;
+	if (mdns_cache_entry_address(resolver_->cache, entry, &addr) < 0) {
+		client_error(request->client, request->id, MDNSD_ERROR_INVALID);
+		return;
+	}
+	mdnsd_address_t body;
+	memset(&body, 0, sizeof(body));
+	body.ttl = mdns_cache_entry_ttl(resolver_->cache, entry);
+	body.family = addr.ss_family;
+	if (addr.ss_family == AF_INET)
+		memcpy(body.address, &((const struct sockaddr_in*)&addr)->sin_addr, 4);
+	else
+		memcpy(body.address, &((const struct sockaddr_in6*)&addr)->sin6_addr, 16);
+	client_send(request->client, MDNSD_ADDRESS, 0, request->id, &body, sizeof(body), 0, 0, -1);
+}
+
+// Remove a subscription, and stop browsing for the type when the last subscriber is gone
+static void
+subscription_remove(subscription_t* subscription) {
+	browse_type_t* type = subscription->type;
+	subscription->client = -1;
+	subscription->type = 0;
+	if (--type->subscribers)
+		return;
+	mdns_browser_remove(&browser, type->name, type->length);
+	type->length = 0;
+}
+
+static void
+client_close(int iclient) {
+	client_t* client = clients + iclient;
+	if (client->fd < 0)
+		return;
+	close(client->fd);
+	client->fd = -1;
+	client->failed = 0;
+	client->size = 0;
+	for (size_t isub = 0; isub < MAX_SUBSCRIPTIONS; ++isub) {
+		if (subscriptions[isub].client == iclient)
+			subscription_remove(subscriptions + isub);
+	}
+	// Pending resolves complete without a client to answer
+	for (size_t ires = 0; ires < MAX_RESOLVES; ++ires) {
+		if (resolves[ires].active && (resolves[ires].client == iclient))
+			resolves[ires].client = -1;
+	}
+}
+
+// Walk the cached instances of a service type
+static size_t
+cached_instance_next(const char* name, size_t length, size_t previous, mdns_string_t* instance,
+                     char* buffer, size_t capacity) {
+	size_t entry = mdns_cache_find(&cache, name, length, MDNS_RECORDTYPE_PTR, previous);
+	if (entry != MDNS_INVALID_POS) {
+		const mdns_cache_entry_t* record = cache.entries + entry;
+		*instance = mdns_record_parse_ptr(record->storage,
+		                                  (size_t)record->name_size + record->data_size,
+		                                  record->name_size, record->data_size, buffer, capacity);
+	}
+	return entry;
+}
+
+static void
+handle_resolve(int iclient, const mdnsd_header_t* header, const uint8_t* body, size_t size) {
+	const mdnsd_resolve_t* request = (const mdnsd_resolve_t*)(const void*)body;
+	if ((size < sizeof(mdnsd_resolve_t)) || !request->length ||
+	    (request->length > (size - sizeof(mdnsd_resolve_t))) || (request->length > 255) ||
+	    ((request->rtype != MDNS_RECORDTYPE_A) && (request->rtype != MDNS_RECORDTYPE_AAAA) &&
+	     (request->rtype != MDNS_RECORDTYPE_ANY))) {
+		client_error(iclient, header->id, MDNSD_ERROR_INVALID);
+		return;
+	}
+	resolve_request_t* slot = 0;
+	for (size_t ires = 0; !slot && (ires < MAX_RESOLVES); ++ires) {
+		if (!resolves[ires].active)
+			slot = resolves + ires;
+	}
+	if (!slot) {
+		client_error(iclient, header->id, MDNSD_ERROR_FULL);
+		return;
+	}
+	slot->client = iclient;
+	slot->id = header->id;
+	slot->active = 1;
+	const char* name = (const char*)body + sizeof(mdnsd_resolve_t);
+	if (mdns_resolve(&resolver, time_now_ms(), name, request->length,
+	                 (mdns_record_type_t)request->rtype, request->timeout, resolve_callback,
+	                 slot) < 0) {
+		slot->active = 0;
+		client_error(iclient, header->id, MDNSD_ERROR_FULL);
+	}
+}
+
+static void
+handle_browse(int iclient, const mdnsd_header_t* header, const uint8_t* body, size_t size) {
+	const mdnsd_name_t* request = (const mdnsd_name_t*)(const void*)body;
+	if ((size < sizeof(mdnsd_name_t)) || !request->length ||
+	    (request->length > (size - sizeof(mdnsd_name_t))) || (request->length > 255)) {
+		client_error(iclient, header->id, MDNSD_ERROR_INVALID);
+		return;
+	}
+	const char* name = (const char*)body + sizeof(mdnsd_name_t);
+	size_t length = request->length;
+
+	subscription_t* subscription = 0;
+	for (size_t isub = 0; !subscription && (isub < MAX_SUBSCRIPTIONS); ++isub) {
+		if (subscriptions[isub].client < 0)
+			subscription = subscriptions + isub;
+	}
+	browse_type_t* type = 0;
+	browse_type_t* free_type = 0;
+	for (size_t itype = 0; !type && (itype < MAX_BROWSES); ++itype) {
+		browse_type_t* candidate = browse_types + itype;
+		if (!candidate->length) {
+			if (!free_type)
+				free_type = candidate;
+		} else if ((candidate->length == length) && !strncasecmp(candidate->name, name, length)) {
+			type = candidate;
+		}
+	}
+	if (!subscription || (!type && !free_type)) {
+		client_error(iclient, header->id, MDNSD_ERROR_FULL);
+		return;
+	}
+	subscription->client = iclient;
+	subscription->id = header->id;
+
+	if (type) {
+		// Already browsed for by another client, report the instances cached so far
+		subscription->type = type;
+		++type->subscribers;
+		char buffer[256];
+		mdns_string_t instance;
+		for (size_t entry =
+		         cached_instance_next(name, length, MDNS_INVALID_POS, &instance, buffer, 256);
+		     entry != MDNS_INVALID_POS;
+		     entry = cached_instance_next(name, length, entry, &instance, buffer, 256))
+			send_instance(subscription, MDNS_BROWSEEVENT_ADDED, instance, entry);
+		return;
+	}
+
+	type = free_type;
+	memcpy(type->name, name, length);
+	type->length = length;
+	type->subscribers = 1;
+	subscription->type = type;
+	if (mdns_browser_add(&browser, time_now_ms(), type->name, type->length, browse_callback,
+	                     type) < 0) {
+		subscription->client = -1;
+		subscription->type = 0;
+		type->length = 0;
+		client_error(iclient, header->id, MDNSD_ERROR_FULL);
+	}
+}
+
+static void
+handle_cancel(int iclient, const mdnsd_header_t* header) {
+	for (size_t isub = 0; isub < MAX_SUBSCRIPTIONS; ++isub) {
+		if ((subscriptions[isub].client == iclient) && (subscriptions[isub].id == header->id))
+			subscription_remove(subscriptions + isub);
+	}
+}
+
+// Pass a large list in a shared memory object, returning the file descriptor or -1 if error
+static int
+shared_list_create(const void* data, size_t size) {
+	static unsigned int counter;
+	char name[64];
+	snprintf(name, sizeof(name), "/mdnsd-%d-%u", (int)getpid(), counter++);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return -1;
+	shm_unlink(name);
+	void* memory = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0)
+		memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (memory == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	memcpy(memory, data, size);
+	munmap(memory, size);
+	return fd;
+}
+
+static void
+handle_list(int iclient, const mdnsd_header_t* header, const uint8_t* body, size_t size) {
+	const mdnsd_name_t* request = (const mdnsd_name_t*)(const void*)body;
+	if ((size < sizeof(mdnsd_name_t)) || !request->length ||
+	    (request->length > (size - sizeof(mdnsd_name_t))) || (request->length > 255)) {
+		client_error(iclient, header->id, MDNSD_ERROR_INVALID);
+		return;
+	}
+	const char* name = (const char*)body + sizeof(mdnsd_name_t);
+	size_t length = request->length;
+
+	mdnsd_list_t list;
+	memset(&list, 0, sizeof(list));
+	char buffer[256];
+	mdns_string_t instance;
+	for (size_t entry = cached_instance_next(name, length, MDNS_INVALID_POS, &instance, buffer,
+	                                         sizeof(buffer));
+	     entry != MDNS_INVALID_POS;
+	     entry = cached_instance_next(name, length, entry, &instance, buffer, sizeof(buffer))) {
+		size_t item_size = sizeof(mdnsd_name_t) + padded(instance.length);
+		if ((list.size + item_size) > sizeof(list_buffer))
+			break;
+		mdnsd_name_t* item = (mdnsd_name_t*)(void*)(list_buffer + list.size);
+		memset(item, 0, item_size);
+		item->ttl = mdns_cache_entry_ttl(&cache, entry);
+		item->length = (uint16_t)instance.length;
+		memcpy(item + 1, instance.str, instance.length);
+		list.size += (uint32_t)item_size;
+		++list.count;
+	}
+
+	if (list.size <= MDNSD_INLINE_MAX) {
+		client_send(iclient, MDNSD_LISTED, 0, header->id, &list, sizeof(list),
+		            (const char*)list_buffer, list.size, -1);
+		return;
+	}
+	int fd = shared_list_create(list_buffer, list.size);
+	if (fd < 0) {
+		client_error(iclient, header->id, MDNSD_ERROR_FULL);
+		return;
+	}
+	client_send(iclient, MDNSD_LISTED, MDNSD_LIST_SHARED, header->id, &list, sizeof(list), 0, 0,
+	            fd);
+	close(fd);
+}
+
+// Read from a client and handle each complete request
+static void
+client_read(int iclient) {
+	client_t* client = clients + iclient;
+	ssize_t ret = recv(client->fd, client->buffer + client->size,
+	                   sizeof(client->buffer) - client->size, 0);
+	if (ret <= 0) {
+		if ((ret == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			client_close(iclient);
+		return;
+	}
+	client->size += (size_t)ret;
+	while (!client->failed && (client->size >= sizeof(mdnsd_header_t))) {
+		mdnsd_header_t header;
+		memcpy(&header, client->buffer, sizeof(header));
+		if ((header.size < sizeof(mdnsd_header_t)) || (header.size > MDNSD_MESSAGE_MAX) ||
+		    (header.size & 3)) {
+			client_close(iclient);
+			return;
+		}
+		if (client->size < header.size)
+			break;
+		const uint8_t* body = client->buffer + sizeof(mdnsd_header_t);
+		size_t body_size = header.size - sizeof(mdnsd_header_t);
+		if (header.type == MDNSD_RESOLVE)
+			handle_resolve(iclient, &header, body, body_size);
+		else if (header.type == MDNSD_BROWSE)
+			handle_browse(iclient, &header, body, body_size);
+		else if (header.type == MDNSD_CANCEL)
+			handle_cancel(iclient, &header);
+		else if (header.type == MDNSD_LIST)
+			handle_list(iclient, &header, body, body_size);
+		else
+			client_error(iclient, header.id, MDNSD_ERROR_INVALID);
+		client->size -= header.size;
+		memmove(client->buffer, client->buffer + header.size, client->size);
+	}
+}
+
+static int
+open_mdns_sockets(void) {
+	struct sockaddr_in sock_addr;
+	memset(&sock_addr, 0, sizeof(struct sockaddr_in));
+	sock_addr.sin_family = AF_INET;
+	sock_addr.sin_addr.s_addr = INADDR_ANY;
+	sock_addr.sin_port = htons(MDNS_PORT);
+#ifdef __APPLE__
+	sock_addr.sin_len = sizeof(struct sockaddr_in);
+#endif
+	int sock = mdns_socket_open_ipv4(&sock_addr);
+	if (sock >= 0)
+		mdns_sockets[num_mdns_sockets++] = sock;
+
+	struct sockaddr_in6 sock_addr6;
+	memset(&sock_addr6, 0, sizeof(struct sockaddr_in6));
+	sock_addr6.sin6_family = AF_INET6;
+	sock_addr6.sin6_addr = in6addr_any;
+	sock_addr6.sin6_port = htons(MDNS_PORT);
+#ifdef __APPLE__
+	sock_addr6.sin6_len = sizeof(struct sockaddr_in6);
+#endif
+	sock = mdns_socket_open_ipv6(&sock_addr6);
+	if (sock >= 0)
+		mdns_sockets[num_mdns_sockets++] = sock;
+	return num_mdns_sockets;
+}
+
+// Identity of the listen socket file, so that only the socket we created is removed on exit
+static struct stat listen_stat;
+
+// Create the directory of the listen socket if missing, and make sure no other user can create
+// files in it. Otherwise another user could put a socket of their own at the path before the
+// daemon starts, and have clients connect to it. Returns 0 if the directory is safe
+static int
+socket_directory_check(const char* path) {
+	char dir[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	const char* slash = strrchr(path, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		strcpy(dir, "/");
+	} else {
+		memcpy(dir, path, (size_t)(slash - path));
+		dir[slash - path] = 0;
+	}
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST))
+		return -1;
+	struct stat dir_stat;
+	if (lstat(dir, &dir_stat) < 0)
+		return -1;
+	if (!S_ISDIR(dir_stat.st_mode) || ((dir_stat.st_uid != geteuid()) && dir_stat.st_uid) ||
+	    (dir_stat.st_mode & (S_IWGRP | S_IWOTH))) {
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+open_listen_socket(const char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if (socket_directory_check(path) < 0)
+		return -1;
+
+	// Only remove a stale socket left by a previous daemon of ours, never another file or the
+	// socket of a daemon still running
+	struct stat path_stat;
+	if (lstat(path, &path_stat) == 0) {
+		int running_sock = -1;
+		if (S_ISSOCK(path_stat.st_mode) && (path_stat.st_uid == geteuid()))
+			running_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		int stale = (running_sock >= 0) &&
+		            (connect(running_sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0);
+		if (running_sock >= 0)
+			close(running_sock);
+		if (!stale) {
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	if ((bind(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+	    (lstat(path, &listen_stat) < 0) || (listen(sock, 16) < 0)) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Remove the listen socket file if it is still the one we created
+static void
+close_listen_socket(int sock, const char* path) {
+	close(sock);
+	struct stat path_stat;
+	if ((lstat(path, &path_stat) == 0) && (path_stat.st_dev == listen_stat.st_dev) &&
+	    (path_stat.st_ino == listen_stat.st_ino))
+		unlink(path);
+}
+
+static int
+run_daemon(const char* path, const char* cache_file) {
+	if (open_mdns_sockets() <= 0) {
+		printf("Failed to open mDNS sockets\n");
+		return -1;
+	}
+	int listen_sock = open_listen_socket(path);
+	if (listen_sock < 0) {
+		printf("Failed to listen on %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	// Keep the cache in a mapped file across restarts if given
+	size_t image_size = mdns_cache_image_size(CACHE_CAPACITY);
+	void* image = MAP_FAILED;
+	if (cache_file) {
+		int fd = open(cache_file, O_RDWR | O_CREAT, 0600);
+		if ((fd >= 0) && (ftruncate(fd, (off_t)image_size) == 0))
+			image = mmap(0, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (fd >= 0)
+			close(fd);
+	}
+	if (image != MAP_FAILED) {
+		int restored = mdns_cache_attach(&cache, image, image_size, cache_buckets,
+		                                 sizeof(cache_buckets) / sizeof(size_t), time_now_ms(),
+		                                 time_wall_ms());
+		printf("Restored %d cached records from %s\n", restored, cache_file);
+	} else {
+		mdns_cache_init(&cache, cache_entries, CACHE_CAPACITY, cache_buckets,
+		                sizeof(cache_buckets) / sizeof(size_t), time_now_ms());
+	}
+	mdns_browser_init(&browser, browses, MAX_BROWSES, &cache, (uint32_t)time_now_ms());
+	mdns_resolver_init(&resolver, resolve_slots, MAX_RESOLVES, &cache);
+	mdns_arena_init(&resolve_arena, resolve_names, sizeof(resolve_names));
+	mdns_resolver_set_arena(&resolver, &resolve_arena);
+
+	for (int iclient = 0; iclient < MAX_CLIENTS; ++iclient)
+		clients[iclient].fd = -1;
+	for (size_t isub = 0; isub < MAX_SUBSCRIPTIONS; ++isub)
+		subscriptions[isub].client = -1;
+
+	printf("Listening on %s\n", path);
+	while (running) {
+		uint64_t now = time_now_ms();
+		mdns_cache_expire(&cache, now);
+		mdns_browser_send(&browser, mdns_sockets, (size_t)num_mdns_sockets, mdns_buffer,
+		                  sizeof(mdns_buffer), now);
+		mdns_resolver_send(&resolver, mdns_sockets, (size_t)num_mdns_sockets, mdns_buffer,
+		                   sizeof(mdns_buffer), now);
+		mdns_cache_refresh_send(&cache, mdns_sockets, (size_t)num_mdns_sockets, mdns_buffer,
+		                        sizeof(mdns_buffer));
+
+		int nfds = listen_sock + 1;
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		FD_SET(listen_sock, &readfs);
+		for (int isock = 0; isock < num_mdns_sockets; ++isock) {
+			if (mdns_sockets[isock] >= nfds)
+				nfds = mdns_sockets[isock] + 1;
+			FD_SET(mdns_sockets[isock], &readfs);
+		}
+		for (int iclient = 0; iclient < MAX_CLIENTS; ++iclient) {
+			if (clients[iclient].fd < 0)
+				continue;
+			if (clients[iclient].fd >= nfds)
+				nfds = clients[iclient].fd + 1;
+			FD_SET(clients[iclient].fd, &readfs);
+		}
+
+		// Wake up for the next query or timeout, or to expire cached records
+		uint64_t wait = 1000;
+		uint64_t next = mdns_browser_next_deadline(&browser);
+		uint64_t next_resolve = mdns_resolver_next_deadline(&resolver);
+		if (next_resolve < next)
+			next = next_resolve;
+		if (next <= now)
+			wait = 0;
+		else if ((next - now) < wait)
+			wait = next - now;
+		struct timeval timeout;
+		timeout.tv_sec = (long)(wait / 1000);
+		timeout.tv_usec = (int)((wait % 1000) * 1000);
+
+		if (select(nfds, &readfs, 0, 0, &timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		// Received records are cached at the time of the last expiry
+		mdns_cache_expire(&cache, time_now_ms());
+		for (int isock = 0; isock < num_mdns_sockets; ++isock) {
+			if (FD_ISSET(mdns_sockets[isock], &readfs))
+				mdns_socket_listen(mdns_sockets[isock], mdns_buffer, sizeof(mdns_buffer),
+				                   mdns_cache_record_callback, &cache);
+		}
+		for (int iclient = 0; iclient < MAX_CLIENTS; ++iclient) {
+			if ((clients[iclient].fd >= 0) && FD_ISSET(clients[iclient].fd, &readfs))
+				client_read(iclient);
+			if (clients[iclient].failed)
+				client_close(iclient);
+		}
+		if (FD_ISSET(listen_sock, &readfs)) {
+			int fd = accept(listen_sock, 0, 0);
+			int iclient = 0;
+			while ((iclient < MAX_CLIENTS) && (clients[iclient].fd >= 0))
+				++iclient;
+			if ((fd >= 0) && (iclient < MAX_CLIENTS)) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				clients[iclient].fd = fd;
+				clients[iclient].size = 0;
+			} else if (fd >= 0) {
+				close(fd);
+			}
+		}
+	}
+
+	for (int iclient = 0; iclient < MAX_CLIENTS; ++iclient)
+		client_close(iclient);
+	close_listen_socket(listen_sock, path);
+	for (int isock = 0; isock < num_mdns_sockets; ++isock)
+		mdns_socket_close(mdns_sockets[isock]);
+	if (image != MAP_FAILED)
+		munmap(image, image_size);
+	printf("Closed sockets\n");
+	return 0;
+}
+
+// Client side, sending one request and printing the responses
+
+static int
+client_connect(const char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int
+client_request(int sock, uint16_t type, uint32_t id, const void* body, size_t body_size,
+               const char* name, size_t length) {
+	uint8_t message[MDNSD_MESSAGE_MAX];
+	size_t size = sizeof(mdnsd_header_t) + body_size + padded(length);
+	if (size > sizeof(message))
+		return -1;
+	memset(message, 0, size);
+	mdnsd_header_t* header = (mdnsd_header_t*)(void*)message;
+	header->size = (uint32_t)size;
+	header->type = type;
+	header->id = id;
+	memcpy(message + sizeof(mdnsd_header_t), body, body_size);
+	memcpy(message + sizeof(mdnsd_header_t) + body_size, name, length);
+	return (send(sock, message, size, 0) == (ssize_t)size) ? 0 : -1;
+}
+
+// Read one message, with a file descriptor passed along with it if any
+static int
+client_response(int sock, uint8_t* message, size_t capacity, int* passed_fd) {
+	*passed_fd = -1;
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = sizeof(mdnsd_header_t);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	if (recvmsg(sock, &msg, MSG_WAITALL) != (ssize_t)sizeof(mdnsd_header_t))
+		return -1;
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+		memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+	const mdnsd_header_t* header = (const mdnsd_header_t*)(const void*)message;
+	if ((header->size < sizeof(mdnsd_header_t)) || (header->size > capacity))
+		return -1;
+	size_t rest = header->size - sizeof(mdnsd_header_t);
+	if (rest && (recv(sock, message + sizeof(mdnsd_header_t), rest, MSG_WAITALL) != (ssize_t)rest))
+		return -1;
+	return 0;
+}
+
+static void
+print_list(const uint8_t* entries, const mdnsd_list_t* list) {
+	size_t offset = 0;
+	for (uint32_t ientry = 0; (ientry < list->count) && (offset < list->size); ++ientry) {
+		const mdnsd_name_t* item = (const mdnsd_name_t*)(const void*)(entries + offset);
+		printf("  %.*s ttl %u\n", (int)item->length, (const char*)(item + 1), item->ttl);
+		offset += sizeof(mdnsd_name_t) + padded(item->length);
+	}
+}
+
+static int
+run_client(const char* path, uint16_t type, const char* name) {
+	int sock = client_connect(path);
+	if (sock < 0) {
+		printf("Failed to connect to %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	size_t length = strlen(name);
+	int ret;
+	if (type == MDNSD_RESOLVE) {
+		mdnsd_resolve_t body;
+		body.rtype = MDNS_RECORDTYPE_ANY;
+		body.length = (uint16_t)length;
+		body.timeout = 5000;
+		ret = client_request(sock, type, 1, &body, sizeof(body), name, length);
+	} else {
+		mdnsd_name_t body;
+		memset(&body, 0, sizeof(body));
+		body.length = (uint16_t)length;
+		ret = client_request(sock, type, 1, &body, sizeof(body), name, length);
+	}
+
+	uint8_t message[MDNSD_MESSAGE_MAX];
+	int passed_fd;
+	while (running && !ret && !client_response(sock, message, sizeof(message), &passed_fd)) {
+		const mdnsd_header_t* header = (const mdnsd_header_t*)(const void*)message;
+		const uint8_t* body = message + sizeof(mdnsd_header_t);
+		if (header->type == MDNSD_ADDRESS) {
+			const mdnsd_address_t* address = (const mdnsd_address_t*)(const void*)body;
+			char addrstr[INET6_ADDRSTRLEN];
+			inet_ntop(address->family, address->address, addrstr, sizeof(addrstr));
+			printf("%s : %s ttl %u\n", name, addrstr, address->ttl);
+			break;
+		} else if (header->type == MDNSD_INSTANCE) {
+			const mdnsd_name_t* instance = (const mdnsd_name_t*)(const void*)body;
+			const char* eventstr = (header->value == MDNS_BROWSEEVENT_ADDED) ?
+                                       "added" :
+                                       ((header->value == MDNS_BROWSEEVENT_UPDATED) ? "updated" :
+                                                                                      "removed");
+			printf("%s : %s %.*s\n", name, eventstr, (int)instance->length,
+			       (const char*)(instance + 1));
+			fflush(stdout);
+		} else if (header->type == MDNSD_LISTED) {
+			const mdnsd_list_t* list = (const mdnsd_list_t*)(const void*)body;
+			if (header->value & MDNSD_LIST_SHARED) {
+				printf("%s : %u instances in shared memory\n", name, list->count);
+				void* entries = MAP_FAILED;
+				if ((passed_fd >= 0) && list->size)
+					entries = mmap(0, list->size, PROT_READ, MAP_SHARED, passed_fd, 0);
+				if (entries != MAP_FAILED) {
+					print_list((const uint8_t*)entries, list);
+					munmap(entries, list->size);
+				}
+			} else {
+				printf("%s : %u instances\n", name, list->count);
+				print_list(body + sizeof(mdnsd_list_t), list);
+			}
+			if (passed_fd >= 0)
+				close(passed_fd);
+			break;
+		} else if (header->type == MDNSD_ERROR) {
+			printf("%s : error %u\n", name, (unsigned int)header->value);
+			break;
+		}
+		if (passed_fd >= 0)
+			close(passed_fd);
+	}
+	close(sock);
+	return ret;
+}
+
+int
+main(int argc, const char* const* argv) {
+	const char* path = MDNSD_SOCKET_PATH;
+	const char* cache_file = 0;
+	const char* name = 0;
+	uint16_t request = 0;
+
+	for (int iarg = 1; iarg < argc; ++iarg) {
+		if (strcmp(argv[iarg], "--socket") == 0) {
+			if (++iarg < argc)
+				path = argv[iarg];
+		} else if (strcmp(argv[iarg], "--cache-file") == 0) {
+			if (++iarg < argc)
+				cache_file = argv[iarg];
+		} else if (strcmp(argv[iarg], "--resolve") == 0) {
+			// Client requests to a running daemon, for example:
+			//  mdnsd --resolve myhost.local.
+			//  mdnsd --browse _http._tcp.local.
+			//  mdnsd --list _http._tcp.local.
+			request = MDNSD_RESOLVE;
+			if (++iarg < argc)
+				name = argv[iarg];
+		} else if (strcmp(argv[iarg], "--browse") == 0) {
+			request = MDNSD_BROWSE;
+			if (++iarg < argc)
+				name = argv[iarg];
+		} else if (strcmp(argv[iarg], "--list") == 0) {
+			request = MDNSD_LIST;
+			if (++iarg < argc)
+				name = argv[iarg];
+		}
+	}
+
+	// Interrupt blocking calls rather than restarting them, so a browsing client stops on SIGINT
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_handler;
+	sigaction(SIGINT, &action, 0);
+	sigaction(SIGTERM, &action, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (request && name)
+		return run_client(path, request, name) < 0 ? 1 : 0;
+	return run_daemon(path, cache_file) < 0 ? 1 : 0;
+}
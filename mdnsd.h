@@ -0,0 +1,117 @@
+/* mdnsd.h  -  mDNS/DNS-SD daemon protocol  -  Public Domain  -  2017 Mattias Jansson
+ *
+ * This header defines the binary protocol of the mdnsd daemon, which owns the mDNS sockets and
+ * record cache of a host and shares them with local clients over a UNIX domain socket.
+ *
+ * The latest source code is always available at
+ *
+ * https://github.com/mjansson/mdns
+ *
+ * This library is put in the public domain; you can redistribute it and/or modify it without any
+ * restrictions.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Default path of the daemon socket, in a directory the daemon creates if missing and refuses to
+// use if other users can create files in it
+#ifndef MDNSD_SOCKET_PATH
+#define MDNSD_SOCKET_PATH "/run/mdnsd/mdnsd.sock"
+#endif
+
+// Largest message in either direction
+#define MDNSD_MESSAGE_MAX 1024
+
+// Lists larger than this many bytes are delivered in shared memory instead of inline
+#ifndef MDNSD_INLINE_MAX
+#define MDNSD_INLINE_MAX 768
+#endif
+
+// Messages are a header followed by the body of the message type, in host byte order since both
+// ends are on the same host. Names are not zero terminated, and all sizes and offsets are 4 byte
+// aligned. Each request has an id chosen by the client, repeated in the responses to the request
+enum mdnsd_message_type {
+	// Resolve a hostname to an address, body mdnsd_resolve_t followed by the name. Answered by
+	// one MDNSD_ADDRESS, or MDNSD_ERROR with MDNSD_ERROR_TIMEOUT, or MDNSD_ERROR_INVALID for a
+	// record type other than A, AAAA or ANY
+	MDNSD_RESOLVE = 1,
+	// Browse for instances of a service type, body mdnsd_name_t followed by the type name.
+	// Answered by MDNSD_INSTANCE for each cached instance and then for each instance added,
+	// updated or removed until canceled
+	MDNSD_BROWSE = 2,
+	// Cancel the browse with the id of the header, no body
+	MDNSD_CANCEL = 3,
+	// List the cached instances of a service type, body mdnsd_name_t followed by the type name.
+	// Answered by MDNSD_LISTED
+	MDNSD_LIST = 4,
+
+	// Address of a resolved name, body mdnsd_address_t
+	MDNSD_ADDRESS = 0x81,
+	// Instance event of a browse with the event (mdns_browse_event_t) as header value, body
+	// mdnsd_name_t followed by the instance name
+	MDNSD_INSTANCE = 0x82,
+	// Instances of a list, body mdnsd_list_t. With MDNSD_LIST_SHARED as header value the entries
+	// are in a shared memory object passed as a file descriptor in the ancillary data of the
+	// message, otherwise they follow the body. Each entry is a mdnsd_name_t followed by the
+	// instance name, padded to 4 bytes
+	MDNSD_LISTED = 0x83,
+	// Request failed, with the error as header value
+	MDNSD_ERROR = 0xff
+};
+
+enum mdnsd_error {
+	MDNSD_ERROR_INVALID = 1,
+	MDNSD_ERROR_FULL = 2,
+	MDNSD_ERROR_TIMEOUT = 3
+};
+
+#define MDNSD_LIST_SHARED 1
+
+typedef enum mdnsd_message_type mdnsd_message_type_t;
+typedef enum mdnsd_error mdnsd_error_t;
+
+typedef struct mdnsd_header_t mdnsd_header_t;
+typedef struct mdnsd_resolve_t mdnsd_resolve_t;
+typedef struct mdnsd_name_t mdnsd_name_t;
+typedef struct mdnsd_address_t mdnsd_address_t;
+typedef struct mdnsd_list_t mdnsd_list_t;
+
+struct mdnsd_header_t {
+	// Size of the message including the header
+	uint32_t size;
+	uint16_t type;
+	uint16_t value;
+	uint32_t id;
+};
+
+struct mdnsd_resolve_t {
+	// MDNS_RECORDTYPE_A, MDNS_RECORDTYPE_AAAA or MDNS_RECORDTYPE_ANY
+	uint16_t rtype;
+	uint16_t length;
+	// Timeout in milliseconds
+	uint32_t timeout;
+};
+
+struct mdnsd_name_t {
+	// Remaining TTL in seconds, zero in requests
+	uint32_t ttl;
+	uint16_t length;
+	uint16_t reserved;
+};
+
+struct mdnsd_address_t {
+	uint32_t ttl;
+	// AF_INET or AF_INET6, with 4 or 16 bytes of address
+	uint16_t family;
+	uint16_t reserved;
+	uint8_t address[16];
+};
+
+struct mdnsd_list_t {
+	uint32_t count;
+	// Size of the entries in bytes
+	uint32_t size;
+};